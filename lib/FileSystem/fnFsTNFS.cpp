@@ -25,7 +25,10 @@ bool FileSystemTNFS::start(const char *host, uint16_t port, const char * mountpa
 
     if(host == nullptr || host[0] == '\0')
         return false;
-    
+
+    // A "tcp://" or "udp://" in front of the host name picks the transport; otherwise we figure it out
+    host = tnfs_transport_from_host(&_mountinfo, host);
+
     strlcpy(_mountinfo.hostname, host, sizeof(_mountinfo.hostname));
 
     // Try to resolve the hostname and store that so we don't have to keep looking it up
@@ -41,6 +44,9 @@ bool FileSystemTNFS::start(const char *host, uint16_t port, const char * mountpa
     _mountinfo.port = port;
     _mountinfo.session = TNFS_INVALID_SESSION;
 
+    if (_mirrors[0] != '\0')
+        _add_mirrors(host, port);
+
     if(mountpath != nullptr)
         strlcpy(_mountinfo.mountpath, mountpath, sizeof(_mountinfo.mountpath));
     else
@@ -80,6 +86,47 @@ bool FileSystemTNFS::start(const char *host, uint16_t port, const char * mountpa
     return true;
 }
 
+void FileSystemTNFS::set_mirrors(const char *mirrors)
+{
+    strlcpy(_mirrors, mirrors == nullptr ? "" : mirrors, sizeof(_mirrors));
+}
+
+/*
+ Gives the mount our host plus each of the mirrors we were given, skipping
+ any we can't resolve. A mirror may have its own ":port".
+*/
+void FileSystemTNFS::_add_mirrors(const char *host, uint16_t port)
+{
+    tnfs_add_mirror(&_mountinfo, host, _mountinfo.host_ip, port);
+
+    char list[sizeof(_mirrors)];
+    strlcpy(list, _mirrors, sizeof(list));
+
+    char *saveptr = nullptr;
+    for (char *name = strtok_r(list, ", ", &saveptr); name != nullptr; name = strtok_r(nullptr, ", ", &saveptr))
+    {
+        uint16_t mirror_port = port;
+        char *colon = strrchr(name, ':');
+        if (colon != nullptr)
+        {
+            *colon = '\0';
+            mirror_port = atoi(colon + 1);
+        }
+
+        in_addr_t ip = get_ip4_addr_by_name(name);
+        if (ip == IPADDR_NONE)
+        {
+            Debug_printf("Failed to resolve TNFS mirror \"%s\"\n", name);
+            continue;
+        }
+        if (tnfs_add_mirror(&_mountinfo, name, ip, mirror_port) != 0)
+        {
+            Debug_printf("Too many TNFS mirrors - ignoring \"%s\"\n", name);
+            break;
+        }
+    }
+}
+
 bool FileSystemTNFS::exists(const char* path)
 {
     tnfsStat tstat;
@@ -11,11 +11,17 @@ private:
     tnfsMountInfo _mountinfo;
     unsigned long _last_dns_refresh;
     char _current_dirpath[TNFS_MAX_FILELEN];
+    char _mirrors[TNFS_MAX_MIRRORS * 48] = { '\0' };
+
+    void _add_mirrors(const char *host, uint16_t port);
 
 public:
     FileSystemTNFS();
     ~FileSystemTNFS();
 
+    // Other servers with the same files as the host given to start(), separated by commas
+    void set_mirrors(const char *mirrors);
+
     bool start(const char *host, uint16_t port=TNFS_DEFAULT_PORT, const char * mountpath=nullptr, const char * userid=nullptr, const char * password=nullptr);
 
     fsType type() override { return FSTYPE_TNFS; };
@@ -34,6 +40,12 @@ public:
     void dir_close();
     uint16_t dir_tell() override;
     bool dir_seek(uint16_t) override;
+
+    const tnfsCacheStats &cache_stats() { return _mountinfo.block_cache.stats; };
+    const tnfsProtocolStats &protocol_stats() { return _mountinfo.protocol_stats; };
+
+    // Call from a background task while idle; re-mounts the server if it's forgotten our session
+    void keep_alive() { tnfs_keepalive(&_mountinfo); };
 };
 
 #endif // _FN_FSTNFS_
\ No newline at end of file
@@ -3,8 +3,10 @@
 */
 #include <dirent.h>
 #include <sys/errno.h>
+#include <new>
 
 #include "esp_vfs.h"
+#include "esp_heap_caps.h"
 #include "../../include/debug.h"
 #include "../TNFSlib/tnfslib.h"
 
@@ -24,8 +26,7 @@
     int (*rename_p)(void* ctx, const char *src, const char *dst);
     int (*mkdir_p)(void* ctx, const char* name, mode_t mode);
     int (*rmdir_p)(void* ctx, const char* name);
-
-    NOT IMPLEMENTED:
+    int (*fsync_p)(void* ctx, int fd);
     DIR* (*opendir_p)(void* ctx, const char* name);
     int (*closedir_p)(void* ctx, DIR* pdir);
     struct dirent* (*readdir_p)(void* ctx, DIR* pdir);
@@ -33,13 +34,14 @@
     long (*telldir_p)(void* ctx, DIR* pdir);
     void (*seekdir_p)(void* ctx, DIR* pdir, long offset);
 
+    NOT IMPLEMENTED:
+
     int (*access_p)(void* ctx, const char *path, int amode);
     int (*truncate_p)(void* ctx, const char *path, off_t length);
 
     int (*link_p)(void* ctx, const char* n1, const char* n2);
     int (*fcntl_p)(void* ctx, int fd, int cmd, va_list args);
     int (*ioctl_p)(void* ctx, int fd, int cmd, va_list args);
-    int (*fsync_p)(void* ctx, int fd);
 */
 
 int vfs_tnfs_mkdir(void* ctx, const char* name, mode_t mode)
@@ -153,6 +155,10 @@ ssize_t vfs_tnfs_read(void* ctx, int fd, void * dst, size_t size)
 {
     tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
 
+    // tnfs_read can't take more than 64K at a time; a short read is fine
+    if (size > UINT16_MAX)
+        size = UINT16_MAX;
+
     uint16_t readcount;
     int result = tnfs_read(mi, fd, (uint8_t *)dst, size, &readcount);
 
@@ -170,6 +176,10 @@ ssize_t vfs_tnfs_write(void* ctx, int fd, const void * data, size_t size)
 {
     tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
 
+    // tnfs_write can't take more than 64K at a time; a short write is fine
+    if (size > UINT16_MAX)
+        size = UINT16_MAX;
+
     uint16_t writecount;
     int result = tnfs_write(mi, fd, (uint8_t *)data, size, &writecount);
 
@@ -201,6 +211,16 @@ off_t vfs_tnfs_lseek(void* ctx, int fd, off_t size, int mode)
 }
 
 
+static void _vfs_tnfs_fill_stat(const tnfsStat &tstat, struct stat * st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_size = tstat.filesize;
+    st->st_atime = tstat.a_time;
+    st->st_mtime = tstat.m_time;
+    st->st_ctime = tstat.c_time;
+    st->st_mode = tstat.isDir ? S_IFDIR : S_IFREG;
+}
+
 int vfs_tnfs_stat(void* ctx, const char * path, struct stat * st)
 {
     tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
@@ -216,13 +236,7 @@ int vfs_tnfs_stat(void* ctx, const char * path, struct stat * st)
         return -1;
     }
 
-    memset(st, 0, sizeof(struct stat));
-    st->st_size = tstat.filesize;
-    st->st_atime = tstat.a_time;
-    st->st_mtime = tstat.m_time;
-    st->st_ctime = tstat.c_time;
-    st->st_mode = tstat.isDir ? S_IFDIR : S_IFREG;
-
+    _vfs_tnfs_fill_stat(tstat, st);
     errno = 0;
     return 0;
 }
@@ -232,10 +246,135 @@ int vfs_tnfs_fstat(void* ctx, int fd, struct stat * st)
     //Debug_printf("vfs_tnfs_fstat: %d\n", fd);    
     tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
 
-    const char *path = tnfs_filepath(mi, fd);
-    return vfs_tnfs_stat(mi, path, st);
+    // The size includes anything still waiting to be written, so there's no need to flush
+    tnfsStat tstat;
+    int result = tnfs_fstat(mi, fd, &tstat);
+    if(result != TNFS_RESULT_SUCCESS)
+    {
+        errno = tnfs_code_to_errno(result);
+        return -1;
+    }
+
+    _vfs_tnfs_fill_stat(tstat, st);
+    errno = 0;
+    return 0;
+}
+
+int vfs_tnfs_fsync(void* ctx, int fd)
+{
+    tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
+
+    int result = tnfs_fsync(mi, fd);
+    if(result != TNFS_RESULT_SUCCESS)
+    {
+        errno = tnfs_code_to_errno(result);
+        return -1;
+    }
+    errno = 0;
+    return 0;
+}
+
+
+/*
+ Each DIR gets a tnfsDirStream of its own, with its own server handle, so it
+ doesn't disturb the mount's directory handle (which FileSystemTNFS may be
+ using) or any other open DIR.
+*/
+struct vfs_tnfs_dir
+{
+    DIR dir; // Must come first - the VFS layer fills in dd_vfs_idx
+    struct dirent entry;
+    tnfsDirStream stream;
+};
+
+DIR* vfs_tnfs_opendir(void* ctx, const char* name)
+{
+    tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
+
+    void *mem = heap_caps_malloc(sizeof(vfs_tnfs_dir), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if(mem == nullptr)
+        mem = malloc(sizeof(vfs_tnfs_dir));
+    if(mem == nullptr)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    vfs_tnfs_dir *pDir = new (mem) vfs_tnfs_dir;
+    memset(&pDir->dir, 0, sizeof(pDir->dir));
+    memset(&pDir->entry, 0, sizeof(pDir->entry));
+
+    int result = tnfs_dirstream_open(mi, &pDir->stream, name);
+    if(result != TNFS_RESULT_SUCCESS)
+    {
+        pDir->~vfs_tnfs_dir();
+        free(pDir);
+        errno = tnfs_code_to_errno(result);
+        return nullptr;
+    }
+
+    errno = 0;
+    return &pDir->dir;
 }
 
+int vfs_tnfs_readdir_r(void* ctx, DIR* pdir, struct dirent* entry, struct dirent** out_dirent)
+{
+    tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
+    vfs_tnfs_dir *pDir = (vfs_tnfs_dir *)pdir;
+
+    tnfsStat tstat;
+    int result = tnfs_dirstream_read(mi, &pDir->stream, &tstat, entry->d_name, sizeof(entry->d_name));
+    if(result != TNFS_RESULT_SUCCESS)
+    {
+        *out_dirent = nullptr;
+        // Running out of entries isn't an error
+        return result == TNFS_RESULT_END_OF_FILE ? 0 : tnfs_code_to_errno(result);
+    }
+
+    entry->d_ino = 0;
+    entry->d_type = tstat.isDir ? DT_DIR : DT_REG;
+
+    *out_dirent = entry;
+    return 0;
+}
+
+struct dirent* vfs_tnfs_readdir(void* ctx, DIR* pdir)
+{
+    vfs_tnfs_dir *pDir = (vfs_tnfs_dir *)pdir;
+
+    struct dirent *out_dirent;
+    int err = vfs_tnfs_readdir_r(ctx, pdir, &pDir->entry, &out_dirent);
+    if(err != 0)
+        errno = err;
+    return out_dirent;
+}
+
+long vfs_tnfs_telldir(void* ctx, DIR* pdir)
+{
+    return ((vfs_tnfs_dir *)pdir)->stream.position;
+}
+
+void vfs_tnfs_seekdir(void* ctx, DIR* pdir, long offset)
+{
+    tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
+    vfs_tnfs_dir *pDir = (vfs_tnfs_dir *)pdir;
+
+    if(offset < 0 || offset > UINT16_MAX)
+        return;
+    tnfs_dirstream_seek(mi, &pDir->stream, offset);
+}
+
+int vfs_tnfs_closedir(void* ctx, DIR* pdir)
+{
+    tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
+    vfs_tnfs_dir *pDir = (vfs_tnfs_dir *)pdir;
+
+    // The DIR is gone either way; a close the server didn't see dies with the session
+    tnfs_dirstream_close(mi, &pDir->stream);
+    pDir->~vfs_tnfs_dir();
+    free(pDir);
+    errno = 0;
+    return 0;
+}
 
 // Register our functions and use tnfsMountInfo as our context
 // New basepath will be stored in basepath
@@ -255,6 +394,13 @@ esp_err_t vfs_tnfs_register(tnfsMountInfo &m_info, char *basepath, int basepathl
     vfs.lseek_p = &vfs_tnfs_lseek;
     vfs.unlink_p = &vfs_tnfs_unlink;
     vfs.rename_p = &vfs_tnfs_rename;
+    vfs.fsync_p = &vfs_tnfs_fsync;
+    vfs.opendir_p = &vfs_tnfs_opendir;
+    vfs.readdir_p = &vfs_tnfs_readdir;
+    vfs.readdir_r_p = &vfs_tnfs_readdir_r;
+    vfs.telldir_p = &vfs_tnfs_telldir;
+    vfs.seekdir_p = &vfs_tnfs_seekdir;
+    vfs.closedir_p = &vfs_tnfs_closedir;
 
     // We'll use the address of our tnfsMountInfo to provide a unique base path
     // for this instance wihtout keeping track of how many we create
@@ -1,14 +1,67 @@
 #include <memory>
 #include <string.h>
+#include <esp_heap_caps.h>
 
 #include "tnfslib.h"
 #include "../tcpip/fnUDP.h"
+#include "../tcpip/fnTcpClient.h"
 #include "../utils/utils.h"
 #include "../hardware/fnSystem.h"
 
+#ifdef TNFS_IMPAIRMENT
+#include <esp_system.h>
+#endif
+
 bool _tnfs_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t datalen);
+bool _tnfs_server_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size);
+bool _tnfs_udp_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size);
+bool _tnfs_send(fnUDP &udp, tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size);
+bool _tnfs_send_stamped(fnUDP &udp, tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size);
+bool _tnfs_send_raw(fnUDP &udp, tnfsMountInfo *m_info, const uint8_t *data, uint16_t len);
+void _tnfs_stamp_packet(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size);
+void _tnfs_rtt_sample(tnfsMountInfo *m_info, unsigned long rtt_ms);
+unsigned long _tnfs_rto(tnfsMountInfo *m_info, int backoff);
+#ifdef TNFS_IMPAIRMENT
+bool _tnfs_impair_send(fnUDP &udp, tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size);
+bool _tnfs_impair_drop(tnfsMountInfo *m_info);
+#endif
+
+bool _tnfs_tcp_connect(tnfsMountInfo *m_info);
+void _tnfs_tcp_disconnect(tnfsMountInfo *m_info);
+bool _tnfs_tcp_failed_recently(tnfsMountInfo *m_info);
+void _tnfs_tcp_remember(tnfsMountInfo *m_info, bool failed);
+bool _tnfs_tcp_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size);
+int _tnfs_tcp_read_window(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, uint32_t position, uint8_t *dest, uint16_t len, uint16_t *dest_used);
+
+int _tnfs_read_window(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, uint32_t position, uint8_t *dest, uint16_t len, uint16_t *dest_used);
+void _tnfs_read_payload_fallback(tnfsMountInfo *m_info);
+void _tnfs_close_lanes(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI);
+bool _tnfs_close_all_lanes(tnfsMountInfo *m_info);
+int _tnfs_open_handle(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, uint16_t open_mode, uint16_t create_perms);
+bool _tnfs_park(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI);
+int _tnfs_unpark(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI);
+void _tnfs_set_file_size(tnfsMountInfo *m_info, uint32_t file_id, uint32_t file_size);
+void _tnfs_stop_recording(tnfsMountInfo *m_info);
+int _tnfs_flush_writes(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI);
+int _tnfs_flush_overlapping(tnfsMountInfo *m_info, uint32_t file_id, uint32_t start, uint32_t end);
+int _tnfs_get_handle(tnfsMountInfo *m_info, int16_t file_handle, tnfsFileHandleInfo **ppFHI);
+bool _tnfs_yield(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI);
+bool _tnfs_wait(tnfsMountInfo *m_info);
 
 int _tnfs_adjust_with_full_path(tnfsMountInfo *m_info, char *buffer, const char *source, int bufflen);
+int _tnfs_opendirx_request(tnfsMountInfo *m_info, tnfsPacket &packet, const char *directory,
+    uint8_t sortopts, uint8_t diropts, const char *pattern, uint16_t maxresults, int *pathoffset);
+
+int _tnfs_mount_server(tnfsMountInfo *m_info);
+void _tnfs_use_mirror(tnfsMountInfo *m_info, int index);
+bool _tnfs_failover(tnfsMountInfo *m_info);
+bool _tnfs_reconnect(tnfsMountInfo *m_info);
+bool _tnfs_recover(tnfsMountInfo *m_info, bool session_lost);
+int _tnfs_keepalive(tnfsMountInfo *m_info);
+void _tnfs_forget_server_handles(tnfsMountInfo *m_info);
+bool _tnfs_session_lost(uint8_t command, int result);
+bool _tnfs_can_resend(uint8_t command);
+bool _tnfs_resend_is_safe(uint8_t command);
 
 void _tnfs_debug_packet(const tnfsPacket &pkt, unsigned short len, bool isResponse = false);
 
@@ -17,9 +70,14 @@ const char *_tnfs_result_code_string(int resultcode);
 
 using namespace std;
 
+#define TNFS_POSITION_UNKNOWN UINT32_MAX
+
 /* Logs-in to the TNFS server by providing a mount path, user and password.
  Success will result in a session ID set in tnfsMountInfo.
  If the host_ip is set, it will be used in all transactions instead of hostname.
+ The transport is picked here based on tnfsMountInfo.transport: with TNFS_TRANSPORT_AUTO
+ we use TCP if the server accepts a connection and answers the MOUNT, otherwise UDP,
+ which we then stick with for that server for TNFS_TCP_RETRY_INTERVAL.
  Currently, mountpath, userid and password are ignored.
  port, timeout_ms, and max_retries may be set or left to defaults.
  Returns:
@@ -27,12 +85,62 @@ using namespace std;
  -1 - failure to send/receive command
  TNFS_RESULT_FUNCTION_UNIMPLEMENTED - returned server version lower than min requried
  other - TNFS_RESULT_*
+
+ If mirrors have been added with tnfs_add_mirror, each one is tried and we stay
+ with the one that answers quickest. If it later stops answering we switch to
+ another (see _tnfs_failover).
 */
 int tnfs_mount(tnfsMountInfo *m_info)
 {
+    tnfsMountLock lock(m_info);
     if (m_info == nullptr)
         return -1;
 
+    if (m_info->mirror_count < 2)
+        return _tnfs_mount_server(m_info);
+
+    // Let go of any session we have while we still know which server it's on
+    if (m_info->session != TNFS_INVALID_SESSION)
+        tnfs_umount(m_info);
+
+    m_info->switching_mirrors = true;
+    int best = -1;
+    unsigned long best_ms = 0;
+    int result = -1;
+    for (int i = 0; i < m_info->mirror_count; i++)
+    {
+        _tnfs_use_mirror(m_info, i);
+        unsigned long ms_start = fnSystem.millis();
+        result = _tnfs_mount_server(m_info);
+        unsigned long ms = fnSystem.millis() - ms_start;
+        if (result != TNFS_RESULT_SUCCESS)
+        {
+            Debug_printf("TNFS mirror \"%s\" failed to mount (%d)\n", m_info->hostname, result);
+            continue;
+        }
+        Debug_printf("TNFS mirror \"%s\" mounted in %lums\n", m_info->hostname, ms);
+        if (best < 0 || ms < best_ms)
+        {
+            best = i;
+            best_ms = ms;
+        }
+        tnfs_umount(m_info);
+    }
+
+    if (best >= 0)
+    {
+        _tnfs_use_mirror(m_info, best);
+        result = _tnfs_mount_server(m_info);
+    }
+    m_info->switching_mirrors = false;
+    return result;
+}
+
+/*
+ Mounts the server at tnfsMountInfo.hostname/host_ip (see tnfs_mount)
+*/
+int _tnfs_mount_server(tnfsMountInfo *m_info)
+{
     // Unmount if we happen to have sesssion
     if (m_info->session != TNFS_INVALID_SESSION)
         tnfs_umount(m_info);
@@ -66,7 +174,50 @@ int tnfs_mount(tnfsMountInfo *m_info)
     // Make sure we have the right starting working directory
     m_info->current_working_directory[0] = '/';
 
-    if (_tnfs_transaction(m_info, packet, payload_offset))
+    // There's nothing in the protocol to tell us how much a server will send in one
+    // READ, so we ask for large ones and learn from the first few replies
+    m_info->read_payload = m_info->max_read_payload;
+    m_info->read_payload_learned = m_info->max_read_payload <= TNFS_MAX_READWRITE_PAYLOAD;
+
+    // Pick our transport, not waiting on TCP again for a server that's recently failed it
+    _tnfs_tcp_disconnect(m_info);
+    m_info->using_tcp = false;
+    if (m_info->transport == TNFS_TRANSPORT_AUTO && _tnfs_tcp_failed_recently(m_info))
+        Debug_println("TNFS server failed over TCP recently - using UDP");
+    else if (m_info->transport != TNFS_TRANSPORT_UDP)
+    {
+        m_info->using_tcp = _tnfs_tcp_connect(m_info);
+        if (m_info->using_tcp == false && m_info->transport == TNFS_TRANSPORT_TCP)
+            return -1;
+        if (m_info->using_tcp == false)
+            _tnfs_tcp_remember(m_info, true);
+    }
+
+    bool sent;
+    if (m_info->using_tcp && m_info->transport == TNFS_TRANSPORT_AUTO)
+    {
+        // Something accepted our connection, but don't wait long to find out if it speaks TNFS
+        tnfsPacket request = packet;
+        uint8_t max_retries = m_info->max_retries;
+        m_info->max_retries = 1;
+        sent = _tnfs_transaction(m_info, packet, payload_offset);
+        m_info->max_retries = max_retries;
+        _tnfs_tcp_remember(m_info, sent == false);
+        if (sent == false)
+        {
+            Debug_println("TNFS MOUNT over TCP failed - falling back to UDP");
+            _tnfs_tcp_disconnect(m_info);
+            m_info->using_tcp = false;
+            packet = request;
+            sent = _tnfs_transaction(m_info, packet, payload_offset);
+        }
+    }
+    else
+        sent = _tnfs_transaction(m_info, packet, payload_offset);
+
+    Debug_printf("TNFS using %s transport\n", m_info->using_tcp ? "TCP" : "UDP");
+
+    if (sent)
     {
         // Success
         if (packet.payload[0] == TNFS_RESULT_SUCCESS)
@@ -92,9 +243,20 @@ int tnfs_mount(tnfsMountInfo *m_info)
 */
 int tnfs_umount(tnfsMountInfo *m_info)
 {
+    tnfsMountLock lock(m_info);
     if (m_info == nullptr)
         return -1;
 
+    const tnfsProtocolStats &ps = m_info->protocol_stats;
+    Debug_printf("TNFS stats: requests=%u, retransmits=%u, try_again=%u, stale=%u, failures=%u, read=%u, written=%u\n",
+        ps.requests, ps.retransmits, ps.try_again, ps.stale_replies, ps.failures, ps.bytes_read, ps.bytes_written);
+    __IGNORE_UNUSED_VAR(ps);
+
+    // Nothing we've cached is any good once we're off the server
+    m_info->block_cache.clear();
+    m_info->meta_cache.clear();
+    m_info->dir_listing = m_info->dir_recording = nullptr;
+
     tnfsPacket packet;
     packet.command = TNFS_CMD_UNMOUNT;
 
@@ -104,19 +266,321 @@ int tnfs_umount(tnfsMountInfo *m_info)
         {
             m_info->session = TNFS_INVALID_SESSION;
         }
+        _tnfs_tcp_disconnect(m_info);
         return packet.payload[0];
     }
+    _tnfs_tcp_disconnect(m_info);
     return -1;
 }
 
+/*
+ Call this regularly while the mount's idle. Once we haven't heard from the
+ server in TNFS_KEEPALIVE_INTERVAL we make sure it still knows our session, and
+ if it's forgotten it (usually because it was restarted) we mount it again, so
+ open files carry on from where they were the next time they're used.
+ The check and any remount can take a while, so call it from a background task,
+ not one that has to answer the Atari. If another task has the mount it plainly
+ isn't idle, so we leave it alone rather than wait.
+ The check is a single request so a server that's down doesn't hold things up;
+ the next real request will deal with that.
+ Returns: 0: session is fine (or wasn't due a check), -1: no answer or couldn't reconnect
+*/
+int tnfs_keepalive(tnfsMountInfo *m_info)
+{
+    if (m_info == nullptr)
+        return -1;
+    if (m_info->try_lock() == false)
+        return 0;
+    int result = _tnfs_keepalive(m_info);
+    m_info->unlock();
+    return result;
+}
+
+// tnfs_keepalive, with the mount locked
+int _tnfs_keepalive(tnfsMountInfo *m_info)
+{
+    if (m_info->session == TNFS_INVALID_SESSION)
+        return -1;
+
+    if (fnSystem.millis() - m_info->last_contact_ms < TNFS_KEEPALIVE_INTERVAL)
+        return 0;
+
+    // Any request that needs a session will do
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_STAT;
+    strlcpy((char *)packet.payload, "/", sizeof(packet.payload));
+
+    uint8_t max_retries = m_info->max_retries;
+    int timeout_ms = m_info->timeout_ms;
+    m_info->max_retries = 1;
+    // Over TCP this is also how long we wait for each read
+    if (m_info->using_tcp == false)
+        m_info->timeout_ms = 0;
+    bool answered = _tnfs_server_transaction(m_info, packet, 2);
+    m_info->max_retries = max_retries;
+    m_info->timeout_ms = timeout_ms;
+
+    if (answered == false)
+    {
+        // Leave it for another interval rather than holding things up again right away
+        Debug_println("TNFS keepalive got no answer");
+        m_info->last_contact_ms = fnSystem.millis();
+        return -1;
+    }
+
+    if (_tnfs_session_lost(packet.command, packet.payload[0]))
+    {
+        Debug_println("TNFS keepalive found our session gone");
+        return _tnfs_recover(m_info, true) ? 0 : -1;
+    }
+    return 0;
+}
+
+/*
+ Sets tnfsMountInfo.transport from an optional "tcp://" or "udp://" prefix on a host name
+ Returns the host name following any prefix
+*/
+const char *tnfs_transport_from_host(tnfsMountInfo *m_info, const char *host)
+{
+    if (m_info == nullptr || host == nullptr)
+        return host;
+
+    if (strncasecmp(host, "tcp://", 6) == 0)
+    {
+        m_info->transport = TNFS_TRANSPORT_TCP;
+        return host + 6;
+    }
+    if (strncasecmp(host, "udp://", 6) == 0)
+    {
+        m_info->transport = TNFS_TRANSPORT_UDP;
+        return host + 6;
+    }
+    m_info->transport = TNFS_TRANSPORT_AUTO;
+    return host;
+}
+
+/*
+ Adds a server with the same files to the list tnfs_mount picks from.
+ The first one added should be the host we were given to mount.
+ Returns: 0: success, -1: we already have TNFS_MAX_MIRRORS
+*/
+int tnfs_add_mirror(tnfsMountInfo *m_info, const char *hostname, in_addr_t host_ip, uint16_t port)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || hostname == nullptr || m_info->mirror_count >= TNFS_MAX_MIRRORS)
+        return -1;
+
+    tnfsMirror &mirror = m_info->mirrors[m_info->mirror_count++];
+    strlcpy(mirror.hostname, hostname, sizeof(mirror.hostname));
+    mirror.host_ip = host_ip;
+    mirror.port = port;
+    return 0;
+}
+
+/*
+ Points the mount at the given mirror
+*/
+void _tnfs_use_mirror(tnfsMountInfo *m_info, int index)
+{
+    tnfsMirror &mirror = m_info->mirrors[index];
+
+    _tnfs_tcp_disconnect(m_info);
+    strlcpy(m_info->hostname, mirror.hostname, sizeof(m_info->hostname));
+    m_info->host_ip = mirror.host_ip;
+    m_info->port = mirror.port;
+    m_info->current_mirror = index;
+
+    // What we learned about the last server's round-trip time doesn't apply to this one
+    m_info->rtt_measured = false;
+    m_info->srtt_ms = 0;
+    m_info->rttvar_ms = 0;
+    m_info->rto_ms = TNFS_INITIAL_RTO;
+}
+
+/*
+ Switches to the next mirror that will let us mount it, after the current
+ server has stopped answering.
+ None of the server's file or directory handles mean anything to the new one,
+ so open files are parked to be re-opened there when next used, and any open
+ directory is lost. Cached data is kept, since every mirror has the same files.
+ Returns false if we don't have any mirrors or none of them answered.
+*/
+bool _tnfs_failover(tnfsMountInfo *m_info)
+{
+    if (m_info->mirror_count < 2 || m_info->switching_mirrors)
+        return false;
+
+    m_info->switching_mirrors = true;
+    int from = m_info->current_mirror;
+    bool switched = false;
+    for (int n = 1; n < m_info->mirror_count && switched == false; n++)
+    {
+        _tnfs_use_mirror(m_info, (from + n) % m_info->mirror_count);
+        Debug_printf("TNFS failing over to mirror \"%s\"\n", m_info->hostname);
+        // There's no point telling the old server we're leaving
+        m_info->session = TNFS_INVALID_SESSION;
+        switched = _tnfs_mount_server(m_info) == TNFS_RESULT_SUCCESS;
+    }
+
+    if (switched)
+    {
+        m_info->protocol_stats.failovers++;
+        _tnfs_forget_server_handles(m_info);
+    }
+    else
+    {
+        Debug_println("TNFS no mirrors available");
+        _tnfs_use_mirror(m_info, from);
+    }
+
+    m_info->switching_mirrors = false;
+    return switched;
+}
+
+/*
+ Gets a new session on the server we're using after it's forgotten the old one
+ (usually because it was restarted) or stopped answering for long enough that
+ it may have.
+ As with _tnfs_failover, open files are parked, so each is re-opened and
+ seeked back to where it was the next time it's used.
+ Returns false if the server wouldn't let us mount it again.
+*/
+bool _tnfs_reconnect(tnfsMountInfo *m_info)
+{
+    m_info->reconnecting = true;
+    Debug_printf("TNFS reconnecting to \"%s\"\n", m_info->hostname);
+
+    // There's no point unmounting a session the server doesn't know about
+    m_info->session = TNFS_INVALID_SESSION;
+    bool reconnected = _tnfs_mount_server(m_info) == TNFS_RESULT_SUCCESS;
+    if (reconnected)
+    {
+        m_info->protocol_stats.reconnects++;
+        _tnfs_forget_server_handles(m_info);
+    }
+    else
+        Debug_println("TNFS reconnect failed");
+
+    m_info->reconnecting = false;
+    return reconnected;
+}
+
+/*
+ Gets us talking to a server again after the one we're using stopped answering
+ or lost our session: another mirror if we have any (and the server's gone
+ quiet), otherwise a new session on the same server.
+ Returns false if we couldn't get to any of them.
+*/
+bool _tnfs_recover(tnfsMountInfo *m_info, bool session_lost)
+{
+    if (m_info->switching_mirrors || m_info->reconnecting)
+        return false;
+
+    // If the server's still answering there's no reason to move away from it
+    if (session_lost == false && _tnfs_failover(m_info))
+        return true;
+
+    return _tnfs_reconnect(m_info);
+}
+
+/*
+ Called once we're on a new session, when none of the old server handles
+ mean anything. Open files are left parked and any open directory is lost.
+*/
+void _tnfs_forget_server_handles(tnfsMountInfo *m_info)
+{
+    for (int i = 0; i < m_info->filehandle_slots(); i++)
+    {
+        tnfsFileHandleInfo *pFHI = m_info->get_filehandleinfo_at(i);
+        if (pFHI == nullptr)
+            continue;
+        pFHI->handle_id = TNFS_INVALID_HANDLE;
+        pFHI->file_position = TNFS_POSITION_UNKNOWN;
+        pFHI->lane_count = 0;
+        pFHI->lane_open_failed = false;
+    }
+    m_info->dir_handle = TNFS_INVALID_HANDLE;
+    m_info->empty_dircache();
+    _tnfs_stop_recording(m_info);
+    m_info->server_generation++;
+}
+
+/*
+ Returns true if the result the server gave for a request means it doesn't know
+ our session. tnfsd answers with 0xFF (TNFS_RESULT_INVALID_HANDLE) in that case.
+*/
+bool _tnfs_session_lost(uint8_t command, int result)
+{
+    if (command == TNFS_CMD_MOUNT || command == TNFS_CMD_UNMOUNT)
+        return false;
+    return result == TNFS_RESULT_INVALID_HANDLE;
+}
+
+/*
+ Returns true if a request can be sent again as-is on a new session or to a
+ different mirror, which isn't the case if it refers to one of the old handles
+*/
+bool _tnfs_can_resend(uint8_t command)
+{
+    switch (command)
+    {
+    case TNFS_CMD_MOUNT:
+    case TNFS_CMD_UNMOUNT:
+    case TNFS_CMD_READDIR:
+    case TNFS_CMD_CLOSEDIR:
+    case TNFS_CMD_TELLDIR:
+    case TNFS_CMD_SEEKDIR:
+    case TNFS_CMD_READDIRX:
+    case TNFS_CMD_READ:
+    case TNFS_CMD_WRITE:
+    case TNFS_CMD_CLOSE:
+    case TNFS_CMD_LSEEK:
+        return false;
+    default:
+        return true;
+    }
+}
+
+/*
+ Returns true if the server can act on a request more than once without harm.
+ Otherwise a second copy does damage: a second WRITE or READ moves the file
+ position on again (writing the data twice, or skipping some), a second CLOSE
+ may close a handle the server's since given out again, and so on. Those
+ requests are re-sent with the sequence number they first went out with, so a
+ server that did get the first copy sees it's a retry and sends its reply
+ again (tnfsd keeps its last one) rather than acting on it twice, so they can
+ be re-sent as soon as any other request. A reply to one of them could be to
+ either copy, though, so it doesn't tell us how long the round trip took.
+ Other requests get a new sequence number every time, so every reply to them
+ is a good measurement of the round trip.
+*/
+bool _tnfs_resend_is_safe(uint8_t command)
+{
+    switch (command)
+    {
+    case TNFS_CMD_STAT:
+    case TNFS_CMD_SIZE:
+    case TNFS_CMD_FREE:
+    case TNFS_CMD_TELLDIR:
+    case TNFS_CMD_SEEKDIR:
+    case TNFS_CMD_CHMOD:
+        return true;
+    default:
+        return false;
+    }
+}
+
 /* Open a file
  open_mode: TNFS_OPENFLAG_*
  create_perms: TNFS_CREATEPERM_* (only meaningful when creating files)
- file_handle: if successful, server's file handle is stored here
+ file_handle: if successful, our handle for the file is stored here. This isn't
+  the server's handle, which may be closed and re-opened behind the scenes if we
+  have more than TNFS_MAX_SERVER_HANDLES files open.
  returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
 */
 int tnfs_open(tnfsMountInfo *m_info, const char *filepath, uint16_t open_mode, uint16_t create_perms, int16_t *file_handle)
 {
+    tnfsMountLock lock(m_info);
     if (m_info == nullptr || filepath == nullptr || file_handle == nullptr)
         return -1;
 
@@ -148,49 +612,39 @@ int tnfs_open(tnfsMountInfo *m_info, const char *filepath, uint16_t open_mode, u
     }
 
     // Done with STAT - now try to actually open the file
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_OPEN;
-
-    packet.payload[0] = TNFS_LOBYTE_FROM_UINT16(open_mode);
-    packet.payload[1] = TNFS_HIBYTE_FROM_UINT16(open_mode);
-
-    packet.payload[2] = TNFS_LOBYTE_FROM_UINT16(create_perms);
-    packet.payload[3] = TNFS_HIBYTE_FROM_UINT16(create_perms);
-
-    int offset_filename = 4; // Where the filename starts in the buffer
-
-    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload + offset_filename, filepath, sizeof(packet.payload) - offset_filename);
-
     // Store the path we used as part of our file handle info
-    strlcpy(pFileInf->filename, (const char *)&packet.payload[offset_filename], TNFS_MAX_FILELEN);
+    _tnfs_adjust_with_full_path(m_info, pFileInf->filename, filepath, sizeof(pFileInf->filename));
 
-    Debug_printf("TNFS open file: \"%s\" (0x%04x, 0x%04x)\n", (char *)&packet.payload[offset_filename], open_mode, create_perms);
+    Debug_printf("TNFS open file: \"%s\" (0x%04x, 0x%04x)\n", pFileInf->filename, open_mode, create_perms);
 
-    // Offset to filename + filename length + zero terminator
-    int result = -1;
-    len = len + offset_filename + 1;
-    if (_tnfs_transaction(m_info, packet, len))
+    int result = _tnfs_open_handle(m_info, pFileInf, open_mode, create_perms);
+    if (result == TNFS_RESULT_SUCCESS)
     {
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        // Since everything went okay, save our file info
+        pFileInf->open_mode = open_mode;
+        pFileInf->file_position = pFileInf->cached_pos = 0;
+        // Share cached blocks with any other handles open on the same file
+        pFileInf->file_id = m_info->get_file_id(pFileInf->filename);
+        // Opening for writing may have created or truncated the file
+        if (open_mode & TNFS_OPENMODE_WRITE)
+            m_info->meta_cache.invalidate_path(pFileInf->filename);
+
+        *file_handle = pFileInf->handle;
+
+        // Depending on the file mode and wether the file aready existed,
+        // we need to do something different with the position of the file
+        if (file_exists && (open_mode & TNFS_OPENMODE_WRITE))
         {
-            // Since everything went okay, save our file info
-            pFileInf->handle_id = packet.payload[1];
-            pFileInf->file_position = pFileInf->cached_pos = 0;
-
-            *file_handle = pFileInf->handle_id;
-
-            // Depending on the file mode and wether the file aready existed,
-            // we need to do something different with the position of the file
-            if (file_exists && (open_mode & TNFS_OPENMODE_WRITE))
+            if (open_mode & TNFS_OPENMODE_WRITE_APPEND)
+                pFileInf->file_position = pFileInf->cached_pos = pFileInf->file_size;
+            else if (open_mode & TNFS_OPENMODE_WRITE_TRUNCATE)
             {
-                if (open_mode & TNFS_OPENMODE_WRITE_APPEND)
-                    pFileInf->file_position = pFileInf->cached_pos = pFileInf->file_size;
-                else if (open_mode & TNFS_OPENMODE_WRITE_TRUNCATE)
-                    pFileInf->file_size = 0;
+                m_info->block_cache.invalidate(pFileInf->file_id);
+                _tnfs_set_file_size(m_info, pFileInf->file_id, 0);
             }
-            Debug_printf("File opened, handle ID: %hhd, size: %u, pos: %u\n", *file_handle, pFileInf->file_size, pFileInf->file_position);
         }
-        result = packet.payload[0];
+        Debug_printf("File opened, handle: %hd (server %hd), size: %u, pos: %u\n",
+            *file_handle, pFileInf->handle_id, pFileInf->file_size, pFileInf->file_position);
     }
 
     // Get rid fo the filehandleinfo if we're not going to use it
@@ -206,434 +660,1174 @@ int tnfs_open(tnfsMountInfo *m_info, const char *filepath, uint16_t open_mode, u
 */
 int tnfs_close(tnfsMountInfo *m_info, int16_t file_handle)
 {
+    tnfsMountLock lock(m_info);
     if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle))
         return -1;
 
     // Find info on this handle
-    tnfsFileHandleInfo *pFileInf = m_info->get_filehandleinfo(file_handle);
-    if (pFileInf == nullptr)
-        return TNFS_RESULT_BAD_FILE_DESCRIPTOR;
+    tnfsFileHandleInfo *pFileInf;
+    int result = _tnfs_get_handle(m_info, file_handle, &pFileInf);
+    if (result != 0)
+        return result;
+
+    // Send anything still sitting in the write buffer
+    int write_result = _tnfs_flush_writes(m_info, pFileInf);
+
+    // Get rid of any extra handles we opened for windowed reads
+    _tnfs_close_lanes(m_info, pFileInf);
+
+    // Nobody else is using this file's cached blocks, so give them up
+    if (m_info->file_id_in_use(pFileInf->file_id, pFileInf) == false)
+        m_info->block_cache.invalidate(pFileInf->file_id);
+
+    // Nothing to tell the server if we'd already parked it
+    if (pFileInf->handle_id == TNFS_INVALID_HANDLE)
+    {
+        m_info->delete_filehandleinfo(pFileInf);
+        return write_result;
+    }
 
     tnfsPacket packet;
     packet.command = TNFS_CMD_CLOSE;
-    packet.payload[0] = file_handle;
+    packet.payload[0] = pFileInf->handle_id;
 
     if (_tnfs_transaction(m_info, packet, 1))
     {
         // We're going to go ahead and delete our info even though the server could reject it
         m_info->delete_filehandleinfo(pFileInf);
+        // A failed write is more interesting to the caller than how the close went
+        if (write_result != TNFS_RESULT_SUCCESS)
+            return write_result;
         return packet.payload[0];
     }
 
     return -1;
 }
 
-#ifdef DEBUG
-void _tnfs_cache_dump(const char *title, uint8_t *cache, uint32_t cache_size)
+/*
+ Sends any buffered writes for an open file to the server.
+ Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
+ If an earlier attempt to send buffered writes failed, that error is returned
+ (and forgotten) here.
+*/
+int tnfs_fsync(tnfsMountInfo *m_info, int16_t file_handle)
 {
-    int bytes_per_line = 16;
-    Debug_printf("\n%s %u\n", title, cache_size);
-    for (int j = 0; j < cache_size; j += bytes_per_line)
-    {
-        for (int k = 0; (k + j) < cache_size && k < bytes_per_line; k++)
-            Debug_printf("%02X ", cache[k + j]);
-        Debug_println();
-    }
-    Debug_println();
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle))
+        return -1;
+
+    // Find info on this handle
+    tnfsFileHandleInfo *pFileInf;
+    int result = _tnfs_get_handle(m_info, file_handle, &pFileInf);
+    if (result != 0)
+        return result;
+
+    result = _tnfs_flush_writes(m_info, pFileInf);
+    pFileInf->write_error = 0;
+    return result;
 }
-#endif    
 
 /*
- Fills destination buffer with data available in internal cache, if any
- Returns 0: success; TNFS_RESULT_END_OF_FILE: EOF; -1: if not all bytes requested could be fulfilled by cache
+ Finds the info for one of the handles we gave the client. If another task has
+ let go of the mount part-way through using it (see _tnfs_yield), we wait for
+ that task to finish with it first.
+ Returns: 0: success, TNFS_RESULT_BAD_FILE_DESCRIPTOR: no such handle,
+  TNFS_RESULT_RESOURCE_BUSY: it's busy and we're inside another call, so can't wait
 */
-int _tnfs_read_from_cache(tnfsFileHandleInfo *pFHI, uint8_t *dest, uint16_t dest_size, uint16_t *dest_used)
+int _tnfs_get_handle(tnfsMountInfo *m_info, int16_t file_handle, tnfsFileHandleInfo **ppFHI)
 {
-    #ifdef VERBOSE_TNFS
-    Debug_printf("_tnfs_read_from_cache: buffpos=%d, cache_start=%d, cache_avail=%d, dest_size=%d, dest_used=%d\n",
-                 pFHI->cached_pos, pFHI->cache_start, pFHI->cache_available, dest_size, *dest_used);
-    #endif
-
-    // Report if we've reached the end of the file
-    if (pFHI->cached_pos >= pFHI->file_size)
+    while (true)
     {
-        #ifdef VERBOSE_TNFS        
-        Debug_print("_tnfs_read_from_cache - attempting to read past EOF\n");
-        #endif
-        return TNFS_RESULT_END_OF_FILE;
-    }
-    // Reject if we have nothing in the cache
-    if (pFHI->cache_available == 0)
-    {
-        #ifdef VERBOSE_TNFS        
-        Debug_print("_tnfs_read_from_cache - nothing in cache\n");
-        #endif
-        return -1;
-    }
-
-    // See if the current file position is at or after the start of our cache
-    if (pFHI->cached_pos >= pFHI->cache_start)
-    {
-        // See if the current file position falls before the end of our cache
-        uint32_t cache_end = pFHI->cache_start + pFHI->cache_available;
-        if (pFHI->cached_pos < cache_end)
+        tnfsFileHandleInfo *pFHI = m_info->get_filehandleinfo(file_handle);
+        if (pFHI == nullptr)
+            return TNFS_RESULT_BAD_FILE_DESCRIPTOR;
+        if (pFHI->busy == false)
         {
-            // Our current file position is within the cached region
-            // Calculate how many bytes to provide:
-            // Either from the position to the end of the cache
-            // Or the bytes free at the destination if that's smaller
-            uint32_t bytes_available = cache_end - pFHI->cached_pos;
-            uint16_t dest_free = dest_size - *dest_used; // This accounts for an earlier partially-fulfilled request
-            uint16_t bytes_provided = dest_free > bytes_available ? bytes_available : dest_free;
-
-            #ifdef VERBOSE_TNFS
-            Debug_printf("TNFS cache providing %u bytes\n", bytes_provided);
-            #endif
-            memcpy(dest + (*dest_used), pFHI->cache + (pFHI->cached_pos - pFHI->cache_start), bytes_provided);
-
-#ifdef DEBUG
-            //_tnfs_cache_dump("CACHE PROVIDED", dest + (*dest_used), bytes_provided);
-#endif
-
-            pFHI->cached_pos += bytes_provided;
-            *dest_used += bytes_provided;
-
-            /*
-            // Report if we've reached the end of the file
-            if (pFHI->cached_pos > pFHI->file_size)
-            {
-                Debug_print("_tnfs_read_from_cache - reached EOF\n");
-                return TNFS_RESULT_END_OF_FILE;
-            }
-            */
+            *ppFHI = pFHI;
+            return 0;
         }
+        // It may even be closed by the time we get the mount back, so look it up again
+        if (_tnfs_wait(m_info) == false)
+            return TNFS_RESULT_RESOURCE_BUSY;
     }
+}
 
-    // Return value depends on whether we filled the destination buffer
-    if (dest_size - *dest_used)
-        return -1;
-    else
-        return 0;
+/*
+ Lets any other task waiting for the mount have it between the packet exchanges
+ of a long read or write of pFHI, so a background transfer doesn't hold up the
+ SIO task's disk reads for its whole length. pFHI is marked busy meanwhile, so
+ the other task won't park it, close its lanes or send its buffered writes.
+ We only let go from the outermost tnfs_* call, as one further up the stack may
+ be relying on parts of the mount that the other task could change.
+ Returns true if someone else had the mount.
+*/
+bool _tnfs_yield(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI)
+{
+    int waiters = m_info->lock_waiters();
+    if (waiters == 0 || m_info->lock_depth() != 1)
+        return false;
+
+    m_info->protocol_stats.handovers++;
+    pFHI->busy = true;
+    m_info->unlock();
+    // A more important task on our core has already taken over, and one just as
+    // important gets to now. One on the other core needs a moment to pick it up.
+    unsigned long started = fnSystem.micros();
+    do
+        taskYIELD();
+    while (m_info->lock_waiters() >= waiters && fnSystem.micros() - started < TNFS_LOCK_HANDOVER_US);
+    m_info->lock();
+    pFHI->busy = false;
+    return true;
 }
 
-/* 
- Executes as many READ calls as needed to populate our internal cache
- Returns: 0: success; -1: failed to deliver/receive packet; other: TNFS error result code
+/*
+ Lets go of the mount for a tick so whichever task marked a handle we need as
+ busy can finish with it. It may be less important than us, so just yielding
+ wouldn't let it run.
+ Returns false if we're inside another tnfs_* call and can't let go.
 */
-int _tnfs_fill_cache(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI)
+bool _tnfs_wait(tnfsMountInfo *m_info)
 {
-    // Note that when we're filling the cache, we're dealing with the "real" file position,
-    // not the cached_position we also keep track of on behalf of the client
-    #ifdef VERBOSE_TNFS
-    Debug_printf("_TNFS_FILL_CACHE fh=%d, file_position=%d\n", pFHI->handle_id, pFHI->file_position);
-    #endif
+    if (m_info->lock_depth() != 1)
+        return false;
 
-    int error = 0;
+    m_info->unlock();
+    vTaskDelay(1);
+    m_info->lock();
+    return true;
+}
 
-    // Reset the current cache values so it's invalid if we fail below
-    pFHI->cache_available = 0;
-    pFHI->cache_start = pFHI->file_position;
+/*
+ Asks the server to open the file at pFHI->filename, storing its handle in pFHI->handle_id.
+ If the server runs out of handles we give up our windowed read handles, then
+ park other files until it has room.
+ Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
+*/
+int _tnfs_open_handle(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, uint16_t open_mode, uint16_t create_perms)
+{
+    // Stay within our own limit on open server handles
+    if (m_info->count_server_handles() >= TNFS_MAX_SERVER_HANDLES)
+        _tnfs_park(m_info, m_info->least_recently_used(pFHI));
 
-    // How many bytes until we finish loading the cache
-    uint32_t bytes_remaining_to_load = sizeof(pFHI->cache);
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_OPEN;
 
-    // Keep making TNFS READ calls as long as we still have bytes to read
-    while (bytes_remaining_to_load > 0)
-    {
-        tnfsPacket packet;
-        packet.command = TNFS_CMD_READ;
-        packet.payload[0] = pFHI->handle_id;
+    packet.payload[0] = TNFS_LOBYTE_FROM_UINT16(open_mode);
+    packet.payload[1] = TNFS_HIBYTE_FROM_UINT16(open_mode);
 
-        // How many bytes to read in this call
-        uint16_t bytes_to_read = bytes_remaining_to_load > TNFS_MAX_READWRITE_PAYLOAD ? TNFS_MAX_READWRITE_PAYLOAD : bytes_remaining_to_load;
+    packet.payload[2] = TNFS_LOBYTE_FROM_UINT16(create_perms);
+    packet.payload[3] = TNFS_HIBYTE_FROM_UINT16(create_perms);
 
-        packet.payload[1] = TNFS_LOBYTE_FROM_UINT16(bytes_to_read);
-        packet.payload[2] = TNFS_HIBYTE_FROM_UINT16(bytes_to_read);
+    int offset_filename = 4; // Where the filename starts in the buffer
+    // Offset to filename + filename length + zero terminator
+    int len = offset_filename + strlcpy((char *)packet.payload + offset_filename, pFHI->filename, sizeof(packet.payload) - offset_filename) + 1;
 
-        #ifdef VERBOSE_TNFS
-        Debug_printf("_tnfs_fill_cache requesting %u bytes\n", bytes_to_read);
-        #endif
-
-        if (_tnfs_transaction(m_info, packet, 3))
-        {
-            int tnfs_result = packet.payload[0];
-            if (tnfs_result == TNFS_RESULT_SUCCESS)
-            {
-                // Copy the actual number of bytes returned to us into our cache
-                // (offset by how many bytes we've already put in the cache)
-                uint16_t bytes_read = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 1);
-                memcpy(pFHI->cache + (sizeof(pFHI->cache) - bytes_remaining_to_load),
-                       packet.payload + 3, bytes_read);
-
-                // Keep track of our file position
-                pFHI->file_position = pFHI->file_position + bytes_read;
-                // Keep track of how many more bytes we have to go
-                bytes_remaining_to_load -= bytes_read;
-
-                #ifdef VERBOSE_TNFS
-                Debug_printf("_tnfs_fill_cache got %u bytes, %u more bytes needed\n", bytes_read, bytes_remaining_to_load);
-                #endif
-            }
-            else if(tnfs_result == TNFS_RESULT_END_OF_FILE)
-            {
-                // Stop if we got an EOF result
-                #ifdef VERBOSE_TNFS
-                Debug_print("_tnfs_fill_cache got EOF\n");
-                #endif
-                break;
-            }
-            else
-            {
-                Debug_printf("_tnfs_fill_cache unexepcted result: %u\n", tnfs_result);
-                error = tnfs_result;
-                break;
-            }
-        }
-        else
+    // Keep a copy of the request in case we need to send it again
+    tnfsPacket request = packet;
+    while (_tnfs_transaction(m_info, packet, len))
+    {
+        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
         {
-            Debug_print("_tnfs_fill_cache received failure condition on TNFS read attempt\n");
-            error = -1;
-            break;
+            pFHI->handle_id = packet.payload[1];
+            pFHI->file_position = 0;
+            return 0;
         }
-    }
 
-    // If we're successful, note the total number of valid bytes in our cache
-    if (error == 0)
-    {
-        pFHI->cache_available = sizeof(pFHI->cache) - bytes_remaining_to_load;
-#ifdef DEBUG
-        //_tnfs_cache_dump("CACHE FILL RESULTS", pFHI->cache, pFHI->cache_available);
-#endif
-    }
+        if (packet.payload[0] != TNFS_RESULT_TOO_MANY_FILES_OPEN && packet.payload[0] != TNFS_RESULT_FILE_TABLE_OVERFLOW)
+            return packet.payload[0];
 
-    return error;
+        // Extra read window handles count against the server's limit - give them up first
+        Debug_print("TNFS server out of file handles - making room\n");
+        if (_tnfs_close_all_lanes(m_info) == false && _tnfs_park(m_info, m_info->least_recently_used(pFHI)) == false)
+            return packet.payload[0];
+        packet = request;
+    }
+    return -1;
 }
 
 /*
- Reads from an open file.
- Max bufflen is TNFS_PAYLOAD_SIZE - 3; any larger size will return an error
- Bytes actually read will be placed in resultlen
- Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
- */
-int tnfs_read(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint16_t bufflen, uint16_t *resultlen)
+ Closes the server's handle on an open file to make room for another one.
+ Buffered writes are sent first; if that fails, the error is kept in write_error
+ as usual. The client's handle stays valid, and _tnfs_unpark re-opens the file
+ the next time we need the server's handle.
+ Returns false if there was nothing to park.
+*/
+bool _tnfs_park(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI)
 {
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle) ||
-        buffer == nullptr || bufflen > (TNFS_PAYLOAD_SIZE - 3) || resultlen == nullptr)
-        return -1;
+    if (pFHI == nullptr || pFHI->handle_id == TNFS_INVALID_HANDLE)
+        return false;
 
-    *resultlen = 0;
+    Debug_printf("TNFS parking handle %hu (server %hd) \"%s\"\n", pFHI->handle, pFHI->handle_id, pFHI->filename);
 
-    // Find info on this handle
-    tnfsFileHandleInfo *pFileInf = m_info->get_filehandleinfo(file_handle);
-    if (pFileInf == nullptr)
-        return TNFS_RESULT_BAD_FILE_DESCRIPTOR;
+    _tnfs_flush_writes(m_info, pFHI);
+    _tnfs_close_lanes(m_info, pFHI);
 
-    #ifdef VERBOSE_TNFS
-    Debug_printf("tnfs_read fh=%d, len=%d\n", file_handle, bufflen);
-    #endif
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_CLOSE;
+    packet.payload[0] = pFHI->handle_id;
+    _tnfs_transaction(m_info, packet, 1);
 
-    int result = 0;
-    // Try to fulfill the request using our internal cache
-    while ((result = _tnfs_read_from_cache(pFileInf, buffer, bufflen, resultlen)) != 0 && result != TNFS_RESULT_END_OF_FILE)
+    pFHI->handle_id = TNFS_INVALID_HANDLE;
+    pFHI->file_position = TNFS_POSITION_UNKNOWN;
+    // Let someone else use the write buffer while we're idle
+    if (pFHI->write_buffer != nullptr && pFHI->write_pending == 0)
     {
-        // Reload the cache if we couldn't fulfill the request
-        result = _tnfs_fill_cache(m_info, pFileInf);
-        if (result != 0)
-        {
-            Debug_printf("tnfs_read cache fill failed (%u) - aborting", result);
-            break;
-        }
+        m_info->release_buffer(pFHI->write_buffer);
+        pFHI->write_buffer = nullptr;
     }
-
-    return result;
+    return true;
 }
 
-
 /*
- Write to an open file.
- Max bufflen is TNFS_PAYLOAD_SIZE - 3; any larger size will return an error
- Bytes actually written will be placed in resultlen
+ Makes sure a file we may have parked is open on the server again.
+ It's re-opened with the mode it was first opened with, minus anything that
+ would create or truncate it.
  Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
- */
-int tnfs_write(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint16_t bufflen, uint16_t *resultlen)
+*/
+int _tnfs_unpark(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI)
 {
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle) || 
-        buffer == nullptr || bufflen > (TNFS_PAYLOAD_SIZE - 3) || resultlen == nullptr)
-        return -1;
+    if (pFHI->handle_id != TNFS_INVALID_HANDLE)
+        return 0;
 
-    *resultlen = 0;
+    uint16_t open_mode = pFHI->open_mode &
+        ~(TNFS_OPENMODE_WRITE_CREATE | TNFS_OPENMODE_WRITE_TRUNCATE | TNFS_OPENMODE_CREATE_EXCLUSIVE);
 
-    // Find info on this handle
-    tnfsFileHandleInfo *pFileInf = m_info->get_filehandleinfo(file_handle);
-    if (pFileInf == nullptr)
-        return TNFS_RESULT_BAD_FILE_DESCRIPTOR;
+    int result = _tnfs_open_handle(m_info, pFHI, open_mode, 0);
+    if (result != 0)
+        Debug_printf("TNFS failed to re-open parked handle %hu \"%s\": %d\n", pFHI->handle, pFHI->filename, result);
+    return result;
+}
+
+/*
+ Opens additional read-only server handles on the same file so that
+ _tnfs_read_window can keep several READ requests in flight.
+ The protocol doesn't allow more than one outstanding request per handle
+ when order matters, so each extra request needs its own handle.
+ Returns the number of lanes available (not counting the original handle)
+*/
+int _tnfs_open_lanes(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, int wanted)
+{
+    if (wanted > TNFS_MAX_READ_WINDOW - 1)
+        wanted = TNFS_MAX_READ_WINDOW - 1;
 
-    // For now, invalidate our cache and seek to the current position in the file before writing
-    pFileInf->cache_available = 0;
-    if(pFileInf->cached_pos != pFileInf->file_position)
+    while (pFHI->lane_count < wanted && pFHI->lane_open_failed == false)
     {
-        int result = tnfs_lseek(m_info, file_handle, pFileInf->cached_pos, SEEK_SET, nullptr, true);
-        if(result != 0)
+        tnfsPacket packet;
+        packet.command = TNFS_CMD_OPEN;
+        packet.payload[0] = TNFS_LOBYTE_FROM_UINT16(TNFS_OPENMODE_READ);
+        packet.payload[1] = TNFS_HIBYTE_FROM_UINT16(TNFS_OPENMODE_READ);
+        packet.payload[2] = 0;
+        packet.payload[3] = 0;
+        // The filename we stored is already a full path
+        int len = strlcpy((char *)packet.payload + 4, pFHI->filename, sizeof(packet.payload) - 4);
+
+        if (_tnfs_transaction(m_info, packet, len + 4 + 1) && packet.payload[0] == TNFS_RESULT_SUCCESS)
         {
-            Debug_print("TNFS seek failed during write\n");
-            return result;
+            pFHI->lane_handles[pFHI->lane_count] = packet.payload[1];
+            pFHI->lane_positions[pFHI->lane_count] = 0;
+            pFHI->lane_count++;
+        }
+        else
+        {
+            Debug_printf("_tnfs_open_lanes couldn't get another handle; continuing with %hu\n", pFHI->lane_count);
+            pFHI->lane_open_failed = true;
         }
     }
+    return pFHI->lane_count;
+}
 
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_WRITE;
-    packet.payload[0] = file_handle;
-    packet.payload[1] = TNFS_LOBYTE_FROM_UINT16(bufflen);
-    packet.payload[2] = TNFS_HIBYTE_FROM_UINT16(bufflen);
-
-    memcpy(packet.payload + 3, buffer, bufflen);
+/*
+ Closes any additional server handles opened for windowed reads
+*/
+void _tnfs_close_lanes(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI)
+{
+    for (int i = 0; i < pFHI->lane_count; i++)
+    {
+        tnfsPacket packet;
+        packet.command = TNFS_CMD_CLOSE;
+        packet.payload[0] = pFHI->lane_handles[i];
+        _tnfs_transaction(m_info, packet, 1);
+    }
+    pFHI->lane_count = 0;
+}
 
-    if (_tnfs_transaction(m_info, packet, bufflen + 3))
+/*
+ Closes the windowed read handles of every open file, making room on the server
+ Returns false if there weren't any
+*/
+bool _tnfs_close_all_lanes(tnfsMountInfo *m_info)
+{
+    bool closed = false;
+    for (int i = 0; i < m_info->filehandle_slots(); i++)
     {
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        tnfsFileHandleInfo *pFHI = m_info->get_filehandleinfo_at(i);
+        // Lanes another task is reading from are left alone
+        if (pFHI != nullptr && pFHI->lane_count > 0 && pFHI->busy == false)
         {
-            *resultlen = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 1);
-            // Keep track of our file position
-            uint32_t new_pos = pFileInf->file_position + *resultlen;
-            // Debug_printf("tnfs_write prev_pos: %u, read: %u, new_pos: %u\n", pFileInf->file_position, *resultlen, new_pos);
-            pFileInf->file_position = pFileInf->cached_pos = new_pos;
+            _tnfs_close_lanes(m_info, pFHI);
+            // Don't immediately grab them again
+            pFHI->lane_open_failed = true;
+            closed = true;
         }
-        return packet.payload[0];
     }
-    return -1;
+    return closed;
 }
 
+// State of one lane of a windowed read
+struct tnfsWindowLane
+{
+    enum
+    {
+        LANE_IDLE = 0,
+        LANE_SEEKING,
+        LANE_READING,
+        LANE_DONE
+    } state = LANE_IDLE;
+
+    uint8_t handle;
+    uint32_t *handle_pos; // Where the server thinks this handle is; UINT32_MAX if unknown
+    uint32_t next;        // Next file position this lane needs to read
+    uint32_t end;         // End of this lane's stripe
+    uint16_t requested;   // Bytes asked for by the READ in flight
+    uint8_t sequence_num; // Sequence number of the request in flight
+    uint8_t retries;
+    unsigned long sent_ms;
+    unsigned long first_ms;  // When we first sent the request in flight
+    unsigned long resend_ms; // Set when the server asks us to back off
+};
+
 /*
-  Try to seek within our internal cache
-  Return 0 on success, -1 on failure
+ Sends the next request for the given lane: a SEEK if the handle isn't where
+ we need it, otherwise a READ of up to one payload.
 */
-int _tnfs_cache_seek(tnfsFileHandleInfo *pFHI, int32_t position, uint8_t type)
+bool _tnfs_window_send(fnUDP &udp, tnfsMountInfo *m_info, tnfsWindowLane &lane)
 {
-    if (pFHI->cache_available == 0)
-        return -1;
+    tnfsPacket packet;
+    uint16_t payload_size;
 
-    // Calculate where we're supposed to end up to see if it's within the cached region
-    uint32_t destination_pos;
-    if (type == SEEK_SET)
-        destination_pos = position;
-    else if (type == SEEK_CUR)
-        destination_pos = pFHI->cached_pos + position;
+    packet.payload[0] = lane.handle;
+    if (*lane.handle_pos != lane.next)
+    {
+        packet.command = TNFS_CMD_LSEEK;
+        packet.payload[1] = SEEK_SET;
+        TNFS_UINT32_TO_LOHI_BYTEPTR(lane.next, packet.payload + 2);
+        payload_size = 6;
+        lane.state = tnfsWindowLane::LANE_SEEKING;
+    }
     else
-        destination_pos = pFHI->file_size + position;
+    {
+        uint32_t left = lane.end - lane.next;
+        lane.requested = left > m_info->read_payload ? m_info->read_payload : left;
+        packet.command = TNFS_CMD_READ;
+        packet.payload[1] = TNFS_LOBYTE_FROM_UINT16(lane.requested);
+        packet.payload[2] = TNFS_HIBYTE_FROM_UINT16(lane.requested);
+        payload_size = 3;
+        lane.state = tnfsWindowLane::LANE_READING;
+    }
+
+    lane.sequence_num = m_info->current_sequence_num;
+    lane.sent_ms = fnSystem.millis();
+    if (lane.retries == 0)
+        lane.first_ms = lane.sent_ms;
+    lane.resend_ms = 0;
+    return _tnfs_send(udp, m_info, packet, payload_size);
+}
 
-    uint32_t cache_end = pFHI->cache_start + pFHI->cache_available;
-    Debug_printf("_tnfs_cache_seek current=%u, destination=%u, cache_start=%u, cache_end=%u\n",
-                 pFHI->cached_pos, destination_pos, pFHI->cache_start, cache_end);
+/*
+ Works out from the reply to one of our first jumbo READs how much the server
+ will send at once. A full reply means jumbo reads work; a short one that isn't
+ at the end of the file is the most it'll send, so that's what we ask for from now on.
+*/
+void _tnfs_learn_read_payload(tnfsMountInfo *m_info, const tnfsWindowLane &lane, uint16_t bytes_read, uint32_t file_size)
+{
+    if (m_info->read_payload_learned || lane.requested <= TNFS_MAX_READWRITE_PAYLOAD)
+        return;
 
-    // Just update our position if we're within the cached region
-    if (destination_pos >= pFHI->cache_start && destination_pos < cache_end)
+    if (bytes_read == lane.requested)
     {
-        Debug_println("_tnfs_cache_seek within cached region");
-        pFHI->cached_pos = destination_pos;
-        return 0;
+        Debug_printf("TNFS server handles %hu byte READs\n", m_info->read_payload);
+        m_info->read_payload_learned = true;
+    }
+    else if (lane.next + bytes_read < file_size)
+    {
+        m_info->read_payload = bytes_read > TNFS_MAX_READWRITE_PAYLOAD ? bytes_read : TNFS_MAX_READWRITE_PAYLOAD;
+        m_info->read_payload_learned = true;
+        Debug_printf("TNFS server limits READs to %hu bytes\n", m_info->read_payload);
     }
+}
 
-    Debug_println("_tnfs_cache_seek outside cached region");
-    return -1;
+/*
+ Goes back to standard-sized READs for the rest of the mount
+*/
+void _tnfs_read_payload_fallback(tnfsMountInfo *m_info)
+{
+    Debug_println("TNFS jumbo READs aren't working - falling back");
+    m_info->read_payload = TNFS_MAX_READWRITE_PAYLOAD;
+    m_info->read_payload_learned = true;
 }
 
 /*
- Seek to different position in open file
- Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
- */
-int tnfs_lseek(tnfsMountInfo *m_info, int16_t file_handle, int32_t position, uint8_t type, uint32_t *new_position, bool skip_cache)
+ Reads (len - *dest_used) bytes starting at the given file position into dest + *dest_used,
+ keeping up to tnfsMountInfo.read_window READ requests in flight.
+
+ The range is split into contiguous stripes, one per server handle ("lane"), so
+ each handle only needs a single SEEK before reading sequentially. Replies are
+ matched to lanes by sequence number and copied straight to their place in the
+ destination, so they may arrive in any order. A lane that times out is
+ re-sent on its own: a lost READ leaves the server's position unknown, so it's
+ preceded by a SEEK back to the lane's position.
+
+ The file's own handle always takes the last stripe, leaving
+ tnfsFileHandleInfo.file_position just past the data we read.
+ Returns: 0: success; TNFS_RESULT_END_OF_FILE: EOF; -1: failed to deliver/receive packet; other: TNFS error result code
+*/
+int _tnfs_read_window(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, uint32_t position, uint8_t *dest, uint16_t len, uint16_t *dest_used)
 {
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle))
-        return -1;
+    if (position >= pFHI->file_size)
+        return TNFS_RESULT_END_OF_FILE;
 
-    // Make sure we're using a valid seek type
-    if (type != SEEK_SET && type != SEEK_CUR && type != SEEK_END)
-        return TNFS_RESULT_INVALID_ARGUMENT;
+    // We need the server's handle from here on
+    int result = _tnfs_unpark(m_info, pFHI);
+    if (result != 0)
+        return result;
 
-    // Find info on this handle
-    tnfsFileHandleInfo *pFileInf = m_info->get_filehandleinfo(file_handle);
-    if (pFileInf == nullptr)
-        return TNFS_RESULT_BAD_FILE_DESCRIPTOR;
+    // TCP keeps our requests in order, so there's no need for extra handles
+    if (m_info->using_tcp)
+        return _tnfs_tcp_read_window(m_info, pFHI, position, dest, len, dest_used);
 
-    Debug_printf("tnfs_lseek currpos=%d, pos=%d, typ=%d\n", pFileInf->cached_pos, position, type);
+    // Don't ask for anything beyond the end of the file
+    uint32_t total = len - *dest_used;
+    bool short_file = false;
+    if (total > pFHI->file_size - position)
+    {
+        total = pFHI->file_size - position;
+        short_file = true;
+    }
 
-    // Try to fulfill the seek within our internal cache
-    if (skip_cache == false && _tnfs_cache_seek(pFileInf, position, type) == 0)
+    // Figure out how many lanes we can use
+    uint16_t chunk = m_info->read_payload;
+    int chunks = (total + chunk - 1) / chunk;
+    int window = m_info->read_window > TNFS_MAX_READ_WINDOW ? TNFS_MAX_READ_WINDOW : m_info->read_window;
+    if (window > chunks)
+        window = chunks;
+    if (window < 1)
+        window = 1;
+    // Stripes are whole payloads, so e.g. 5 payloads over 4 lanes is 2 each and only needs 3 lanes
+    int stripe_chunks = (chunks + window - 1) / window;
+    window = (chunks + stripe_chunks - 1) / stripe_chunks;
+    if (window > 1)
     {
-        if(new_position != nullptr)
-            *new_position = pFileInf->cached_pos;
-        return 0;
+        int granted = _tnfs_open_lanes(m_info, pFHI, window - 1) + 1;
+        if (granted < window)
+        {
+            window = granted;
+            stripe_chunks = (chunks + window - 1) / window;
+            window = (chunks + stripe_chunks - 1) / stripe_chunks;
+        }
     }
-    // Cache seek failed - invalidate the internal cache
-    pFileInf->cache_available = 0;
 
-    // Go ahead and execute a new TNFS SEEK request
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_LSEEK;
-    packet.payload[0] = file_handle;
-    packet.payload[1] = type;
-    TNFS_UINT32_TO_LOHI_BYTEPTR(position, packet.payload + 2);
+    // Divide the range into stripes of whole payloads, none of them past the end of the range
+    tnfsWindowLane lanes[TNFS_MAX_READ_WINDOW];
+    uint32_t stripe = stripe_chunks * chunk;
+    for (int i = 0; i < window; i++)
+    {
+        lanes[i].next = position + i * stripe;
+        lanes[i].end = (i == window - 1) ? position + total : lanes[i].next + stripe;
+        if (lanes[i].end > position + total)
+            lanes[i].end = position + total;
+        if (lanes[i].next > lanes[i].end)
+            lanes[i].next = lanes[i].end;
+        if (i == window - 1)
+        {
+            lanes[i].handle = pFHI->handle_id;
+            lanes[i].handle_pos = &pFHI->file_position;
+        }
+        else
+        {
+            lanes[i].handle = pFHI->lane_handles[i];
+            lanes[i].handle_pos = &pFHI->lane_positions[i];
+        }
+        lanes[i].retries = 0;
+    }
 
-    if (_tnfs_transaction(m_info, packet, 6))
+    #ifdef VERBOSE_TNFS
+    Debug_printf("_tnfs_read_window pos=%u, len=%u, lanes=%d, stripe=%u\n", position, total, window, stripe);
+    #endif
+
+    fnUDP udp;
+    int error = 0;
+
+    for (int i = 0; i < window; i++)
+        if (!_tnfs_window_send(udp, m_info, lanes[i]))
+            lanes[i].sent_ms = 0; // Let the timeout logic retry it
+
+    int busy = window;
+    while (busy > 0 && error == 0)
     {
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        if (udp.parsePacket())
         {
-            // Keep track of our file position
-            if (type == SEEK_SET)
-                pFileInf->file_position = position;
-            else if (type == SEEK_CUR)
-                pFileInf->file_position += position;
+            // Only the header, result and READ count go in pkt. READ data is copied straight
+            // from the datagram to dest, since a jumbo reply won't fit in a tnfsPacket
+            tnfsPacket pkt;
+            unsigned short l = udp.read(pkt.rawData, TNFS_HEADER_SIZE + 3);
+#ifdef TNFS_IMPAIRMENT
+            if (_tnfs_impair_drop(m_info))
+            {
+                udp.flush();
+                continue;
+            }
+#endif
+#ifdef DEBUG
+            _tnfs_debug_packet(pkt, l, true);
+#endif
+            // Find the lane waiting on this reply; anything else is a stale duplicate
+            tnfsWindowLane *lane = nullptr;
+            for (int i = 0; i < window; i++)
+                if ((lanes[i].state == tnfsWindowLane::LANE_SEEKING || lanes[i].state == tnfsWindowLane::LANE_READING) &&
+                    lanes[i].sequence_num == pkt.sequence_num && lanes[i].resend_ms == 0)
+                {
+                    lane = &lanes[i];
+                    break;
+                }
+
+            if (lane == nullptr || l < TNFS_HEADER_SIZE + 1)
+            {
+                Debug_println("_tnfs_read_window ignoring unexpected packet");
+                m_info->protocol_stats.stale_replies++;
+            }
+            else if (pkt.payload[0] == TNFS_RESULT_TRY_AGAIN)
+            {
+                m_info->protocol_stats.try_again++;
+                // The server didn't act on it; send the same thing again after the requested delay
+                uint16_t backoffms = TNFS_UINT16_FROM_LOHI_BYTEPTR(pkt.payload + 1);
+                if (backoffms > TNFS_MAX_BACKOFF_DELAY)
+                    backoffms = TNFS_MAX_BACKOFF_DELAY;
+                lane->resend_ms = fnSystem.millis() + backoffms;
+            }
+            else if (lane->state == tnfsWindowLane::LANE_SEEKING)
+            {
+                if (pkt.payload[0] != TNFS_RESULT_SUCCESS)
+                    error = pkt.payload[0];
+                else
+                {
+                    *lane->handle_pos = lane->next;
+                    if (!_tnfs_window_send(udp, m_info, *lane))
+                        lane->sent_ms = 0;
+                }
+            }
+            else if (pkt.payload[0] == TNFS_RESULT_SUCCESS)
+            {
+                uint16_t bytes_read = TNFS_UINT16_FROM_LOHI_BYTEPTR(pkt.payload + 1);
+                if (bytes_read > lane->requested)
+                    bytes_read = lane->requested;
+                bytes_read = udp.read(dest + *dest_used + (lane->next - position), bytes_read);
+                _tnfs_learn_read_payload(m_info, *lane, bytes_read, pFHI->file_size);
+                m_info->protocol_stats.bytes_read += bytes_read;
+                lane->next += bytes_read;
+                *lane->handle_pos += bytes_read;
+                lane->retries = 0;
+
+                if (lane->next >= lane->end || bytes_read == 0)
+                {
+                    lane->state = tnfsWindowLane::LANE_DONE;
+                    busy--;
+                }
+                else if (!_tnfs_window_send(udp, m_info, *lane))
+                    lane->sent_ms = 0;
+            }
+            else if (pkt.payload[0] == TNFS_RESULT_END_OF_FILE)
+            {
+                // The file must have shrunk since we opened it
+                lane->state = tnfsWindowLane::LANE_DONE;
+                busy--;
+            }
+            else if (lane->requested > TNFS_MAX_READWRITE_PAYLOAD && m_info->read_payload_learned == false)
+            {
+                // The server may not like being asked for more than it would normally send
+                _tnfs_read_payload_fallback(m_info);
+                if (!_tnfs_window_send(udp, m_info, *lane))
+                    lane->sent_ms = 0;
+            }
             else
-                pFileInf->file_position = (pFileInf->file_size + position);
+            {
+                Debug_printf("_tnfs_read_window unexpected result: %u\n", pkt.payload[0]);
+                error = pkt.payload[0];
+            }
+            udp.flush();
 
-            pFileInf->cached_pos = pFileInf->file_position;
+            // Let anyone waiting for the mount in between our packets. Replies that come
+            // in meanwhile wait on our socket, so the time away doesn't count against them.
+            unsigned long away_ms = fnSystem.millis();
+            if (busy > 0 && error == 0 && _tnfs_yield(m_info, pFHI))
+            {
+                away_ms = fnSystem.millis() - away_ms;
+                for (int i = 0; i < window; i++)
+                {
+                    lanes[i].first_ms += away_ms;
+                    if (lanes[i].sent_ms != 0)
+                        lanes[i].sent_ms += away_ms;
+                    if (lanes[i].resend_ms != 0)
+                        lanes[i].resend_ms += away_ms;
+                }
+            }
+        }
 
-            if(new_position != nullptr)
-                *new_position = pFileInf->file_position;
-            uint32_t response_pos = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + 1);    
-            Debug_printf("tnfs_lseek success, new pos=%u, response pos=%u\n", pFileInf->file_position, response_pos);
+        // Re-send anything that's timed out or that the server asked us to delay
+        unsigned long now = fnSystem.millis();
+        for (int i = 0; i < window && error == 0; i++)
+        {
+            tnfsWindowLane &lane = lanes[i];
+            if (lane.state != tnfsWindowLane::LANE_SEEKING && lane.state != tnfsWindowLane::LANE_READING)
+                continue;
 
-            // TODO: This is temporary while we confirm that the recently-changed TNFSD code matches what we've been doing prior
-            if(pFileInf->file_position != response_pos)
+            if (lane.resend_ms != 0)
             {
-                Debug_print("CALCULATED AND RESPONSE POS DON'T MATCH!\n");
-                vTaskDelay(5000 / portTICK_PERIOD_MS);
+                if ((long)(now - lane.resend_ms) >= 0 && !_tnfs_window_send(udp, m_info, lane))
+                    lane.sent_ms = 0;
+            }
+            // The server works through our requests one after the other, so allow for the ones ahead of this
+            else if (now - lane.sent_ms >= _tnfs_rto(m_info, lane.retries) * window)
+            {
+                if (++lane.retries >= m_info->max_retries && now - lane.first_ms >= (unsigned long)m_info->timeout_ms)
+                {
+                    Debug_println("_tnfs_read_window retry attempts failed");
+                    m_info->protocol_stats.failures++;
+                    error = -1;
+                    break;
+                }
+                Debug_printf("_tnfs_read_window lane %d timed out. Retrying\n", i);
+                m_info->protocol_stats.retransmits++;
+                // Replies too large for something between us and the server never make it back
+                if (lane.state == tnfsWindowLane::LANE_READING && lane.requested > TNFS_MAX_READWRITE_PAYLOAD &&
+                    m_info->read_payload_learned == false && lane.retries >= TNFS_JUMBO_PROBE_RETRIES)
+                    _tnfs_read_payload_fallback(m_info);
+                // We can't tell if a lost READ moved the file position, so put it back where we want it
+                if (lane.state == tnfsWindowLane::LANE_READING)
+                    *lane.handle_pos = TNFS_POSITION_UNKNOWN;
+                if (!_tnfs_window_send(udp, m_info, lane))
+                    lane.sent_ms = 0;
             }
         }
-        return packet.payload[0];
+        fnSystem.yield();
     }
-    return -1;
+
+    // Only count the data that's contiguous from the start of the range
+    uint32_t got = 0;
+    for (int i = 0; i < window; i++)
+    {
+        got = lanes[i].next - position;
+        if (lanes[i].next < lanes[i].end)
+            break;
+    }
+    *dest_used += got;
+
+    if (error != 0)
+        return error;
+
+    return (short_file || got < total) ? TNFS_RESULT_END_OF_FILE : 0;
 }
 
 /*
-    Opens directory and stores directory handle in tnfsMountInfo.dir_handle
-    sortopts = zero or more TNFS_DIRSORT flags
-    diropts = zero or more TNFS_DIROPT flags
-    pattern = zero-terminated wildcard pattern string
-    maxresults = max number of results to return or zero for unlimited
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+ Loads the given block into the mount's block cache along with any read-ahead.
+ blocks_wanted is the number of blocks the caller needs right away.
+
+ Each handle's read-ahead doubles every time it misses on the block right
+ after the last ones we loaded, up to TNFS_MAX_READAHEAD_BLOCKS, and drops back
+ to a single block as soon as it reads anywhere else.
+ Returns: 0: success; TNFS_RESULT_END_OF_FILE: EOF; -1: failed to deliver/receive packet; other: TNFS error result code
 */
-int tnfs_opendirx(tnfsMountInfo *m_info, const char *directory, uint8_t sortopts, uint8_t diropts, const char *pattern, uint16_t maxresults)
+int _tnfs_cache_fetch(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, uint32_t block_num, uint32_t blocks_wanted)
 {
-    if (m_info == nullptr || directory == nullptr)
-        return -1;
-
-#define OFFSET_OPENDIRX_DIROPT 0
-#define OFFSET_OPENDIRX_SORTOPT 1
-#define OFFSET_OPENDIRX_MAXRESULTS 2
-#define OFFSET_OPENDIRX_PATTERN 4
+    tnfsBlockCache &cache = m_info->block_cache;
 
-// Number of bytes before the two null-terminated strings start
-#define OPENDIRX_HEADERBYTES 4
+    uint8_t *staging = cache.staging();
+    if (staging == nullptr)
+        return TNFS_RESULT_OUT_OF_MEMORY;
 
-    // Throw out any existing cached directory entries
-    m_info->empty_dircache();
+    // Sequential access grows the read-ahead; anything else resets it
+    if (block_num == pFHI->next_block)
+    {
+        if (pFHI->readahead < TNFS_MAX_READAHEAD_BLOCKS)
+            pFHI->readahead *= 2;
+    }
+    else
+        pFHI->readahead = 1;
+
+    uint32_t count = blocks_wanted > pFHI->readahead ? blocks_wanted : pFHI->readahead;
+    uint32_t max_blocks = cache.staging_size() / TNFS_CACHE_BLOCK_SIZE;
+    if (count > max_blocks)
+        count = max_blocks;
+
+    // Don't go past the end of the file or re-load anything we already have
+    uint32_t last_block = (pFHI->file_size + TNFS_CACHE_BLOCK_SIZE - 1) / TNFS_CACHE_BLOCK_SIZE;
+    if (block_num + count > last_block)
+        count = last_block > block_num ? last_block - block_num : 1;
+    for (uint32_t i = 1; i < count; i++)
+    {
+        if (cache.find(pFHI->file_id, block_num + i) != nullptr)
+        {
+            count = i;
+            break;
+        }
+    }
 
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_OPENDIRX;
+    #ifdef VERBOSE_TNFS
+    Debug_printf("_tnfs_cache_fetch fh=%d, block=%u, count=%u, readahead=%hu\n", pFHI->handle_id, block_num, count, pFHI->readahead);
+    #endif
 
-    packet.payload[OFFSET_OPENDIRX_DIROPT] = diropts;
-    packet.payload[OFFSET_OPENDIRX_SORTOPT] = sortopts;
+    // Another task's load, which let us have the mount part-way through, is still using the staging area
+    uint8_t *own_staging = nullptr;
+    if (cache.staging_in_use)
+    {
+        own_staging = (uint8_t *)heap_caps_malloc(count * TNFS_CACHE_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (own_staging == nullptr)
+            own_staging = (uint8_t *)heap_caps_malloc(count * TNFS_CACHE_BLOCK_SIZE, MALLOC_CAP_8BIT);
+        if (own_staging == nullptr)
+            return TNFS_RESULT_OUT_OF_MEMORY;
+        staging = own_staging;
+    }
+    else
+        cache.staging_in_use = true;
+
+    uint16_t got = 0;
+    uint32_t generation = m_info->server_generation;
+    int result = _tnfs_read_window(m_info, pFHI, block_num * TNFS_CACHE_BLOCK_SIZE, staging, count * TNFS_CACHE_BLOCK_SIZE, &got);
+    // If we lost the server part-way through, the file is re-opened once we've got one back
+    if ((result == -1 || _tnfs_session_lost(TNFS_CMD_READ, result)) &&
+        (m_info->server_generation != generation || _tnfs_recover(m_info, result != -1)))
+    {
+        got = 0;
+        result = _tnfs_read_window(m_info, pFHI, block_num * TNFS_CACHE_BLOCK_SIZE, staging, count * TNFS_CACHE_BLOCK_SIZE, &got);
+    }
+
+    // Keep whatever we managed to get, even if something went wrong
+    uint32_t stored = 0;
+    for (uint32_t offset = 0; offset < got; offset += TNFS_CACHE_BLOCK_SIZE)
+    {
+        uint16_t len = (got - offset) > TNFS_CACHE_BLOCK_SIZE ? TNFS_CACHE_BLOCK_SIZE : got - offset;
+        if (cache.store(pFHI->file_id, block_num + stored, staging + offset, len) == nullptr)
+            break;
+        stored++;
+    }
+    cache.stats.blocks_fetched += stored;
+    if (stored > blocks_wanted)
+        cache.stats.readahead_blocks += stored - blocks_wanted;
+
+    pFHI->next_block = block_num + count;
+
+    if (own_staging != nullptr)
+        heap_caps_free(own_staging);
+    else
+        cache.staging_in_use = false;
+
+    return result;
+}
+
+/*
+ Reads from an open file.
+ Data is provided from the mount's block cache, which is loaded as needed.
+ Bytes actually read will be placed in resultlen
+ Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
+ */
+int tnfs_read(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint16_t bufflen, uint16_t *resultlen)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle) ||
+        buffer == nullptr || resultlen == nullptr)
+        return -1;
+
+    *resultlen = 0;
+
+    // Find info on this handle
+    tnfsFileHandleInfo *pFileInf;
+    int result = _tnfs_get_handle(m_info, file_handle, &pFileInf);
+    if (result != 0)
+        return result;
+
+    #ifdef VERBOSE_TNFS
+    Debug_printf("tnfs_read fh=%d, len=%d\n", file_handle, bufflen);
+    #endif
+
+    // Anything we're about to read that's still waiting to be written has to go to the server first
+    result = _tnfs_flush_overlapping(m_info, pFileInf->file_id, pFileInf->cached_pos, pFileInf->cached_pos + bufflen);
+    if (result != 0)
+        return result;
+
+    tnfsBlockCache &cache = m_info->block_cache;
+    while (*resultlen < bufflen)
+    {
+        // Give anyone waiting for the mount a turn between the blocks of a long read
+        if (*resultlen > 0)
+            _tnfs_yield(m_info, pFileInf);
+
+        // Report if we've reached the end of the file
+        if (pFileInf->cached_pos >= pFileInf->file_size)
+        {
+            result = TNFS_RESULT_END_OF_FILE;
+            break;
+        }
+
+        uint32_t block_num = pFileInf->cached_pos / TNFS_CACHE_BLOCK_SIZE;
+        uint16_t block_offset = pFileInf->cached_pos % TNFS_CACHE_BLOCK_SIZE;
+
+        tnfsCacheBlock *pBlock = cache.find(pFileInf->file_id, block_num);
+        // A short block we have cached may have since been extended by a write past it
+        if (pBlock != nullptr && block_offset >= pBlock->valid)
+        {
+            cache.invalidate(pBlock);
+            pBlock = nullptr;
+        }
+
+        if (pBlock != nullptr)
+            cache.stats.hits++;
+        else
+        {
+            cache.stats.misses++;
+            uint32_t bytes_wanted = block_offset + (bufflen - *resultlen);
+            result = _tnfs_cache_fetch(m_info, pFileInf, block_num, (bytes_wanted + TNFS_CACHE_BLOCK_SIZE - 1) / TNFS_CACHE_BLOCK_SIZE);
+            if (result != 0 && result != TNFS_RESULT_END_OF_FILE)
+            {
+                Debug_printf("tnfs_read cache fill failed (%u) - aborting", result);
+                break;
+            }
+            pBlock = cache.find(pFileInf->file_id, block_num);
+            if (pBlock == nullptr || block_offset >= pBlock->valid)
+            {
+                // The server has less data than we expected
+                result = TNFS_RESULT_END_OF_FILE;
+                break;
+            }
+        }
+
+        uint16_t bytes_available = pBlock->valid - block_offset;
+        uint16_t dest_free = bufflen - *resultlen;
+        uint16_t bytes_provided = dest_free > bytes_available ? bytes_available : dest_free;
+
+        memcpy(buffer + *resultlen, pBlock->data + block_offset, bytes_provided);
+        pFileInf->cached_pos += bytes_provided;
+        *resultlen += bytes_provided;
+        result = 0;
+    }
+
+    return result;
+}
+
+/*
+ Updates the size we've recorded for every handle open on the given file
+*/
+void _tnfs_set_file_size(tnfsMountInfo *m_info, uint32_t file_id, uint32_t file_size)
+{
+    for (int i = 0; i < m_info->filehandle_slots(); i++)
+    {
+        tnfsFileHandleInfo *pFHI = m_info->get_filehandleinfo_at(i);
+        if (pFHI != nullptr && pFHI->file_id == file_id)
+            pFHI->file_size = file_size;
+    }
+}
+
+/*
+ Sends the contents of a handle's write buffer to the server.
+ If this fails, the buffered data is dropped and the error is kept in
+ write_error so it's returned by every flush until tnfs_fsync or tnfs_close
+ reports it.
+ Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
+*/
+int _tnfs_flush_writes(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI)
+{
+    if (pFHI->write_error != 0)
+        return pFHI->write_error;
+
+    uint32_t generation = m_info->server_generation;
+    bool retried = false;
+    while (pFHI->write_pending > 0)
+    {
+        // The file may have been parked since we started buffering
+        int result = _tnfs_unpark(m_info, pFHI);
+        if (result != 0)
+        {
+            pFHI->write_error = result;
+            break;
+        }
+
+        // Make sure the server is at the position we're writing to
+        if (pFHI->file_position != pFHI->write_start)
+        {
+            // Seeking the server moves cached_pos too, which we don't want here
+            uint32_t client_pos = pFHI->cached_pos;
+            result = tnfs_lseek(m_info, pFHI->handle, pFHI->write_start, SEEK_SET, nullptr, true);
+            pFHI->cached_pos = client_pos;
+            if (result != 0)
+            {
+                Debug_print("TNFS seek failed during write\n");
+                pFHI->write_error = result;
+                break;
+            }
+        }
+
+        #ifdef VERBOSE_TNFS
+        Debug_printf("_tnfs_flush_writes fh=%d, pos=%u, len=%hu\n", pFHI->handle_id, pFHI->write_start, pFHI->write_pending);
+        #endif
+
+        tnfsPacket packet;
+        packet.command = TNFS_CMD_WRITE;
+        packet.payload[0] = pFHI->handle_id;
+        packet.payload[1] = TNFS_LOBYTE_FROM_UINT16(pFHI->write_pending);
+        packet.payload[2] = TNFS_HIBYTE_FROM_UINT16(pFHI->write_pending);
+
+        memcpy(packet.payload + 3, pFHI->write_buffer, pFHI->write_pending);
+
+        if (_tnfs_transaction(m_info, packet, pFHI->write_pending + 3) == false)
+        {
+            // If we've just switched mirrors or sessions, try again once the file's re-opened
+            if (m_info->server_generation != generation && retried == false)
+            {
+                retried = true;
+                continue;
+            }
+            pFHI->write_error = -1;
+            break;
+        }
+        if (packet.payload[0] != TNFS_RESULT_SUCCESS)
+        {
+            pFHI->write_error = packet.payload[0];
+            break;
+        }
+
+        uint16_t written = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 1);
+        if (written > pFHI->write_pending)
+            written = pFHI->write_pending;
+        m_info->protocol_stats.bytes_written += written;
+        // Keep any blocks we have cached in line with what we wrote
+        m_info->block_cache.write(pFHI->file_id, pFHI->write_start, pFHI->write_buffer, written);
+        m_info->meta_cache.invalidate_path(pFHI->filename);
+        // Keep track of our file position
+        pFHI->file_position = pFHI->write_start + written;
+
+        // The server didn't take everything - try again with what's left
+        if (written == 0)
+        {
+            pFHI->write_error = TNFS_RESULT_NO_SPACE_ON_DEVICE;
+            break;
+        }
+        pFHI->write_pending -= written;
+        pFHI->write_start += written;
+        if (pFHI->write_pending > 0)
+            memmove(pFHI->write_buffer, pFHI->write_buffer + written, pFHI->write_pending);
+    }
+
+    if (pFHI->write_error != 0)
+    {
+        Debug_printf("_tnfs_flush_writes failed (%d), dropping %hu bytes\n", pFHI->write_error, pFHI->write_pending);
+        pFHI->write_pending = 0;
+    }
+    return pFHI->write_error;
+}
+
+/*
+ Flushes buffered writes on any handle open on the given file that overlap
+ the range start to end, so a read of that range gets what was written.
+ Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
+*/
+int _tnfs_flush_overlapping(tnfsMountInfo *m_info, uint32_t file_id, uint32_t start, uint32_t end)
+{
+    for (int i = 0; i < m_info->filehandle_slots(); i++)
+    {
+        tnfsFileHandleInfo *pFHI = m_info->get_filehandleinfo_at(i);
+        if (pFHI == nullptr || pFHI->file_id != file_id || pFHI->write_pending == 0)
+            continue;
+        if (end <= pFHI->write_start || start >= pFHI->write_start + pFHI->write_pending)
+            continue;
+        // Another task is part-way through using it, so let it finish, then look again from the start
+        if (pFHI->busy)
+        {
+            if (_tnfs_wait(m_info) == false)
+                return TNFS_RESULT_RESOURCE_BUSY;
+            i = -1;
+            continue;
+        }
+        int result = _tnfs_flush_writes(m_info, pFHI);
+        if (result != 0)
+            return result;
+    }
+    return 0;
+}
+
+/*
+ Write to an open file.
+ Data is collected in the handle's write buffer and sent once the buffer is
+ full, the client writes somewhere else, reads what's been buffered, or calls
+ tnfs_fsync or tnfs_close. Consecutive small writes therefore go out as
+ full-sized WRITE requests.
+ Because of this, an error writing data to the server may not be returned
+ until a later call to tnfs_write, tnfs_fsync or tnfs_close.
+ Bytes accepted will be placed in resultlen
+ Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
+ */
+int tnfs_write(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint16_t bufflen, uint16_t *resultlen)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle) || 
+        buffer == nullptr || resultlen == nullptr)
+        return -1;
+
+    *resultlen = 0;
+
+    // Find info on this handle
+    tnfsFileHandleInfo *pFileInf;
+    int result = _tnfs_get_handle(m_info, file_handle, &pFileInf);
+    if (result != 0)
+        return result;
+
+    // Get a write buffer if this is the first write since we opened (or parked) the file
+    if (pFileInf->write_buffer == nullptr)
+    {
+        pFileInf->write_buffer = m_info->get_buffer();
+        if (pFileInf->write_buffer == nullptr)
+            return TNFS_RESULT_OUT_OF_MEMORY;
+    }
+
+    while (*resultlen < bufflen)
+    {
+        // Don't take any more data if we couldn't send what we had
+        if (pFileInf->write_error != 0)
+            return pFileInf->write_error;
+
+        // Send what we have if the buffer is full or this write doesn't follow on from it
+        if (pFileInf->write_pending == TNFS_WRITE_BUFFER_SIZE ||
+            (pFileInf->write_pending > 0 && pFileInf->cached_pos != pFileInf->write_start + pFileInf->write_pending))
+        {
+            // Give anyone waiting for the mount a turn between the WRITEs of a long write
+            if (*resultlen > 0)
+                _tnfs_yield(m_info, pFileInf);
+            result = _tnfs_flush_writes(m_info, pFileInf);
+            if (result != 0)
+                return result;
+        }
+
+        if (pFileInf->write_pending == 0)
+            pFileInf->write_start = pFileInf->cached_pos;
+
+        uint16_t space = TNFS_WRITE_BUFFER_SIZE - pFileInf->write_pending;
+        uint16_t count = (bufflen - *resultlen) > space ? space : bufflen - *resultlen;
+        memcpy(pFileInf->write_buffer + pFileInf->write_pending, buffer + *resultlen, count);
+        pFileInf->write_pending += count;
+        pFileInf->cached_pos += count;
+        *resultlen += count;
+    }
+
+    // Growing the file affects every handle open on it
+    if (pFileInf->cached_pos > pFileInf->file_size)
+        _tnfs_set_file_size(m_info, pFileInf->file_id, pFileInf->cached_pos);
+
+    return 0;
+}
+
+/*
+ Seek to different position in open file
+ We keep track of the position ourselves and only move the server's position
+ when we read or write, unless skip_cache is set.
+ Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
+ */
+int tnfs_lseek(tnfsMountInfo *m_info, int16_t file_handle, int32_t position, uint8_t type, uint32_t *new_position, bool skip_cache)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle))
+        return -1;
+
+    // Make sure we're using a valid seek type
+    if (type != SEEK_SET && type != SEEK_CUR && type != SEEK_END)
+        return TNFS_RESULT_INVALID_ARGUMENT;
+
+    // Find info on this handle
+    tnfsFileHandleInfo *pFileInf;
+    int result = _tnfs_get_handle(m_info, file_handle, &pFileInf);
+    if (result != 0)
+        return result;
+
+    Debug_printf("tnfs_lseek currpos=%d, pos=%d, typ=%d\n", pFileInf->cached_pos, position, type);
+
+    if (skip_cache == false)
+    {
+        // Calculate where we're supposed to end up
+        int64_t destination_pos;
+        if (type == SEEK_SET)
+            destination_pos = position;
+        else if (type == SEEK_CUR)
+            destination_pos = (int64_t)pFileInf->cached_pos + position;
+        else
+            destination_pos = (int64_t)pFileInf->file_size + position;
+
+        if (destination_pos < 0 || destination_pos > UINT32_MAX)
+            return TNFS_RESULT_INVALID_ARGUMENT;
+
+        pFileInf->cached_pos = destination_pos;
+        if(new_position != nullptr)
+            *new_position = pFileInf->cached_pos;
+        return 0;
+    }
+
+    // Go ahead and execute a new TNFS SEEK request
+    result = _tnfs_unpark(m_info, pFileInf);
+    if (result != 0)
+        return result;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_LSEEK;
+    packet.payload[0] = pFileInf->handle_id;
+    packet.payload[1] = type;
+    TNFS_UINT32_TO_LOHI_BYTEPTR(position, packet.payload + 2);
+
+    if (_tnfs_transaction(m_info, packet, 6))
+    {
+        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        {
+            // Keep track of our file position
+            if (type == SEEK_SET)
+                pFileInf->file_position = position;
+            else if (type == SEEK_CUR)
+                pFileInf->file_position += position;
+            else
+                pFileInf->file_position = (pFileInf->file_size + position);
+
+            pFileInf->cached_pos = pFileInf->file_position;
+
+            if(new_position != nullptr)
+                *new_position = pFileInf->file_position;
+            uint32_t response_pos = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + 1);    
+            Debug_printf("tnfs_lseek success, new pos=%u, response pos=%u\n", pFileInf->file_position, response_pos);
+
+            // TODO: This is temporary while we confirm that the recently-changed TNFSD code matches what we've been doing prior
+            if(pFileInf->file_position != response_pos)
+            {
+                Debug_print("CALCULATED AND RESPONSE POS DON'T MATCH!\n");
+                vTaskDelay(5000 / portTICK_PERIOD_MS);
+            }
+        }
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+#define OFFSET_OPENDIRX_DIROPT 0
+#define OFFSET_OPENDIRX_SORTOPT 1
+#define OFFSET_OPENDIRX_MAXRESULTS 2
+#define OFFSET_OPENDIRX_PATTERN 4
+
+// Number of bytes before the two null-terminated strings start
+#define OPENDIRX_HEADERBYTES 4
+
+/*
+ Fills in an OPENDIRX request, leaving the offset of the full path in the payload
+ in pathoffset. Returns the length of the path.
+*/
+int _tnfs_opendirx_request(tnfsMountInfo *m_info, tnfsPacket &packet, const char *directory,
+    uint8_t sortopts, uint8_t diropts, const char *pattern, uint16_t maxresults, int *pathoffset)
+{
+    packet.command = TNFS_CMD_OPENDIRX;
+
+    packet.payload[OFFSET_OPENDIRX_DIROPT] = diropts;
+    packet.payload[OFFSET_OPENDIRX_SORTOPT] = sortopts;
 
     packet.payload[OFFSET_OPENDIRX_MAXRESULTS] = TNFS_LOBYTE_FROM_UINT16(maxresults);
     packet.payload[OFFSET_OPENDIRX_MAXRESULTS + 1] = TNFS_HIBYTE_FROM_UINT16(maxresults);
@@ -644,15 +1838,56 @@ int tnfs_opendirx(tnfsMountInfo *m_info, const char *directory, uint8_t sortopts
         sizeof(packet.payload) - OPENDIRX_HEADERBYTES - 1);
 
     // Calculate the new offset to the path taking the pattern string into account
-    int pathoffset = strlen((char *)(packet.payload + OFFSET_OPENDIRX_PATTERN)) + OPENDIRX_HEADERBYTES + 1;
+    *pathoffset = strlen((char *)(packet.payload + OFFSET_OPENDIRX_PATTERN)) + OPENDIRX_HEADERBYTES + 1;
 
     // Copy the directory into the right spot in the packet and get its string len
-    int pathlen = _tnfs_adjust_with_full_path(m_info, 
-        (char *)(packet.payload + pathoffset), directory, sizeof(packet.payload) - pathoffset);
+    return _tnfs_adjust_with_full_path(m_info,
+        (char *)(packet.payload + *pathoffset), directory, sizeof(packet.payload) - *pathoffset);
+}
+
+/*
+    Opens directory and stores directory handle in tnfsMountInfo.dir_handle
+    sortopts = zero or more TNFS_DIRSORT flags
+    diropts = zero or more TNFS_DIROPT flags
+    pattern = zero-terminated wildcard pattern string
+    maxresults = max number of results to return or zero for unlimited
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_opendirx(tnfsMountInfo *m_info, const char *directory, uint8_t sortopts, uint8_t diropts, const char *pattern, uint16_t maxresults)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || directory == nullptr)
+        return -1;
+
+    // Throw out any existing cached directory entries
+    m_info->empty_dircache();
+    m_info->dir_listing = m_info->dir_recording = nullptr;
+
+    tnfsPacket packet;
+    int pathoffset;
+    int pathlen = _tnfs_opendirx_request(m_info, packet, directory, sortopts, diropts, pattern, maxresults, &pathoffset);
 
     Debug_printf("TNFS open directory: sortopts=0x%02x diropts=0x%02x maxresults=0x%04x pattern=\"%s\" path=\"%s\"\n",
      sortopts, diropts, maxresults, (char *)(packet.payload + OFFSET_OPENDIRX_PATTERN), (char *)(packet.payload + pathoffset));
 
+    // A recent complete listing made the same way saves us from asking the server at all
+    if (maxresults == 0)
+    {
+        const char *fullpath = (const char *)(packet.payload + pathoffset);
+        const char *fullpattern = (const char *)(packet.payload + OFFSET_OPENDIRX_PATTERN);
+        m_info->dir_listing = m_info->meta_cache.find_listing(fullpath, sortopts, diropts, fullpattern);
+        if (m_info->dir_listing != nullptr)
+        {
+            m_info->dir_listing_offset = 0;
+            m_info->dir_listing_index = 0;
+            m_info->dir_entries = m_info->dir_listing->count;
+            Debug_printf("Directory opened from cached listing, entries: %u\n", m_info->dir_entries);
+            return 0;
+        }
+        // Otherwise record what we read so we can do that next time
+        m_info->dir_recording = m_info->meta_cache.start_listing(fullpath, sortopts, diropts, fullpattern);
+    }
+
     if (_tnfs_transaction(m_info, packet, pathoffset + pathlen + 1))
     {
         if (packet.payload[0] == TNFS_RESULT_SUCCESS)
@@ -661,11 +1896,25 @@ int tnfs_opendirx(tnfsMountInfo *m_info, const char *directory, uint8_t sortopts
             m_info->dir_entries = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 2);
             Debug_printf("Directory opened, handle ID: %hhd, entries: %u\n", m_info->dir_handle, m_info->dir_entries);
         }
+        else
+            _tnfs_stop_recording(m_info);
         return packet.payload[0];
     }
+    _tnfs_stop_recording(m_info);
     return -1;
 }
 
+/*
+ Stops filling the directory listing we've been recording, throwing it out
+ unless we managed to read the whole directory
+*/
+void _tnfs_stop_recording(tnfsMountInfo *m_info)
+{
+    if (m_info->dir_recording != nullptr && m_info->dir_recording->complete == false)
+        m_info->meta_cache.abandon_listing(m_info->dir_recording);
+    m_info->dir_recording = nullptr;
+}
+
 void _readdirx_fill_response(tnfsDirCacheEntry *pCached, tnfsStat *filestat, char *dir_entry, int dir_entry_len)
 {
     filestat->isDir = pCached->flags & TNFS_READDIRX_DIR ? true : false;
@@ -692,16 +1941,49 @@ void _readdirx_fill_response(tnfsDirCacheEntry *pCached, tnfsStat *filestat, cha
 #endif
 }
 
-/*
-    Reads next available file using open directory handle specified in
-    tnfsMountInfo.dir_handle
-    dir_entry filled with filename up to dir_entry_len
+// These also describe the entries in a tnfsDirListing
+#define OFFSET_READDIRX_FLAGS 0
+#define OFFSET_READDIRX_SIZE 1
+#define OFFSET_READDIRX_MTIME 5
+#define OFFSET_READDIRX_CTIME 9
+#define OFFSET_READDIRX_PATH 13
+
+/*
+    Reads next available file using open directory handle specified in
+    tnfsMountInfo.dir_handle, or from the cached listing in tnfsMountInfo.dir_listing
+    dir_entry filled with filename up to dir_entry_len
  returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
 */
 int tnfs_readdirx(tnfsMountInfo *m_info, tnfsStat *filestat, char *dir_entry, int dir_entry_len)
 {
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr)
+        return -1;
+
+    // Answer from a cached listing if that's what we opened
+    if (m_info->dir_listing != nullptr)
+    {
+        uint32_t next_offset;
+        const uint8_t *pData = m_info->meta_cache.listing_entry(m_info->dir_listing, m_info->dir_listing_offset, &next_offset);
+        if (pData == nullptr)
+            return TNFS_RESULT_END_OF_FILE;
+
+        tnfsDirCacheEntry entry;
+        entry.dirpos = m_info->dir_listing_index;
+        entry.flags = pData[OFFSET_READDIRX_FLAGS];
+        entry.filesize = TNFS_UINT32_FROM_LOHI_BYTEPTR(pData + OFFSET_READDIRX_SIZE);
+        entry.m_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(pData + OFFSET_READDIRX_MTIME);
+        entry.c_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(pData + OFFSET_READDIRX_CTIME);
+        strlcpy(entry.entryname, (const char *)pData + OFFSET_READDIRX_PATH, sizeof(entry.entryname));
+        _readdirx_fill_response(&entry, filestat, dir_entry, dir_entry_len);
+
+        m_info->dir_listing_offset = next_offset;
+        m_info->dir_listing_index++;
+        return 0;
+    }
+
     // Check for a valid open handle ID
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
+    if (false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
         return -1;
 
     // See if we have an entry in our directory cache to return first
@@ -723,554 +2005,1559 @@ int tnfs_readdirx(tnfsMountInfo *m_info, tnfsStat *filestat, char *dir_entry, in
     // Invalidate the cache before loading more
     m_info->empty_dircache();
 
-#define OFFSET_READDIRX_FLAGS 0
-#define OFFSET_READDIRX_SIZE 1
-#define OFFSET_READDIRX_MTIME 5
-#define OFFSET_READDIRX_CTIME 9
-#define OFFSET_READDIRX_PATH 13
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_READDIRX;
+    packet.payload[0] = m_info->dir_handle;
+    // Number of responses to read
+    packet.payload[1] = TNFS_MAX_DIRCACHE_ENTRIES;
+
+    if (_tnfs_transaction(m_info, packet, 2))
+    {
+        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        {
+            uint8_t response_count = packet.payload[1];
+            uint8_t response_status = packet.payload[2];
+            uint16_t dirpos = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 3);
+
+            // Set our EOF flag if the server tells us there's no more after this
+            if(response_status & TNFS_READDIRX_STATUS_EOF)
+                m_info->set_dircache_eof();
+
+            Debug_printf("tnfs_readdirx resp_count=%hu, dirpos=%hu, status=%hu\n", response_count, dirpos, response_status);
+
+            // Fill our directory cache using the returned values
+            int current_offset = 5;
+            for(int i = 0; i < response_count; i++)
+            {
+                tnfsDirCacheEntry *pEntry = m_info->new_dircache_entry();
+                if(pEntry != nullptr)
+                {
+                    pEntry->dirpos = dirpos + i;
+                    pEntry->flags = 
+                        packet.payload[current_offset + OFFSET_READDIRX_FLAGS];
+                    pEntry->filesize = 
+                        TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_SIZE);
+                    pEntry->m_time = 
+                        TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_MTIME);
+                    pEntry->c_time = 
+                        TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_CTIME);
+
+                    int name_len = strlcpy(pEntry->entryname, 
+                        (char *)packet.payload + current_offset + OFFSET_READDIRX_PATH, sizeof(pEntry->entryname));
+
+                    // Keep a copy in the listing we're recording (unless it's been thrown out from under us)
+                    if (m_info->dir_recording != nullptr && m_info->dir_recording->path[0] == '\0')
+                        m_info->dir_recording = nullptr;
+                    if (m_info->dir_recording != nullptr &&
+                        !m_info->meta_cache.add_listing_entry(m_info->dir_recording,
+                            pEntry->flags, pEntry->filesize, pEntry->m_time, pEntry->c_time, pEntry->entryname))
+                        m_info->dir_recording = nullptr;
+
+                    /*
+                     Adjust our offset to point to the next entry within the packet
+                     flags (1) + size (4) + mtime (4) + ctime (4) + null (1) = 14
+                    */ 
+                    current_offset += 14 + name_len;
+                }
+                else
+                {
+                    Debug_print("tnfs_readdirx Failed to allocate new dircache entry!\n");
+                    break;
+                }
+            }
+
+            // That's the whole directory, so the listing we've recorded is good to use
+            if (m_info->dir_recording != nullptr && (response_status & TNFS_READDIRX_STATUS_EOF))
+            {
+                m_info->meta_cache.finish_listing(m_info->dir_recording);
+                m_info->dir_recording = nullptr;
+            }
+
+            int loaded = m_info->count_dircache();
+            Debug_printf("tnfs_readdirx cached %d entries\n", loaded);
+            // Now that we've cached our entries, return the first one
+            if(loaded > 0)
+                _readdirx_fill_response(m_info->next_dircache_entry(), filestat, dir_entry, dir_entry_len);
+
+        }
+        else if (packet.payload[0] == TNFS_RESULT_END_OF_FILE && m_info->dir_recording != nullptr)
+        {
+            m_info->meta_cache.finish_listing(m_info->dir_recording);
+            m_info->dir_recording = nullptr;
+        }
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+    TELLDIR
+*/
+int tnfs_telldir(tnfsMountInfo *m_info, uint16_t *position)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || position == nullptr)
+        return -1;
+
+    if (m_info->dir_listing != nullptr)
+    {
+        *position = m_info->dir_listing_index;
+        return 0;
+    }
+
+    if (false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
+        return -1;
+
+    // First see if we're pointing at a currently-cached directory entry and return that
+    int cached = m_info->tell_dircache_entry();
+    if (cached > -1)
+    {
+        *position = cached;
+        return 0;
+    }
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_TELLDIR;
+    packet.payload[0] = m_info->dir_handle;
+
+    if (_tnfs_transaction(m_info, packet, 1))
+    {
+        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        {
+            *position = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + 1);
+        }
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+    SEEKDIR
+*/
+int tnfs_seekdir(tnfsMountInfo *m_info, uint16_t position)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr)
+        return -1;
+
+    if (m_info->dir_listing != nullptr)
+    {
+        // Walk the listing from the start to find the entry
+        uint32_t offset = 0;
+        uint16_t index;
+        for (index = 0; index < position; index++)
+            if (m_info->meta_cache.listing_entry(m_info->dir_listing, offset, &offset) == nullptr)
+                break;
+        m_info->dir_listing_offset = offset;
+        m_info->dir_listing_index = index;
+        return 0;
+    }
+
+    if (false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
+        return -1;
+
+    // A SEEKDIR will always invalidate our directory cache, and we can't record a listing out of order
+    m_info->empty_dircache();
+    _tnfs_stop_recording(m_info);
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_SEEKDIR;
+    packet.payload[0] = m_info->dir_handle;
+    uint32_t pos = position;
+    TNFS_UINT32_TO_LOHI_BYTEPTR(pos, packet.payload + 1);
+
+    if (_tnfs_transaction(m_info, packet, 5))
+        return packet.payload[0];
+
+    return -1;
+}
+
+/*
+    Closes current directory handle specificed in tnfsMountInfo
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_closedir(tnfsMountInfo *m_info)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr)
+        return -1;
+
+    // There's nothing open on the server if we were reading a cached listing
+    if (m_info->dir_listing != nullptr)
+    {
+        m_info->dir_listing = nullptr;
+        return 0;
+    }
+
+    if (false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
+        return -1;
+
+    // Throw out any existing cached directory entries
+    m_info->empty_dircache();
+    _tnfs_stop_recording(m_info);
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_CLOSEDIR;
+    packet.payload[0] = m_info->dir_handle;
+
+    if (_tnfs_transaction(m_info, packet, 1))
+    {
+        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        {
+            m_info->dir_handle = TNFS_INVALID_HANDLE;
+        }
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+ Opens a directory on a server handle of its own, leaving the mount's dir_handle,
+ directory cache and listings alone so it can be read alongside tnfs_opendirx
+ and any number of other streams.
+ Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_dirstream_open(tnfsMountInfo *m_info, tnfsDirStream *ds, const char *directory, uint8_t sortopts, uint8_t diropts, const char *pattern)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || ds == nullptr || directory == nullptr)
+        return -1;
+
+    *ds = tnfsDirStream();
+
+    tnfsPacket packet;
+    int pathoffset;
+    int pathlen = _tnfs_opendirx_request(m_info, packet, directory, sortopts, diropts, pattern, 0, &pathoffset);
+
+    if (_tnfs_transaction(m_info, packet, pathoffset + pathlen + 1))
+    {
+        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        {
+            ds->handle = packet.payload[1];
+            ds->server_generation = m_info->server_generation;
+            Debug_printf("Directory stream opened, handle ID: %hd\n", ds->handle);
+        }
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+ Returns the next entry in a directory stream, asking the server for as many
+ as fit in a reply whenever the ones we have are used up.
+ Returns: 0: success, -1: failed to send/receive packet, other: TNFS error result code
+*/
+int tnfs_dirstream_read(tnfsMountInfo *m_info, tnfsDirStream *ds, tnfsStat *filestat, char *dir_entry, int dir_entry_len)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || ds == nullptr)
+        return -1;
+
+    if (false == TNFS_VALID_AS_UINT8(ds->handle))
+        return -1;
+    // We've lost the session since this was opened
+    if (ds->server_generation != m_info->server_generation)
+        return TNFS_RESULT_BAD_FILE_DESCRIPTOR;
+
+    if (ds->entries_left == 0)
+    {
+        if (ds->eof)
+            return TNFS_RESULT_END_OF_FILE;
+
+        tnfsPacket packet;
+        packet.command = TNFS_CMD_READDIRX;
+        packet.payload[0] = ds->handle;
+        packet.payload[1] = 0; // As many as will fit
+
+        if (false == _tnfs_transaction(m_info, packet, 2))
+            return -1;
+        if (packet.payload[0] != TNFS_RESULT_SUCCESS)
+            return packet.payload[0];
+
+        ds->entries_left = packet.payload[1];
+        ds->eof = packet.payload[2] & TNFS_READDIRX_STATUS_EOF;
+        ds->entries_offset = 0;
+        memcpy(ds->entries, packet.payload + TNFS_READDIRX_HEADERBYTES, sizeof(ds->entries));
+        if (ds->entries_left == 0)
+            return TNFS_RESULT_END_OF_FILE;
+    }
+
+    // Don't trust a name to be terminated inside what the server sent
+    const uint8_t *pData = ds->entries + ds->entries_offset;
+    uint16_t remaining = sizeof(ds->entries) - ds->entries_offset;
+    if (remaining <= OFFSET_READDIRX_PATH ||
+        memchr(pData + OFFSET_READDIRX_PATH, '\0', remaining - OFFSET_READDIRX_PATH) == nullptr)
+    {
+        ds->entries_left = 0;
+        return -1;
+    }
+
+    tnfsDirCacheEntry entry;
+    entry.dirpos = ds->position;
+    entry.flags = pData[OFFSET_READDIRX_FLAGS];
+    entry.filesize = TNFS_UINT32_FROM_LOHI_BYTEPTR(pData + OFFSET_READDIRX_SIZE);
+    entry.m_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(pData + OFFSET_READDIRX_MTIME);
+    entry.c_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(pData + OFFSET_READDIRX_CTIME);
+    strlcpy(entry.entryname, (const char *)pData + OFFSET_READDIRX_PATH, sizeof(entry.entryname));
+    _readdirx_fill_response(&entry, filestat, dir_entry, dir_entry_len);
+
+    ds->entries_offset += OFFSET_READDIRX_PATH + strlen((const char *)pData + OFFSET_READDIRX_PATH) + 1;
+    ds->entries_left--;
+    ds->position++;
+    return 0;
+}
+
+/*
+ Moves a directory stream so the next entry read is the one at the given position
+ Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_dirstream_seek(tnfsMountInfo *m_info, tnfsDirStream *ds, uint16_t position)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || ds == nullptr)
+        return -1;
+
+    if (false == TNFS_VALID_AS_UINT8(ds->handle))
+        return -1;
+    if (ds->server_generation != m_info->server_generation)
+        return TNFS_RESULT_BAD_FILE_DESCRIPTOR;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_SEEKDIR;
+    packet.payload[0] = ds->handle;
+    uint32_t pos = position;
+    TNFS_UINT32_TO_LOHI_BYTEPTR(pos, packet.payload + 1);
+
+    if (_tnfs_transaction(m_info, packet, 5))
+    {
+        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        {
+            ds->entries_left = 0;
+            ds->eof = false;
+            ds->position = position;
+        }
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+ Closes a directory stream's server handle. The stream is closed even if the
+ server couldn't be told, since a lost session takes its handles with it.
+ Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_dirstream_close(tnfsMountInfo *m_info, tnfsDirStream *ds)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || ds == nullptr)
+        return -1;
+
+    int16_t handle = ds->handle;
+    bool current = ds->server_generation == m_info->server_generation;
+    *ds = tnfsDirStream();
+
+    if (false == TNFS_VALID_AS_UINT8(handle) || false == current)
+        return 0;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_CLOSEDIR;
+    packet.payload[0] = handle;
+
+    if (_tnfs_transaction(m_info, packet, 1))
+        return packet.payload[0];
+    return -1;
+}
+
+/*
+    Creates directory.
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_mkdir(tnfsMountInfo *m_info, const char *directory)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || directory == nullptr)
+        return -1;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_MKDIR;
+
+    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, directory, sizeof(packet.payload));
+
+    Debug_printf("TNFS make directory: \"%s\"\n", (char *)packet.payload);
+
+    m_info->meta_cache.invalidate_path((char *)packet.payload);
+
+    if (_tnfs_transaction(m_info, packet, len + 1))
+    {
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+    Deletes directory.
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_rmdir(tnfsMountInfo *m_info, const char *directory)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || directory == nullptr)
+        return -1;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_RMDIR;
+
+    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, directory, sizeof(packet.payload));
+
+    Debug_printf("TNFS remove directory: \"%s\"\n", (char *)packet.payload);
+
+    m_info->meta_cache.invalidate_path((char *)packet.payload);
+
+    if (_tnfs_transaction(m_info, packet, len + 1))
+    {
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+    Returns file information filled in tnfsStat.
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_stat(tnfsMountInfo *m_info, tnfsStat *filestat, const char *filepath)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || filepath == nullptr || filestat == nullptr)
+        return -1;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_STAT;
+
+    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, filepath, sizeof(packet.payload));
+
+    // Debug_printf("TNFS stat: \"%s\"\n", (char *)packet.payload);
+
+    // See if we already know the answer
+    tnfsCachedStat cached;
+    if (m_info->meta_cache.lookup_stat((char *)packet.payload, &cached))
+    {
+        if (cached.exists == false)
+            return TNFS_RESULT_FILE_NOT_FOUND;
+        filestat->isDir = cached.isDir;
+        filestat->filesize = cached.filesize;
+        filestat->a_time = cached.a_time;
+        filestat->m_time = cached.m_time;
+        filestat->c_time = cached.c_time;
+        return 0;
+    }
+    tnfsStatCacheEntry *pCacheEntry = m_info->meta_cache.reserve_stat((char *)packet.payload);
+
+#define OFFSET_STAT_FILEMODE 1
+#define OFFSET_STAT_UID 3
+#define OFFSET_STAT_GID 5
+#define OFFSET_STAT_FILESIZE 7
+#define OFFSET_STAT_ATIME 11
+#define OFFSET_STAT_MTIME 15
+#define OFFSET_STAT_CTIME 19
+
+    if (_tnfs_transaction(m_info, packet, len + 1))
+    {
+        __BEGIN_IGNORE_UNUSEDVARS
+        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        {
+
+            uint16_t filemode = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_FILEMODE);
+            filestat->isDir = (filemode & S_IFDIR) ? true : false;
+
+            uint16_t uid = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_UID);
+            uint16_t gid = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_GID);
+
+            filestat->filesize = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_FILESIZE);
+
+            filestat->a_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_ATIME);
+            filestat->m_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_MTIME);
+            filestat->c_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_CTIME);
+
+            /*
+            Debug_printf("\ttnfs_stat: mode: %ho, uid: %hu, gid: %hu, dir: %d, size: %u, atime: 0x%04x, mtime: 0x%04x, ctime: 0x%04x\n", 
+                filemode, uid, gid,
+                filestat->isDir ? 1 : 0, filestat->filesize, filestat->a_time, filestat->m_time, filestat->c_time );
+            */
+            if (pCacheEntry != nullptr)
+            {
+                cached.exists = true;
+                cached.isDir = filestat->isDir;
+                cached.filesize = filestat->filesize;
+                cached.a_time = filestat->a_time;
+                cached.m_time = filestat->m_time;
+                cached.c_time = filestat->c_time;
+                m_info->meta_cache.fill_stat(pCacheEntry, &cached);
+            }
+        }
+        // Remember that it isn't there, too
+        else if (packet.payload[0] == TNFS_RESULT_FILE_NOT_FOUND && pCacheEntry != nullptr)
+            m_info->meta_cache.fill_stat(pCacheEntry, &cached);
+        __END_IGNORE_UNUSEDVARS
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+ Returns file information for an open file. The size is the one we're keeping
+ track of, which counts writes still sitting in the write-behind buffer, so
+ nothing has to be flushed first.
+ Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_fstat(tnfsMountInfo *m_info, int16_t file_handle, tnfsStat *filestat)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || filestat == nullptr || false == TNFS_VALID_AS_UINT8(file_handle))
+        return -1;
+
+    tnfsFileHandleInfo *pFileInf;
+    int result = _tnfs_get_handle(m_info, file_handle, &pFileInf);
+    if (result != 0)
+        return result;
+
+    result = tnfs_stat(m_info, filestat, pFileInf->filename);
+    if (result == TNFS_RESULT_SUCCESS)
+        filestat->filesize = pFileInf->file_size;
+    return result;
+}
+
+/*
+    Deletes file.
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_unlink(tnfsMountInfo *m_info, const char *filepath)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || filepath == nullptr)
+        return -1;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_UNLINK;
+
+    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, filepath, sizeof(packet.payload));
+
+    Debug_printf("TNFS unlink file: \"%s\"\n", (char *)packet.payload);
+
+    m_info->meta_cache.invalidate_path((char *)packet.payload);
+
+    if (_tnfs_transaction(m_info, packet, len + 1))
+    {
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+    Renames file from old_filepath to new_filepath
+    Relative paths ("../file") won't work.
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_rename(tnfsMountInfo *m_info, const char *old_filepath, const char *new_filepath)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || old_filepath == nullptr || new_filepath == nullptr)
+        return -1;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_RENAME;
+
+    int l1 = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, old_filepath, sizeof(packet.payload)) + 1;
+    int l2 = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload + l1, new_filepath, sizeof(packet.payload) - l1) + 1;
+
+    Debug_printf("TNFS rename file: \"%s\" -> \"%s\"\n", (char *)packet.payload, (char *)(packet.payload + l1));
+
+    m_info->meta_cache.invalidate_path((char *)packet.payload);
+    m_info->meta_cache.invalidate_path((char *)packet.payload + l1);
+
+    if (_tnfs_transaction(m_info, packet, l1 + l2))
+    {
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+    THIS ISN'T IMPLEMENTED IN THE CURRENT TNFSD CODE
+    Changes permissions on file
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_chmod(tnfsMountInfo *m_info, const char *filepath, uint16_t mode)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || filepath == nullptr)
+        return -1;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_CHMOD;
+
+    packet.payload[0] = TNFS_LOBYTE_FROM_UINT16(mode);
+    packet.payload[1] = TNFS_HIBYTE_FROM_UINT16(mode);
+
+    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload + 2, filepath, sizeof(packet.payload) - 2);
+
+    Debug_printf("TNFS chmod file: \"%s\", %ho\n", (char *)packet.payload + 2, mode);
+
+    m_info->meta_cache.invalidate_path((char *)packet.payload + 2);
+
+    if (_tnfs_transaction(m_info, packet, len + 3))
+    {
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+    THIS ISN'T IMPLEMENTED IN THE CURRENT TNFSD CODE
+    Returns size of mounted filesystem in kilobytes in the 'size' parameter
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_size(tnfsMountInfo *m_info, uint32_t *size)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || size == nullptr)
+        return -1;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_SIZE;
+
+    if (_tnfs_transaction(m_info, packet, 0))
+    {
+        if (packet.payload[0] == 0)
+        {
+            *size = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + 1);
+        }
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+/*
+    THIS ISN'T IMPLEMENTED IN THE CURRENT TNFSD CODE
+    Returns free kilobytes in mounted filesystem in the 'size' parameter
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_free(tnfsMountInfo *m_info, uint32_t *size)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || size == nullptr)
+        return -1;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_FREE;
+
+    if (_tnfs_transaction(m_info, packet, 0))
+    {
+        if (packet.payload[0] == 0)
+        {
+            *size = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + 1);
+        }
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+// ------------------------------------------------
+// HELPER TNFS FUNCTIONS (Aren't actual TNFSD commands)
+// ------------------------------------------------
+
+/*
+ Returns the filepath associated with an open filehandle
+*/
+const char *tnfs_filepath(tnfsMountInfo *m_info, int16_t file_handle)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle))
+        return nullptr;
+
+    // Find info on this handle
+    tnfsFileHandleInfo *pFileInf = m_info->get_filehandleinfo(file_handle);
+    if (pFileInf == nullptr)
+        return nullptr;
+
+    return pFileInf->filename;
+}
+
+/*
+ Sets the internally-tracked current working directory after confirming that
+ the given directory exists.
+ ".." can be used to go up one (and only one) directory
+*/
+int tnfs_chdir(tnfsMountInfo *m_info, const char *dirpath)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr || dirpath == nullptr)
+        return -1;
+
+    // Check for ".."
+    if (dirpath[0] == '.' && dirpath[1] == '.' && dirpath[2] == '\0')
+    {
+        // Figure out what the previous directory is
+        char *lslash = strrchr(m_info->current_working_directory, '/');
+        // Assuming we're not alraedy at the root, just truncate the string at the last slash
+        if (lslash != nullptr && lslash != m_info->current_working_directory)
+            *lslash = '\0';
+        return TNFS_RESULT_SUCCESS;
+    }
+
+    tnfsStat tstat;
+    int rs = tnfs_stat(m_info, &tstat, dirpath);
+    if (rs != TNFS_RESULT_SUCCESS)
+        return rs;
+
+    if (tstat.isDir == false)
+        return TNFS_RESULT_NOT_A_DIRECTORY;
+
+    // Looks okay - store it
+    _tnfs_adjust_with_full_path(m_info, m_info->current_working_directory, dirpath, sizeof(m_info->current_working_directory));
+
+    return TNFS_RESULT_SUCCESS;
+}
+
+/*
+ Returns directory path we currently have stored
+*/
+const char *tnfs_getcwd(tnfsMountInfo *m_info)
+{
+    tnfsMountLock lock(m_info);
+    if (m_info == nullptr)
+        return nullptr;
+    return m_info->current_working_directory;
+}
+// ------------------------------------------------
+// INTERNAL UTILITY FUNCTIONS
+// ------------------------------------------------
+
+/*
+  Send constructed TNFS packet and check for reply
+  Each attempt waits for the current re-send timeout (see _tnfs_rto), which doubles
+  with every retry. We give up once we've made at least tnfsMountInfo.max_retries
+  attempts (default: TNFS_RETRIES) over at least tnfsMountInfo.timeout_ms (default: TNFS_TIMEOUT).
+
+  Only the command (tnfsPacket.command) and payload contents need to be set on the packet.
+  Current session ID will be copied from tnfsMountInfo and retryCount is always reset to zero.
+  
+  If successful, server's response code will be the first byte of of tnfsPacket.data
+  
+  returns - true if response packet was received
+            false if no response received during retries/timeout period
+
+  If the server doesn't answer, or answers that it doesn't know our session, we
+  switch to another mirror or mount the same server again (see _tnfs_recover) and,
+  unless the request refers to one of the old session's handles, send it again.
+  Requests that do refer to a handle fail, and it's up to the caller to try
+  again once the file's been re-opened.
+ */
+bool _tnfs_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
+{
+    // Nothing to fall back on while we're mounting
+    if (m_info->switching_mirrors || m_info->reconnecting ||
+        pkt.command == TNFS_CMD_MOUNT || pkt.command == TNFS_CMD_UNMOUNT)
+        return _tnfs_server_transaction(m_info, pkt, payload_size);
+
+    tnfsPacket request = pkt;
+    bool answered = _tnfs_server_transaction(m_info, pkt, payload_size);
+    bool session_lost = answered && _tnfs_session_lost(request.command, pkt.payload[0]);
+    if (answered && session_lost == false)
+        return true;
+
+    if (session_lost)
+        Debug_println("TNFS server doesn't know our session");
+
+    if (_tnfs_recover(m_info, session_lost) == false || _tnfs_can_resend(request.command) == false)
+        return false;
+
+    pkt = request;
+    return _tnfs_server_transaction(m_info, pkt, payload_size);
+}
 
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_READDIRX;
-    packet.payload[0] = m_info->dir_handle;
-    // Number of responses to read
-    packet.payload[1] = TNFS_MAX_DIRCACHE_ENTRIES;
+/*
+  Sends a request to the server we're using over whichever transport we picked
+*/
+bool _tnfs_server_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
+{
+    bool answered = m_info->using_tcp ? _tnfs_tcp_transaction(m_info, pkt, payload_size) : _tnfs_udp_transaction(m_info, pkt, payload_size);
+    if (answered)
+        m_info->last_contact_ms = fnSystem.millis();
+    return answered;
+}
 
-    if (_tnfs_transaction(m_info, packet, 2))
+/*
+  UDP version of _tnfs_transaction
+*/
+bool _tnfs_udp_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
+{
+    fnUDP udp;
+
+    // Start a new retry sequence
+    unsigned long ms_first = fnSystem.millis();
+    int retry = 0;
+    int backoff = 0;
+    bool same_sequence = false; // Re-sending a request the server may already have acted on
+    while (retry < m_info->max_retries || (fnSystem.millis() - ms_first) < (unsigned long)m_info->timeout_ms)
     {
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        // Send packet
+        bool sent;
+        if (same_sequence)
         {
-            uint8_t response_count = packet.payload[1];
-            uint8_t response_status = packet.payload[2];
-            uint16_t dirpos = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 3);
-
-            // Set our EOF flag if the server tells us there's no more after this
-            if(response_status & TNFS_READDIRX_STATUS_EOF)
-                m_info->set_dircache_eof();
+            m_info->protocol_stats.requests++;
+            sent = _tnfs_send_stamped(udp, m_info, pkt, payload_size);
+        }
+        else
+            sent = _tnfs_send(udp, m_info, pkt, payload_size);
 
-            Debug_printf("tnfs_readdirx resp_count=%hu, dirpos=%hu, status=%hu\n", response_count, dirpos, response_status);
+        if (!sent)
+        {
+            Debug_println("Failed to send packet - retrying");
+            // Nothing went out, so give the network a moment before trying again
+            vTaskDelay(m_info->min_retry_ms / portTICK_PERIOD_MS);
+            retry++;
+            continue;
+        }
 
-            // Fill our directory cache using the returned values
-            int current_offset = 5;
-            for(int i = 0; i < response_count; i++)
+        // Wait for a response until the re-send timeout
+        unsigned long ms_start = fnSystem.millis();
+        unsigned long wait_ms = _tnfs_rto(m_info, backoff);
+        uint8_t current_sequence_num = pkt.sequence_num;
+        bool try_again = false;
+        do
+        {
+            if (udp.parsePacket())
             {
-                tnfsDirCacheEntry *pEntry = m_info->new_dircache_entry();
-                if(pEntry != nullptr)
-                {
-                    pEntry->dirpos = dirpos + i;
-                    pEntry->flags = 
-                        packet.payload[current_offset + OFFSET_READDIRX_FLAGS];
-                    pEntry->filesize = 
-                        TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_SIZE);
-                    pEntry->m_time = 
-                        TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_MTIME);
-                    pEntry->c_time = 
-                        TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_CTIME);
-
-                    int name_len = strlcpy(pEntry->entryname, 
-                        (char *)packet.payload + current_offset + OFFSET_READDIRX_PATH, sizeof(pEntry->entryname));
+                // Look at the header and result before touching pkt, which we may need to send again
+                uint8_t reply[TNFS_HEADER_SIZE + 3];
+                unsigned short l = udp.read(reply, TNFS_HEADER_SIZE + 1);
 
-                    /*
-                     Adjust our offset to point to the next entry within the packet
-                     flags (1) + size (4) + mtime (4) + ctime (4) + null (1) = 14
-                    */ 
-                    current_offset += 14 + name_len;
+#ifdef TNFS_IMPAIRMENT
+                if (_tnfs_impair_drop(m_info))
+                {
+                    udp.flush();
+                    continue;
                 }
-                else
+#endif
+                // Replies to requests we've given up on are just ignored
+                if (l < TNFS_HEADER_SIZE + 1 || reply[2] != current_sequence_num)
                 {
-                    Debug_print("tnfs_readdirx Failed to allocate new dircache entry!\n");
+                    Debug_println("TNFS OUT OF ORDER SEQUENCE! IGNORING");
+                    m_info->protocol_stats.stale_replies++;
+                    udp.flush();
+                }
+                // Check in case the server asks us to wait and try again
+                else if (reply[TNFS_HEADER_SIZE] == TNFS_RESULT_TRY_AGAIN)
+                {
+                    udp.read(reply + TNFS_HEADER_SIZE + 1, 2);
+                    udp.flush();
+                    // Server should tell us how long it wants us to wait
+                    uint16_t backoffms = TNFS_UINT16_FROM_LOHI_BYTEPTR(reply + TNFS_HEADER_SIZE + 1);
+                    Debug_printf("Server asked us to TRY AGAIN after %ums\n", backoffms);
+                    m_info->protocol_stats.try_again++;
+                    if (backoffms > TNFS_MAX_BACKOFF_DELAY)
+                        backoffms = TNFS_MAX_BACKOFF_DELAY;
+                    // It's still a perfectly good measurement of how long the server takes to answer,
+                    // as long as we know which copy of the request it's answering
+                    if (same_sequence == false)
+                        _tnfs_rtt_sample(m_info, fnSystem.millis() - ms_start);
+                    vTaskDelay(backoffms / portTICK_PERIOD_MS);
+                    try_again = true;
                     break;
                 }
+                else
+                {
+                    memcpy(pkt.rawData, reply, l);
+                    l += udp.read(pkt.rawData + l, sizeof(pkt.rawData) - l);
+                    udp.flush();
+                    __IGNORE_UNUSED_VAR(l);
+#ifdef DEBUG
+                    _tnfs_debug_packet(pkt, l, true);
+#endif
+                    // Unless we re-sent it as-is, this reply is to the copy of
+                    // the request we just sent and the sample is good
+                    if (same_sequence == false)
+                        _tnfs_rtt_sample(m_info, fnSystem.millis() - ms_start);
+                    return true;
+                }
             }
+            fnSystem.yield();
 
-            int loaded = m_info->count_dircache();
-            Debug_printf("tnfs_readdirx cached %d entries\n", loaded);
-            // Now that we've cached our entries, return the first one
-            if(loaded > 0)
-                _readdirx_fill_response(m_info->next_dircache_entry(), filestat, dir_entry, dir_entry_len);
+        } while ((fnSystem.millis() - ms_start) < wait_ms);
 
+        // The server answered, so there's no reason to slow down. It didn't act on
+        // the request, so it goes out again as a new one.
+        if (try_again)
+        {
+            backoff = 0;
+            same_sequence = false;
         }
-        return packet.payload[0];
+        else
+        {
+            Debug_printf("Timeout after %lu milliseconds. Retrying\n", wait_ms);
+            m_info->protocol_stats.retransmits++;
+            backoff++;
+            same_sequence = _tnfs_resend_is_safe(pkt.command) == false;
+        }
+        retry++;
     }
-    return -1;
+
+    Debug_println("Retry attempts failed");
+    m_info->protocol_stats.failures++;
+
+    return false;
 }
 
 /*
-    TELLDIR
+  Updates our round-trip time estimates with a new measurement and works out
+  the re-send timeout from them, the same way TCP does (RFC 6298)
 */
-int tnfs_telldir(tnfsMountInfo *m_info, uint16_t *position)
+void _tnfs_rtt_sample(tnfsMountInfo *m_info, unsigned long rtt_ms)
 {
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
-        return -1;
-
-    if(position == nullptr)
-        return -1;
+    if (rtt_ms > TNFS_MAX_RTO)
+        rtt_ms = TNFS_MAX_RTO;
 
-    // First see if we're pointing at a currently-cached directory entry and return that
-    int cached = m_info->tell_dircache_entry();
-    if (cached > -1)
+    if (m_info->rtt_measured == false)
     {
-        *position = cached;
-        return 0;
+        m_info->srtt_ms = rtt_ms;
+        m_info->rttvar_ms = rtt_ms / 2;
+        m_info->rtt_measured = true;
     }
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_TELLDIR;
-    packet.payload[0] = m_info->dir_handle;
-
-    if (_tnfs_transaction(m_info, packet, 1))
+    else
     {
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
-        {
-            *position = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + 1);
-        }
-        return packet.payload[0];
+        unsigned long delta = m_info->srtt_ms > rtt_ms ? m_info->srtt_ms - rtt_ms : rtt_ms - m_info->srtt_ms;
+        m_info->rttvar_ms = (3 * m_info->rttvar_ms + delta) / 4;
+        m_info->srtt_ms = (7 * m_info->srtt_ms + rtt_ms) / 8;
     }
-    return -1;
+
+    unsigned long slack = 4 * m_info->rttvar_ms;
+    if (slack < TNFS_RTO_GRANULARITY)
+        slack = TNFS_RTO_GRANULARITY;
+    unsigned long rto = m_info->srtt_ms + slack;
+    if (rto < TNFS_MIN_RTO)
+        rto = TNFS_MIN_RTO;
+    if (rto > TNFS_MAX_RTO)
+        rto = TNFS_MAX_RTO;
+    m_info->rto_ms = rto;
+
+    #ifdef VERBOSE_TNFS
+    Debug_printf("_tnfs_rtt_sample rtt=%lu, srtt=%hu, rttvar=%hu, rto=%hu\n", rtt_ms, m_info->srtt_ms, m_info->rttvar_ms, m_info->rto_ms);
+    #endif
 }
 
 /*
-    SEEKDIR
+  Returns how long to wait for a reply before re-sending, doubling the current
+  re-send timeout for each time we've already had to re-send
 */
-int tnfs_seekdir(tnfsMountInfo *m_info, uint16_t position)
+unsigned long _tnfs_rto(tnfsMountInfo *m_info, int backoff)
 {
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
-        return -1;
-
-    // A SEEKDIR will always invalidate our directory cache
-    m_info->empty_dircache();
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_SEEKDIR;
-    packet.payload[0] = m_info->dir_handle;
-    uint32_t pos = position;
-    TNFS_UINT32_TO_LOHI_BYTEPTR(pos, packet.payload + 1);
-
-    if (_tnfs_transaction(m_info, packet, 5))
-        return packet.payload[0];
-
-    return -1;
+    unsigned long rto = m_info->rto_ms;
+    while (backoff-- > 0 && rto < TNFS_MAX_RTO)
+        rto *= 2;
+    return rto > TNFS_MAX_RTO ? TNFS_MAX_RTO : rto;
 }
 
 /*
-    Closes current directory handle specificed in tnfsMountInfo
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+  Sets the session ID and next sequence number on the packet and sends it
+  returns - true if the packet was sent
 */
-int tnfs_closedir(tnfsMountInfo *m_info)
+bool _tnfs_send(fnUDP &udp, tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
 {
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
-        return -1;
-
-    // Throw out any existing cached directory entries
-    m_info->empty_dircache();
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_CLOSEDIR;
-    packet.payload[0] = m_info->dir_handle;
-
-    if (_tnfs_transaction(m_info, packet, 1))
-    {
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
-        {
-            m_info->dir_handle = TNFS_INVALID_HANDLE;
-        }
-        return packet.payload[0];
-    }
-    return -1;
+    _tnfs_stamp_packet(m_info, pkt, payload_size);
+    return _tnfs_send_stamped(udp, m_info, pkt, payload_size);
 }
 
 /*
-    Creates directory.
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+  Sends a packet that already has its session ID and sequence number
+  returns - true if the packet was sent
 */
-int tnfs_mkdir(tnfsMountInfo *m_info, const char *directory)
+bool _tnfs_send_stamped(fnUDP &udp, tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
 {
-    if (m_info == nullptr || directory == nullptr)
-        return -1;
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_MKDIR;
-
-    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, directory, sizeof(packet.payload));
+#ifdef TNFS_IMPAIRMENT
+    return _tnfs_impair_send(udp, m_info, pkt, payload_size);
+#else
+    return _tnfs_send_raw(udp, m_info, pkt.rawData, payload_size + TNFS_HEADER_SIZE); // Add the data payload along with 4 bytes of TNFS header
+#endif
+}
 
-    Debug_printf("TNFS make directory: \"%s\"\n", (char *)packet.payload);
+/*
+ Sends a datagram to the server
+*/
+bool _tnfs_send_raw(fnUDP &udp, tnfsMountInfo *m_info, const uint8_t *data, uint16_t len)
+{
+    bool sent = false;
+    // Use the IP address if we have it
+    if (m_info->host_ip != IPADDR_NONE)
+        sent = udp.beginPacket(m_info->host_ip, m_info->port);
+    else
+        sent = udp.beginPacket(m_info->hostname, m_info->port);
 
-    if (_tnfs_transaction(m_info, packet, len + 1))
+    if (sent)
     {
-        return packet.payload[0];
+        udp.write(data, len);
+        sent = udp.endPacket();
     }
-    return -1;
+    return sent;
 }
 
 /*
-    Deletes directory.
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+  Sets the session ID and next sequence number on the packet
 */
-int tnfs_rmdir(tnfsMountInfo *m_info, const char *directory)
+void _tnfs_stamp_packet(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
 {
-    if (m_info == nullptr || directory == nullptr)
-        return -1;
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_RMDIR;
+    // Set our session ID
+    pkt.session_idl = TNFS_LOBYTE_FROM_UINT16(m_info->session);
+    pkt.session_idh = TNFS_HIBYTE_FROM_UINT16(m_info->session);
 
-    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, directory, sizeof(packet.payload));
+    // Set the sequence number
+    pkt.sequence_num = m_info->current_sequence_num++;
+    m_info->protocol_stats.requests++;
 
-    Debug_printf("TNFS remove directory: \"%s\"\n", (char *)packet.payload);
+#ifdef DEBUG
+    _tnfs_debug_packet(pkt, payload_size);
+#endif
+}
 
-    if (_tnfs_transaction(m_info, packet, len + 1))
-    {
-        return packet.payload[0];
-    }
-    return -1;
+#ifdef TNFS_IMPAIRMENT
+// Returns true with the given percent chance
+bool _tnfs_impair_chance(uint8_t percent)
+{
+    return percent > 0 && (esp_random() % 100) < percent;
 }
 
 /*
-    Returns file information filled in tnfsStat.
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+ Sends a stamped request the way a poor network might, according to
+ tnfsMountInfo.impairment: late, not at all, twice, or after the next one.
+ Returns false only if we failed to send something we meant to.
 */
-int tnfs_stat(tnfsMountInfo *m_info, tnfsStat *filestat, const char *filepath)
+bool _tnfs_impair_send(fnUDP &udp, tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
 {
-    if (m_info == nullptr || filepath == nullptr || filestat == nullptr)
-        return -1;
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_STAT;
-
-    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, filepath, sizeof(packet.payload));
+    tnfsImpairment &imp = m_info->impairment;
+    uint16_t len = payload_size + TNFS_HEADER_SIZE;
 
-    // Debug_printf("TNFS stat: \"%s\"\n", (char *)packet.payload);
-
-#define OFFSET_STAT_FILEMODE 1
-#define OFFSET_STAT_UID 3
-#define OFFSET_STAT_GID 5
-#define OFFSET_STAT_FILESIZE 7
-#define OFFSET_STAT_ATIME 11
-#define OFFSET_STAT_MTIME 15
-#define OFFSET_STAT_CTIME 19
+    unsigned long delay = imp.delay_ms + (imp.jitter_ms > 0 ? esp_random() % (imp.jitter_ms + 1) : 0);
+    if (delay > 0)
+        vTaskDelay(delay / portTICK_PERIOD_MS);
 
-    if (_tnfs_transaction(m_info, packet, len + 1))
+    if (_tnfs_impair_chance(imp.loss_percent))
     {
-        __BEGIN_IGNORE_UNUSEDVARS
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
-        {
-
-            uint16_t filemode = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_FILEMODE);
-            filestat->isDir = (filemode & S_IFDIR) ? true : false;
-
-            uint16_t uid = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_UID);
-            uint16_t gid = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_GID);
+        Debug_printf("TNFS impairment: dropping request #%hhu\n", pkt.sequence_num);
+        return true;
+    }
 
-            filestat->filesize = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_FILESIZE);
+    if (imp.held_len == 0 && _tnfs_impair_chance(imp.reorder_percent))
+    {
+        Debug_printf("TNFS impairment: holding back request #%hhu\n", pkt.sequence_num);
+        memcpy(imp.held, pkt.rawData, len);
+        imp.held_len = len;
+        return true;
+    }
 
-            filestat->a_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_ATIME);
-            filestat->m_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_MTIME);
-            filestat->c_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_CTIME);
+    bool sent = _tnfs_send_raw(udp, m_info, pkt.rawData, len);
+    if (sent && _tnfs_impair_chance(imp.duplicate_percent))
+    {
+        Debug_printf("TNFS impairment: duplicating request #%hhu\n", pkt.sequence_num);
+        _tnfs_send_raw(udp, m_info, pkt.rawData, len);
+    }
 
-            /*
-            Debug_printf("\ttnfs_stat: mode: %ho, uid: %hu, gid: %hu, dir: %d, size: %u, atime: 0x%04x, mtime: 0x%04x, ctime: 0x%04x\n", 
-                filemode, uid, gid,
-                filestat->isDir ? 1 : 0, filestat->filesize, filestat->a_time, filestat->m_time, filestat->c_time );
-            */
-        }
-        __END_IGNORE_UNUSEDVARS
-        return packet.payload[0];
+    // Anything we held back goes out after this one
+    if (imp.held_len > 0)
+    {
+        Debug_printf("TNFS impairment: sending held request #%hhu\n", imp.held[2]);
+        _tnfs_send_raw(udp, m_info, imp.held, imp.held_len);
+        imp.held_len = 0;
     }
-    return -1;
+    return sent;
 }
 
 /*
-    Deletes file.
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+ Returns true if a reply we've received should be treated as lost
 */
-int tnfs_unlink(tnfsMountInfo *m_info, const char *filepath)
+bool _tnfs_impair_drop(tnfsMountInfo *m_info)
 {
-    if (m_info == nullptr || filepath == nullptr)
-        return -1;
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_UNLINK;
-
-    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, filepath, sizeof(packet.payload));
-
-    Debug_printf("TNFS unlink file: \"%s\"\n", (char *)packet.payload);
-
-    if (_tnfs_transaction(m_info, packet, len + 1))
+    if (_tnfs_impair_chance(m_info->impairment.loss_percent))
     {
-        return packet.payload[0];
+        Debug_println("TNFS impairment: dropping reply");
+        return true;
     }
-    return -1;
+    return false;
 }
+#endif
 
 /*
-    Renames file from old_filepath to new_filepath
-    Relative paths ("../file") won't work.
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+  Makes sure we have a TCP connection to the server
+  returns - true if we're connected
 */
-int tnfs_rename(tnfsMountInfo *m_info, const char *old_filepath, const char *new_filepath)
+/*
+  Servers that didn't accept a TCP connection, or didn't answer a MOUNT over one,
+  while we were picking a transport. Without this every mount and every recovery
+  of such a server would wait out TNFS_TCP_CONNECT_TIMEOUT before using UDP.
+  Shared by every mount, since more than one may be using the same server.
+*/
+struct tnfsNoTcpServer
 {
-    if (m_info == nullptr || old_filepath == nullptr || new_filepath == nullptr)
-        return -1;
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_RENAME;
+    bool used = false;
+    char hostname[64] = { '\0' };
+    in_addr_t host_ip = IPADDR_NONE;
+    uint16_t port = 0;
+    unsigned long failed_ms = 0;
+};
+static tnfsNoTcpServer _tnfs_no_tcp[TNFS_NO_TCP_SERVERS];
+static portMUX_TYPE _tnfs_no_tcp_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static bool _tnfs_no_tcp_matches(const tnfsNoTcpServer &entry, tnfsMountInfo *m_info)
+{
+    return entry.used && entry.port == m_info->port && entry.host_ip == m_info->host_ip &&
+           strncmp(entry.hostname, m_info->hostname, sizeof(entry.hostname)) == 0;
+}
 
-    int l1 = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, old_filepath, sizeof(packet.payload)) + 1;
-    int l2 = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload + l1, new_filepath, sizeof(packet.payload) - l1) + 1;
+/*
+  Returns true if the server we're about to use failed over TCP in the last TNFS_TCP_RETRY_INTERVAL
+*/
+bool _tnfs_tcp_failed_recently(tnfsMountInfo *m_info)
+{
+    unsigned long now = fnSystem.millis();
+    bool failed = false;
+    portENTER_CRITICAL(&_tnfs_no_tcp_mux);
+    for (int i = 0; i < TNFS_NO_TCP_SERVERS; i++)
+        if (_tnfs_no_tcp_matches(_tnfs_no_tcp[i], m_info))
+        {
+            if (now - _tnfs_no_tcp[i].failed_ms < TNFS_TCP_RETRY_INTERVAL)
+                failed = true;
+            else
+                _tnfs_no_tcp[i].used = false; // Time to give it another chance
+        }
+    portEXIT_CRITICAL(&_tnfs_no_tcp_mux);
+    return failed;
+}
 
-    Debug_printf("TNFS rename file: \"%s\" -> \"%s\"\n", (char *)packet.payload, (char *)(packet.payload + l1));
+/*
+  Records whether the server we're using failed over TCP, replacing the oldest
+  entry if they're all taken
+*/
+void _tnfs_tcp_remember(tnfsMountInfo *m_info, bool failed)
+{
+    unsigned long now = fnSystem.millis();
+    portENTER_CRITICAL(&_tnfs_no_tcp_mux);
+    int slot = 0;
+    for (int i = 0; i < TNFS_NO_TCP_SERVERS; i++)
+    {
+        if (_tnfs_no_tcp_matches(_tnfs_no_tcp[i], m_info))
+        {
+            slot = i;
+            break;
+        }
+        // Otherwise an empty one, or failing that the one that failed longest ago
+        if (_tnfs_no_tcp[slot].used &&
+            (_tnfs_no_tcp[i].used == false || now - _tnfs_no_tcp[i].failed_ms > now - _tnfs_no_tcp[slot].failed_ms))
+            slot = i;
+    }
 
-    if (_tnfs_transaction(m_info, packet, l1 + l2))
+    tnfsNoTcpServer &entry = _tnfs_no_tcp[slot];
+    if (failed)
     {
-        return packet.payload[0];
+        entry.used = true;
+        strlcpy(entry.hostname, m_info->hostname, sizeof(entry.hostname));
+        entry.host_ip = m_info->host_ip;
+        entry.port = m_info->port;
+        entry.failed_ms = now;
     }
-    return -1;
+    else if (_tnfs_no_tcp_matches(entry, m_info))
+        entry.used = false;
+    portEXIT_CRITICAL(&_tnfs_no_tcp_mux);
 }
 
-/*
-    THIS ISN'T IMPLEMENTED IN THE CURRENT TNFSD CODE
-    Changes permissions on file
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
-*/
-int tnfs_chmod(tnfsMountInfo *m_info, const char *filepath, uint16_t mode)
+bool _tnfs_tcp_connect(tnfsMountInfo *m_info)
 {
-    if (m_info == nullptr || filepath == nullptr)
-        return -1;
+    if (m_info->tcp != nullptr && m_info->tcp->connected())
+        return true;
 
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_CHMOD;
+    if (m_info->tcp == nullptr)
+        m_info->tcp = new fnTcpClient;
 
-    packet.payload[0] = TNFS_LOBYTE_FROM_UINT16(mode);
-    packet.payload[1] = TNFS_HIBYTE_FROM_UINT16(mode);
+    int connected;
+    if (m_info->host_ip != IPADDR_NONE)
+        connected = m_info->tcp->connect(m_info->host_ip, m_info->port, TNFS_TCP_CONNECT_TIMEOUT);
+    else
+        connected = m_info->tcp->connect(m_info->hostname, m_info->port, TNFS_TCP_CONNECT_TIMEOUT);
 
-    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload + 2, filepath, sizeof(packet.payload) - 2);
+    if (!connected)
+    {
+        Debug_printf("TNFS TCP connection to %s:%hu failed\n", m_info->hostname, m_info->port);
+        _tnfs_tcp_disconnect(m_info);
+        return false;
+    }
 
-    Debug_printf("TNFS chmod file: \"%s\", %ho\n", (char *)packet.payload + 2, mode);
+    // Our requests are small and we always wait on the reply, so don't let them sit in the stack
+    m_info->tcp->setNoDelay(true);
+    return true;
+}
 
-    if (_tnfs_transaction(m_info, packet, len + 3))
+void _tnfs_tcp_disconnect(tnfsMountInfo *m_info)
+{
+    if (m_info->tcp != nullptr)
     {
-        return packet.payload[0];
+        m_info->tcp->stop();
+        delete m_info->tcp;
+        m_info->tcp = nullptr;
     }
-    return -1;
 }
 
 /*
-    THIS ISN'T IMPLEMENTED IN THE CURRENT TNFSD CODE
-    Returns size of mounted filesystem in kilobytes in the 'size' parameter
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+  Reads exactly len bytes from our TCP connection, waiting at most timeout_ms for each to arrive.
+  If buf is null, the data is thrown away.
+  returns - number of bytes read
 */
-int tnfs_size(tnfsMountInfo *m_info, uint32_t *size)
+int _tnfs_tcp_read(tnfsMountInfo *m_info, uint8_t *buf, int len, int timeout_ms)
 {
-    if (m_info == nullptr || size == nullptr)
-        return -1;
+    uint8_t discard[32];
+    int count = 0;
+    unsigned long ms_last = fnSystem.millis();
+    while (count < len)
+    {
+        if (m_info->tcp->connected() == false)
+            break;
 
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_SIZE;
+        int want = len - count;
+        uint8_t *dest = buf + count;
+        if (buf == nullptr)
+        {
+            dest = discard;
+            if (want > (int)sizeof(discard))
+                want = sizeof(discard);
+        }
 
-    if (_tnfs_transaction(m_info, packet, 0))
-    {
-        if (packet.payload[0] == 0)
+        int got = m_info->tcp->available() > 0 ? m_info->tcp->read(dest, want) : 0;
+        if (got > 0)
         {
-            *size = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + 1);
+            count += got;
+            ms_last = fnSystem.millis();
         }
-        return packet.payload[0];
+        else if (fnSystem.millis() - ms_last >= (unsigned long)timeout_ms)
+            break;
+        else
+            fnSystem.yield();
     }
-    return -1;
+    return count;
 }
 
 /*
-    THIS ISN'T IMPLEMENTED IN THE CURRENT TNFSD CODE
-    Returns free kilobytes in mounted filesystem in the 'size' parameter
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+  Reads a zero-terminated string into buf, stopping early if nothing arrives for TNFS_TCP_IDLE_TIMEOUT
+  (some servers leave out strings the protocol calls for).
+  returns - number of bytes read, including the terminator
 */
-int tnfs_free(tnfsMountInfo *m_info, uint32_t *size)
+int _tnfs_tcp_read_string(tnfsMountInfo *m_info, uint8_t *buf, int bufflen)
 {
-    if (m_info == nullptr || size == nullptr)
-        return -1;
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_FREE;
-
-    if (_tnfs_transaction(m_info, packet, 0))
+    int count = 0;
+    while (count < bufflen)
     {
-        if (packet.payload[0] == 0)
-        {
-            *size = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + 1);
-        }
-        return packet.payload[0];
+        if (_tnfs_tcp_read(m_info, buf + count, 1, TNFS_TCP_IDLE_TIMEOUT) != 1)
+            break;
+        if (buf[count++] == '\0')
+            break;
     }
-    return -1;
+    return count;
 }
 
-// ------------------------------------------------
-// HELPER TNFS FUNCTIONS (Aren't actual TNFSD commands)
-// ------------------------------------------------
-
 /*
- Returns the filepath associated with an open filehandle
+  Receives one reply over TCP into pkt.
+  UDP gives us a datagram per reply, but TCP is just a stream, so we work out
+  where each reply ends from its command and contents.
+  returns - false if the connection failed or we didn't get the whole reply in time
 */
-const char *tnfs_filepath(tnfsMountInfo *m_info, int16_t file_handle)
+bool _tnfs_tcp_receive(tnfsMountInfo *m_info, tnfsPacket &pkt)
 {
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle))
-        return nullptr;
+    // Header plus result code
+    if (_tnfs_tcp_read(m_info, pkt.rawData, TNFS_HEADER_SIZE + 1, m_info->timeout_ms) != TNFS_HEADER_SIZE + 1)
+        return false;
+
+    int offset = 1; // Where the next bytes go in the payload
+    int room = sizeof(pkt.payload);
+    bool ok = true;
+
+    // Reads count bytes into the payload, discarding anything that doesn't fit
+    auto take = [&](int count) {
+        int fits = (offset + count <= room) ? count : (offset < room ? room - offset : 0);
+        if (fits > 0 && _tnfs_tcp_read(m_info, pkt.payload + offset, fits, m_info->timeout_ms) != fits)
+            ok = false;
+        if (count > fits && _tnfs_tcp_read(m_info, nullptr, count - fits, m_info->timeout_ms) != count - fits)
+            ok = false;
+        offset += fits;
+    };
+    auto take_string = [&]() {
+        if (offset < room)
+            offset += _tnfs_tcp_read_string(m_info, pkt.payload + offset, room - offset);
+    };
+
+    uint8_t result = pkt.payload[0];
+    if (result == TNFS_RESULT_TRY_AGAIN)
+        take(2); // Backoff time
+    else if (result != TNFS_RESULT_SUCCESS)
+    {
+        if (pkt.command == TNFS_CMD_MOUNT)
+            take(2); // Server version
+    }
+    else
+    {
+        switch (pkt.command)
+        {
+        case TNFS_CMD_UNMOUNT:
+        case TNFS_CMD_CLOSEDIR:
+        case TNFS_CMD_MKDIR:
+        case TNFS_CMD_RMDIR:
+        case TNFS_CMD_SEEKDIR:
+        case TNFS_CMD_CLOSE:
+        case TNFS_CMD_UNLINK:
+        case TNFS_CMD_CHMOD:
+        case TNFS_CMD_RENAME:
+            break;
+        case TNFS_CMD_OPEN:
+        case TNFS_CMD_OPENDIR:
+            take(1);
+            break;
+        case TNFS_CMD_WRITE:
+            take(2);
+            break;
+        case TNFS_CMD_OPENDIRX:
+            take(3);
+            break;
+        case TNFS_CMD_MOUNT:
+        case TNFS_CMD_LSEEK:
+        case TNFS_CMD_TELLDIR:
+        case TNFS_CMD_SIZE:
+        case TNFS_CMD_FREE:
+            take(4);
+            break;
+        case TNFS_CMD_READ:
+            take(2);
+            if (ok)
+                take(TNFS_UINT16_FROM_LOHI_BYTEPTR(pkt.payload + 1));
+            break;
+        case TNFS_CMD_READDIR:
+            take_string();
+            break;
+        case TNFS_CMD_STAT:
+            take(22);
+            take_string(); // User name
+            take_string(); // Group name
+            break;
+        case TNFS_CMD_READDIRX:
+        {
+            take(4);
+            uint8_t count = pkt.payload[1];
+            for (int i = 0; ok && i < count; i++)
+            {
+                take(13); // Flags, size, mtime, ctime
+                take_string();
+            }
+            break;
+        }
+        default:
+            // Take whatever shows up
+            offset += _tnfs_tcp_read(m_info, pkt.payload + offset, room - offset, TNFS_TCP_IDLE_TIMEOUT);
+            break;
+        }
+    }
 
-    // Find info on this handle
-    tnfsFileHandleInfo *pFileInf = m_info->get_filehandleinfo(file_handle);
-    if (pFileInf == nullptr)
-        return nullptr;
+#ifdef DEBUG
+    _tnfs_debug_packet(pkt, offset, true);
+#endif
 
-    return pFileInf->filename;
+    return ok;
 }
 
 /*
- Sets the internally-tracked current working directory after confirming that
- the given directory exists.
- ".." can be used to go up one (and only one) directory
+  TCP version of _tnfs_transaction.
+  If the connection fails we reconnect and try again, up to tnfsMountInfo.max_retries times.
 */
-int tnfs_chdir(tnfsMountInfo *m_info, const char *dirpath)
+bool _tnfs_tcp_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
 {
-    if (m_info == nullptr || dirpath == nullptr)
-        return -1;
+    // The reply overwrites pkt, so keep a copy of the request in case we need to send it again
+    tnfsPacket request = pkt;
 
-    // Check for ".."
-    if (dirpath[0] == '.' && dirpath[1] == '.' && dirpath[2] == '\0')
+    int retry = 0;
+    while (retry < m_info->max_retries)
     {
-        // Figure out what the previous directory is
-        char *lslash = strrchr(m_info->current_working_directory, '/');
-        // Assuming we're not alraedy at the root, just truncate the string at the last slash
-        if (lslash != nullptr && lslash != m_info->current_working_directory)
-            *lslash = '\0';
-        return TNFS_RESULT_SUCCESS;
-    }
+        if (retry > 0)
+            pkt = request;
 
-    tnfsStat tstat;
-    int rs = tnfs_stat(m_info, &tstat, dirpath);
-    if (rs != TNFS_RESULT_SUCCESS)
-        return rs;
+        if (_tnfs_tcp_connect(m_info))
+        {
+            _tnfs_stamp_packet(m_info, pkt, payload_size);
+            uint8_t current_sequence_num = pkt.sequence_num;
 
-    if (tstat.isDir == false)
-        return TNFS_RESULT_NOT_A_DIRECTORY;
+            size_t size = payload_size + TNFS_HEADER_SIZE;
+            if (m_info->tcp->write(pkt.rawData, size) == size && _tnfs_tcp_receive(m_info, pkt))
+            {
+                if (pkt.sequence_num != current_sequence_num)
+                {
+                    // We can't trust anything else in the stream at this point
+                    Debug_println("TNFS OUT OF ORDER SEQUENCE! RECONNECTING");
+                    _tnfs_tcp_disconnect(m_info);
+                }
+                else if (pkt.payload[0] != TNFS_RESULT_TRY_AGAIN)
+                    return true;
+                else
+                {
+                    // Server should tell us how long it wants us to wait
+                    uint16_t backoffms = TNFS_UINT16_FROM_LOHI_BYTEPTR(pkt.payload + 1);
+                    Debug_printf("Server asked us to TRY AGAIN after %ums\n", backoffms);
+                    m_info->protocol_stats.try_again++;
+                    if (backoffms > TNFS_MAX_BACKOFF_DELAY)
+                        backoffms = TNFS_MAX_BACKOFF_DELAY;
+                    vTaskDelay(backoffms / portTICK_PERIOD_MS);
+                    retry++;
+                    continue;
+                }
+            }
+            else
+            {
+                Debug_println("TNFS TCP request failed - reconnecting");
+                _tnfs_tcp_disconnect(m_info);
+            }
+        }
 
-    // Looks okay - store it
-    _tnfs_adjust_with_full_path(m_info, m_info->current_working_directory, dirpath, sizeof(m_info->current_working_directory));
+        // Make sure we wait before retrying
+        vTaskDelay(m_info->min_retry_ms / portTICK_PERIOD_MS);
+        retry++;
+    }
 
-    return TNFS_RESULT_SUCCESS;
-}
+    Debug_println("Retry attempts failed");
 
-/*
- Returns directory path we currently have stored
-*/
-const char *tnfs_getcwd(tnfsMountInfo *m_info)
-{
-    if (m_info == nullptr)
-        return nullptr;
-    return m_info->current_working_directory;
+    return false;
 }
-// ------------------------------------------------
-// INTERNAL UTILITY FUNCTIONS
-// ------------------------------------------------
 
 /*
-  Send constructed TNFS packet and check for reply
-  The send/receive loop will be attempted tnfsPacket.max_retries times (default: TNFS_RETRIES)
-  Each retry attempt is limited to tnfsPacket.timeout_ms (default: TNFS_TIMEOUT)
-
-  Only the command (tnfsPacket.command) and payload contents need to be set on the packet.
-  Current session ID will be copied from tnfsMountInfo and retryCount is always reset to zero.
-  
-  If successful, server's response code will be the first byte of of tnfsPacket.data
-  
-  returns - true if response packet was received
-            false if no response received during retries/timeout period
- */
-bool _tnfs_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
+  TCP version of _tnfs_read_window.
+  Since TCP delivers our requests in order, we can send several READs on the file's
+  own handle without waiting, each asking for up to TNFS_TCP_READ_SIZE bytes, and
+  the replies come back as one contiguous run of data however much each one carries.
+  Returns: 0: success; TNFS_RESULT_END_OF_FILE: EOF; -1: failed to deliver/receive packet; other: TNFS error result code
+*/
+int _tnfs_tcp_read_window(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, uint32_t position, uint8_t *dest, uint16_t len, uint16_t *dest_used)
 {
-    fnUDP udp;
-
-    // Set our session ID
-    pkt.session_idl = TNFS_LOBYTE_FROM_UINT16(m_info->session);
-    pkt.session_idh = TNFS_HIBYTE_FROM_UINT16(m_info->session);
-
-    // Start a new retry sequence
-    int retry = 0;
-    while (retry < m_info->max_retries)
+    // Don't ask for anything beyond the end of the file
+    uint32_t wanted = len - *dest_used;
+    uint32_t total = wanted;
+    if (total > pFHI->file_size - position)
+        total = pFHI->file_size - position;
+
+    // Get the server to where we want to start
+    if (pFHI->file_position != position)
     {
-        // Set the sequence number
-        pkt.sequence_num = m_info->current_sequence_num++;
-
-#ifdef DEBUG
-        _tnfs_debug_packet(pkt, payload_size);
-#endif
+        uint32_t client_pos = pFHI->cached_pos;
+        int result = tnfs_lseek(m_info, pFHI->handle, position, SEEK_SET, nullptr, true);
+        pFHI->cached_pos = client_pos;
+        if (result != 0)
+            return result;
+    }
 
-        // Send packet
-        bool sent = false;
-        // Use the IP address if we have it
-        if (m_info->host_ip != IPADDR_NONE)
-            sent = udp.beginPacket(m_info->host_ip, m_info->port);
-        else
-            sent = udp.beginPacket(m_info->hostname, m_info->port);
+    int depth = m_info->read_window > TNFS_MAX_READ_WINDOW ? TNFS_MAX_READ_WINDOW : m_info->read_window;
+    if (depth < 1)
+        depth = 1;
 
-        if (sent)
+    uint32_t got = 0;
+    int result = 0;
+    while (got < total && result == 0)
+    {
+        if (_tnfs_tcp_connect(m_info) == false)
+            return -1;
+
+        // Send a batch of READs
+        uint8_t sequence_nums[TNFS_MAX_READ_WINDOW];
+        uint32_t requested = 0;
+        int sent;
+        for (sent = 0; sent < depth && got + requested < total; sent++)
         {
-            udp.write(pkt.rawData, payload_size + TNFS_HEADER_SIZE); // Add the data payload along with 4 bytes of TNFS header
-            sent = udp.endPacket();
+            uint32_t chunk = total - got - requested;
+            if (chunk > TNFS_TCP_READ_SIZE)
+                chunk = TNFS_TCP_READ_SIZE;
+
+            tnfsPacket packet;
+            packet.command = TNFS_CMD_READ;
+            packet.payload[0] = pFHI->handle_id;
+            packet.payload[1] = TNFS_LOBYTE_FROM_UINT16(chunk);
+            packet.payload[2] = TNFS_HIBYTE_FROM_UINT16(chunk);
+            _tnfs_stamp_packet(m_info, packet, 3);
+            sequence_nums[sent] = packet.sequence_num;
+            if (m_info->tcp->write(packet.rawData, TNFS_HEADER_SIZE + 3) != TNFS_HEADER_SIZE + 3)
+            {
+                _tnfs_tcp_disconnect(m_info);
+                pFHI->file_position = TNFS_POSITION_UNKNOWN;
+                return -1;
+            }
+            requested += chunk;
         }
 
-        if (!sent)
-        {
-            Debug_println("Failed to send packet - retrying");
-        }
-        else
+        #ifdef VERBOSE_TNFS
+        Debug_printf("_tnfs_tcp_read_window pos=%u, requests=%d, bytes=%u\n", position + got, sent, requested);
+        #endif
+
+        // Collect the replies in order; data lands right after whatever the previous one brought
+        uint16_t backoffms = 0;
+        for (int i = 0; i < sent; i++)
         {
-            // Wait for a response at most TNFS_TIMEOUT milliseconds
-            int ms_start = fnSystem.millis();
-            uint8_t current_sequence_num = pkt.sequence_num;
-            do
+            uint8_t reply[TNFS_HEADER_SIZE + 3];
+            if (_tnfs_tcp_read(m_info, reply, TNFS_HEADER_SIZE + 1, m_info->timeout_ms) != TNFS_HEADER_SIZE + 1 ||
+                reply[2] != sequence_nums[i])
             {
-                if (udp.parsePacket())
-                {
-                    unsigned short l = udp.read(pkt.rawData, sizeof(pkt.rawData));
-                    __IGNORE_UNUSED_VAR(l);
-#ifdef DEBUG
-                    _tnfs_debug_packet(pkt, l, true);
-#endif
-
-                    // Out of order packet received.
-                    if (pkt.sequence_num != current_sequence_num)
-                    {
-                        Debug_println("TNFS OUT OF ORDER SEQUENCE! RETRYING");
-                        // Fall through and let retry logic handle it.
-                    }
-                    else
-                    {
-                        // Check in case the server asks us to wait and try again
-                        if (pkt.payload[0] != TNFS_RESULT_TRY_AGAIN)
-                            return true;
-                        else
-                        {
-                            // Server should tell us how long it wants us to wait
-                            uint16_t backoffms = TNFS_UINT16_FROM_LOHI_BYTEPTR(pkt.payload + 1);
-                            Debug_printf("Server asked us to TRY AGAIN after %ums\n", backoffms);
-                            if (backoffms > TNFS_MAX_BACKOFF_DELAY)
-                                backoffms = TNFS_MAX_BACKOFF_DELAY;
-                            vTaskDelay(backoffms / portTICK_PERIOD_MS);
-                        }
-                    }
-                }
-                fnSystem.yield();
+                Debug_println("TNFS TCP READ reply missing or out of sequence - reconnecting");
+                _tnfs_tcp_disconnect(m_info);
+                pFHI->file_position = TNFS_POSITION_UNKNOWN;
+                return -1;
+            }
 
-            } while ((fnSystem.millis() - ms_start) < m_info->timeout_ms);
+            uint8_t code = reply[TNFS_HEADER_SIZE];
+            uint16_t extra = (code == TNFS_RESULT_SUCCESS || code == TNFS_RESULT_TRY_AGAIN) ? 2 : 0;
+            if (extra && _tnfs_tcp_read(m_info, reply + TNFS_HEADER_SIZE + 1, extra, m_info->timeout_ms) != extra)
+            {
+                _tnfs_tcp_disconnect(m_info);
+                pFHI->file_position = TNFS_POSITION_UNKNOWN;
+                return -1;
+            }
 
-            Debug_printf("Timeout after %d milliseconds. Retrying\n", m_info->timeout_ms);
+            if (code == TNFS_RESULT_SUCCESS)
+            {
+                uint16_t count = TNFS_UINT16_FROM_LOHI_BYTEPTR(reply + TNFS_HEADER_SIZE + 1);
+                // We never ask for more than we have room for, but don't trust the server on that
+                uint16_t fits = count > (total - got) ? total - got : count;
+                if (_tnfs_tcp_read(m_info, dest + *dest_used + got, fits, m_info->timeout_ms) != fits ||
+                    (count > fits && _tnfs_tcp_read(m_info, nullptr, count - fits, m_info->timeout_ms) != count - fits))
+                {
+                    _tnfs_tcp_disconnect(m_info);
+                    pFHI->file_position = TNFS_POSITION_UNKNOWN;
+                    return -1;
+                }
+                got += fits;
+                m_info->protocol_stats.bytes_read += fits;
+                pFHI->file_position += count;
+                // Nothing at all means the file's shorter than we thought; asking again won't change that
+                if (count == 0 && result == 0)
+                    result = TNFS_RESULT_END_OF_FILE;
+            }
+            else if (code == TNFS_RESULT_TRY_AGAIN)
+                // The server didn't move, so the next reply's data still follows on from ours
+                backoffms = TNFS_UINT16_FROM_LOHI_BYTEPTR(reply + TNFS_HEADER_SIZE + 1);
+            else if (result == 0)
+                result = code;
         }
 
-        // Make sure we wait before retrying
-        vTaskDelay(m_info->min_retry_ms / portTICK_PERIOD_MS);
-        retry++;
+        if (backoffms > 0)
+        {
+            Debug_printf("Server asked us to TRY AGAIN after %ums\n", backoffms);
+            m_info->protocol_stats.try_again++;
+            if (backoffms > TNFS_MAX_BACKOFF_DELAY)
+                backoffms = TNFS_MAX_BACKOFF_DELAY;
+            vTaskDelay(backoffms / portTICK_PERIOD_MS);
+        }
     }
 
-    Debug_println("Retry attempts failed");
+    *dest_used += got;
 
-    return false;
+    if (result != 0 && result != TNFS_RESULT_END_OF_FILE)
+        return result;
+
+    return got < wanted ? TNFS_RESULT_END_OF_FILE : 0;
 }
 
 // Copies to buffer while ensuring that we start with a '/'
@@ -148,6 +148,25 @@ struct tnfsStat
     uint32_t c_time;
 };
 
+// Bytes ahead of the entries in a READDIRX reply: result, count, status and position (2)
+#define TNFS_READDIRX_HEADERBYTES 5
+
+/*
+ A directory read on a server handle of its own rather than the mount's dir_handle,
+ so the VFS can have several open while FileSystemTNFS uses tnfs_opendirx.
+ Entries from each READDIRX reply are kept here and handed out one at a time.
+*/
+struct tnfsDirStream
+{
+    int16_t handle = TNFS_INVALID_HANDLE;
+    uint32_t server_generation = 0; // The handle means nothing once the mount's changes
+    uint16_t position = 0; // Position of the next entry we'll return
+    bool eof = false; // The server has nothing after what's in entries
+    uint8_t entries_left = 0;
+    uint16_t entries_offset = 0;
+    uint8_t entries[TNFS_PAYLOAD_SIZE - TNFS_READDIRX_HEADERBYTES];
+};
+
 // Retruns a uint16 value given two bytes in high-low order
 #define TNFS_UINT16_FROM_HILOBYTES(high, low) ((uint16_t)high << 8 | low)
 
@@ -174,7 +193,10 @@ struct tnfsStat
 #define TNFS_VALID_AS_UINT8(value) (value >= 0 && value <= 255)
 
 int tnfs_mount(tnfsMountInfo *m_info);
+const char *tnfs_transport_from_host(tnfsMountInfo *m_info, const char *host);
+int tnfs_add_mirror(tnfsMountInfo *m_info, const char *hostname, in_addr_t host_ip, uint16_t port);
 int tnfs_umount(tnfsMountInfo *m_info);
+int tnfs_keepalive(tnfsMountInfo *m_info);
 
 //int tnfs_opendir(tnfsMountInfo *m_info, const char *directory);
 int tnfs_opendirx(tnfsMountInfo *m_info, const char *directory, uint8_t sortopts = 0, uint8_t diropts = 0, const char *pattern = nullptr, uint16_t maxresults = 0);
@@ -185,6 +207,11 @@ int tnfs_closedir(tnfsMountInfo *m_info);
 int tnfs_telldir(tnfsMountInfo *m_info, uint16_t *position);
 int tnfs_seekdir(tnfsMountInfo *m_info, uint16_t position);
 
+int tnfs_dirstream_open(tnfsMountInfo *m_info, tnfsDirStream *ds, const char *directory, uint8_t sortopts = 0, uint8_t diropts = 0, const char *pattern = nullptr);
+int tnfs_dirstream_read(tnfsMountInfo *m_info, tnfsDirStream *ds, tnfsStat *filestat, char *dir_entry, int dir_entry_len);
+int tnfs_dirstream_seek(tnfsMountInfo *m_info, tnfsDirStream *ds, uint16_t position);
+int tnfs_dirstream_close(tnfsMountInfo *m_info, tnfsDirStream *ds);
+
 int tnfs_rmdir(tnfsMountInfo *m_info, const char *directory);
 int tnfs_mkdir(tnfsMountInfo *m_info, const char *directory);
 
@@ -195,7 +222,9 @@ int tnfs_open(tnfsMountInfo *m_info, const char *filepath, uint16_t open_mode, u
 int tnfs_read(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint16_t bufflen, uint16_t *resultlen);
 int tnfs_write(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint16_t bufflen, uint16_t *resultlen);
 int tnfs_close(tnfsMountInfo *m_info, int16_t file_handle);
+int tnfs_fsync(tnfsMountInfo *m_info, int16_t file_handle);
 int tnfs_stat(tnfsMountInfo *m_info, tnfsStat *filestat, const char *filepath);
+int tnfs_fstat(tnfsMountInfo *m_info, int16_t file_handle, tnfsStat *filestat);
 int tnfs_lseek(tnfsMountInfo *m_info, int16_t file_handle, int32_t position, uint8_t type, uint32_t *new_position = nullptr, bool skip_cache = false);
 int tnfs_unlink(tnfsMountInfo *m_info, const char *filepath);
 int tnfs_chmod(tnfsMountInfo *m_info, const char *filepath, uint16_t mode);
@@ -0,0 +1,219 @@
+#include <cstring>
+#include <esp_heap_caps.h>
+
+#include "tnfslibBlockCache.h"
+#include "../../include/debug.h"
+
+tnfsBlockCache::~tnfsBlockCache()
+{
+    if (_blocks != nullptr)
+        delete[] _blocks;
+    if (_arena != nullptr)
+        heap_caps_free(_arena);
+}
+
+/*
+ Allocates our blocks the first time we need them.
+ We try for TNFS_CACHE_BLOCKS in PSRAM, falling back to a few blocks in regular memory.
+ Returns false if we couldn't get any memory at all.
+*/
+bool tnfsBlockCache::_allocate()
+{
+    if (_arena != nullptr)
+        return true;
+
+    int count = TNFS_CACHE_BLOCKS;
+    int staging = TNFS_MAX_READAHEAD_BLOCKS;
+    _arena = (uint8_t *)heap_caps_malloc((count + staging) * TNFS_CACHE_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (_arena == nullptr)
+    {
+        count = staging = TNFS_CACHE_MIN_BLOCKS;
+        _arena = (uint8_t *)heap_caps_malloc((count + staging) * TNFS_CACHE_BLOCK_SIZE, MALLOC_CAP_8BIT);
+        if (_arena == nullptr)
+        {
+            Debug_println("tnfsBlockCache failed to allocate memory");
+            return false;
+        }
+    }
+
+    _blocks = new tnfsCacheBlock[count];
+    for (int i = 0; i < count; i++)
+    {
+        _blocks[i].data = _arena + i * TNFS_CACHE_BLOCK_SIZE;
+        // Start with every block in the LRU list, all of them unused
+        _blocks[i].lru_prev = i - 1;
+        _blocks[i].lru_next = (i + 1 < count) ? i + 1 : -1;
+    }
+    _block_count = count;
+    _lru_head = 0;
+    _lru_tail = count - 1;
+
+    _staging = _arena + count * TNFS_CACHE_BLOCK_SIZE;
+    _staging_blocks = staging;
+
+    Debug_printf("tnfsBlockCache allocated %d blocks\n", count);
+    return true;
+}
+
+void tnfsBlockCache::_unlink(int index)
+{
+    tnfsCacheBlock &b = _blocks[index];
+    if (b.lru_prev != -1)
+        _blocks[b.lru_prev].lru_next = b.lru_next;
+    else
+        _lru_head = b.lru_next;
+
+    if (b.lru_next != -1)
+        _blocks[b.lru_next].lru_prev = b.lru_prev;
+    else
+        _lru_tail = b.lru_prev;
+
+    b.lru_prev = b.lru_next = -1;
+}
+
+void tnfsBlockCache::_push_front(int index)
+{
+    tnfsCacheBlock &b = _blocks[index];
+    b.lru_prev = -1;
+    b.lru_next = _lru_head;
+    if (_lru_head != -1)
+        _blocks[_lru_head].lru_prev = index;
+    _lru_head = index;
+    if (_lru_tail == -1)
+        _lru_tail = index;
+}
+
+/*
+ Returns the cached block for the given file and block number and marks it
+ as most recently used, or null if it isn't cached
+*/
+tnfsCacheBlock *tnfsBlockCache::find(uint32_t file_id, uint32_t block_num)
+{
+    if (file_id == TNFS_CACHE_INVALID_FILE)
+        return nullptr;
+
+    for (int i = 0; i < _block_count; i++)
+    {
+        if (_blocks[i].file_id == file_id && _blocks[i].block_num == block_num)
+        {
+            if (i != _lru_head)
+            {
+                _unlink(i);
+                _push_front(i);
+            }
+            return &_blocks[i];
+        }
+    }
+    return nullptr;
+}
+
+/*
+ Stores a block of file data, replacing the least recently used block if needed
+ Returns a pointer to the new block or null if we don't have any memory to store it
+*/
+tnfsCacheBlock *tnfsBlockCache::store(uint32_t file_id, uint32_t block_num, const uint8_t *data, uint16_t datalen)
+{
+    if (file_id == TNFS_CACHE_INVALID_FILE || _allocate() == false)
+        return nullptr;
+
+    if (datalen > TNFS_CACHE_BLOCK_SIZE)
+        datalen = TNFS_CACHE_BLOCK_SIZE;
+
+    // Re-use the existing block if we already have one, otherwise take the oldest
+    tnfsCacheBlock *pBlock = find(file_id, block_num);
+    if (pBlock == nullptr)
+    {
+        int i = _lru_tail;
+        if (_blocks[i].file_id != TNFS_CACHE_INVALID_FILE)
+            stats.evictions++;
+        _unlink(i);
+        _push_front(i);
+        pBlock = &_blocks[i];
+        pBlock->file_id = file_id;
+        pBlock->block_num = block_num;
+    }
+
+    memcpy(pBlock->data, data, datalen);
+    pBlock->valid = datalen;
+    return pBlock;
+}
+
+/*
+ Keeps cached blocks in line with data we've just written to the server.
+ Blocks that would end up with a hole in them are simply dropped.
+*/
+void tnfsBlockCache::write(uint32_t file_id, uint32_t position, const uint8_t *data, uint16_t datalen)
+{
+    uint32_t end = position + datalen;
+    for (int i = 0; i < _block_count; i++)
+    {
+        tnfsCacheBlock &b = _blocks[i];
+        if (b.file_id != file_id)
+            continue;
+
+        uint32_t block_start = b.block_num * TNFS_CACHE_BLOCK_SIZE;
+        uint32_t block_end = block_start + TNFS_CACHE_BLOCK_SIZE;
+        if (end <= block_start || position >= block_end)
+            continue;
+
+        uint32_t from = position > block_start ? position : block_start;
+        uint32_t to = end < block_end ? end : block_end;
+        uint16_t offset = from - block_start;
+
+        if (offset > b.valid)
+        {
+            invalidate(&b);
+            continue;
+        }
+        memcpy(b.data + offset, data + (from - position), to - from);
+        if (to - block_start > b.valid)
+            b.valid = to - block_start;
+    }
+}
+
+/*
+ Throws out the given block
+*/
+void tnfsBlockCache::invalidate(tnfsCacheBlock *pBlock)
+{
+    int i = pBlock - _blocks;
+    pBlock->file_id = TNFS_CACHE_INVALID_FILE;
+    pBlock->valid = 0;
+    // Move it to the end of the line so it's the next one to be re-used
+    _unlink(i);
+    if (_lru_tail != -1)
+    {
+        _blocks[_lru_tail].lru_next = i;
+        pBlock->lru_prev = _lru_tail;
+    }
+    else
+        _lru_head = i;
+    _lru_tail = i;
+}
+
+/*
+ Throws out all the blocks belonging to the given file
+*/
+void tnfsBlockCache::invalidate(uint32_t file_id)
+{
+    for (int i = 0; i < _block_count; i++)
+        if (_blocks[i].file_id == file_id)
+            invalidate(&_blocks[i]);
+}
+
+/*
+ Throws out everything in the cache, keeping the memory
+*/
+void tnfsBlockCache::clear()
+{
+    for (int i = 0; i < _block_count; i++)
+        if (_blocks[i].file_id != TNFS_CACHE_INVALID_FILE)
+            invalidate(&_blocks[i]);
+}
+
+uint8_t *tnfsBlockCache::staging()
+{
+    if (_allocate() == false)
+        return nullptr;
+    return _staging;
+}
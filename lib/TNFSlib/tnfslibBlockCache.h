@@ -0,0 +1,72 @@
+#ifndef _TNFSLIB_BLOCKCACHE_H
+#define _TNFSLIB_BLOCKCACHE_H
+
+#include <cstdint>
+
+#define TNFS_CACHE_BLOCK_SIZE 512 // Fits in a single TNFS_MAX_READWRITE_PAYLOAD packet
+#define TNFS_CACHE_BLOCKS 64 // Number of blocks we cache per mount (allocated from PSRAM)
+#define TNFS_CACHE_MIN_BLOCKS 8 // Number of blocks we'll settle for if PSRAM isn't available
+#define TNFS_MAX_READAHEAD_BLOCKS 16 // Most blocks we'll read ahead for a sequential reader
+
+#define TNFS_CACHE_INVALID_FILE 0 // File ID never given to an open file
+
+// Counters kept by each mount's block cache
+struct tnfsCacheStats
+{
+    uint32_t hits = 0; // Block lookups satisfied from the cache
+    uint32_t misses = 0; // Block lookups that required a trip to the server
+    uint32_t blocks_fetched = 0; // Blocks loaded from the server
+    uint32_t readahead_blocks = 0; // Blocks loaded before anyone asked for them
+    uint32_t evictions = 0; // Blocks thrown out to make room for others
+};
+
+// One cached block of file data
+struct tnfsCacheBlock
+{
+    uint32_t file_id = TNFS_CACHE_INVALID_FILE;
+    uint32_t block_num = 0; // File position / TNFS_CACHE_BLOCK_SIZE
+    uint16_t valid = 0; // Number of valid bytes (less than a full block at the end of a file)
+    int16_t lru_prev = -1;
+    int16_t lru_next = -1;
+    uint8_t *data = nullptr;
+};
+
+/*
+ Cache of file data blocks shared by all files open on a mount.
+ Blocks are identified by a file ID (shared by every handle open on the same path)
+ and block number, and are evicted least-recently-used first.
+*/
+class tnfsBlockCache
+{
+private:
+    tnfsCacheBlock *_blocks = nullptr;
+    uint8_t *_arena = nullptr; // Data for all blocks plus the staging area
+    uint8_t *_staging = nullptr;
+    int _block_count = 0;
+    int _staging_blocks = 0;
+    int _lru_head = -1; // Most recently used
+    int _lru_tail = -1; // Least recently used
+
+    bool _allocate();
+    void _unlink(int index);
+    void _push_front(int index);
+
+public:
+    tnfsCacheStats stats;
+
+    ~tnfsBlockCache();
+
+    tnfsCacheBlock *find(uint32_t file_id, uint32_t block_num);
+    tnfsCacheBlock *store(uint32_t file_id, uint32_t block_num, const uint8_t *data, uint16_t datalen);
+    void write(uint32_t file_id, uint32_t position, const uint8_t *data, uint16_t datalen);
+    void invalidate(uint32_t file_id);
+    void invalidate(tnfsCacheBlock *pBlock);
+    void clear();
+
+    // Scratch space for loading several blocks at a time
+    uint8_t *staging();
+    uint16_t staging_size() { return _staging_blocks * TNFS_CACHE_BLOCK_SIZE; };
+    bool staging_in_use = false; // Set while a load that may let another task have the mount is using it
+};
+
+#endif // _TNFSLIB_BLOCKCACHE_H
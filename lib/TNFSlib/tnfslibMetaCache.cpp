@@ -0,0 +1,342 @@
+#include <cstring>
+#include <esp_heap_caps.h>
+
+#include "tnfslibMetaCache.h"
+#include "../hardware/fnSystem.h"
+#include "../../include/debug.h"
+
+tnfsMetaCache::~tnfsMetaCache()
+{
+    clear();
+    if (_stats != nullptr)
+        heap_caps_free(_stats);
+}
+
+// Returns the length of the path ignoring any trailing '/' (other than the root)
+static size_t _path_len(const char *path)
+{
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    return len;
+}
+
+// Compares two paths, ignoring trailing slashes
+static bool _path_equal(const char *a, const char *b, size_t b_len)
+{
+    size_t a_len = _path_len(a);
+    return a_len == b_len && strncmp(a, b, a_len) == 0;
+}
+
+// True if path is the same as or underneath parent
+static bool _path_within(const char *path, const char *parent, size_t parent_len)
+{
+    if (strncmp(path, parent, parent_len) != 0)
+        return false;
+    return path[parent_len] == '\0' || path[parent_len] == '/' || (parent_len == 1 && parent[0] == '/');
+}
+
+/*
+ Allocates our stat entries the first time we need them.
+ We try for TNFS_STAT_CACHE_ENTRIES in PSRAM, falling back to a few in regular memory.
+*/
+bool tnfsMetaCache::_allocate()
+{
+    if (_stats != nullptr)
+        return true;
+
+    int count = TNFS_STAT_CACHE_ENTRIES;
+    _stats = (tnfsStatCacheEntry *)heap_caps_calloc(count, sizeof(tnfsStatCacheEntry), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (_stats == nullptr)
+    {
+        count = TNFS_STAT_CACHE_MIN_ENTRIES;
+        _stats = (tnfsStatCacheEntry *)heap_caps_calloc(count, sizeof(tnfsStatCacheEntry), MALLOC_CAP_8BIT);
+        if (_stats == nullptr)
+        {
+            Debug_println("tnfsMetaCache failed to allocate memory");
+            return false;
+        }
+    }
+    _stat_count = count;
+    return true;
+}
+
+tnfsStatCacheEntry *tnfsMetaCache::_find_stat(const char *path)
+{
+    size_t len = _path_len(path);
+    for (int i = 0; i < _stat_count; i++)
+        if (_stats[i].path[0] != '\0' && _path_equal(_stats[i].path, path, len))
+            return &_stats[i];
+    return nullptr;
+}
+
+/*
+ Looks for what we know about the given full path, either from an earlier
+ stat or from a complete listing of its directory.
+ Returns false if we don't know anything (or what we knew has expired).
+*/
+bool tnfsMetaCache::lookup_stat(const char *path, tnfsCachedStat *stat)
+{
+    unsigned long now = fnSystem.millis();
+
+    tnfsStatCacheEntry *pEntry = _stats != nullptr ? _find_stat(path) : nullptr;
+    if (pEntry != nullptr)
+    {
+        if ((long)(now - pEntry->expires_ms) < 0)
+        {
+            pEntry->last_used = ++_use_counter;
+            *stat = pEntry->stat;
+            return true;
+        }
+        pEntry->path[0] = '\0';
+    }
+
+    // See if the file shows up in a listing of its directory
+    const char *name = strrchr(path, '/');
+    if (name == nullptr || name[1] == '\0')
+        return false;
+    size_t parent_len = name == path ? 1 : name - path;
+    name++;
+
+    for (int i = 0; i < TNFS_DIR_LISTINGS; i++)
+    {
+        tnfsDirListing *pListing = &_listings[i];
+        if (pListing->complete == false || pListing->pattern[0] != '\0' || (long)(now - pListing->expires_ms) >= 0)
+            continue;
+        if (!_path_equal(pListing->path, path, parent_len))
+            continue;
+
+        uint32_t offset = 0;
+        const uint8_t *pData;
+        while ((pData = listing_entry(pListing, offset, &offset)) != nullptr)
+        {
+            if (strcmp((const char *)pData + TNFS_DIR_LISTING_ENTRY_HEADER, name) == 0)
+            {
+                stat->exists = true;
+                stat->isDir = pData[0] & 0x01; // TNFS_READDIRX_DIR
+                stat->filesize = (uint32_t)pData[4] << 24 | (uint32_t)pData[3] << 16 | (uint32_t)pData[2] << 8 | pData[1];
+                stat->m_time = (uint32_t)pData[8] << 24 | (uint32_t)pData[7] << 16 | (uint32_t)pData[6] << 8 | pData[5];
+                stat->c_time = (uint32_t)pData[12] << 24 | (uint32_t)pData[11] << 16 | (uint32_t)pData[10] << 8 | pData[9];
+                stat->a_time = 0;
+                pListing->last_used = ++_use_counter;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ Sets aside an entry for the result of a stat we're about to make, replacing the
+ least recently used entry if needed. The entry isn't used until fill_stat is called.
+ Returns null if we can't cache this path.
+*/
+tnfsStatCacheEntry *tnfsMetaCache::reserve_stat(const char *path)
+{
+    if (_allocate() == false || strlen(path) >= TNFS_META_MAX_PATH)
+        return nullptr;
+
+    tnfsStatCacheEntry *pEntry = _find_stat(path);
+    if (pEntry == nullptr)
+    {
+        pEntry = &_stats[0];
+        for (int i = 0; i < _stat_count; i++)
+        {
+            if (_stats[i].path[0] == '\0')
+            {
+                pEntry = &_stats[i];
+                break;
+            }
+            if (_stats[i].last_used < pEntry->last_used)
+                pEntry = &_stats[i];
+        }
+        strlcpy(pEntry->path, path, sizeof(pEntry->path));
+    }
+
+    pEntry->expires_ms = fnSystem.millis();
+    pEntry->last_used = ++_use_counter;
+    return pEntry;
+}
+
+// Stores the result of a stat in an entry from reserve_stat
+void tnfsMetaCache::fill_stat(tnfsStatCacheEntry *pEntry, const tnfsCachedStat *stat)
+{
+    if (pEntry->path[0] == '\0')
+        return;
+    pEntry->stat = *stat;
+    pEntry->expires_ms = fnSystem.millis() + (stat->exists ? TNFS_STAT_CACHE_TTL : TNFS_NEGATIVE_CACHE_TTL);
+}
+
+/*
+ Returns a complete, current listing of the given directory made with the same options, if we have one
+*/
+tnfsDirListing *tnfsMetaCache::find_listing(const char *path, uint8_t sortopts, uint8_t diropts, const char *pattern)
+{
+    if (pattern == nullptr)
+        pattern = "";
+
+    unsigned long now = fnSystem.millis();
+    size_t len = _path_len(path);
+    for (int i = 0; i < TNFS_DIR_LISTINGS; i++)
+    {
+        tnfsDirListing *pListing = &_listings[i];
+        if (pListing->complete == false)
+            continue;
+        if ((long)(now - pListing->expires_ms) >= 0)
+        {
+            _drop_listing(pListing);
+            continue;
+        }
+        if (pListing->sortopts == sortopts && pListing->diropts == diropts &&
+            strcmp(pListing->pattern, pattern) == 0 && _path_equal(pListing->path, path, len))
+        {
+            pListing->last_used = ++_use_counter;
+            return pListing;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ Sets aside an empty listing to be filled as entries are read from the server,
+ throwing out the least recently used listing if needed.
+ Returns null if we won't cache this listing.
+*/
+tnfsDirListing *tnfsMetaCache::start_listing(const char *path, uint8_t sortopts, uint8_t diropts, const char *pattern)
+{
+    if (pattern == nullptr)
+        pattern = "";
+    if (strlen(pattern) >= TNFS_DIR_PATTERN_LEN || strlen(path) >= TNFS_META_MAX_PATH)
+        return nullptr;
+
+    tnfsDirListing *pListing = &_listings[0];
+    for (int i = 0; i < TNFS_DIR_LISTINGS; i++)
+    {
+        if (_listings[i].path[0] == '\0')
+        {
+            pListing = &_listings[i];
+            break;
+        }
+        if (_listings[i].last_used < pListing->last_used)
+            pListing = &_listings[i];
+    }
+    _drop_listing(pListing);
+
+    strlcpy(pListing->path, path, sizeof(pListing->path));
+    strlcpy(pListing->pattern, pattern, sizeof(pListing->pattern));
+    pListing->sortopts = sortopts;
+    pListing->diropts = diropts;
+    pListing->last_used = ++_use_counter;
+    return pListing;
+}
+
+/*
+ Adds an entry to a listing we're recording.
+ Returns false (and gives up on the listing) if it's grown too big or we're out of memory.
+*/
+bool tnfsMetaCache::add_listing_entry(tnfsDirListing *pListing, uint8_t flags, uint32_t filesize, uint32_t m_time, uint32_t c_time, const char *name)
+{
+    uint32_t entry_len = TNFS_DIR_LISTING_ENTRY_HEADER + strlen(name) + 1;
+    if (pListing->data_used + entry_len > pListing->data_size)
+    {
+        uint32_t new_size = pListing->data_size == 0 ? 1024 : pListing->data_size * 2;
+        while (new_size < pListing->data_used + entry_len)
+            new_size *= 2;
+        if (new_size > TNFS_DIR_LISTING_MAX_BYTES)
+        {
+            Debug_printf("tnfsMetaCache listing of \"%s\" too big to keep\n", pListing->path);
+            abandon_listing(pListing);
+            return false;
+        }
+        // Listings only go in PSRAM; regular memory is too precious
+        uint8_t *new_data = (uint8_t *)heap_caps_realloc(pListing->data, new_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (new_data == nullptr)
+        {
+            abandon_listing(pListing);
+            return false;
+        }
+        pListing->data = new_data;
+        pListing->data_size = new_size;
+    }
+
+    uint8_t *p = pListing->data + pListing->data_used;
+    p[0] = flags;
+    for (int i = 0; i < 4; i++)
+    {
+        p[1 + i] = (filesize >> (8 * i)) & 0xFF;
+        p[5 + i] = (m_time >> (8 * i)) & 0xFF;
+        p[9 + i] = (c_time >> (8 * i)) & 0xFF;
+    }
+    strcpy((char *)p + TNFS_DIR_LISTING_ENTRY_HEADER, name);
+
+    pListing->data_used += entry_len;
+    pListing->count++;
+    return true;
+}
+
+// Marks a listing as complete so it can be used in place of the server
+void tnfsMetaCache::finish_listing(tnfsDirListing *pListing)
+{
+    pListing->complete = true;
+    pListing->expires_ms = fnSystem.millis() + TNFS_DIR_LISTING_TTL;
+}
+
+void tnfsMetaCache::abandon_listing(tnfsDirListing *pListing)
+{
+    _drop_listing(pListing);
+}
+
+void tnfsMetaCache::_drop_listing(tnfsDirListing *pListing)
+{
+    if (pListing->data != nullptr)
+        heap_caps_free(pListing->data);
+    *pListing = tnfsDirListing();
+}
+
+/*
+ Returns the packed entry at the given offset in a listing and sets next_offset
+ to the one after it, or returns null if there are no more
+*/
+const uint8_t *tnfsMetaCache::listing_entry(tnfsDirListing *pListing, uint32_t offset, uint32_t *next_offset)
+{
+    if (pListing->data == nullptr || offset >= pListing->data_used)
+        return nullptr;
+
+    const uint8_t *p = pListing->data + offset;
+    *next_offset = offset + TNFS_DIR_LISTING_ENTRY_HEADER + strlen((const char *)p + TNFS_DIR_LISTING_ENTRY_HEADER) + 1;
+    return p;
+}
+
+/*
+ Forgets anything we know about the given full path, anything underneath it,
+ and listings of the directory it's in
+*/
+void tnfsMetaCache::invalidate_path(const char *path)
+{
+    size_t len = _path_len(path);
+
+    for (int i = 0; i < _stat_count; i++)
+        if (_stats[i].path[0] != '\0' && _path_within(_stats[i].path, path, len))
+            _stats[i].path[0] = '\0';
+
+    const char *slash = strrchr(path, '/');
+    size_t parent_len = (slash == nullptr || slash == path) ? 1 : slash - path;
+
+    for (int i = 0; i < TNFS_DIR_LISTINGS; i++)
+    {
+        tnfsDirListing *pListing = &_listings[i];
+        if (pListing->path[0] == '\0')
+            continue;
+        if (_path_within(pListing->path, path, len) || _path_equal(pListing->path, path, parent_len))
+            _drop_listing(pListing);
+    }
+}
+
+// Forgets everything
+void tnfsMetaCache::clear()
+{
+    for (int i = 0; i < _stat_count; i++)
+        _stats[i].path[0] = '\0';
+    for (int i = 0; i < TNFS_DIR_LISTINGS; i++)
+        _drop_listing(&_listings[i]);
+}
@@ -0,0 +1,96 @@
+#ifndef _TNFSLIB_METACACHE_H
+#define _TNFSLIB_METACACHE_H
+
+#include <cstdint>
+
+#define TNFS_META_MAX_PATH 256 // Same as TNFS_MAX_FILELEN
+
+#define TNFS_STAT_CACHE_ENTRIES 32 // Number of stat results we keep per mount (allocated from PSRAM)
+#define TNFS_STAT_CACHE_MIN_ENTRIES 8 // Number we'll settle for if PSRAM isn't available
+#define TNFS_STAT_CACHE_TTL 5000 // How long (ms) we trust a stat result
+#define TNFS_NEGATIVE_CACHE_TTL 2000 // How long (ms) we trust that a file doesn't exist
+
+#define TNFS_DIR_LISTINGS 4 // Number of complete directory listings we keep per mount
+#define TNFS_DIR_LISTING_MAX_BYTES 32768 // Largest listing we'll keep; bigger ones are always read from the server
+#define TNFS_DIR_LISTING_TTL 10000 // How long (ms) we trust a directory listing
+#define TNFS_DIR_PATTERN_LEN 32 // Longest wildcard pattern we'll cache listings for
+
+// What we know about a path from a stat or a directory listing
+struct tnfsCachedStat
+{
+    bool exists = false;
+    bool isDir = false;
+    uint32_t filesize = 0;
+    uint32_t a_time = 0;
+    uint32_t m_time = 0;
+    uint32_t c_time = 0;
+};
+
+struct tnfsStatCacheEntry
+{
+    char path[TNFS_META_MAX_PATH];
+    tnfsCachedStat stat;
+    unsigned long expires_ms;
+    uint32_t last_used;
+};
+
+/*
+ A directory listing recorded as it was read from the server.
+ Entries are packed one after the other: flags (1), size (4), mtime (4), ctime (4)
+ and a zero-terminated name, in the same order the server returned them.
+*/
+struct tnfsDirListing
+{
+    char path[TNFS_META_MAX_PATH] = { '\0' };
+    char pattern[TNFS_DIR_PATTERN_LEN] = { '\0' };
+    uint8_t sortopts = 0;
+    uint8_t diropts = 0;
+    bool complete = false; // We've seen the whole directory
+    unsigned long expires_ms = 0;
+    uint32_t last_used = 0;
+
+    uint8_t *data = nullptr;
+    uint32_t data_used = 0;
+    uint32_t data_size = 0;
+    uint16_t count = 0;
+};
+
+// The fixed part of each packed tnfsDirListing entry
+#define TNFS_DIR_LISTING_ENTRY_HEADER 13
+
+/*
+ Cache of file and directory metadata for a mount: stat results (including
+ "doesn't exist" answers) and complete directory listings, each good for a
+ limited time and thrown out when this client changes the path.
+*/
+class tnfsMetaCache
+{
+private:
+    tnfsStatCacheEntry *_stats = nullptr;
+    int _stat_count = 0;
+    tnfsDirListing _listings[TNFS_DIR_LISTINGS];
+    uint32_t _use_counter = 0;
+
+    bool _allocate();
+    tnfsStatCacheEntry *_find_stat(const char *path);
+    void _drop_listing(tnfsDirListing *pListing);
+
+public:
+    ~tnfsMetaCache();
+
+    bool lookup_stat(const char *path, tnfsCachedStat *stat);
+    tnfsStatCacheEntry *reserve_stat(const char *path);
+    void fill_stat(tnfsStatCacheEntry *pEntry, const tnfsCachedStat *stat);
+
+    tnfsDirListing *find_listing(const char *path, uint8_t sortopts, uint8_t diropts, const char *pattern);
+    tnfsDirListing *start_listing(const char *path, uint8_t sortopts, uint8_t diropts, const char *pattern);
+    bool add_listing_entry(tnfsDirListing *pListing, uint8_t flags, uint32_t filesize, uint32_t m_time, uint32_t c_time, const char *name);
+    void finish_listing(tnfsDirListing *pListing);
+    void abandon_listing(tnfsDirListing *pListing);
+    const uint8_t *listing_entry(tnfsDirListing *pListing, uint32_t offset, uint32_t *next_offset);
+
+    void invalidate_path(const char *path);
+    void clear();
+};
+
+#endif // _TNFSLIB_METACACHE_H
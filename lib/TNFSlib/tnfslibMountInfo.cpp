@@ -1,6 +1,11 @@
+#include <cstdlib>
 #include <cstring>
+#include <new>
+#include <lwip/sockets.h>
+#include <esp_heap_caps.h>
 
 #include "tnfslibMountInfo.h"
+#include "../tcpip/fnTcpClient.h"
 
 tnfsMountInfo::tnfsMountInfo(const char *host_name, uint16_t host_port)
 {
@@ -17,14 +22,49 @@ tnfsMountInfo::tnfsMountInfo(in_addr_t host_address, uint16_t host_port)
 // Make sure to clean up any memory we allocated
 tnfsMountInfo::~tnfsMountInfo()
 {
-    // Find a matching tnfsFileHandleInfo
-    for (int i = 0; i < TNFS_MAX_FILE_HANDLES; i++)
-    {
-        if (_file_handles[i] != nullptr)
-            delete _file_handles[i];
-    }
+    // Get rid of our file handle table and everything in it
+    for (int i = 0; i < _file_handle_slots; i++)
+        _free_filehandleinfo(i);
+    if (_file_handles != nullptr)
+        free(_file_handles);
+    // And any buffers we were holding on to
+    for (int i = 0; i < _free_buffer_count; i++)
+        heap_caps_free(_free_buffers[i]);
     // Delete any remaining directory cache entries
     empty_dircache();
+    // Drop our TCP connection if we have one
+    if (tcp != nullptr)
+        delete tcp;
+    if (_mutex != nullptr)
+        vSemaphoreDelete(_mutex);
+}
+
+void tnfsMountInfo::lock()
+{
+    portENTER_CRITICAL(&_lock_mux);
+    _lock_waiters++;
+    portEXIT_CRITICAL(&_lock_mux);
+
+    xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+
+    portENTER_CRITICAL(&_lock_mux);
+    _lock_waiters--;
+    portEXIT_CRITICAL(&_lock_mux);
+    _lock_depth++;
+}
+
+void tnfsMountInfo::unlock()
+{
+    _lock_depth--;
+    xSemaphoreGiveRecursive(_mutex);
+}
+
+bool tnfsMountInfo::try_lock()
+{
+    if (xSemaphoreTakeRecursive(_mutex, 0) != pdTRUE)
+        return false;
+    _lock_depth++;
+    return true;
 }
 
 // Empty the current contents of the directory cache
@@ -83,61 +123,86 @@ int tnfsMountInfo::tell_dircache_entry()
 }
 
 /*
- Returns a pointer to the tnfsFileHandleInfo with a matching file handle,
- or null if no match exists in the table.
+ Returns a pointer to the tnfsFileHandleInfo for the handle we gave the client,
+ or null if there isn't one. Also marks it as the most recently used.
 */
 tnfsFileHandleInfo *tnfsMountInfo::get_filehandleinfo(uint8_t filehandle)
 {
-    // Find a matching tnfsFileHandleInfo
-    for (int i = 0; i < TNFS_MAX_FILE_HANDLES; i++)
-    {
-        if (_file_handles[i] != nullptr)
-        {
-            if (_file_handles[i]->handle_id == filehandle)
-                return _file_handles[i];
-        }
-    }
-    return nullptr;
+    if (filehandle >= _file_handle_slots || _file_handles[filehandle] == nullptr)
+        return nullptr;
+
+    _file_handles[filehandle]->last_used = ++_handle_use_counter;
+    return _file_handles[filehandle];
 }
 
 /*
- Returns a pointer to a new tnfsFileHandleInfo pointer or null if table is full
+ Adds TNFS_FILE_HANDLE_SLOTS_GROWTH slots to the file handle table
+ Returns false if the table is already as big as we allow or we're out of memory
+*/
+bool tnfsMountInfo::_grow_filehandle_table()
+{
+    int slots = _file_handle_slots + TNFS_FILE_HANDLE_SLOTS_GROWTH;
+    if (slots > TNFS_MAX_FILE_HANDLES)
+        slots = TNFS_MAX_FILE_HANDLES;
+    if (slots <= _file_handle_slots)
+        return false;
+
+    tnfsFileHandleInfo **p = (tnfsFileHandleInfo **)realloc(_file_handles, slots * sizeof(tnfsFileHandleInfo *));
+    if (p == nullptr)
+        return false;
+    for (int i = _file_handle_slots; i < slots; i++)
+        p[i] = nullptr;
+    _file_handles = p;
+    _file_handle_slots = slots;
+    return true;
+}
+
+/*
+ Returns a pointer to a new tnfsFileHandleInfo or null if we can't have any more files open.
+ The handle infos themselves live in PSRAM if we have it.
 */
 tnfsFileHandleInfo *tnfsMountInfo::new_filehandleinfo()
 {
-    // Find a free slot and create a new tnfsFileHandleInfo
-    for (int i = 0; i < TNFS_MAX_FILE_HANDLES; i++)
-    {
+    // Find a free slot, growing the table if they're all in use
+    int i;
+    for (i = 0; i < _file_handle_slots; i++)
         if (_file_handles[i] == nullptr)
-        {
-            tnfsFileHandleInfo *p = new tnfsFileHandleInfo;
-            if (p != nullptr)
-            {
-                _file_handles[i] = p;
-                return p;
-            }
-        }
-    }
-    return nullptr;
+            break;
+    if (i == _file_handle_slots && _grow_filehandle_table() == false)
+        return nullptr;
+
+    void *mem = heap_caps_malloc(sizeof(tnfsFileHandleInfo), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (mem == nullptr)
+        mem = heap_caps_malloc(sizeof(tnfsFileHandleInfo), MALLOC_CAP_8BIT);
+    if (mem == nullptr)
+        return nullptr;
+
+    tnfsFileHandleInfo *p = new (mem) tnfsFileHandleInfo;
+    p->handle = i;
+    p->last_used = ++_handle_use_counter;
+    _file_handles[i] = p;
+    return p;
+}
+
+void tnfsMountInfo::_free_filehandleinfo(int index)
+{
+    tnfsFileHandleInfo *p = _file_handles[index];
+    if (p == nullptr)
+        return;
+    if (p->write_buffer != nullptr)
+        release_buffer(p->write_buffer);
+    p->~tnfsFileHandleInfo();
+    heap_caps_free(p);
+    _file_handles[index] = nullptr;
 }
 
 /*
- Removes any existing tnfsFileHandleInfo with a matching file handle
+ Removes any existing tnfsFileHandleInfo with a matching client file handle
 */
 void tnfsMountInfo::delete_filehandleinfo(uint8_t filehandle)
 {
-    // Find a matching tnfsFileHandleInfo
-    for (int i = 0; i < TNFS_MAX_FILE_HANDLES; i++)
-    {
-        if (_file_handles[i] != nullptr)
-        {
-            if (_file_handles[i]->handle_id == filehandle)
-            {
-                delete _file_handles[i];
-                _file_handles[i] = nullptr;
-            }
-        }
-    }
+    if (filehandle < _file_handle_slots)
+        _free_filehandleinfo(filehandle);
 }
 
 /*
@@ -145,13 +210,97 @@ void tnfsMountInfo::delete_filehandleinfo(uint8_t filehandle)
 */
 void tnfsMountInfo::delete_filehandleinfo(tnfsFileHandleInfo *pFilehandle)
 {
-    // Find a matching tnfsFileHandleInfo
-    for (int i = 0; i < TNFS_MAX_FILE_HANDLES; i++)
+    if (pFilehandle != nullptr && pFilehandle->handle < _file_handle_slots && _file_handles[pFilehandle->handle] == pFilehandle)
+        _free_filehandleinfo(pFilehandle->handle);
+}
+
+/*
+ Returns the number of files we currently have open on the server
+ (not counting any extra handles used for windowed reads)
+*/
+int tnfsMountInfo::count_server_handles()
+{
+    int count = 0;
+    for (int i = 0; i < _file_handle_slots; i++)
+        if (_file_handles[i] != nullptr && _file_handles[i]->handle_id != TNFS_INVALID_HANDLE)
+            count++;
+    return count;
+}
+
+/*
+ Returns the file that's been open on the server the longest without being used,
+ ignoring pExcept and any that another task is busy with, or null if there isn't one
+*/
+tnfsFileHandleInfo *tnfsMountInfo::least_recently_used(tnfsFileHandleInfo *pExcept)
+{
+    tnfsFileHandleInfo *pOldest = nullptr;
+    for (int i = 0; i < _file_handle_slots; i++)
+    {
+        tnfsFileHandleInfo *p = _file_handles[i];
+        if (p == nullptr || p == pExcept || p->handle_id == TNFS_INVALID_HANDLE || p->busy)
+            continue;
+        if (pOldest == nullptr || p->last_used < pOldest->last_used)
+            pOldest = p;
+    }
+    return pOldest;
+}
+
+/*
+ Returns a TNFS_WRITE_BUFFER_SIZE buffer, re-using one given back earlier if we can.
+ New buffers come from PSRAM if we have it.
+ Returns null if we're out of memory.
+*/
+uint8_t *tnfsMountInfo::get_buffer()
+{
+    if (_free_buffer_count > 0)
+        return _free_buffers[--_free_buffer_count];
+
+    uint8_t *p = (uint8_t *)heap_caps_malloc(TNFS_WRITE_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (p == nullptr)
+        p = (uint8_t *)heap_caps_malloc(TNFS_WRITE_BUFFER_SIZE, MALLOC_CAP_8BIT);
+    return p;
+}
+
+/*
+ Gives back a buffer from get_buffer, keeping a few around for next time
+*/
+void tnfsMountInfo::release_buffer(uint8_t *buffer)
+{
+    if (_free_buffer_count < TNFS_BUFFER_POOL_SIZE)
+        _free_buffers[_free_buffer_count++] = buffer;
+    else
+        heap_caps_free(buffer);
+}
+
+/*
+ Returns the block cache file ID for the given path.
+ Every handle open on the same path shares an ID, so they share cached blocks.
+*/
+uint32_t tnfsMountInfo::get_file_id(const char *filepath)
+{
+    for (int i = 0; i < _file_handle_slots; i++)
     {
-        if (_file_handles[i] == pFilehandle)
+        if (_file_handles[i] != nullptr && _file_handles[i]->file_id != TNFS_CACHE_INVALID_FILE)
         {
-            delete _file_handles[i];
-            _file_handles[i] = nullptr;
+            if (strcmp(_file_handles[i]->filename, filepath) == 0)
+                return _file_handles[i]->file_id;
         }
     }
+
+    if (_next_file_id == TNFS_CACHE_INVALID_FILE)
+        _next_file_id++;
+    return _next_file_id++;
+}
+
+/*
+ Returns true if any handle other than pExcept is using the given file ID
+*/
+bool tnfsMountInfo::file_id_in_use(uint32_t file_id, tnfsFileHandleInfo *pExcept)
+{
+    for (int i = 0; i < _file_handle_slots; i++)
+    {
+        if (_file_handles[i] != nullptr && _file_handles[i] != pExcept && _file_handles[i]->file_id == file_id)
+            return true;
+    }
+    return false;
 }
@@ -3,40 +3,160 @@
 
 #include <cstdint>
 #include <lwip/netdb.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 
+#include "tnfslibBlockCache.h"
+#include "tnfslibMetaCache.h"
+
+class fnTcpClient;
 
 #define TNFS_DEFAULT_PORT 16384
 #define TNFS_RETRIES 5 // Number of times to retry if we fail to send/receive a packet
-#define TNFS_TIMEOUT 2000 // This is how long we wait for a reply packet from the server before trying again
+#define TNFS_TIMEOUT 2000 // Least amount of time we'll keep re-sending a request before giving up (and TCP read timeout)
 #define TNFS_RETRY_DELAY 1000 // Default delay before retrying. Server will provide a minimum during TNFS_CMD_MOUNT
+#define TNFS_INITIAL_RTO 1000 // Re-send timeout used until we've measured the round-trip time to the server
+#define TNFS_MIN_RTO 50 // Shortest re-send timeout we'll use, however fast the server seems to be
+#define TNFS_MAX_RTO 4000 // Longest re-send timeout we'll use, including backoff
+#define TNFS_RTO_GRANULARITY 10 // Least amount of slack we'll add to the smoothed round-trip time
 #define TNFS_MAX_BACKOFF_DELAY 3000 // Longest we'll wait if server sends us a EAGAIN error
-#define TNFS_MAX_FILE_HANDLES 8 // Max number of file handles we'll open to the server
+#define TNFS_KEEPALIVE_INTERVAL 30000 // How long we'll go without hearing from the server before tnfs_keepalive checks our session
+#define TNFS_MAX_FILE_HANDLES 64 // Max number of files we'll have open at once (the table grows as needed)
+#define TNFS_FILE_HANDLE_SLOTS_GROWTH 8 // Number of slots we add to the file handle table each time it fills up
+#define TNFS_MAX_SERVER_HANDLES 8 // Max number of those files we'll keep open on the server; the rest are parked
+#define TNFS_BUFFER_POOL_SIZE 4 // Number of freed write buffers we hold on to for re-use
+#define TNFS_TCP_CONNECT_TIMEOUT 750 // How long we'll wait for a TCP connection before giving up (must be less than 1000)
+#define TNFS_TCP_RETRY_INTERVAL 600000 // How long TNFS_TRANSPORT_AUTO sticks with UDP for a server that's failed over TCP
+#define TNFS_NO_TCP_SERVERS 8 // Servers we remember failing over TCP
+#define TNFS_TCP_IDLE_TIMEOUT 20 // Reply data arriving over TCP with gaps longer than this is assumed to be complete
+#define TNFS_TCP_READ_SIZE 4096 // Size of each READ request over TCP; the server may send less
+#define TNFS_LOCK_HANDOVER_US 200 // How long we'll wait for another task to pick up a mount we've let go of
 #define TNFS_MAX_FILELEN 256
 
-#define TNFS_FILE_CACHE_SIZE 512 // 4 * 128 fits in a single packet when TNFS_MAX_READWRITE_PAYLOAD is 512
+#define TNFS_READ_WINDOW 4 // Default number of READ requests we'll keep in flight for large reads
+#define TNFS_MAX_READ_WINDOW 8 // Upper limit for tnfsMountInfo.read_window
+
+#define TNFS_JUMBO_READ_PAYLOAD 1400 // Largest READ we'll ask for over UDP (reply fits in one unfragmented datagram)
+#define TNFS_JUMBO_PROBE_RETRIES 2 // Timeouts on a jumbo READ before we decide large replies aren't getting through
+
+#define TNFS_WRITE_BUFFER_SIZE 529 // Same as TNFS_MAX_READWRITE_PAYLOAD so a full buffer goes out in a single WRITE
 
 #define TNFS_INVALID_HANDLE -1
 #define TNFS_INVALID_SESSION 0 // We're assuming a '0' is never a valid session ID
 
 #define TNFS_MAX_DIRCACHE_ENTRIES 32 // Max number of directory cache entries we'll store
 
-// Some things we need to keep track of for every file we open
+#define TNFS_MAX_MIRRORS 4 // Max number of servers (including the first) we'll switch between for a mount
+
+// How we talk to the server
+enum tnfsTransport
+{
+    TNFS_TRANSPORT_AUTO = 0, // TCP if the server accepts a connection, otherwise UDP
+    TNFS_TRANSPORT_UDP,
+    TNFS_TRANSPORT_TCP
+};
+
+/*
+ Some things we need to keep track of for every file we open.
+ The handle we give the client stays the same for as long as the file is open,
+ while the server's handle may be closed ("parked") when we need it for another
+ file and re-opened the next time we need to talk to the server about this one.
+*/
 struct tnfsFileHandleInfo
 {
-    uint8_t handle_id = 0;
+    uint8_t handle = 0; // Handle we gave the client (its slot in tnfsMountInfo's table)
+    int16_t handle_id = TNFS_INVALID_HANDLE; // Server's handle, or TNFS_INVALID_HANDLE while parked
+    uint32_t last_used = 0; // Used to pick which file to park
 
     uint32_t file_position = 0; // Current actual file position
     uint32_t file_size = 0;
-    uint32_t cached_pos = 0; // File position the client thinks we're at (usually somewhere in the cached region)
-    uint32_t cache_start = 0; // The file position at which the cache starts
-    uint32_t cache_available = 0; // Number of valid bytes in the cache
+    uint32_t cached_pos = 0; // File position the client thinks we're at
+
+    uint32_t file_id = TNFS_CACHE_INVALID_FILE; // Identifies this file's blocks in the mount's block cache
+    uint32_t next_block = 0; // Block following the last one we loaded, used to spot sequential reads
+    uint8_t readahead = 1; // Number of blocks we'll load on the next cache miss
+
+    uint16_t open_mode = 0; // TNFS_OPENMODE_* flags the file was opened with
+
+    // Write-behind buffer: data the client has written that we haven't sent yet
+    uint8_t *write_buffer = nullptr; // TNFS_WRITE_BUFFER_SIZE bytes from the mount's pool, taken on the first write
+    uint32_t write_start = 0; // File position of the first byte in write_buffer
+    uint16_t write_pending = 0; // Number of bytes in write_buffer
+    int write_error = 0; // Result of a failed flush, held until reported by tnfs_fsync or tnfs_close
+
+    // Additional read-only server handles on the same file, used to keep several
+    // READ requests in flight at once (see _tnfs_read_window)
+    int16_t lane_handles[TNFS_MAX_READ_WINDOW - 1];
+    uint32_t lane_positions[TNFS_MAX_READ_WINDOW - 1]; // Server-side file position of each lane
+    uint8_t lane_count = 0;
+    bool lane_open_failed = false; // Server refused to give us another handle - don't keep asking
 
-    bool cache_modified = false; // Notes if we've written to the cache
+    // Set while the task using this handle has let go of the mount part-way through
+    // a read or write (see _tnfs_yield). Nobody else touches it until it's back.
+    bool busy = false;
 
-    uint8_t cache[TNFS_FILE_CACHE_SIZE];
     char filename[TNFS_MAX_FILELEN];
 };
 
+// Counters kept by each mount for measuring how the protocol is behaving
+struct tnfsProtocolStats
+{
+    uint32_t requests = 0; // Requests sent to the server, including re-sends
+    uint32_t retransmits = 0; // Requests re-sent because we didn't hear back in time
+    uint32_t try_again = 0; // Times the server asked us to back off
+    uint32_t stale_replies = 0; // Replies we threw out because we'd already given up on (or had) them
+    uint32_t failures = 0; // Requests we gave up on entirely
+    uint32_t bytes_read = 0; // File data received
+    uint32_t bytes_written = 0; // File data sent
+    uint32_t failovers = 0; // Times we've switched to another mirror because the server stopped answering
+    uint32_t reconnects = 0; // Times we've had to mount the same server again after losing our session
+    uint32_t handovers = 0; // Times we've let another task have the mount part-way through a read or write
+};
+
+// A server with the same files as the others listed for a mount
+struct tnfsMirror
+{
+    char hostname[64] = { '\0' };
+    in_addr_t host_ip = IPADDR_NONE;
+    uint16_t port = TNFS_DEFAULT_PORT;
+};
+
+#ifdef TNFS_IMPAIRMENT
+// Defaults for the network trouble simulated when built with TNFS_IMPAIRMENT
+#ifndef TNFS_IMPAIR_LOSS_PERCENT
+#define TNFS_IMPAIR_LOSS_PERCENT 5 // Chance of dropping each UDP packet we send or receive
+#endif
+#ifndef TNFS_IMPAIR_DUPLICATE_PERCENT
+#define TNFS_IMPAIR_DUPLICATE_PERCENT 2 // Chance of sending a request twice
+#endif
+#ifndef TNFS_IMPAIR_REORDER_PERCENT
+#define TNFS_IMPAIR_REORDER_PERCENT 2 // Chance of holding a request back until after the next one
+#endif
+#ifndef TNFS_IMPAIR_DELAY_MS
+#define TNFS_IMPAIR_DELAY_MS 0 // Added to every request we send
+#endif
+#ifndef TNFS_IMPAIR_JITTER_MS
+#define TNFS_IMPAIR_JITTER_MS 0 // Random extra delay, up to this much, for every request we send
+#endif
+#define TNFS_HELD_PACKET_SIZE 536 // TNFS_HEADER_SIZE + TNFS_PAYLOAD_SIZE
+
+/*
+ Network trouble to simulate on UDP so we can see how the client copes with a
+ poor connection without needing one. Only built with TNFS_IMPAIRMENT defined.
+*/
+struct tnfsImpairment
+{
+    uint8_t loss_percent = TNFS_IMPAIR_LOSS_PERCENT;
+    uint8_t duplicate_percent = TNFS_IMPAIR_DUPLICATE_PERCENT;
+    uint8_t reorder_percent = TNFS_IMPAIR_REORDER_PERCENT;
+    uint16_t delay_ms = TNFS_IMPAIR_DELAY_MS;
+    uint16_t jitter_ms = TNFS_IMPAIR_JITTER_MS;
+
+    uint8_t held[TNFS_HELD_PACKET_SIZE]; // Request being held back to be sent out of order
+    uint16_t held_len = 0;
+};
+#endif
+
 // A place to store each directory entry we cache from a response to TNFS_READDIRX
 struct tnfsDirCacheEntry
 {
@@ -52,11 +172,26 @@ struct tnfsDirCacheEntry
 class tnfsMountInfo
 {
 private:
-    tnfsFileHandleInfo * _file_handles[TNFS_MAX_FILE_HANDLES] = { nullptr }; // Stored from server's responses to TNFS_OPEN
+    tnfsFileHandleInfo ** _file_handles = nullptr; // Indexed by the handles we give the client
+    uint16_t _file_handle_slots = 0;
+    uint32_t _handle_use_counter = 0;
+    uint8_t * _free_buffers[TNFS_BUFFER_POOL_SIZE] = { nullptr };
+    int _free_buffer_count = 0;
     tnfsDirCacheEntry * _dir_cache[TNFS_MAX_DIRCACHE_ENTRIES] = { nullptr };
     uint16_t _dir_cache_current = 0;
     uint16_t _dir_cache_count = 0;
     bool _dir_cache_eof = false;
+    uint32_t _next_file_id = TNFS_CACHE_INVALID_FILE + 1;
+
+    // Held by every tnfs_* call, so the mount can be shared by more than one task.
+    // It's recursive because those calls make use of each other.
+    SemaphoreHandle_t _mutex = xSemaphoreCreateRecursiveMutex();
+    int _lock_depth = 0; // How many times the task holding _mutex has taken it
+    volatile int _lock_waiters = 0; // Tasks waiting for _mutex
+    portMUX_TYPE _lock_mux = portMUX_INITIALIZER_UNLOCKED;
+
+    bool _grow_filehandle_table();
+    void _free_filehandleinfo(int index);
 
 public:
     ~tnfsMountInfo();
@@ -65,11 +200,28 @@ public:
     tnfsMountInfo(const char *host_name, uint16_t host_port = TNFS_DEFAULT_PORT);
     tnfsMountInfo(in_addr_t host_address, uint16_t host_port = TNFS_DEFAULT_PORT);
 
+    void lock();
+    void unlock();
+    bool try_lock();
+    int lock_depth() { return _lock_depth; };
+    int lock_waiters() { return _lock_waiters; };
+
     tnfsFileHandleInfo * new_filehandleinfo();
     tnfsFileHandleInfo * get_filehandleinfo(uint8_t filehandle);
+    tnfsFileHandleInfo * get_filehandleinfo_at(int index) { return _file_handles[index]; };
+    uint16_t filehandle_slots() { return _file_handle_slots; };
     void delete_filehandleinfo(uint8_t filehandle);
     void delete_filehandleinfo(tnfsFileHandleInfo * pFilehandle);
 
+    int count_server_handles();
+    tnfsFileHandleInfo * least_recently_used(tnfsFileHandleInfo *pExcept = nullptr);
+
+    uint8_t * get_buffer();
+    void release_buffer(uint8_t *buffer);
+
+    uint32_t get_file_id(const char *filepath);
+    bool file_id_in_use(uint32_t file_id, tnfsFileHandleInfo *pExcept = nullptr);
+
     tnfsDirCacheEntry * new_dircache_entry();
     tnfsDirCacheEntry * next_dircache_entry();
 
@@ -92,10 +244,64 @@ public:
     uint16_t server_version = 0;  // Stored from server's response to TNFS_MOUNT
     uint8_t max_retries = TNFS_RETRIES;
     int timeout_ms = TNFS_TIMEOUT;
+
+    // Round-trip time estimates used to decide when to re-send a UDP request
+    bool rtt_measured = false;
+    uint16_t srtt_ms = 0; // Smoothed round-trip time
+    uint16_t rttvar_ms = 0; // Round-trip time variation
+    uint16_t rto_ms = TNFS_INITIAL_RTO; // Current re-send timeout
+    uint8_t read_window = TNFS_READ_WINDOW; // Max READ requests in flight for large reads; 1 disables windowing
+    uint16_t max_read_payload = TNFS_JUMBO_READ_PAYLOAD; // Largest READ we'll try over UDP; TNFS_MAX_READWRITE_PAYLOAD disables jumbo reads
+    uint16_t read_payload = 529; // Largest READ we're currently asking this server for (starts at TNFS_MAX_READWRITE_PAYLOAD)
+    bool read_payload_learned = false; // Set once we know whether the server sends more than TNFS_MAX_READWRITE_PAYLOAD
     uint8_t current_sequence_num = 0; // Updated with each transaction to the server
 
+    tnfsTransport transport = TNFS_TRANSPORT_AUTO; // Transport requested
+    bool using_tcp = false; // Transport chosen during TNFS_MOUNT
+    fnTcpClient *tcp = nullptr; // Our connection to the server when using_tcp is set
+
     int16_t dir_handle = TNFS_INVALID_HANDLE; // Stored from server's response to TNFS_OPENDIR
+
+    tnfsMetaCache meta_cache; // Stat results and directory listings for this mount
+    tnfsDirListing *dir_listing = nullptr; // Cached listing we're reading from instead of the server
+    uint32_t dir_listing_offset = 0; // Where the next entry is in dir_listing
+    uint16_t dir_listing_index = 0; // Position of the next entry in dir_listing
+    tnfsDirListing *dir_recording = nullptr; // Listing we're filling as we read from the server
+
+    // Servers we can use for this mount, added by tnfs_add_mirror. The one we're using
+    // is copied to hostname, host_ip and port.
+    tnfsMirror mirrors[TNFS_MAX_MIRRORS];
+    uint8_t mirror_count = 0;
+    uint8_t current_mirror = 0;
+    bool switching_mirrors = false; // Set while we're picking a mirror, so we don't fail over from within
+
+    unsigned long last_contact_ms = 0; // When we last heard from (or checked on) the server
+    uint32_t server_generation = 0; // Changes every time the server's handles stop meaning anything to us
+    bool reconnecting = false; // Set while we're getting a new session, so we don't try to reconnect from within
+
+    tnfsBlockCache block_cache; // File data cached for all files open on this mount
+    tnfsProtocolStats protocol_stats;
+#ifdef TNFS_IMPAIRMENT
+    tnfsImpairment impairment;
+#endif
     uint16_t dir_entries = 0; // Stored from server's response to TNFS_OPENDIRX
 };
 
+/*
+ Holds a mount's lock for as long as it's in scope.
+ Tasks waiting on the same mount get it in priority order (and first-come,
+ first-served within a priority), so the SIO task's disk reads go ahead of
+ lower-priority background work. Reads and writes that take more than one
+ packet exchange let waiting tasks in between exchanges (see _tnfs_yield).
+*/
+class tnfsMountLock
+{
+private:
+    tnfsMountInfo *_m_info;
+
+public:
+    tnfsMountLock(tnfsMountInfo *m_info) : _m_info(m_info) { if (_m_info != nullptr) _m_info->lock(); };
+    ~tnfsMountLock() { if (_m_info != nullptr) _m_info->unlock(); };
+};
+
 #endif // _TNFSLIB_MOUNTINFO_H
@@ -123,6 +123,14 @@ std::string fnConfig::get_host_name(uint8_t num)
         return "";
 }
 
+std::string fnConfig::get_host_mirrors(uint8_t num)
+{
+    if (num < MAX_HOST_SLOTS)
+        return _host_slots[num].mirrors;
+    else
+        return "";
+}
+
 fnConfig::host_type_t fnConfig::get_host_type(uint8_t num)
 {
     if (num < MAX_HOST_SLOTS)
@@ -139,6 +147,9 @@ void fnConfig::store_host(uint8_t num, const char *hostname, host_type_t type)
             return;
         _dirty = true;
         _host_slots[num].type = type;
+        // Mirrors of the old host aren't mirrors of a new one
+        if (_host_slots[num].name.compare(hostname) != 0)
+            _host_slots[num].mirrors.clear();
         _host_slots[num].name = hostname;
     }
 }
@@ -152,6 +163,7 @@ void fnConfig::clear_host(uint8_t num)
         _dirty = true;
         _host_slots[num].type = HOSTTYPE_INVALID;
         _host_slots[num].name.clear();
+        _host_slots[num].mirrors.clear();
     }
 }
 
@@ -385,6 +397,8 @@ void fnConfig::save()
             ss << LINETERM << "[Host" << (i + 1) << "]" LINETERM;
             ss << "type=" << _host_type_names[_host_slots[i].type] << LINETERM;
             ss << "name=" << _host_slots[i].name << LINETERM;
+            if (_host_slots[i].mirrors.length() > 0)
+                ss << "mirrors=" << _host_slots[i].mirrors << LINETERM;
         }
     }
 
@@ -694,6 +708,7 @@ void fnConfig::_read_section_host(std::stringstream &ss, int index)
     // Throw out any existing data for this index
     _host_slots[index].type = HOSTTYPE_INVALID;
     _host_slots[index].name.clear();
+    _host_slots[index].mirrors.clear();
 
     std::string line;
     // Read lines until one starts with '[' which indicates a new section
@@ -711,6 +726,10 @@ void fnConfig::_read_section_host(std::stringstream &ss, int index)
             {
                 _host_slots[index].type = host_type_from_string(value.c_str());
             }
+            else if (strcasecmp(name.c_str(), "mirrors") == 0)
+            {
+                _host_slots[index].mirrors = value;
+            }
         }
     }
 }
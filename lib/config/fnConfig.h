@@ -75,6 +75,7 @@ public:
 
     // HOSTS
     std::string get_host_name(uint8_t num);
+    std::string get_host_mirrors(uint8_t num);
     host_type_t get_host_type(uint8_t num);
     void store_host(uint8_t num, const char *hostname, host_type_t type);
     void clear_host(uint8_t num);
@@ -153,6 +154,7 @@ private:
     {
         host_type_t type = HOSTTYPE_INVALID;
         std::string name;
+        std::string mirrors; // Other servers with the same files, separated by commas
     };
 
     struct mount_info
@@ -14,6 +14,11 @@ Note that two other changes had to be made in these functions:
 
 These are commented with "OMF".
 
+To let fnHttpClient keep connections open between requests, a request
+on a kept-alive connection now goes through esp_http_client_connect()
+(which prepares the request) in esp_http_client_perform, and
+esp_http_client_is_reusable and esp_http_client_reuse were added.
+
 Arduino-ESP32 is missing a couple of functions used here. Once the
 project is migrated to ESP-IDF the functions can be restored to
 their original behavior.
@@ -895,14 +900,14 @@ esp_err_t esp_http_client_perform(esp_http_client_handle_t client)
            then the esp_http_client_perform() API will return ESP_ERR_HTTP_EAGAIN error. The user may call
            esp_http_client_perform API again, and for this reason, we maintain the states */
             case HTTP_STATE_INIT:
+            case HTTP_STATE_CONNECTED:
+                // A kept-alive connection skips connecting, but still needs the request prepared
                 if ((err = esp_http_client_connect(client)) != ESP_OK) {
                     if (client->is_async && err == ESP_ERR_HTTP_CONNECTING) {
                         return ESP_ERR_HTTP_EAGAIN;
                     }
                     return err;
                 }
-                /* falls through */
-            case HTTP_STATE_CONNECTED:
                 if ((err = esp_http_client_request_send(client, client->post_len)) != ESP_OK) {
                     if (client->is_async && errno == EAGAIN) {
                         return ESP_ERR_HTTP_EAGAIN;
@@ -1219,6 +1224,47 @@ esp_err_t esp_http_client_close(esp_http_client_handle_t client)
     return ESP_OK;
 }
 
+bool esp_http_client_is_reusable(esp_http_client_handle_t client)
+{
+    if (client == NULL || client->state != HTTP_STATE_CONNECTED || client->transport == NULL) {
+        return false;
+    }
+    // Anything waiting on an idle connection means the server closed it (or sent something we didn't ask for)
+    return esp_transport_poll_read(client->transport, 0) == 0;
+}
+
+esp_err_t esp_http_client_reuse(esp_http_client_handle_t client, const esp_http_client_config_t *config)
+{
+    if (client == NULL || config == NULL || config->url == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    client->event_handler = config->event_handler;
+    client->user_data = config->user_data;
+    client->timeout_ms = config->timeout_ms;
+    client->connection_info.method = config->method;
+    client->connection_info.auth_type = config->auth_type;
+    client->max_redirection_count = config->max_redirection_count == 0 ? DEFAULT_MAX_REDIRECT : config->max_redirection_count;
+    client->redirect_counter = 0;
+    client->post_data = NULL;
+    client->post_len = 0;
+
+    // Forget everything the last user asked for
+    _clear_auth_data(client);
+    esp_http_client_set_username(client, NULL);
+    esp_http_client_set_password(client, NULL);
+    http_header_clean(client->request->headers);
+
+    if (esp_http_client_set_url(client, config->url) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (esp_http_client_set_header(client, "User-Agent", DEFAULT_HTTP_USER_AGENT) != ESP_OK ||
+        esp_http_client_set_header(client, "Host", client->connection_info.host) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
 esp_err_t esp_http_client_set_post_field(esp_http_client_handle_t client, const char *data, int len)
 {
     esp_err_t err = ESP_OK;
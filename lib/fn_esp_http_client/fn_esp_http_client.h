@@ -445,6 +445,33 @@ esp_err_t esp_http_client_close(esp_http_client_handle_t client);
  */
 esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client);
 
+/**
+ * @brief      Check whether a handle's connection can be used for another request:
+ *             its last exchange is complete, the server asked to keep it alive,
+ *             and nothing has arrived on it since
+ *
+ * @param[in]  client  The esp_http_client handle
+ *
+ * @return     true if the connection can be re-used
+ */
+bool esp_http_client_is_reusable(esp_http_client_handle_t client);
+
+/**
+ * @brief      Set up a handle with an open connection for a new request to the same
+ *             scheme, host and port, as if esp_http_client_init had just been called
+ *             with config, but without closing the connection.
+ *             Request headers and credentials from earlier requests are discarded.
+ *
+ * @param[in]  client  The esp_http_client handle
+ * @param[in]  config  The configurations; only url, method, event_handler, user_data,
+ *                     timeout_ms, auth_type and max_redirection_count are used
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_FAIL
+ */
+esp_err_t esp_http_client_reuse(esp_http_client_handle_t client, const esp_http_client_config_t *config);
+
 /**
  * @brief      Get transport type
  *
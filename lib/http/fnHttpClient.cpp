@@ -7,6 +7,7 @@
 #include "../../include/debug.h"
 #include "fnSystem.h"
 #include "fnHttpClient.h"
+#include "fnHttpClientPool.h"
 #include "utils.h"
 using namespace fujinet;
 
@@ -25,6 +26,7 @@ fnHttpClient::~fnHttpClient()
 {
     close();
 
+    // close() hands back connections that can be re-used; whatever's left goes
     if (_handle != nullptr)
         esp_http_client_cleanup(_handle);
 
@@ -36,6 +38,9 @@ bool fnHttpClient::begin(std::string url)
 {
     Debug_printf("fnHttpClient::begin \"%s\"\n", url.c_str());
 
+    // Don't leak the handle from a previous begin()
+    _release_handle();
+
     esp_http_client_config_t cfg;
     memset(&cfg, 0, sizeof(cfg));
     cfg.url = url.c_str();
@@ -48,12 +53,43 @@ bool fnHttpClient::begin(std::string url)
     // Keep track of the auth type set
     _auth_type = cfg.auth_type;
 
-    _handle = esp_http_client_init(&cfg);
+    // Pick up an open connection to the same server if we have one
+    _pool_key = fnHttpClientPool::key_for(cfg.url);
+    _handle = fnHttpPool.checkout(_pool_key);
+    if (_handle != nullptr && esp_http_client_reuse(_handle, &cfg) != ESP_OK)
+    {
+        esp_http_client_cleanup(_handle);
+        _handle = nullptr;
+    }
+
+    if (_handle == nullptr)
+        _handle = esp_http_client_init(&cfg);
     if (_handle == nullptr)
         return false;
     return true;
 }
 
+/*
+ Gives our handle back to the pool if we're not in the middle of a transaction.
+ The pool keeps it if the server's agreed to keep the connection alive.
+*/
+void fnHttpClient::_release_handle()
+{
+    if (_handle == nullptr)
+        return;
+
+    if (_taskh_subtask != nullptr)
+    {
+        // Response wasn't read to the end, so the connection's no good to anyone else
+        _delete_subtask_if_running();
+        esp_http_client_cleanup(_handle);
+    }
+    else
+        fnHttpPool.checkin(_pool_key, _handle);
+
+    _handle = nullptr;
+}
+
 int fnHttpClient::available()
 {
     if (_handle == nullptr)
@@ -188,14 +224,11 @@ void fnHttpClient::_flush_response()
     //Debug_println("fnHttpClient::flush_response done");
 }
 
-// Close connection, but keep request resources
+// Close connection (or give it to the pool to re-use if it was kept alive)
 void fnHttpClient::close()
 {
     //Debug_println("::close");
-    _delete_subtask_if_running();
-
-    if (_handle != nullptr)
-        esp_http_client_close(_handle);
+    _release_handle();
 
     _stored_headers.clear();
 }
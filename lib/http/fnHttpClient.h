@@ -32,11 +32,13 @@ private:
     header_map_t _stored_headers;
 
     esp_http_client_handle_t _handle = nullptr;
+    std::string _pool_key; // Which pooled connections _handle can go back with
 
     static void _perform_subtask(void *param);
     static esp_err_t _httpevent_handler(esp_http_client_event_t *evt);
 
     void _delete_subtask_if_running();
+    void _release_handle();
 
     void _flush_response();
 
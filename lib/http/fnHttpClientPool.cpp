@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cstring>
+
+#include "fnHttpClientPool.h"
+#include "fnSystem.h"
+#include "../../include/debug.h"
+
+fnHttpClientPool fnHttpPool;
+
+std::string fnHttpClientPool::key_for(const char *url)
+{
+    std::string s(url == nullptr ? "" : url);
+
+    std::string scheme = "http";
+    size_t start = s.find("://");
+    if (start != std::string::npos)
+    {
+        scheme = s.substr(0, start);
+        start += 3;
+    }
+    else
+        start = 0;
+
+    std::string authority = s.substr(start, s.find_first_of("/?#", start) - start);
+    size_t at = authority.find_last_of('@');
+    if (at != std::string::npos)
+        authority.erase(0, at + 1);
+
+    std::transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
+    std::transform(authority.begin(), authority.end(), authority.begin(), ::tolower);
+
+    // Make the port explicit so "host" and "host:80" share connections
+    if (authority.find(':') == std::string::npos)
+        authority += scheme == "https" ? ":443" : ":80";
+
+    return scheme + "://" + authority;
+}
+
+/*
+ Closing a handle sends HTTP_EVENT_DISCONNECTED to the fnHttpClient that last used it,
+ which may be long gone; fnHttpClient's handler doesn't touch its object for that event.
+*/
+void fnHttpClientPool::_discard(esp_http_client_handle_t handle)
+{
+    esp_http_client_cleanup(handle);
+    portENTER_CRITICAL(&_mux);
+    discards++;
+    portEXIT_CRITICAL(&_mux);
+}
+
+esp_http_client_handle_t fnHttpClientPool::checkout(const std::string &key)
+{
+    expire();
+
+    while (true)
+    {
+        esp_http_client_handle_t handle = nullptr;
+
+        portENTER_CRITICAL(&_mux);
+        for (int i = 0; i < _count; i++)
+        {
+            if (strcmp(_entries[i].key, key.c_str()) == 0)
+            {
+                handle = _entries[i].handle;
+                _entries[i] = _entries[--_count];
+                _entries[_count].handle = nullptr;
+                break;
+            }
+        }
+        if (handle == nullptr)
+            misses++;
+        portEXIT_CRITICAL(&_mux);
+
+        if (handle == nullptr)
+            return nullptr;
+
+        // The server may have closed it while it sat here
+        if (esp_http_client_is_reusable(handle))
+        {
+            portENTER_CRITICAL(&_mux);
+            hits++;
+            portEXIT_CRITICAL(&_mux);
+            Debug_printf("fnHttpClientPool re-using connection to %s (hits %u, misses %u)\n", key.c_str(), hits, misses);
+            return handle;
+        }
+        _discard(handle);
+    }
+}
+
+void fnHttpClientPool::checkin(const std::string &key, esp_http_client_handle_t handle)
+{
+    if (handle == nullptr)
+        return;
+
+    if (key.length() >= HTTP_POOL_KEY_LEN || esp_http_client_is_reusable(handle) == false)
+    {
+        esp_http_client_cleanup(handle);
+        return;
+    }
+
+    esp_http_client_handle_t evicted = nullptr;
+
+    portENTER_CRITICAL(&_mux);
+    if (_count == HTTP_POOL_SIZE)
+    {
+        int oldest = 0;
+        for (int i = 1; i < _count; i++)
+            if (_entries[i].idle_since < _entries[oldest].idle_since)
+                oldest = i;
+        evicted = _entries[oldest].handle;
+        _entries[oldest] = _entries[--_count];
+    }
+    strcpy(_entries[_count].key, key.c_str());
+    _entries[_count].handle = handle;
+    _entries[_count].idle_since = fnSystem.millis();
+    _count++;
+    portEXIT_CRITICAL(&_mux);
+
+    if (evicted != nullptr)
+        _discard(evicted);
+}
+
+void fnHttpClientPool::expire()
+{
+    unsigned long now = fnSystem.millis();
+
+    while (true)
+    {
+        esp_http_client_handle_t expired = nullptr;
+
+        portENTER_CRITICAL(&_mux);
+        for (int i = 0; i < _count; i++)
+        {
+            if (now - _entries[i].idle_since > HTTP_POOL_IDLE_TIMEOUT_MS)
+            {
+                expired = _entries[i].handle;
+                _entries[i] = _entries[--_count];
+                _entries[_count].handle = nullptr;
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&_mux);
+
+        if (expired == nullptr)
+            return;
+        _discard(expired);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef _FN_HTTPCLIENTPOOL_H_
+#define _FN_HTTPCLIENTPOOL_H_
+
+#include <string>
+#include <freertos/FreeRTOS.h>
+#include "../fn_esp_http_client/fn_esp_http_client.h"
+
+using namespace fujinet;
+
+#define HTTP_POOL_SIZE 4 // Most idle connections we'll keep open
+#define HTTP_POOL_IDLE_TIMEOUT_MS 4000 // Just under the 5s most servers give an idle keep-alive connection
+#define HTTP_POOL_KEY_LEN 128 // Connections to hosts with longer names aren't pooled
+
+// Kept as plain arrays so nothing's allocated while the pool's locked
+struct httpPoolEntry
+{
+    char key[HTTP_POOL_KEY_LEN];
+    esp_http_client_handle_t handle = nullptr;
+    unsigned long idle_since = 0;
+};
+
+/*
+ Holds on to esp_http_client handles whose connections the server agreed
+ to keep alive, so the next request to the same scheme, host and port can
+ skip the TCP handshake (and for https, the TLS handshake).
+ Idle connections are closed after HTTP_POOL_IDLE_TIMEOUT_MS, and when the
+ pool is full the one that's been idle longest makes way for the newcomer.
+*/
+class fnHttpClientPool
+{
+private:
+    portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+    httpPoolEntry _entries[HTTP_POOL_SIZE];
+    int _count = 0;
+
+    void _discard(esp_http_client_handle_t handle);
+
+public:
+    uint32_t hits = 0; // Requests that got a pooled connection
+    uint32_t misses = 0; // Requests that had to make a new one
+    uint32_t discards = 0; // Pooled connections closed because they'd expired, been dropped by the server or were evicted
+
+    // Returns "scheme://host:port" for url, which is what connections are pooled by
+    static std::string key_for(const char *url);
+
+    // Returns an idle handle with an open connection for key, or nullptr if there isn't one
+    esp_http_client_handle_t checkout(const std::string &key);
+    // Takes handle back; it's kept if its connection can be re-used and cleaned up otherwise
+    void checkin(const std::string &key, esp_http_client_handle_t handle);
+    // Closes connections that have been idle too long
+    void expire();
+};
+
+extern fnHttpClientPool fnHttpPool;
+
+#endif // _FN_HTTPCLIENTPOOL_H_
@@ -95,6 +95,14 @@ const string fnHttpServiceParser::substitute_tag(const string &tag)
         FN_HOST6PREFIX,
         FN_HOST7PREFIX,
         FN_HOST8PREFIX,
+        FN_HOST1CACHE,
+        FN_HOST2CACHE,
+        FN_HOST3CACHE,
+        FN_HOST4CACHE,
+        FN_HOST5CACHE,
+        FN_HOST6CACHE,
+        FN_HOST7CACHE,
+        FN_HOST8CACHE,
         FN_LASTTAG
     };
 
@@ -170,7 +178,15 @@ const string fnHttpServiceParser::substitute_tag(const string &tag)
         "FN_HOST5PREFIX",
         "FN_HOST6PREFIX",
         "FN_HOST7PREFIX",
-        "FN_HOST8PREFIX"
+        "FN_HOST8PREFIX",
+        "FN_HOST1CACHE",
+        "FN_HOST2CACHE",
+        "FN_HOST3CACHE",
+        "FN_HOST4CACHE",
+        "FN_HOST5CACHE",
+        "FN_HOST6CACHE",
+        "FN_HOST7CACHE",
+        "FN_HOST8CACHE"
     };
 
     stringstream resultstream;
@@ -375,6 +391,18 @@ const string fnHttpServiceParser::substitute_tag(const string &tag)
             resultstream << "";
         }
         break;
+    case FN_HOST1CACHE:
+    case FN_HOST2CACHE:
+    case FN_HOST3CACHE:
+    case FN_HOST4CACHE:
+    case FN_HOST5CACHE:
+    case FN_HOST6CACHE:
+    case FN_HOST7CACHE:
+    case FN_HOST8CACHE:
+        /* How well is the block cache doing for each TNFS host? */
+        host_slot = tagid - FN_HOST1CACHE;
+        resultstream << theFuji.get_host_cache_stats(host_slot);
+        break;
     default:
         resultstream << tag;
         break;
@@ -6,7 +6,7 @@
  */
 
 #include <string.h>
-#include <sstream>
+#include <esp_heap_caps.h>
 #include "json.h"
 #include "../../include/debug.h"
 
@@ -17,7 +17,6 @@ JSON::JSON()
 {
     Debug_printf("JSON::ctor()\n");
     _protocol = nullptr;
-    _json = nullptr;
 }
 
 /**
@@ -27,7 +26,6 @@ JSON::~JSON()
 {
     Debug_printf("JSON::dtor()\n");
     _protocol = nullptr;
-    _json = nullptr;
 }
 
 /**
@@ -45,69 +43,68 @@ void JSON::setProtocol(networkProtocol *newProtocol)
 void JSON::setReadQuery(string queryString)
 {
     _queryString = queryString;
+    _current = -1;
 }
 
 /**
- * Resolve query string
+ * Set how values are written out (JSON_OUTPUT_TEXT or JSON_OUTPUT_BINARY)
  */
-cJSON *JSON::resolveQuery()
+void JSON::setOutputFormat(uint8_t format)
 {
-    // This needs a full blown query parser!, for now, I just find object on same depth.
-    if (_queryString.empty())
-        return _json;
-
-    return cJSON_GetObjectItem(_json, _queryString.c_str());
+    _format = format == JSON_OUTPUT_BINARY ? JSON_OUTPUT_BINARY : JSON_OUTPUT_TEXT;
+    _current = -1;
 }
 
 /**
- * Return normalized string of JSON item
+ * Forget every query result, as they belong to the last document parsed
  */
-string JSON::getValue(cJSON *item)
+void JSON::invalidateCache()
 {
-    if (cJSON_IsString(item))
-        return string(cJSON_GetStringValue(item)) + "\x9b";
-    else if (cJSON_IsBool(item))
-    {
-        if (cJSON_IsTrue(item))
-            return "TRUE\x9b";
-        else if (cJSON_IsFalse(item))
-            return "FALSE\x9b";
-    }
-    else if (cJSON_IsNull(item))
-        return "NULL\x9b";
-    else if (cJSON_IsNumber(item))
+    for (int i = 0; i < JSON_QUERY_CACHE_SIZE; i++)
     {
-        stringstream ss;
-        ss << item->valuedouble;
-        return ss.str() + "\x9b";
+        _cache[i].valid = false;
+        _cache[i].query.clear();
+        _cache[i].value.clear();
     }
-    else if (cJSON_IsObject(item))
-    {
-        string ret="";
+    _current = -1;
+}
 
-        item=item->child;
+/**
+ * Return the result for the current query and format, working it out if we haven't already
+ */
+jsonQueryResult &JSON::runQuery()
+{
+    if (_current >= 0)
+        return _cache[_current];
 
-        do
-        {
-            ret += string(item->string) + "\x9b" + getValue(item);
-        } while ((item=item->next) != NULL);
-        
-        return ret;
-    }
-    else if (cJSON_IsArray(item))
+    int oldest = 0;
+    for (int i = 0; i < JSON_QUERY_CACHE_SIZE; i++)
     {
-        cJSON *child=item->child;
-        string ret;
-
-        do
+        if (_cache[i].valid && _cache[i].format == _format && _cache[i].query == _queryString)
         {
-            ret += getValue(child);
-        } while ((child=child->next) != NULL);
-        
-        return ret;
+            _current = i;
+            _cache[i].last_used = ++_clock;
+            _cache_hits++;
+            return _cache[i];
+        }
+        if (!_cache[i].valid || (_cache[oldest].valid && _cache[i].last_used < _cache[oldest].last_used))
+            oldest = i;
     }
 
-    return "UNKNOWN\x9b";
+    jsonQueryResult &result = _cache[oldest];
+    result.query = _queryString;
+    result.format = _format;
+    result.value.clear();
+    _query.compile(_queryString);
+    result.matches = _query.run(_parser.events(), _parser.events_len(), result.value, _format);
+    result.last_used = ++_clock;
+    result.valid = true;
+    _current = oldest;
+    _cache_misses++;
+
+    Debug_printf("JSON::runQuery() - %d matches, %u bytes (cache hits %u, misses %u)\n",
+                 result.matches, result.value.size(), _cache_hits, _cache_misses);
+    return result;
 }
 
 /**
@@ -115,13 +112,12 @@ string JSON::getValue(cJSON *item)
  */
 bool JSON::readValue(uint8_t *rx_buf, unsigned short len)
 {
-    cJSON *item = resolveQuery();
-    string ret = getValue(item);
+    jsonQueryResult &result = runQuery();
 
-    if (item == nullptr)
+    if (result.matches == 0)
         return true; // error
 
-    memcpy(rx_buf, ret.data(), ret.size());
+    memcpy(rx_buf, result.value.data(), result.value.size() > len ? len : result.value.size());
 
     return false; // no error.
 }
@@ -131,22 +127,16 @@ bool JSON::readValue(uint8_t *rx_buf, unsigned short len)
  */
 int JSON::readValueLen()
 {
-    cJSON *item = resolveQuery();
-    int len = getValue(item).size();
-
-    if (item == nullptr)
-        return len;
-
-    return len;
+    return runQuery().value.size();
 }
 
 /**
- * Parse data from protocol
+ * Parse data from protocol, a chunk at a time as it arrives
  */
 bool JSON::parse()
 {
-    char *buf;
-    int available = 0;
+    uint8_t *buf;
+    size_t total = 0;
 
     if (_protocol == nullptr)
     {
@@ -154,34 +144,34 @@ bool JSON::parse()
         return false;
     }
 
-    //while (available==0)
-    available = _protocol->available();
-
-    Debug_printf("JSON::parse() - %d bytes now available\n", available);
+    _parser.reset();
+    invalidateCache();
 
-    buf = (char *)heap_caps_malloc(available, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    buf = (uint8_t *)heap_caps_malloc(JSON_PARSE_CHUNK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
     if (buf == nullptr)
     {
-        Debug_printf("JSON::parse() - could not allocate JSON buffer of %d bytes", available);
+        Debug_printf("JSON::parse() - could not allocate JSON buffer of %d bytes", JSON_PARSE_CHUNK_SIZE);
         return false;
     }
 
-    if (_protocol->read((uint8_t *)buf, available) == true)
-    {
-        Debug_printf("JSON::parse() - Could not read %d bytes from protocol adapter.\n", available);
-        return false;
-    }
+    // A read that fails part way leaves an incomplete document, which finish() reports
+    document_read_protocol(
+        _protocol, JSON_PARSE_CHUNK_SIZE, JSON_PARSE_TIMEOUT_MS,
+        [buf](size_t len) { return buf; },
+        [this, buf](size_t len) {
+            _parser.push((const char *)buf, len);
+            return _parser.failed() == false;
+        },
+        [this]() { return _parser.complete(); }, &total);
 
-    _json = cJSON_Parse(buf);
+    free(buf);
 
-    if (_json == nullptr)
+    if (_parser.finish() == false)
     {
-        Debug_printf("JSON::parse() - Could not parse JSON\n");
+        Debug_printf("JSON::parse() - Could not parse JSON (%u bytes read)\n", total);
         return false;
     }
 
-    Debug_printf("Parsed JSON: %s\n", cJSON_Print(_json));
-
-    free(buf);
+    Debug_printf("JSON::parse() - parsed %u bytes into %u bytes of events\n", total, _parser.events_len());
     return true;
-}
\ No newline at end of file
+}
@@ -9,7 +9,21 @@
 #define JSON_H
 
 #include <networkProtocol.h>
-#include <cJSON.h>
+#include "jsonStream.h"
+
+#define JSON_PARSE_CHUNK_SIZE 1024
+#define JSON_PARSE_TIMEOUT_MS 1000 // How long to wait for the rest of a document that's stopped arriving
+#define JSON_QUERY_CACHE_SIZE 4 // Results we keep for queries a program switches between
+
+struct jsonQueryResult
+{
+    bool valid = false;
+    string query;
+    uint8_t format = JSON_OUTPUT_TEXT;
+    string value;
+    int matches = 0;
+    uint32_t last_used = 0;
+};
 
 class JSON
 {
@@ -19,19 +33,29 @@ public:
 
     void setProtocol(networkProtocol *newProtocol);
     void setReadQuery(string queryString);
-    cJSON *resolveQuery();
-    
+    void setOutputFormat(uint8_t format);
+    uint8_t outputFormat() { return _format; }
+
     bool parse();
     int readValueLen();
     bool readValue(uint8_t *buf, unsigned short len);
 
 private:
-    cJSON *_json;
     networkProtocol *_protocol;
+    JSONStreamParser _parser;
+    JSONQuery _query;
     string _queryString;
+    uint8_t _format = JSON_OUTPUT_TEXT;
+
+    // Results are worked out the first time they're asked for, and kept until the next parse
+    jsonQueryResult _cache[JSON_QUERY_CACHE_SIZE];
+    int _current = -1; // Cache entry for the current query and format, once we've looked it up
+    uint32_t _clock = 0;
+    uint32_t _cache_hits = 0;
+    uint32_t _cache_misses = 0;
 
-    string getValue(cJSON *item);
-    
+    void invalidateCache();
+    jsonQueryResult &runQuery();
 };
 
 #endif /* JSON_H */
\ No newline at end of file
@@ -0,0 +1,541 @@
+/**
+ * Streaming JSON tokenizer and path queries for #FujiNet
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "jsonStream.h"
+#include "../../include/debug.h"
+
+void JSONStreamParser::reset()
+{
+    _state = S_VALUE;
+    _depth = 0;
+    _token.clear();
+    _high_surrogate = 0;
+
+    _events.clear();
+}
+
+/**
+ * Append an event, with its length and data for keys, strings and numbers
+ */
+bool JSONStreamParser::_emit(uint8_t type, const char *data, size_t len)
+{
+    bool added;
+    if (type == JSON_EV_KEY || type == JSON_EV_STRING || type == JSON_EV_NUMBER)
+        added = _events.add(type, data, len);
+    else
+        added = _events.add(type);
+
+    if (!added)
+        _state = S_ERROR;
+    return added;
+}
+
+void JSONStreamParser::_emit_token(uint8_t type)
+{
+    if (type == JSON_EV_NUMBER)
+    {
+        char *end;
+        strtod(_token.c_str(), &end);
+        if (*end != '\0')
+        {
+            _state = S_ERROR;
+            return;
+        }
+    }
+    _emit(type, _token.data(), _token.size());
+}
+
+void JSONStreamParser::_value_done()
+{
+    if (_state != S_ERROR)
+        _state = _depth == 0 ? S_DONE : S_AFTER_VALUE;
+}
+
+void JSONStreamParser::_close(char container)
+{
+    if (_depth == 0 || _stack[_depth - 1] != container)
+    {
+        _state = S_ERROR;
+        return;
+    }
+    _depth--;
+    _emit(container == '{' ? JSON_EV_OBJECT_END : JSON_EV_ARRAY_END);
+    _value_done();
+}
+
+void JSONStreamParser::_append_utf8(uint32_t cp)
+{
+    // Hold on to the first half of a surrogate pair until we see the second
+    if (cp >= 0xD800 && cp <= 0xDBFF)
+    {
+        _high_surrogate = cp;
+        return;
+    }
+    if (cp >= 0xDC00 && cp <= 0xDFFF && _high_surrogate != 0)
+        cp = 0x10000 + ((_high_surrogate - 0xD800) << 10) + (cp - 0xDC00);
+    _high_surrogate = 0;
+
+    if (cp < 0x80)
+        _token += (char)cp;
+    else if (cp < 0x800)
+    {
+        _token += (char)(0xC0 | (cp >> 6));
+        _token += (char)(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        _token += (char)(0xE0 | (cp >> 12));
+        _token += (char)(0x80 | ((cp >> 6) & 0x3F));
+        _token += (char)(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        _token += (char)(0xF0 | (cp >> 18));
+        _token += (char)(0x80 | ((cp >> 12) & 0x3F));
+        _token += (char)(0x80 | ((cp >> 6) & 0x3F));
+        _token += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+void JSONStreamParser::_process(char c)
+{
+    // Tokens that can be split across pushes
+    switch (_state)
+    {
+    case S_STRING:
+        if (c == '"')
+        {
+            if (_token_is_key)
+            {
+                _emit_token(JSON_EV_KEY);
+                if (_state != S_ERROR)
+                    _state = S_COLON;
+            }
+            else
+            {
+                _emit_token(JSON_EV_STRING);
+                _value_done();
+            }
+        }
+        else if (c == '\\')
+            _state = S_STRING_ESCAPE;
+        else
+            _token += c;
+        return;
+
+    case S_STRING_ESCAPE:
+        _state = S_STRING;
+        switch (c)
+        {
+        case 'b':
+            _token += '\b';
+            break;
+        case 'f':
+            _token += '\f';
+            break;
+        case 'n':
+            _token += '\n';
+            break;
+        case 'r':
+            _token += '\r';
+            break;
+        case 't':
+            _token += '\t';
+            break;
+        case '"':
+        case '\\':
+        case '/':
+            _token += c;
+            break;
+        case 'u':
+            _unicode = 0;
+            _unicode_digits = 0;
+            _state = S_STRING_UNICODE;
+            break;
+        default:
+            _state = S_ERROR;
+            break;
+        }
+        return;
+
+    case S_STRING_UNICODE:
+    {
+        int v;
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            v = c - 'A' + 10;
+        else
+        {
+            _state = S_ERROR;
+            return;
+        }
+        _unicode = (_unicode << 4) | v;
+        if (++_unicode_digits == 4)
+        {
+            _append_utf8(_unicode);
+            _state = S_STRING;
+        }
+        return;
+    }
+
+    case S_NUMBER:
+        if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-')
+        {
+            _token += c;
+            return;
+        }
+        _emit_token(JSON_EV_NUMBER);
+        _value_done();
+        break; // c still needs handling
+
+    case S_LITERAL:
+        if (c >= 'a' && c <= 'z')
+        {
+            _token += c;
+            return;
+        }
+        if (_token == "true")
+            _emit(JSON_EV_TRUE);
+        else if (_token == "false")
+            _emit(JSON_EV_FALSE);
+        else if (_token == "null")
+            _emit(JSON_EV_NULL);
+        else
+            _state = S_ERROR;
+        _value_done();
+        break; // c still needs handling
+
+    default:
+        break;
+    }
+
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+        return;
+
+    switch (_state)
+    {
+    case S_VALUE_OR_END:
+        if (c == ']')
+        {
+            _close('[');
+            break;
+        }
+        /* falls through */
+    case S_VALUE:
+        if (c == '{' || c == '[')
+        {
+            if (_depth == JSON_MAX_DEPTH)
+            {
+                Debug_printf("JSONStreamParser: nested more than %d deep\n", JSON_MAX_DEPTH);
+                _state = S_ERROR;
+                break;
+            }
+            _stack[_depth++] = c;
+            _emit(c == '{' ? JSON_EV_OBJECT : JSON_EV_ARRAY);
+            if (_state != S_ERROR)
+                _state = c == '{' ? S_KEY_OR_END : S_VALUE_OR_END;
+        }
+        else if (c == '"')
+        {
+            _token.clear();
+            _token_is_key = false;
+            _state = S_STRING;
+        }
+        else if (c == '-' || (c >= '0' && c <= '9'))
+        {
+            _token.assign(1, c);
+            _state = S_NUMBER;
+        }
+        else if (c == 't' || c == 'f' || c == 'n')
+        {
+            _token.assign(1, c);
+            _state = S_LITERAL;
+        }
+        else
+            _state = S_ERROR;
+        break;
+
+    case S_KEY_OR_END:
+        if (c == '}')
+        {
+            _close('{');
+            break;
+        }
+        /* falls through */
+    case S_KEY:
+        if (c == '"')
+        {
+            _token.clear();
+            _token_is_key = true;
+            _state = S_STRING;
+        }
+        else
+            _state = S_ERROR;
+        break;
+
+    case S_COLON:
+        _state = c == ':' ? S_VALUE : S_ERROR;
+        break;
+
+    case S_AFTER_VALUE:
+        if (c == ',')
+            _state = _stack[_depth - 1] == '{' ? S_KEY : S_VALUE;
+        else if (c == '}' || c == ']')
+            _close(c == '}' ? '{' : '[');
+        else
+            _state = S_ERROR;
+        break;
+
+    case S_DONE:
+        // Like cJSON, ignore anything after the document
+    default:
+        break;
+    }
+}
+
+void JSONStreamParser::push(const char *data, size_t len)
+{
+    for (size_t i = 0; i < len && _state != S_ERROR && _state != S_DONE; i++)
+        _process(data[i]);
+}
+
+bool JSONStreamParser::finish()
+{
+    // A bare number or literal has nothing after it to tell us it's finished
+    if (_state == S_NUMBER || _state == S_LITERAL)
+        _process(' ');
+
+    return _state == S_DONE;
+}
+
+void JSONQuery::compile(const std::string &query)
+{
+    _segments.clear();
+
+    size_t start = 0;
+    while (start <= query.size())
+    {
+        size_t end = query.find('/', start);
+        if (end == std::string::npos)
+            end = query.size();
+
+        std::string name = query.substr(start, end - start);
+        // Drop any EOL or spaces the Atari left on the end
+        while (!name.empty() && (name.back() == '\x9b' || name.back() == '\n' || name.back() == '\r' || name.back() == ' '))
+            name.pop_back();
+
+        if (!name.empty())
+        {
+            JSONQuerySegment segment;
+            segment.key = name;
+            segment.any = name == "*";
+            segment.is_index = name.find_first_not_of("0123456789") == std::string::npos;
+            if (segment.is_index)
+                segment.index = atol(name.c_str());
+            _segments.push_back(segment);
+        }
+        start = end + 1;
+    }
+}
+
+static void _bin_append_u16(std::string *out, size_t value)
+{
+    *out += (char)(value & 0xFF);
+    *out += (char)((value >> 8) & 0xFF);
+}
+
+// Writes a key, string or number in JSON_OUTPUT_BINARY form
+static void _bin_append_token(std::string *out, uint8_t type, const char *data, size_t len)
+{
+    if (type == JSON_EV_NUMBER && memchr(data, '.', len) == nullptr &&
+        memchr(data, 'e', len) == nullptr && memchr(data, 'E', len) == nullptr)
+    {
+        long long value = strtoll(std::string(data, len).c_str(), nullptr, 10);
+        if (value >= INT32_MIN && value <= INT32_MAX)
+        {
+            uint32_t v = (uint32_t)(int32_t)value;
+            *out += (char)JSON_BIN_INT;
+            for (int i = 0; i < 4; i++, v >>= 8)
+                *out += (char)(v & 0xFF);
+            return;
+        }
+    }
+
+    if (len > UINT16_MAX)
+        len = UINT16_MAX;
+    *out += (char)(type == JSON_EV_KEY ? JSON_BIN_KEY : JSON_BIN_STRING);
+    _bin_append_u16(out, len);
+    out->append(data, len);
+}
+
+/*
+ Steps over the value starting at pos, appending it to out (if it's not
+ null) in the form the Atari gets: each key, string or scalar followed by
+ an EOL, in document order, or in JSON_OUTPUT_BINARY form
+*/
+static size_t _walk_value(const uint8_t *events, size_t events_len, size_t pos, std::string *out, uint8_t format = JSON_OUTPUT_TEXT)
+{
+    bool binary = out != nullptr && format == JSON_OUTPUT_BINARY;
+    size_t list_count_at = 0; // Where a flattened list's count goes
+    size_t list_count = 0;
+    int depth = 0;
+    do
+    {
+        uint8_t type = events[pos++];
+        switch (type)
+        {
+        case JSON_EV_OBJECT:
+        case JSON_EV_ARRAY:
+            if (binary && depth == 0)
+            {
+                *out += (char)JSON_BIN_LIST;
+                list_count_at = out->size();
+                _bin_append_u16(out, 0);
+            }
+            depth++;
+            continue;
+        case JSON_EV_OBJECT_END:
+        case JSON_EV_ARRAY_END:
+            depth--;
+            continue;
+        case JSON_EV_KEY:
+        case JSON_EV_STRING:
+        case JSON_EV_NUMBER:
+        {
+            size_t len = DocumentEvents::read_len(events, pos);
+            if (binary)
+                _bin_append_token(out, type, (const char *)events + pos, len);
+            else if (out != nullptr)
+            {
+                if (type == JSON_EV_NUMBER)
+                {
+                    // Formatted the way cJSON's double always was
+                    std::stringstream ss;
+                    ss << strtod(std::string((const char *)events + pos, len).c_str(), nullptr);
+                    *out += ss.str();
+                }
+                else
+                    out->append((const char *)events + pos, len);
+                *out += "\x9b";
+            }
+            pos += len;
+            break;
+        }
+        case JSON_EV_TRUE:
+            if (binary)
+                *out += (char)JSON_BIN_TRUE;
+            else if (out != nullptr)
+                *out += "TRUE\x9b";
+            break;
+        case JSON_EV_FALSE:
+            if (binary)
+                *out += (char)JSON_BIN_FALSE;
+            else if (out != nullptr)
+                *out += "FALSE\x9b";
+            break;
+        case JSON_EV_NULL:
+            if (binary)
+                *out += (char)JSON_BIN_NULL;
+            else if (out != nullptr)
+                *out += "NULL\x9b";
+            break;
+        }
+        list_count++;
+    } while (pos < events_len && depth > 0);
+
+    if (binary && list_count_at > 0)
+    {
+        if (list_count > UINT16_MAX)
+            list_count = UINT16_MAX;
+        (*out)[list_count_at] = (char)(list_count & 0xFF);
+        (*out)[list_count_at + 1] = (char)((list_count >> 8) & 0xFF);
+    }
+
+    return pos;
+}
+
+int JSONQuery::run(const uint8_t *events, size_t events_len, std::string &out, uint8_t format)
+{
+    // Containers we've gone into; all of them lie on a path the query matches so far
+    struct
+    {
+        uint8_t type;
+        const char *key;
+        size_t key_len;
+        long index;
+    } stack[JSON_MAX_DEPTH];
+    size_t depth = 0;
+    int matches = 0;
+    size_t pos = 0;
+
+    if (events == nullptr)
+        return 0;
+
+    while (pos < events_len)
+    {
+        uint8_t type = events[pos];
+
+        if (type == JSON_EV_KEY)
+        {
+            pos++;
+            stack[depth - 1].key_len = DocumentEvents::read_len(events, pos);
+            stack[depth - 1].key = (const char *)events + pos;
+            pos += stack[depth - 1].key_len;
+            continue;
+        }
+
+        if (type == JSON_EV_OBJECT_END || type == JSON_EV_ARRAY_END)
+        {
+            pos++;
+            depth--;
+            if (depth > 0 && stack[depth - 1].type == JSON_EV_ARRAY)
+                stack[depth - 1].index++;
+            continue;
+        }
+
+        // A value starts here; is this where the query's looking?
+        bool here = true;
+        if (depth > 0)
+        {
+            const JSONQuerySegment &segment = _segments[depth - 1];
+            if (segment.any)
+                here = true;
+            else if (stack[depth - 1].type == JSON_EV_OBJECT)
+                here = segment.key.size() == stack[depth - 1].key_len && memcmp(segment.key.data(), stack[depth - 1].key, stack[depth - 1].key_len) == 0;
+            else
+                here = segment.is_index && segment.index == stack[depth - 1].index;
+        }
+
+        if (here && depth == _segments.size())
+        {
+            pos = _walk_value(events, events_len, pos, &out, format);
+            matches++;
+        }
+        else if (here && (type == JSON_EV_OBJECT || type == JSON_EV_ARRAY))
+        {
+            // Go in and keep looking
+            stack[depth].type = type;
+            stack[depth].key = nullptr;
+            stack[depth].key_len = 0;
+            stack[depth].index = 0;
+            depth++;
+            pos++;
+            continue;
+        }
+        else
+            pos = _walk_value(events, events_len, pos, nullptr);
+
+        if (depth > 0 && stack[depth - 1].type == JSON_EV_ARRAY)
+            stack[depth - 1].index++;
+    }
+
+    return matches;
+}
@@ -0,0 +1,140 @@
+/**
+ * Streaming JSON tokenizer and path queries for #FujiNet
+ */
+
+#ifndef JSONSTREAM_H
+#define JSONSTREAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../utils/documentStream.h"
+
+#define JSON_MAX_DEPTH 64
+
+/*
+ Events recorded by JSONStreamParser in a DocumentEvents buffer. Keys,
+ strings and numbers carry data; numbers are kept as the text they
+ arrived as.
+*/
+#define JSON_EV_OBJECT '{'
+#define JSON_EV_OBJECT_END '}'
+#define JSON_EV_ARRAY '['
+#define JSON_EV_ARRAY_END ']'
+#define JSON_EV_KEY 'K'
+#define JSON_EV_STRING 'S'
+#define JSON_EV_NUMBER 'N'
+#define JSON_EV_TRUE 'T'
+#define JSON_EV_FALSE 'F'
+#define JSON_EV_NULL 'Z'
+
+/*
+ How matched values are written out for the Atari.
+ TEXT is one line per key and value, numbers in decimal and literals as
+ TRUE, FALSE or NULL.
+ BINARY is a type byte for each item, followed by:
+   JSON_BIN_INT     4 bytes, signed, low byte first (integers that fit)
+   JSON_BIN_STRING  2 byte length, low byte first, then the bytes (also
+                    used for numbers that aren't integers, as text)
+   JSON_BIN_KEY     the same as a string
+   JSON_BIN_TRUE, JSON_BIN_FALSE, JSON_BIN_NULL  nothing
+ A matched object or array is flattened into JSON_BIN_LIST, a 2 byte count
+ of the items that follow, and then those keys and values in order.
+*/
+#define JSON_OUTPUT_TEXT 0
+#define JSON_OUTPUT_BINARY 1
+
+#define JSON_BIN_INT 'I'
+#define JSON_BIN_STRING 'S'
+#define JSON_BIN_KEY 'K'
+#define JSON_BIN_TRUE 'T'
+#define JSON_BIN_FALSE 'F'
+#define JSON_BIN_NULL 'Z'
+#define JSON_BIN_LIST 'L'
+
+/*
+ Incremental JSON tokenizer. Data can be pushed in pieces of any size as
+ it arrives (a token can be split across pieces), and the document is
+ kept as a compact list of events in PSRAM instead of either the raw text
+ or a tree of nodes.
+*/
+class JSONStreamParser
+{
+private:
+    enum
+    {
+        S_VALUE,
+        S_VALUE_OR_END, // Just after '['
+        S_KEY_OR_END, // Just after '{'
+        S_KEY, // Just after ',' in an object
+        S_COLON,
+        S_AFTER_VALUE,
+        S_STRING,
+        S_STRING_ESCAPE,
+        S_STRING_UNICODE,
+        S_NUMBER,
+        S_LITERAL,
+        S_DONE,
+        S_ERROR
+    } _state = S_VALUE;
+
+    char _stack[JSON_MAX_DEPTH]; // '{' or '[' for each open container
+    int _depth = 0;
+
+    std::string _token;
+    bool _token_is_key = false;
+    uint32_t _unicode = 0;
+    int _unicode_digits = 0;
+    uint32_t _high_surrogate = 0;
+
+    DocumentEvents _events;
+
+    bool _emit(uint8_t type, const char *data = nullptr, size_t len = 0);
+    void _emit_token(uint8_t type);
+    void _value_done();
+    void _close(char container);
+    void _append_utf8(uint32_t cp);
+    void _process(char c);
+
+public:
+    // Starts over with an empty document
+    void reset();
+    void push(const char *data, size_t len);
+    // Call once all the data's been pushed; true if it was a complete, valid document
+    bool finish();
+
+    bool complete() { return _state == S_DONE; }
+    bool failed() { return _state == S_ERROR; }
+
+    const uint8_t *events() { return _events.data(); }
+    size_t events_len() { return _events.len(); }
+};
+
+struct JSONQuerySegment
+{
+    bool any = false; // "*"
+    bool is_index = false; // All digits, so it can match an array index as well as a key
+    long index = 0;
+    std::string key;
+};
+
+/*
+ A path like "/results/0/name", compiled once and then matched against a
+ parsed document. Segments name object keys or array indices, and a
+ segment of just an asterisk matches anything at that level. The leading
+ slash is optional, and an empty query matches the whole document.
+*/
+class JSONQuery
+{
+private:
+    std::vector<JSONQuerySegment> _segments;
+
+public:
+    void compile(const std::string &query);
+    // Appends every matching value, formatted for the Atari, to out; returns how many matched
+    int run(const uint8_t *events, size_t events_len, std::string &out, uint8_t format = JSON_OUTPUT_TEXT);
+};
+
+#endif /* JSONSTREAM_H */
@@ -248,6 +248,13 @@ void sioDisk::unmount()
         _disk->unmount();
 }
 
+// Called while the SIO bus is idle so written sectors get synced
+void sioDisk::idle()
+{
+    if (_disk != nullptr)
+        _disk->idle();
+}
+
 // Create blank disk
 bool sioDisk::write_blank(FILE *f, uint16_t sectorSize, uint16_t numSectors)
 {
@@ -23,6 +23,7 @@ private:
 public:
     disktype_t mount(FILE *f, const char *filename, uint32_t disksize, disktype_t disk_type = DISKTYPE_UNKNOWN);
     void unmount();
+    void idle();
     bool write_blank(FILE *f, uint16_t sectorSize, uint16_t numSectors);
 
     disktype_t disktype() { return _disk == nullptr ? DISKTYPE_UNKNOWN : _disk->_disktype; };
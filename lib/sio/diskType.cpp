@@ -1,8 +1,11 @@
 #include <string.h>
+#include <unistd.h>
 
 #include "../../include/debug.h"
 #include "../utils/utils.h"
 
+#include "fnSystem.h"
+
 #include "diskType.h"
 
 #define DENSITY_FM 0
@@ -25,6 +28,59 @@ bool DiskType::write(uint16_t sectornum, bool verify)
     return true;
 }
 
+/*
+ Syncs everything written so far to the disk image.
+ Returns TRUE if an error condition occurred
+*/
+bool DiskType::_disk_sync()
+{
+    _disk_unsynced = false;
+    if (_disk_fileh == nullptr)
+        return false;
+
+    if (fflush(_disk_fileh) != 0 || fsync(fileno(_disk_fileh)) != 0)
+    {
+        Debug_printf("disk sync failed %d\n", errno);
+        return true;
+    }
+    return false;
+}
+
+/*
+ Called after each sector is written. Rather than syncing every sector, which
+ costs a round trip to a TNFS server each time, we leave the data in the file's
+ write-behind buffer and sync when the bus goes quiet (see idle()) or when
+ writes have been going on for DISK_SYNC_MAX_MS without a break.
+ Returns TRUE if an error condition occurred, including a failed sync from idle()
+*/
+bool DiskType::_disk_written()
+{
+    unsigned long now = fnSystem.millis();
+    if (_disk_unsynced == false)
+    {
+        _disk_unsynced = true;
+        _disk_unsynced_ms = now;
+    }
+    _disk_written_ms = now;
+
+    if (_disk_sync_failed)
+    {
+        _disk_sync_failed = false;
+        return true;
+    }
+    if (now - _disk_unsynced_ms >= DISK_SYNC_MAX_MS)
+        return _disk_sync();
+    return false;
+}
+
+// Syncs written sectors once there's been no writing for DISK_SYNC_IDLE_MS
+void DiskType::idle()
+{
+    if (_disk_unsynced && fnSystem.millis() - _disk_written_ms >= DISK_SYNC_IDLE_MS)
+        if (_disk_sync())
+            _disk_sync_failed = true;
+}
+
 // Default FORMAT is not implemented
 bool DiskType::format(uint16_t *responsesize)
 {
@@ -129,11 +185,14 @@ void DiskType::dump_percom_block()
 
 void DiskType::unmount()
 {
+    // Closing the file writes out anything we hadn't synced
     if (_disk_fileh != nullptr)
     {
         fclose(_disk_fileh);
         _disk_fileh = nullptr;
     }
+    _disk_unsynced = false;
+    _disk_sync_failed = false;
 }
 
 disktype_t DiskType::discover_disktype(const char *filename)
@@ -7,6 +7,11 @@
 
 #define DISK_SECTORBUF_SIZE 256
 
+// Written sectors are synced once the bus has been quiet this long, and at the
+// latest this long after the first write that hasn't been synced
+#define DISK_SYNC_IDLE_MS 500
+#define DISK_SYNC_MAX_MS 5000
+
 #define DISK_BYTES_PER_SECTOR_SINGLE 128
 #define DISK_BYTES_PER_SECTOR_DOUBLE 256
 
@@ -50,6 +55,16 @@ protected:
     int32_t _disk_last_sector = INVALID_SECTOR_VALUE;
     uint8_t _disk_controller_status = DISK_CTRL_STATUS_CLEAR;
 
+    bool _disk_unsynced = false; // Written to since the last sync
+    unsigned long _disk_unsynced_ms = 0; // When the first write since the last sync was made
+    unsigned long _disk_written_ms = 0; // When the last write was made
+    bool _disk_sync_failed = false; // A sync from idle() failed, to be reported by the next write
+
+    // Returns TRUE if an error condition occurred
+    bool _disk_sync();
+    // Returns TRUE if an error condition occurred
+    bool _disk_written();
+
 public:
     struct
     {
@@ -88,6 +103,9 @@ public:
     
     virtual void status(uint8_t statusbuff[4]) = 0;
 
+    // Called while the bus is idle
+    virtual void idle();
+
     static disktype_t discover_disktype(const char *filename);
 
     void dump_percom_block();
@@ -114,13 +114,17 @@ bool DiskTypeATR::write(uint16_t sectornum, bool verify)
         return true;
     }
 
-    int ret = fflush(_disk_fileh);    // This doesn't seem to be connected to anything in ESP-IDF VF, so it may not do anything
-    ret = fsync(fileno(_disk_fileh)); // Since we might get reset at any moment, go ahead and sync the file (not clear if fflush does this)
-    Debug_printf("ATR::write fsync:%d\n", ret);
+    // Hand the sector to the file system now; syncing it waits for the bus to go idle
+    e = fflush(_disk_fileh);
+    if (e != 0)
+    {
+        Debug_printf("::write flush error %d, %d\n", e, errno);
+        return true;
+    }
 
     _disk_last_sector = sectornum;
 
-    return false;
+    return _disk_written();
 }
 
 void DiskTypeATR::status(uint8_t statusbuff[4])
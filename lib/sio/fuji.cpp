@@ -45,6 +45,10 @@
 #define SIO_FUJICMD_STATUS 0x53
 #define SIO_FUJICMD_HSIO_INDEX 0x3F
 
+#define FUJI_KEEPALIVE_WAKE_MS 1000 // How often an idle bus wakes the keepalive task
+#define FUJI_KEEPALIVE_STACKSIZE 4096
+#define FUJI_KEEPALIVE_PRIORITY 1
+
 sioFuji theFuji; // global fuji device object
 
 //sioDisk sioDiskDevs[MAX_HOSTS];
@@ -1131,7 +1135,10 @@ void sioFuji::_populate_slots_from_config()
         if (Config.get_host_type(i) == fnConfig::host_types::HOSTTYPE_INVALID)
             _fnHosts[i].set_hostname("");
         else
+        {
             _fnHosts[i].set_hostname(Config.get_host_name(i).c_str());
+            _fnHosts[i].set_mirrors(Config.get_host_mirrors(i).c_str());
+        }
     }
 
     for (int i = 0; i < MAX_DISK_DEVICES; i++)
@@ -1327,6 +1334,11 @@ void sioFuji::setup(sioBus *siobus)
     cassette()->set_buttons(Config.get_cassette_buttons());
     cassette()->set_pulldown(Config.get_cassette_pulldown());
 
+    if (xTaskCreate(_keepalive_task_fn, "fnKeepAlive", FUJI_KEEPALIVE_STACKSIZE, this, FUJI_KEEPALIVE_PRIORITY, &_keepalive_task) != pdPASS)
+    {
+        Debug_println("sioFuji::setup couldn't start the keepalive task");
+        _keepalive_task = nullptr;
+    }
 }
 
 sioDisk *sioFuji::bootdisk()
@@ -1488,3 +1500,33 @@ std::string sioFuji::get_host_prefix(int host_slot) {
     return _fnHosts[host_slot].get_prefix();
 }
 
+std::string sioFuji::get_host_cache_stats(int host_slot) {
+    return _fnHosts[host_slot].get_cache_stats();
+}
+
+// Checking on a server can take a while (and a remount longer), so it's done here rather than on the SIO task
+void sioFuji::_keepalive_task_fn(void *param)
+{
+    sioFuji *fuji = (sioFuji *)param;
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        for (int i = 0; i < MAX_HOSTS; i++)
+            fuji->_fnHosts[i].keep_alive();
+    }
+}
+
+// Called while the SIO bus is idle so sectors written to mounted disks get synced
+void sioFuji::sync_disks() {
+    for (int i = 0; i < MAX_DISK_DEVICES; i++)
+        _fnDisks[i].disk_dev.idle();
+}
+
+// Called while the SIO bus is idle so TNFS hosts can notice a server's lost our session; never blocks
+void sioFuji::keep_hosts_alive() {
+    if (_keepalive_task == nullptr || fnSystem.millis() - _keepalive_woken_ms < FUJI_KEEPALIVE_WAKE_MS)
+        return;
+    _keepalive_woken_ms = fnSystem.millis();
+    xTaskNotifyGive(_keepalive_task);
+}
+
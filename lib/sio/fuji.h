@@ -1,6 +1,8 @@
 #ifndef FUJI_H
 #define FUJI_H
 #include <cstdint>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #include "../../include/debug.h"
 #include "sio.h"
@@ -61,6 +63,10 @@ private:
 
     appkey _current_appkey;
 
+    TaskHandle_t _keepalive_task = nullptr;
+    unsigned long _keepalive_woken_ms = 0;
+    static void _keepalive_task_fn(void *param);
+
 protected:
     void sio_reset_fujinet();          // 0xFF
     void sio_net_get_ssid();           // 0xFE
@@ -114,6 +120,9 @@ public:
     void image_rotate();
     int get_disk_id(int drive_slot);
     std::string get_host_prefix(int host_slot);
+    std::string get_host_cache_stats(int host_slot);
+    void keep_hosts_alive();
+    void sync_disks();
 
     sioFuji();
 };
@@ -21,10 +21,12 @@ void fujiHost::cleanup()
         _fs->dir_close();
 
     // Delete the filesystem if it's not one of the global oens
+    xSemaphoreTake(_fs_lock, portMAX_DELAY);
     if (_fs->is_global() == false)
         delete _fs;
 
     _fs = nullptr;
+    xSemaphoreGive(_fs_lock);
 
     _hostname[0] = '\0';
 }
@@ -65,6 +67,16 @@ void fujiHost::set_hostname(const char *hostname)
         set_type(HOSTTYPE_UNINITIALIZED);
     }
     strlcpy(_hostname, hostname, sizeof(_hostname));
+    // Mirrors of the old host aren't mirrors of this one
+    _mirrors[0] = '\0';
+}
+
+/* Sets other TNFS servers with the same files as this host, separated by commas.
+ These take effect the next time the host is mounted.
+ */
+void fujiHost::set_mirrors(const char *mirrors)
+{
+    strlcpy(_mirrors, mirrors == nullptr ? "" : mirrors, sizeof(_mirrors));
 }
 
 // Sets the host slot prefix.
@@ -264,6 +276,43 @@ const char *fujiHost::get_prefix()
     return get_prefix(NULL, 0);
 }
 
+/* Returns a short description of how the TNFS block cache is doing,
+   or an empty string if this isn't a mounted TNFS host.
+   Called from the web server's task, so it never waits on an unmount.
+*/
+std::string fujiHost::get_cache_stats()
+{
+    // If the host's being unmounted right now there's nothing to report
+    if (xSemaphoreTake(_fs_lock, 0) != pdTRUE)
+        return std::string();
+    if (_type != HOSTTYPE_TNFS || _fs == nullptr)
+    {
+        xSemaphoreGive(_fs_lock);
+        return std::string();
+    }
+    tnfsCacheStats stats = ((FileSystemTNFS *)_fs)->cache_stats();
+    xSemaphoreGive(_fs_lock);
+
+    uint32_t lookups = stats.hits + stats.misses;
+    if (lookups == 0)
+        return std::string();
+
+    char buffer[80];
+    snprintf(buffer, sizeof(buffer), "cache %u%% hit, %u blocks read, %u read ahead, %u evicted",
+             (unsigned)((uint64_t)stats.hits * 100 / lookups), stats.blocks_fetched, stats.readahead_blocks, stats.evictions);
+    return std::string(buffer);
+}
+
+void fujiHost::keep_alive()
+{
+    // If the host's being unmounted right now it doesn't need checking
+    if (xSemaphoreTake(_fs_lock, 0) != pdTRUE)
+        return;
+    if (_type == HOSTTYPE_TNFS && _fs != nullptr && _fs->running())
+        ((FileSystemTNFS *)_fs)->keep_alive();
+    xSemaphoreGive(_fs_lock);
+}
+
 /* Returns:
     0 on success
    -1 devicename isn't a local one
@@ -321,6 +370,7 @@ int fujiHost::mount_tnfs()
     else
     {
         Debug_println("Calling TNFS::begin");
+        ((FileSystemTNFS *)_fs)->set_mirrors(_mirrors);
         if (((FileSystemTNFS *)_fs)->start(_hostname))
         {
             return 0;
@@ -2,11 +2,14 @@
 #define _FUJI_HOST_
 
 #include <string>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 
 #include "../FileSystem/fnFS.h"
 
 #define MAX_HOSTNAME_LEN 32
 #define MAX_HOST_PREFIX_LEN 256
+#define MAX_HOST_MIRRORS_LEN 192
 
 enum fujiHostType
 {
@@ -23,6 +26,10 @@ private:
     fujiHostType _type;
     char _hostname[MAX_HOSTNAME_LEN] = { '\0' };
     char _prefix[MAX_HOST_PREFIX_LEN] = { '\0' };
+    char _mirrors[MAX_HOST_MIRRORS_LEN] = { '\0' }; // Other TNFS servers with the same files, separated by commas
+
+    // Held while _fs is deleted, and by keep_alive (on the keepalive task) while it's using it
+    SemaphoreHandle_t _fs_lock = xSemaphoreCreateMutex();
 
     void cleanup();
     void unmount();
@@ -43,6 +50,8 @@ public:
     const char* get_hostname(char *buffer, size_t buffersize);
     const char* get_hostname();
 
+    void set_mirrors(const char *mirrors);
+
     bool mount();
 
     // Host prefixes are used for host file operations that take a path (file_exists, file_open, dir_open)
@@ -50,6 +59,12 @@ public:
     const char* get_prefix(char *buffer, size_t buffersize);
     const char* get_prefix();
 
+    // Summary of the TNFS block cache counters (empty for other host types)
+    std::string get_cache_stats();
+
+    // Lets a TNFS host check in with its server when it's been quiet for a while; may block, so not for the SIO task
+    void keep_alive();
+
     // File functions
     bool file_exists(const char *path);
     FILE * file_open(const char *path, char *fullpath, int fullpathlen, const char *mode);
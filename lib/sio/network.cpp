@@ -3,6 +3,8 @@
 #include "../../include/debug.h"
 #include "../hardware/fnSystem.h"
 #include "../hardware/fnWiFi.h"
+#include "../utils/bufferArena.h"
+#include "../utils/utils.h"
 
 #include "network.h"
 
@@ -37,19 +39,24 @@ string remove_spaces(const string &s)
 
 /**
  * Allocate input/output buffers
+ * These come from the shared buffer arena and start small; sio_read and
+ * sio_write grow them to whatever the computer asks for.
  */
 bool sioNetwork::allocate_buffers()
 {
-    rx_buf = (uint8_t *)heap_caps_malloc(INPUT_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    tx_buf = (uint8_t *)heap_caps_malloc(OUTPUT_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    sp_buf = (uint8_t *)heap_caps_malloc(SPECIAL_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    rx_buf = fnBufferArena.acquire(INITIAL_BUFFER_SIZE, &rx_buf_size);
+    tx_buf = fnBufferArena.acquire(INITIAL_BUFFER_SIZE, &tx_buf_size);
+    sp_buf = fnBufferArena.acquire(SPECIAL_BUFFER_SIZE, &sp_buf_size);
 
     if ((rx_buf == nullptr) || (tx_buf == nullptr) || (sp_buf == nullptr))
+    {
+        deallocate_buffers();
         return false;
+    }
 
-    memset(rx_buf, 0, INPUT_BUFFER_SIZE);
-    memset(tx_buf, 0, OUTPUT_BUFFER_SIZE);
-    memset(sp_buf, 0, SPECIAL_BUFFER_SIZE);
+    memset(rx_buf, 0, rx_buf_size);
+    memset(tx_buf, 0, tx_buf_size);
+    memset(sp_buf, 0, sp_buf_size);
 
     HEAP_CHECK("sioNetwork::allocate_buffers");
     return true;
@@ -60,12 +67,35 @@ bool sioNetwork::allocate_buffers()
  */
 void sioNetwork::deallocate_buffers()
 {
-    if (rx_buf != nullptr)
-        free(rx_buf);
-    if (tx_buf != nullptr)
-        free(tx_buf);
-    if (sp_buf != nullptr)
-        free(sp_buf);
+    fnBufferArena.release(rx_buf, rx_buf_size);
+    fnBufferArena.release(tx_buf, tx_buf_size);
+    fnBufferArena.release(sp_buf, sp_buf_size);
+    rx_buf = tx_buf = sp_buf = nullptr;
+    rx_buf_size = tx_buf_size = sp_buf_size = 0;
+}
+
+/**
+ * Make sure the receive buffer holds at least len bytes
+ */
+bool sioNetwork::grow_rx_buffer(size_t len)
+{
+    uint8_t *buf = fnBufferArena.grow(rx_buf, &rx_buf_size, len);
+    if (buf == nullptr)
+        return false;
+    rx_buf = buf;
+    return true;
+}
+
+/**
+ * Make sure the transmit buffer holds at least len bytes
+ */
+bool sioNetwork::grow_tx_buffer(size_t len)
+{
+    uint8_t *buf = fnBufferArena.grow(tx_buf, &tx_buf_size, len);
+    if (buf == nullptr)
+        return false;
+    tx_buf = buf;
+    return true;
 }
 
 bool sioNetwork::open_protocol()
@@ -78,8 +108,6 @@ bool sioNetwork::open_protocol()
     else if (urlParser->scheme == "UDP")
     {
         protocol = new networkProtocolUDP();
-        if (protocol != nullptr)
-            protocol->set_saved_rx_buffer(rx_buf, &rx_buf_len);
         return true;
     }
     else if (urlParser->scheme == "HTTP")
@@ -228,6 +256,7 @@ void sioNetwork::sio_open()
         protocol->close(sio_enable_interrupts);
         delete protocol;
         protocol = nullptr;
+        deallocate_buffers();
         status_buf.error = 170;
         sio_error();
         return;
@@ -246,6 +275,7 @@ void sioNetwork::sio_open()
 
     // Finally, go ahead and inform the parsers of the active protocol.
     _json.setProtocol(protocol);
+    _xml.setProtocol(protocol);
 
     sio_complete();
 }
@@ -291,10 +321,18 @@ void sioNetwork::sio_read()
         sio_nak();
         return;
     }
+    // Leave room for a terminating zero after what's asked for
+    size_t len = cmdFrame.aux2 * 256 + cmdFrame.aux1;
+    if (grow_rx_buffer(len + 1) == false)
+    {
+        Debug_println("Couldn't grow read buffer!");
+        sio_nak();
+        return;
+    }
     sio_ack();
 
     // Clean out RX buffer.
-    memset(rx_buf, 0, INPUT_BUFFER_SIZE);
+    memset(rx_buf, 0, len + 1);
 
     Debug_printf("Read %d bytes\n", cmdFrame.aux2 * 256 + cmdFrame.aux1);
 
@@ -315,37 +353,17 @@ void sioNetwork::sio_read()
         case QUERY_JSON:
             err = _json.readValue(rx_buf, cmdFrame.aux2 * 256 + cmdFrame.aux1);
             break;
+        case QUERY_XML:
+            err = _xml.readValue(rx_buf, cmdFrame.aux2 * 256 + cmdFrame.aux1);
+            break;
         }
         // Convert CR and/or LF to ATASCII EOL
         // 1 = CR, 2 = LF, 3 = CR/LF
-        if (aux2 > 0)
+        // (but not in binary JSON values, where those bytes are lengths and numbers)
+        if (aux2 > 0 && (read_mode != QUERY_JSON || _json.outputFormat() != JSON_OUTPUT_BINARY))
         {
             Debug_printf("sio_read conversion rx_buf_len = %hu\n", rx_buf_len);
-            for (int i = 0; i < rx_buf_len; i++)
-            {
-                switch (aux2 & 3)
-                {
-                case 1:
-                    if (rx_buf[i] == 0x0D)
-                        rx_buf[i] = 0x9B;
-                    break;
-                case 2:
-                    if (rx_buf[i] == 0x0A)
-                        rx_buf[i] = 0x9B;
-                    break;
-                case 3:
-                    if (rx_buf[i] == 0x0D)
-                        rx_buf[i] = 0x20;
-                    else if (rx_buf[i] == 0x0A)
-                        rx_buf[i] = 0x9b;
-                    break;
-                }
-
-                // Translate ASCII TAB to ATASCII TAB.
-                if (aux2 > 0)
-                    if (rx_buf[i] == 0x09)
-                        rx_buf[i] = 0x7f;
-            }
+            util_eol_to_atascii(rx_buf, rx_buf_len, aux2 & 3, true);
         }
     }
     sio_to_computer(rx_buf, rx_buf_len, err);
@@ -354,9 +372,22 @@ void sioNetwork::sio_read()
 void sioNetwork::sio_write()
 {
     Debug_printf("sioNetwork::sio_write() %d bytes\n", cmdFrame.aux2 * 256 + cmdFrame.aux1);
+
+    // Leave room for a terminating zero, and for EOLs that turn into CR/LF
+    size_t len = cmdFrame.aux2 * 256 + cmdFrame.aux1;
+    size_t needed = (aux2 & 3) == 3 ? len * 2 + 1 : len + 1;
+    if (needed > OUTPUT_BUFFER_SIZE + 1)
+        needed = OUTPUT_BUFFER_SIZE + 1;
+    if (tx_buf != nullptr && grow_tx_buffer(needed) == false)
+    {
+        Debug_println("Couldn't grow write buffer!");
+        sio_nak();
+        return;
+    }
     sio_ack();
 
-    memset(tx_buf, 0, OUTPUT_BUFFER_SIZE);
+    if (tx_buf != nullptr)
+        memset(tx_buf, 0, needed);
 
     if (protocol == nullptr)
     {
@@ -373,36 +404,13 @@ void sioNetwork::sio_write()
         // Handle EOL to CR/LF translation.
         // 1 = CR, 2 = LF, 3 = CR/LF
 
-        if (aux2 > 0)
+        if (aux2 > 0 && tx_buf != nullptr)
         {
-            for (int i = 0; i < tx_buf_len; i++)
-            {
-                switch (aux2 & 3)
-                {
-                case 1:
-                    if (tx_buf[i] == 0x9B)
-                        tx_buf[i] = 0x0D;
-                    break;
-                case 2:
-                    if (tx_buf[i] == 0x9B)
-                        tx_buf[i] = 0x0A;
-                    break;
-                case 3:
-                    if (tx_buf[i] == 0x9B)
-                    {
-                        memmove(&tx_buf[i + 1], &tx_buf[i], tx_buf_len);
-                        tx_buf[i] = 0x0D;
-                        tx_buf[i + 1] = 0x0A;
-                        tx_buf_len++;
-                    }
-                    break;
-                }
-
-                // Translate ATASCII TAB to ASCII TAB.
-                if (aux2 > 0)
-                    if (tx_buf[i] == 0x7F)
-                        tx_buf[i] = 0x09;
-            }
+            // Leave room for the terminating zero some protocols expect
+            size_t capacity = tx_buf_size - 1;
+            if (capacity > OUTPUT_BUFFER_SIZE)
+                capacity = OUTPUT_BUFFER_SIZE;
+            tx_buf_len = util_eol_from_atascii(tx_buf, tx_buf_len, capacity, aux2 & 3, true);
         }
 
         if (!protocol->write(tx_buf, tx_buf_len))
@@ -475,6 +483,12 @@ void sioNetwork::sio_status()
             status_buf.error = (_json.readValueLen() > 0 ? 1 : 136);
             err=false;
             break;
+        case QUERY_XML:
+            status_buf.rx_buf_len = (_xml.readValueLen() > 65535 ? 65535 : _xml.readValueLen());
+            status_buf.connection_status = (_xml.readValueLen() > 0 ? 1 : 0);
+            status_buf.error = (_xml.readValueLen() > 0 ? 1 : 136);
+            err = false;
+            break;
         }
     }
     Debug_printf("Status bytes: %02x %02x %02x %02x\n", status_buf.rawData[0], status_buf.rawData[1], status_buf.rawData[2], status_buf.rawData[3]);
@@ -833,6 +847,10 @@ bool sioNetwork::sio_special_supported_00_command(unsigned char c)
         return true;
     case 0x80: // JSON parse
         return true;
+    case 0x82: // JSON output format
+        return true;
+    case 0x83: // XML parse
+        return true;
     }
     return false;
 }
@@ -869,6 +887,8 @@ bool sioNetwork::sio_special_supported_80_command(unsigned char c)
         return true;
     case 0x81: // JSON Read Query
         return true;
+    case 0x84: // XML Read Query
+        return true;
     }
     return false;
 }
@@ -884,6 +904,12 @@ void sioNetwork::sio_special_00()
     case 0x80: // Parse JSON
         sio_special_parse_json();
         break;
+    case 0x82: // Set JSON output format
+        sio_special_set_json_format();
+        break;
+    case 0x83: // Parse XML
+        sio_special_parse_xml();
+        break;
     }
 }
 
@@ -922,6 +948,9 @@ void sioNetwork::sio_special_80()
     case 0x81: // Read query
         sio_special_json_read_query();
         break;
+    case 0x84: // XML read query
+        sio_special_xml_read_query();
+        break;
     }
 
     if (err == true)
@@ -942,7 +971,8 @@ void sioNetwork::sio_special_protocol_00()
 // For commands with Peripheral->Computer payload
 void sioNetwork::sio_special_protocol_40()
 {
-    err = protocol->special(sp_buf, 4, &cmdFrame);
+    sp_buf_len = 4; // DVSTAT sized
+    err = protocol->special(sp_buf, sp_buf_len, &cmdFrame);
     sio_to_computer(sp_buf, sp_buf_len, err);
 }
 
@@ -977,6 +1007,17 @@ void sioNetwork::sio_special_parse_json()
         sio_complete();
 }
 
+/*
+ Picks how JSON query results are written out: aux2 of 0 is text, one
+ line per value, and 1 is the compact binary form in jsonStream.h
+*/
+void sioNetwork::sio_special_set_json_format()
+{
+    _json.setOutputFormat(cmdFrame.aux2);
+    Debug_printf("SPECIAL SET JSON OUTPUT FORMAT %u\n", cmdFrame.aux2);
+    sio_complete();
+}
+
 void sioNetwork::sio_special_json_read_query()
 {
     string param = string((char *)filespecBuf);
@@ -991,6 +1032,29 @@ void sioNetwork::sio_special_json_read_query()
     // sio_complete handled by sio_pecial_protocol_80()
 }
 
+void sioNetwork::sio_special_parse_xml()
+{
+    Debug_printf("SPECIAL PARSE XML\n");
+    if (_xml.parse() == false)
+        sio_error();
+    else
+        sio_complete();
+}
+
+void sioNetwork::sio_special_xml_read_query()
+{
+    string param = string((char *)filespecBuf);
+
+    param = param.substr(param.find(":") + 1);
+    read_mode = QUERY_XML;
+    _xml.setReadQuery(param);
+
+    Debug_printf("SPECIAL SET XML READ QUERY\n");
+    Debug_printf("Query string now: %s\n", param.c_str());
+
+    // sio_complete handled by sio_special_80()
+}
+
 void sioNetwork::sio_assert_interrupts()
 {
     if (interruptEnabled == true && protocol != nullptr)
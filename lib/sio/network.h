@@ -6,11 +6,13 @@
 #include "networkProtocol.h"
 #include "EdUrlParser.h"
 #include "json.h"
+#include "xml.h"
 
 #define NUM_DEVICES 8
 
-#define INPUT_BUFFER_SIZE 65535
-#define OUTPUT_BUFFER_SIZE 65535
+#define INPUT_BUFFER_SIZE 65535 // Largest the receive buffer gets
+#define OUTPUT_BUFFER_SIZE 65535 // Largest the transmit buffer gets
+#define INITIAL_BUFFER_SIZE 256 // What the receive and transmit buffers start at; they grow as needed
 
 #define SPECIAL_BUFFER_SIZE 256
 #define DEVICESPEC_SIZE 256
@@ -32,6 +34,8 @@ class sioNetwork : public sioDevice
 private:
     bool allocate_buffers();
     void deallocate_buffers();
+    bool grow_rx_buffer(size_t len);
+    bool grow_tx_buffer(size_t len);
     bool open_protocol();
     void start_timer();
 
@@ -72,7 +76,10 @@ public:
 
     void sio_special_set_translation();
     void sio_special_parse_json();
+    void sio_special_set_json_format();
     void sio_special_json_read_query();
+    void sio_special_parse_xml();
+    void sio_special_xml_read_query();
 
     bool sio_special_supported_00_command(unsigned char c);
     bool sio_special_supported_40_command(unsigned char c);
@@ -90,6 +97,9 @@ private:
     uint8_t *rx_buf = nullptr;
     uint8_t *tx_buf = nullptr;
     uint8_t *sp_buf = nullptr;
+    size_t rx_buf_size = 0; // Capacity of the buffers we got from fnBufferArena
+    size_t tx_buf_size = 0;
+    size_t sp_buf_size = 0;
     unsigned short rx_buf_len;
     unsigned short tx_buf_len = 256;
     unsigned short sp_buf_len;
@@ -100,10 +110,12 @@ private:
     string initial_prefix;
     char filespecBuf[256];
     JSON _json;
+    XML _xml;
     enum _read_mode 
     {
         NORMAL,
-        QUERY_JSON
+        QUERY_JSON,
+        QUERY_XML
     } read_mode;
 
     union
@@ -0,0 +1,255 @@
+#include <cstring>
+
+#include "networkCoalescer.h"
+#include "../utils/bufferArena.h"
+#include "../utils/utils.h"
+#include "../../include/debug.h"
+
+networkCoalescer::networkCoalescer(fnTcpClient *client)
+{
+    _client = client;
+}
+
+networkCoalescer::~networkCoalescer()
+{
+    stop();
+}
+
+// Every started coalescer, for the service task to check on
+static networkCoalescer *_coalescers[NETWORK_COALESCE_MAX];
+static SemaphoreHandle_t _coalescers_lock = nullptr;
+static TaskHandle_t _coalescers_task = nullptr;
+// The one the service task is sending for right now; stop() waits for it (with _coalescers_lock)
+static networkCoalescer *_coalescers_sending = nullptr;
+
+void networkCoalescer::_service_task(void *param)
+{
+    for (;;)
+    {
+        TickType_t now = xTaskGetTickCount();
+        TickType_t wait = portMAX_DELAY;
+
+        // Note which ones are due, so a slow send doesn't hold up start() and stop() for everyone
+        networkCoalescer *due[NETWORK_COALESCE_MAX];
+        int due_count = 0;
+        xSemaphoreTake(_coalescers_lock, portMAX_DELAY);
+        for (int i = 0; i < NETWORK_COALESCE_MAX; i++)
+        {
+            networkCoalescer *c = _coalescers[i];
+            if (c == nullptr || c->_due == false)
+                continue;
+
+            TickType_t left = c->_due_tick - now;
+            if ((int32_t)left > 0)
+            {
+                if (left < wait)
+                    wait = left;
+                continue;
+            }
+            due[due_count++] = c;
+        }
+        xSemaphoreGive(_coalescers_lock);
+
+        for (int i = 0; i < due_count; i++)
+        {
+            networkCoalescer *c = due[i];
+
+            // It may have been stopped since; if not, it can't be until we're done with it
+            bool listed = false;
+            xSemaphoreTake(_coalescers_lock, portMAX_DELAY);
+            for (int j = 0; j < NETWORK_COALESCE_MAX && !listed; j++)
+                listed = _coalescers[j] == c;
+            if (listed)
+                _coalescers_sending = c;
+            xSemaphoreGive(_coalescers_lock);
+            if (!listed)
+                continue;
+
+            xSemaphoreTake(c->_lock, portMAX_DELAY);
+            if (c->_len > 0)
+            {
+                c->_deadline_sends++;
+                c->_send();
+            }
+            c->_due = false;
+            xSemaphoreGive(c->_lock);
+
+            xSemaphoreTake(_coalescers_lock, portMAX_DELAY);
+            _coalescers_sending = nullptr;
+            xSemaphoreGive(_coalescers_lock);
+        }
+
+        // Until the next deadline, or until write() tells us about a new one
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+bool networkCoalescer::start()
+{
+    if (_lock != nullptr)
+        return true;
+
+    // The service task is started by the first coalescer and then stays
+    if (_coalescers_lock == nullptr)
+        _coalescers_lock = xSemaphoreCreateMutex();
+    if (_coalescers_lock != nullptr && _coalescers_task == nullptr &&
+        xTaskCreate(_service_task, "netCoalesce", NETWORK_COALESCE_STACKSIZE, nullptr, NETWORK_COALESCE_PRIORITY, &_coalescers_task) != pdPASS)
+        _coalescers_task = nullptr;
+
+    _buffer = fnBufferArena.acquire(NETWORK_COALESCE_SIZE, &_capacity);
+    _lock = xSemaphoreCreateMutex();
+    if (_buffer == nullptr || _lock == nullptr || _coalescers_task == nullptr)
+    {
+        Debug_println("networkCoalescer::start couldn't allocate buffer or service task");
+        stop();
+        return false;
+    }
+
+    _len = 0;
+    _due = false;
+    _bytes = _sends = _full_sends = _deadline_sends = 0;
+
+    bool added = false;
+    xSemaphoreTake(_coalescers_lock, portMAX_DELAY);
+    for (int i = 0; i < NETWORK_COALESCE_MAX && !added; i++)
+        if (_coalescers[i] == nullptr)
+        {
+            _coalescers[i] = this;
+            added = true;
+        }
+    xSemaphoreGive(_coalescers_lock);
+
+    if (!added)
+    {
+        Debug_println("networkCoalescer::start too many coalescers");
+        stop();
+        return false;
+    }
+
+    return true;
+}
+
+void networkCoalescer::stop()
+{
+    if (_coalescers_lock != nullptr)
+    {
+        // Once we're off the list (and it's finished any send for us) the service task won't look at us again
+        xSemaphoreTake(_coalescers_lock, portMAX_DELAY);
+        for (int i = 0; i < NETWORK_COALESCE_MAX; i++)
+            if (_coalescers[i] == this)
+                _coalescers[i] = nullptr;
+        while (_coalescers_sending == this)
+        {
+            xSemaphoreGive(_coalescers_lock);
+            vTaskDelay(1);
+            xSemaphoreTake(_coalescers_lock, portMAX_DELAY);
+        }
+        xSemaphoreGive(_coalescers_lock);
+    }
+
+    if (_lock != nullptr)
+    {
+        flush();
+        debug_print_stats();
+        vSemaphoreDelete(_lock);
+        _lock = nullptr;
+    }
+
+    fnBufferArena.release(_buffer, _capacity);
+    _buffer = nullptr;
+    _capacity = 0;
+    _len = 0;
+    _due = false;
+}
+
+bool networkCoalescer::_send()
+{
+    if (_len == 0)
+        return true;
+
+    size_t sent = _client->write(_buffer, _len);
+    _sends++;
+    _bytes += sent;
+    if (_len == NETWORK_COALESCE_SIZE)
+        _full_sends++;
+
+    if (sent < _len)
+    {
+        // Whatever's left stays at the front for next time
+        memmove(_buffer, _buffer + sent, _len - sent);
+        _len -= sent;
+        return false;
+    }
+
+    _len = 0;
+    return true;
+}
+
+size_t networkCoalescer::write(const uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+
+    if (_lock == nullptr)
+        return 0;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool ok = true;
+    while (done < len && ok)
+    {
+        size_t n = NETWORK_COALESCE_SIZE - _len;
+        if (n > len - done)
+            n = len - done;
+        memcpy(_buffer + _len, buf + done, n);
+        _len += n;
+        done += n;
+
+        if (_len == NETWORK_COALESCE_SIZE)
+            ok = _send();
+    }
+
+    if (ok && _deadline_ms == 0)
+        ok = _send();
+
+    // The connection's failed: whatever of this write didn't go out isn't ours to keep
+    if (!ok)
+    {
+        size_t unsent = _len < done ? _len : done;
+        _len -= unsent;
+        done -= unsent;
+    }
+
+    // Anything left over goes when the deadline's up, counting from when it started waiting
+    bool wake = false;
+    if (_len > 0 && _deadline_ms > 0 && _due == false)
+    {
+        _due_tick = xTaskGetTickCount() + pdMS_TO_TICKS(_deadline_ms);
+        _due = true;
+        wake = true;
+    }
+    xSemaphoreGive(_lock);
+
+    if (wake)
+        xTaskNotifyGive(_coalescers_task);
+
+    return done;
+}
+
+bool networkCoalescer::flush()
+{
+    if (_lock == nullptr)
+        return false;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool ok = _send();
+    xSemaphoreGive(_lock);
+    return ok;
+}
+
+void networkCoalescer::debug_print_stats()
+{
+    // Sends per KB is roughly packets per KB, since each send is at most one segment
+    unsigned per_kb = _bytes ? (unsigned)((uint64_t)_sends * 102400 / _bytes) : 0; // In hundredths
+    __IGNORE_UNUSED_VAR(per_kb);
+    Debug_printf("networkCoalescer: %u bytes in %u sends (%u full, %u by deadline), %u.%02u sends/KB, deadline %ums\n",
+                 _bytes, _sends, _full_sends, _deadline_sends, per_kb / 100, per_kb % 100, _deadline_ms);
+}
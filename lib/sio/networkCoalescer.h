@@ -0,0 +1,76 @@
+#ifndef NETWORKCOALESCER_H
+#define NETWORKCOALESCER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include "../tcpip/fnTcpClient.h"
+
+#define NETWORK_COALESCE_SIZE 1460 // One full-size segment on Ethernet-sized links
+#define NETWORK_COALESCE_DEADLINE_MS 0 // Default longest a byte waits for company; 0 sends every write straight away
+#define NETWORK_COALESCE_MAX 16 // Coalescers the service task looks after at once
+#define NETWORK_COALESCE_STACKSIZE 3072
+#define NETWORK_COALESCE_PRIORITY 5
+
+/*
+ Gathers the Atari's writes to a TCP connection into full segments. Each
+ SIO write used to go out as its own send, so a program writing a line or
+ a block at a time produced a stream of tiny packets.
+ Bytes are held until there's a segment's worth, the deadline passes,
+ or flush() is called. A deadline of 0 (the default, until the Atari asks
+ for one) sends each write as soon as it's made, the way it always was.
+ One service task, shared by every coalescer, sends what's waiting when a
+ deadline passes. The SIO task writes and flushes and the service task
+ flushes; the buffer is only touched with _lock held, so the bytes go out
+ in order.
+*/
+class networkCoalescer
+{
+private:
+    fnTcpClient *_client;
+
+    uint8_t *_buffer = nullptr;
+    size_t _capacity = 0; // What the arena gave us, which may be more than we use
+    size_t _len = 0;
+    volatile uint32_t _deadline_ms = NETWORK_COALESCE_DEADLINE_MS;
+
+    uint32_t _bytes = 0; // Sent
+    uint32_t _sends = 0; // Times we handed data to the socket
+    uint32_t _full_sends = 0; // Of those, how many were a whole segment
+    uint32_t _deadline_sends = 0; // And how many the deadline sent
+
+    SemaphoreHandle_t _lock = nullptr;
+    volatile bool _due = false; // Something's waiting for the deadline
+    volatile TickType_t _due_tick = 0; // When it's up
+
+    static void _service_task(void *param);
+    bool _send(); // With _lock held
+
+public:
+    networkCoalescer(fnTcpClient *client);
+    ~networkCoalescer();
+
+    // Allocates the buffer and signs up with the service task; returns false if either fails
+    bool start();
+    // Sends anything still waiting and leaves the service task
+    void stop();
+
+    void set_deadline(uint32_t ms) { _deadline_ms = ms; }
+    uint32_t deadline() { return _deadline_ms; }
+
+    // Takes len bytes from buf, returning how many were accepted (fewer only if the connection's failed)
+    size_t write(const uint8_t *buf, size_t len);
+    // Sends everything waiting; returns false if it couldn't
+    bool flush();
+
+    // Bytes sent so far, and how many sends it took (roughly packets, since each is at most one segment)
+    uint32_t bytes_sent() { return _bytes; }
+    uint32_t sends() { return _sends; }
+
+    void debug_print_stats();
+};
+
+#endif /* NETWORKCOALESCER_H */
@@ -0,0 +1,166 @@
+#include <cstring>
+#include <errno.h>
+#include <esp_heap_caps.h>
+
+#include "networkDatagramQueue.h"
+#include "../../include/debug.h"
+
+networkDatagramQueue::networkDatagramQueue(int fd)
+{
+    _fd = fd;
+}
+
+networkDatagramQueue::~networkDatagramQueue()
+{
+    stop();
+}
+
+void networkDatagramQueue::_receive_task(void *param)
+{
+    networkDatagramQueue *q = (networkDatagramQueue *)param;
+
+    while (q->_stopping == false)
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(q->_fd, &fds);
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = NETWORK_DATAGRAM_WAIT_MS * 1000;
+
+        int res = select(q->_fd + 1, &fds, nullptr, nullptr, &tv);
+        if (res < 0)
+            break;
+        if (res == 0)
+            continue;
+
+        portENTER_CRITICAL(&q->_mux);
+        size_t head = q->_head;
+        size_t count = q->_count;
+        portEXIT_CRITICAL(&q->_mux);
+
+        // Full: take it off the socket anyway, or it'll sit in front of newer ones
+        if (count == NETWORK_DATAGRAM_QUEUE_DEPTH)
+        {
+            uint8_t discard;
+            if (recv(q->_fd, &discard, sizeof(discard), MSG_DONTWAIT) >= 0)
+                q->_dropped++;
+            continue;
+        }
+
+        networkDatagram &slot = q->_slots[(head + count) % NETWORK_DATAGRAM_QUEUE_DEPTH];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        res = recvfrom(q->_fd, slot.data, NETWORK_DATAGRAM_MAX_SIZE, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+        if (res < 0)
+        {
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+                continue;
+            Debug_printf("networkDatagramQueue: recvfrom failed, errno %d\n", errno);
+            break;
+        }
+
+        slot.ip = from.sin_addr.s_addr;
+        slot.port = ntohs(from.sin_port);
+        slot.len = res;
+        q->_received++;
+
+        portENTER_CRITICAL(&q->_mux);
+        q->_count++;
+        portEXIT_CRITICAL(&q->_mux);
+    }
+
+    xSemaphoreGive(q->_task_done);
+    vTaskDelete(nullptr);
+}
+
+bool networkDatagramQueue::start()
+{
+    if (_task != nullptr)
+        return true;
+
+    if (_fd < 0)
+        return false;
+
+    _storage = (uint8_t *)heap_caps_malloc(NETWORK_DATAGRAM_QUEUE_DEPTH * NETWORK_DATAGRAM_MAX_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    _task_done = xSemaphoreCreateBinary();
+    if (_storage == nullptr || _task_done == nullptr)
+    {
+        Debug_println("networkDatagramQueue::start couldn't allocate slots");
+        stop();
+        return false;
+    }
+
+    for (int i = 0; i < NETWORK_DATAGRAM_QUEUE_DEPTH; i++)
+        _slots[i].data = _storage + i * NETWORK_DATAGRAM_MAX_SIZE;
+    _head = _count = 0;
+    _received = _dropped = 0;
+    _stopping = false;
+
+    if (xTaskCreate(_receive_task, "netDatagram", NETWORK_DATAGRAM_STACKSIZE, this, NETWORK_DATAGRAM_PRIORITY, &_task) != pdPASS)
+    {
+        Debug_println("networkDatagramQueue::start couldn't create task");
+        _task = nullptr;
+        stop();
+        return false;
+    }
+
+    return true;
+}
+
+void networkDatagramQueue::stop()
+{
+    if (_task != nullptr)
+    {
+        // select gives up within NETWORK_DATAGRAM_WAIT_MS, so this won't be long
+        _stopping = true;
+        xSemaphoreTake(_task_done, portMAX_DELAY);
+        _task = nullptr;
+        Debug_printf("networkDatagramQueue::stop received %u datagrams, dropped %u with the queue full\n", _received, _dropped);
+    }
+
+    if (_task_done != nullptr)
+    {
+        vSemaphoreDelete(_task_done);
+        _task_done = nullptr;
+    }
+
+    free(_storage);
+    _storage = nullptr;
+    for (int i = 0; i < NETWORK_DATAGRAM_QUEUE_DEPTH; i++)
+        _slots[i].data = nullptr;
+    _head = _count = 0;
+}
+
+size_t networkDatagramQueue::count()
+{
+    portENTER_CRITICAL(&_mux);
+    size_t count = _count;
+    portEXIT_CRITICAL(&_mux);
+    return count;
+}
+
+const networkDatagram *networkDatagramQueue::front()
+{
+    if (count() == 0)
+        return nullptr;
+    return &_slots[_head];
+}
+
+size_t networkDatagramQueue::pop(uint8_t *buf, size_t len)
+{
+    const networkDatagram *datagram = front();
+    if (datagram == nullptr)
+        return 0;
+
+    if (len > datagram->len)
+        len = datagram->len;
+    memcpy(buf, datagram->data, len);
+
+    portENTER_CRITICAL(&_mux);
+    _head = (_head + 1) % NETWORK_DATAGRAM_QUEUE_DEPTH;
+    _count--;
+    portEXIT_CRITICAL(&_mux);
+
+    return len;
+}
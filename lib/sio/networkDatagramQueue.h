@@ -0,0 +1,72 @@
+#ifndef NETWORKDATAGRAMQUEUE_H
+#define NETWORKDATAGRAMQUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <lwip/sockets.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#define NETWORK_DATAGRAM_QUEUE_DEPTH 16
+#define NETWORK_DATAGRAM_MAX_SIZE 1460 // Same as fnUDP's receive buffer
+#define NETWORK_DATAGRAM_WAIT_MS 100 // Longest we block on the socket before checking if we're stopping
+#define NETWORK_DATAGRAM_STACKSIZE 3072
+#define NETWORK_DATAGRAM_PRIORITY 5
+
+struct networkDatagram
+{
+    in_addr_t ip = 0; // Who sent it
+    uint16_t port = 0;
+    uint16_t len = 0;
+    uint8_t *data = nullptr; // NETWORK_DATAGRAM_MAX_SIZE bytes of the queue's storage
+};
+
+/*
+ Receives datagrams from a UDP socket in a background task and holds up to
+ NETWORK_DATAGRAM_QUEUE_DEPTH of them, each whole and with its sender, until
+ the Atari reads them. Before this, a datagram that arrived before the last
+ one had been read replaced it.
+ When the queue's full, new datagrams are dropped (and counted), so the
+ ones already waiting stay in the order they came.
+ There's one reader (the SIO task) and one writer (the receive task): the
+ writer only fills the slot after the last one and the reader only takes
+ the first, and only the count is shared.
+*/
+class networkDatagramQueue
+{
+private:
+    int _fd;
+
+    uint8_t *_storage = nullptr;
+    networkDatagram _slots[NETWORK_DATAGRAM_QUEUE_DEPTH];
+    size_t _head = 0; // Next datagram for the reader
+    size_t _count = 0;
+
+    uint32_t _received = 0;
+    uint32_t _dropped = 0;
+
+    volatile bool _stopping = false;
+    TaskHandle_t _task = nullptr;
+    SemaphoreHandle_t _task_done = nullptr;
+    portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+
+    static void _receive_task(void *param);
+
+public:
+    networkDatagramQueue(int fd);
+    ~networkDatagramQueue();
+
+    // Allocates the slots and starts the task; returns false if either fails
+    bool start();
+    // Stops the task and drops anything unread
+    void stop();
+
+    size_t count();
+    // The datagram the next pop() will return, or nullptr if there isn't one
+    const networkDatagram *front();
+    // Copies up to len bytes of the first datagram to buf and removes it, returning the bytes copied
+    size_t pop(uint8_t *buf, size_t len);
+};
+
+#endif /* NETWORKDATAGRAMQUEUE_H */
@@ -0,0 +1,169 @@
+#include <cstring>
+
+#include "networkPrefetch.h"
+#include "../utils/bufferArena.h"
+#include "../../include/debug.h"
+
+networkPrefetch::networkPrefetch(prefetch_source_t source, void *source_arg)
+{
+    _source = source;
+    _source_arg = source_arg;
+}
+
+networkPrefetch::~networkPrefetch()
+{
+    stop();
+}
+
+void networkPrefetch::_prefetch_task(void *param)
+{
+    networkPrefetch *p = (networkPrefetch *)param;
+
+    while (p->_stopping == false)
+    {
+        // Find the free run after the data, up to the end of the buffer
+        portENTER_CRITICAL(&p->_mux);
+        size_t tail = (p->_head + p->_count) % p->_capacity;
+        size_t space = p->_capacity - p->_count;
+        portEXIT_CRITICAL(&p->_mux);
+
+        if (tail + space > p->_capacity)
+            space = p->_capacity - tail;
+
+        // Full: leave the data where it is and let the TCP window close until the reader catches up
+        if (space == 0)
+        {
+            p->_full_waits++;
+            vTaskDelay(pdMS_TO_TICKS(NETWORK_PREFETCH_FULL_WAIT_MS));
+            continue;
+        }
+
+        int result = p->_source(p->_source_arg, p->_buffer + tail, space);
+        if (result < 0)
+            break;
+
+        if (result > 0)
+        {
+            portENTER_CRITICAL(&p->_mux);
+            p->_count += result;
+            portEXIT_CRITICAL(&p->_mux);
+            p->_total += result;
+        }
+    }
+
+    portENTER_CRITICAL(&p->_mux);
+    p->_finished = true;
+    portEXIT_CRITICAL(&p->_mux);
+
+    xSemaphoreGive(p->_task_done);
+    vTaskDelete(nullptr);
+}
+
+bool networkPrefetch::start()
+{
+    if (_task != nullptr)
+        return true;
+
+    _buffer = fnBufferArena.acquire(NETWORK_PREFETCH_SIZE, &_capacity);
+    _task_done = xSemaphoreCreateBinary();
+    if (_buffer == nullptr || _task_done == nullptr)
+    {
+        Debug_println("networkPrefetch::start couldn't allocate ring");
+        stop();
+        return false;
+    }
+
+    _head = _count = 0;
+    _total = _full_waits = 0;
+    _finished = false;
+    _stopping = false;
+
+    if (xTaskCreate(_prefetch_task, "netPrefetch", NETWORK_PREFETCH_STACKSIZE, this, NETWORK_PREFETCH_PRIORITY, &_task) != pdPASS)
+    {
+        Debug_println("networkPrefetch::start couldn't create task");
+        _task = nullptr;
+        stop();
+        return false;
+    }
+
+    return true;
+}
+
+void networkPrefetch::stop()
+{
+    if (_task != nullptr)
+    {
+        // The source gives up within NETWORK_PREFETCH_WAIT_MS, so this won't be long
+        _stopping = true;
+        xSemaphoreTake(_task_done, portMAX_DELAY);
+        _task = nullptr;
+        Debug_printf("networkPrefetch::stop prefetched %u bytes, waited on a full ring %u times\n", _total, _full_waits);
+    }
+
+    if (_task_done != nullptr)
+    {
+        vSemaphoreDelete(_task_done);
+        _task_done = nullptr;
+    }
+
+    fnBufferArena.release(_buffer, _capacity);
+    _buffer = nullptr;
+    _capacity = 0;
+    _head = _count = 0;
+}
+
+size_t networkPrefetch::available()
+{
+    portENTER_CRITICAL(&_mux);
+    size_t count = _count;
+    portEXIT_CRITICAL(&_mux);
+    return count;
+}
+
+bool networkPrefetch::finished()
+{
+    portENTER_CRITICAL(&_mux);
+    bool done = _finished && _count == 0;
+    portEXIT_CRITICAL(&_mux);
+    return done;
+}
+
+size_t networkPrefetch::read(uint8_t *buf, size_t len, uint32_t timeout_ms)
+{
+    if (_buffer == nullptr || buf == nullptr)
+        return 0;
+
+    // Give the task a chance to bring in the rest if the caller asked for more than we have
+    TickType_t start = xTaskGetTickCount();
+    while (true)
+    {
+        portENTER_CRITICAL(&_mux);
+        bool ready = _count >= len || _finished;
+        portEXIT_CRITICAL(&_mux);
+
+        if (ready || (xTaskGetTickCount() - start) >= pdMS_TO_TICKS(timeout_ms))
+            break;
+        vTaskDelay(1);
+    }
+
+    portENTER_CRITICAL(&_mux);
+    size_t count = _count;
+    portEXIT_CRITICAL(&_mux);
+
+    if (len > count)
+        len = count;
+
+    // Copy in up to two pieces if the data wraps around the end of the ring
+    size_t first = _capacity - _head;
+    if (first > len)
+        first = len;
+    memcpy(buf, _buffer + _head, first);
+    memcpy(buf + first, _buffer, len - first);
+
+    portENTER_CRITICAL(&_mux);
+    _head = (_head + len) % _capacity;
+    _count -= len;
+    portEXIT_CRITICAL(&_mux);
+
+    return len;
+}
@@ -0,0 +1,71 @@
+#ifndef NETWORKPREFETCH_H
+#define NETWORKPREFETCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#define NETWORK_PREFETCH_SIZE 16384 // Ring size; several TCP windows' worth
+#define NETWORK_PREFETCH_WAIT_MS 100 // Longest a source should block waiting for data
+#define NETWORK_PREFETCH_FULL_WAIT_MS 10 // How often we look for room once the ring is full
+#define NETWORK_PREFETCH_READ_TIMEOUT_MS 500 // Default wait in read() for bytes that haven't arrived yet
+#define NETWORK_PREFETCH_STACKSIZE 3072
+#define NETWORK_PREFETCH_PRIORITY 5
+
+/*
+ Reads up to len bytes into buf, waiting no more than NETWORK_PREFETCH_WAIT_MS
+ for some to arrive. Returns the number of bytes read, 0 if none arrived in
+ time, or -1 once the source is closed or has failed.
+*/
+typedef int (*prefetch_source_t)(void *arg, uint8_t *buf, size_t len);
+
+/*
+ Pulls data from a protocol's connection in a background task into a ring
+ buffer, so it's already in memory when the Atari asks for it.
+ When the ring is full, the task stops reading from the source. Data backs up
+ in the TCP stack and the receive window closes, so the peer slows down
+ instead of us having to drop anything.
+ There's one reader (the SIO task) and one writer (the prefetch task): each
+ only touches its own end of the ring and only the byte count is shared.
+*/
+class networkPrefetch
+{
+private:
+    prefetch_source_t _source;
+    void *_source_arg;
+
+    uint8_t *_buffer = nullptr;
+    size_t _capacity = 0;
+    size_t _head = 0; // Next byte for the reader
+    size_t _count = 0; // Bytes waiting in the ring
+    bool _finished = false; // Source is closed; nothing more is coming
+
+    uint32_t _total = 0;
+    uint32_t _full_waits = 0;
+
+    volatile bool _stopping = false;
+    TaskHandle_t _task = nullptr;
+    SemaphoreHandle_t _task_done = nullptr;
+    portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+
+    static void _prefetch_task(void *param);
+
+public:
+    networkPrefetch(prefetch_source_t source, void *source_arg);
+    ~networkPrefetch();
+
+    // Allocates the ring and starts the task; returns false if either fails
+    bool start();
+    // Stops the task (waiting for it to finish with the source) and drops anything unread
+    void stop();
+
+    size_t available();
+    // True once the source is closed and everything it sent has been read
+    bool finished();
+    // Copies up to len bytes to buf, waiting up to timeout_ms for all of them to arrive. Returns bytes copied.
+    size_t read(uint8_t *buf, size_t len, uint32_t timeout_ms = NETWORK_PREFETCH_READ_TIMEOUT_MS);
+};
+
+#endif /* NETWORKPREFETCH_H */
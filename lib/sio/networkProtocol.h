@@ -15,9 +15,6 @@ public:
     bool assertInterrupt = false;
     bool assertProceed = false;
 
-    uint8_t *saved_rx_buffer;
-    unsigned short *saved_rx_buffer_len;
-
     virtual bool open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enable_interrupt_t enable_interrupt) = 0;
     virtual bool close(enable_interrupt_t enable_interrupt) = 0;
     virtual bool read(uint8_t *rx_buf, unsigned short len) = 0;
@@ -36,12 +33,6 @@ public:
 
     virtual bool isConnected() { return true; }
 
-    void set_saved_rx_buffer(uint8_t *rx_buf, unsigned short *len)
-    {
-        saved_rx_buffer = rx_buf;
-        saved_rx_buffer_len = len;
-    }
-
     virtual bool special_supported_40_command(unsigned char comnd) { return false; }
     virtual bool special_supported_80_command(unsigned char comnd) { return false; }
     virtual bool special_supported_00_command(unsigned char comnd) { return false; }
@@ -237,15 +237,7 @@ bool networkProtocolFTP::read(uint8_t *rx_buf, unsigned short len)
         dataSize -= len;
 
     if (aux1 == 6)
-    {
-        for (int i = 0; i < len; i++)
-        {
-            if (rx_buf[i] == 0x0D)
-                rx_buf[i] = 0x20;
-            else if (rx_buf[i] == 0x0A)
-                rx_buf[i] = 0x9B;
-        }
-    }
+        util_eol_to_atascii(rx_buf, len, EOL_TRANSLATION_CRLF, false);
     return false;
 }
 
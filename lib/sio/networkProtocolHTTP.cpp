@@ -9,9 +9,14 @@ class DAVHandler
 public:
     vector<DAVEntry> entries;
     DAVEntry currentEntry;
-    bool insideResponse;
-    bool insideDisplayName;
-    bool insideGetContentLength;
+    bool insideResponse = false;
+    bool insideDisplayName = false;
+    bool insideGetContentLength = false;
+    string contentLength; // Character data can come in pieces, so collect it before converting
+
+    bool keepEntries = false; // Keep every entry in entries, for looking up a name
+    string *listing = nullptr; // Where to append each entry, formatted for the Atari, as soon as it's parsed
+    bool longFormat = false;
 
     void Start(const XML_Char *el, const XML_Char **attr)
     {
@@ -20,7 +25,10 @@ public:
         else if (strcmp(el, "D:displayname") == 0)
             insideDisplayName = true;
         else if (strcmp(el, "D:getcontentlength") == 0)
+        {
             insideGetContentLength = true;
+            contentLength.clear();
+        }
     }
     void End(const XML_Char *el)
     {
@@ -28,12 +36,25 @@ public:
         {
             insideResponse = false;
             Debug_printf("Adding Entry: %s %lu\n", currentEntry.filename.c_str(), currentEntry.filesize);
-            entries.push_back(currentEntry);
+            if (keepEntries)
+                entries.push_back(currentEntry);
+            if (listing != nullptr)
+            {
+                if (longFormat)
+                    *listing += util_long_entry(currentEntry.filename, currentEntry.filesize);
+                else
+                    *listing += util_entry(util_crunch(currentEntry.filename), currentEntry.filesize) + "\x9b";
+            }
+            currentEntry = DAVEntry();
         }
         else if (strcmp(el, "D:displayname") == 0)
             insideDisplayName = false;
-        else if (strcmp(el, "D:getcontentlength"))
+        else if (strcmp(el, "D:getcontentlength") == 0)
+        {
             insideGetContentLength = false;
+            stringstream ss(contentLength);
+            ss >> currentEntry.filesize;
+        }
     }
 
     void Char(const XML_Char *s, int len)
@@ -42,42 +63,14 @@ public:
         {
             if (insideDisplayName == true)
             {
-                currentEntry.filename = string(s, len);
+                currentEntry.filename += string(s, len);
             }
             else if (insideGetContentLength == true)
             {
-                stringstream ss(string(s, len));
-                ss >> currentEntry.filesize;
+                contentLength += string(s, len);
             }
         }
     }
-
-    string ToString()
-    {
-        string output;
-        for (vector<DAVEntry>::iterator it = entries.begin(); it != entries.end(); ++it)
-        {
-            output += util_entry(util_crunch(it->filename), it->filesize) + "\x9b";
-        }
-        output += "999+FREE SECTORS\x9b";
-        return output;
-    }
-
-    string ToLongString()
-    {
-        string output;
-        for (vector<DAVEntry>::iterator it = entries.begin(); it != entries.end(); ++it)
-        {
-            output += util_long_entry(it->filename, it->filesize);
-        }
-        output += "999+FREE SECTORS\x9b";
-        return output;
-    }
-
-    vector<DAVEntry> ToEntries()
-    {
-        return entries;
-    }
 };
 
 template <class T>
@@ -112,45 +105,95 @@ networkProtocolHTTP::~networkProtocolHTTP()
     for (int i = 0; i < headerCollectionIndex; i++)
         free(headerCollection[i]);
 
+    free(rangeCache);
+    dir_end();
+
     // client.end();
     client.close();
 }
 
+// Reads the whole PROPFIND response into dirEntries, for looking up a name
 void networkProtocolHTTP::parseDir()
 {
-    DAVHandler handler;
-    XML_Parser parser = XML_ParserCreate(NULL);
-    uint8_t *buf;
+    dir_start(true);
+    dir_fill(SIZE_MAX);
+    dirEntries = dirHandler->entries;
+    dir_end();
+    Debug_printf("DAV Response Parsed.\n");
+}
+
+/*
+ Sets up to parse a PROPFIND response as it arrives. With keepEntries, the
+ entries are collected in the handler; otherwise each one is appended to
+ dirString, formatted for the Atari, for read() to hand out.
+*/
+void networkProtocolHTTP::dir_start(bool keepEntries)
+{
+    dir_end();
+
+    dirHandler = new DAVHandler();
+    dirHandler->keepEntries = keepEntries;
+    dirHandler->listing = keepEntries ? nullptr : &dirString;
+    dirHandler->longFormat = aux2 == 128;
 
-    buf = (uint8_t *)heap_caps_malloc(16384, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    dirParser = XML_ParserCreate(NULL);
+    XML_SetUserData(dirParser, dirHandler);
+    XML_SetElementHandler(dirParser, Start<DAVHandler>, End<DAVHandler>);
+    XML_SetCharacterDataHandler(dirParser, Char<DAVHandler>);
 
-    XML_SetUserData(parser, &handler);
-    XML_SetElementHandler(parser, Start<DAVHandler>, End<DAVHandler>);
-    XML_SetCharacterDataHandler(parser, Char<DAVHandler>);
+    dirString.clear();
+    dirOffset = 0;
+    dirDone = false;
+}
 
-    while (int len = client.read(buf, client.available()))
+/*
+ Parses more of the response until at least wanted bytes of listing are
+ waiting to be read or the response ends. Only one chunk of the response
+ and the entries not yet read are held at a time.
+*/
+void networkProtocolHTTP::dir_fill(size_t wanted)
+{
+    while (dirParser != nullptr && dirDone == false && dirString.size() - dirOffset < wanted)
     {
-        int done = len < 16384;
-        XML_Status status = XML_Parse(parser, (const char *)buf, len, done);
-        if (status == XML_STATUS_ERROR)
+        // Drop what's been read once it's most of the buffer, so erasing costs no more than reading did
+        if (dirOffset > 0 && dirOffset >= dirString.size() / 2)
         {
-            Debug_printf("DAV response XML Parse Error! msg: %s line: %lu\n", XML_ErrorString(XML_GetErrorCode(parser)), XML_GetCurrentLineNumber(parser));
-            XML_ParserFree(parser);
-            free(buf);
-            return;
+            dirString.erase(0, dirOffset);
+            dirOffset = 0;
+        }
+
+        void *buf = XML_GetBuffer(dirParser, HTTP_DIR_CHUNK_SIZE);
+        int len = buf == nullptr ? -1 : client.read((uint8_t *)buf, HTTP_DIR_CHUNK_SIZE);
+        if (len < 0)
+            len = 0;
+
+        // A short read is the end of the response
+        bool last = len < HTTP_DIR_CHUNK_SIZE;
+        if (XML_ParseBuffer(dirParser, len, last) == XML_STATUS_ERROR)
+        {
+            Debug_printf("DAV response XML Parse Error! msg: %s line: %lu\n", XML_ErrorString(XML_GetErrorCode(dirParser)), XML_GetCurrentLineNumber(dirParser));
+            last = true;
         }
-    }
-    Debug_printf("DAV Response Parsed.\n");
 
-    dirEntries = handler.ToEntries();
+        if (last)
+        {
+            dirDone = true;
+            if (dirHandler->listing != nullptr)
+                dirString += "999+FREE SECTORS\x9b";
+        }
+    }
+}
 
-    if (aux2 == 128)
-        dirString = handler.ToLongString();
-    else
-        dirString = handler.ToString();
-    Debug_printf("DAV Response serialized.\n");
-    XML_ParserFree(parser);
-    free(buf);
+void networkProtocolHTTP::dir_end()
+{
+    if (dirParser != nullptr)
+    {
+        XML_ParserFree(dirParser);
+        dirParser = nullptr;
+    }
+    delete dirHandler;
+    dirHandler = nullptr;
+    dirDone = true;
 }
 
 bool networkProtocolHTTP::startConnection(uint8_t *buf, unsigned short len)
@@ -168,7 +211,7 @@ bool networkProtocolHTTP::startConnection(uint8_t *buf, unsigned short len)
     case DIR:
         resultCode = client.PROPFIND(fnHttpClient::webdav_depth::DEPTH_1, "<?xml version=\"1.0\"?>\r\n<D:propfind xmlns:D=\"DAV:\">\r\n<D:prop>\r\n<D:displayname />\r\n<D:getcontentlength /></D:prop>\r\n</D:propfind>\r\n");
         if (resultCode == 207)
-            parseDir();
+            dir_start(false);
         ret = true;
         break;
     case GET:
@@ -197,11 +240,14 @@ bool networkProtocolHTTP::startConnection(uint8_t *buf, unsigned short len)
                             return false; // Error
 
                         resultCode = client.GET();
+                        rangeUrl = baseurl + "/" + it->filename;
                     }
                 }
             }
         }
 
+        position = 0;
+        resourceSize = client.available() > 0 ? client.available() : -1;
         headerIndex = 0;
         numHeaders = client.get_header_count();
         ret = true;
@@ -267,6 +313,7 @@ bool networkProtocolHTTP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, ena
 
     openedUrlParser = urlParser;
     openedUrl = urlParser->scheme + "://" + urlParser->hostName + ":" + urlParser->port + urlParser->path + (urlParser->query.empty() ? "" : ("?") + urlParser->query).c_str();
+    rangeUrl = openedUrl;
 
     if (openMode == PUT)
     {
@@ -278,6 +325,8 @@ bool networkProtocolHTTP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, ena
 
 bool networkProtocolHTTP::close(enable_interrupt_t enable_interrupt)
 {
+    dir_end();
+
     size_t putPos;
     uint8_t *putBuf;
 
@@ -363,15 +412,21 @@ bool networkProtocolHTTP::read(uint8_t *rx_buf, unsigned short len)
     case DATA:
         if (openMode == DIR)
         {
-            string fragment = dirString.substr(0, len);
-            memcpy(rx_buf, fragment.data(), fragment.size());
-            dirString.erase(0, len);
+            dir_fill(len);
+            size_t n = dirString.size() - dirOffset;
+            if (n > len)
+                n = len;
+            memcpy(rx_buf, dirString.data() + dirOffset, n);
+            dirOffset += n;
             return false;
         }
+        else if (rangeMode)
+            return range_read(rx_buf, len);
         else
         {
             if (client.read(rx_buf, len) != len)
                 return true;
+            position += len;
             break;
         case HEADERS:
             if (headerIndex < numHeaders)
@@ -508,10 +563,14 @@ bool networkProtocolHTTP::status(uint8_t *status_buf)
                 if (!startConnection(status_buf, 4))
                     return true;
 
-            status_buf[0] = dirString.size() & 0xFF;
-            status_buf[1] = dirString.size() >> 8;
-            status_buf[2] = (dirString.size() > 0 ? 1 : 0);
-            status_buf[3] = (dirString.size() > 0 ? 1 : 136);
+            dir_fill(1);
+            a = dirString.size() - dirOffset;
+            a = a > 0xFFFF ? 0xFFFF : a;
+
+            status_buf[0] = a & 0xFF;
+            status_buf[1] = a >> 8;
+            status_buf[2] = (a > 0 ? 1 : 0);
+            status_buf[3] = (a > 0 ? 1 : 136);
         }
         else
         {
@@ -521,7 +580,7 @@ bool networkProtocolHTTP::status(uint8_t *status_buf)
                     return true;
             }
 
-            a = client.available();
+            a = rangeMode ? range_available() : client.available();
             a = a > 0xFFFF ? 0xFFFF : a;
 
             status_buf[0] = a & 0xFF;
@@ -601,7 +660,237 @@ void networkProtocolHTTP::special_ca_toggle(unsigned char a)
 
 bool networkProtocolHTTP::isConnected()
 {
-    return client.available() > 0;
+    return available() > 0;
+}
+
+bool networkProtocolHTTP::note(uint8_t *rx_buf)
+{
+    uint32_t pos = position & 0xFFFFFF; // 24 bit value.
+
+    memcpy(rx_buf, &pos, 3);
+    return true;
+}
+
+/*
+ Moving anywhere but where the stream's already up to switches us over to
+ fetching blocks with Range requests
+*/
+bool networkProtocolHTTP::point(uint8_t *tx_buf)
+{
+    uint32_t pos = 0;
+
+    memcpy(&pos, tx_buf, 3);
+
+    if (openMode != GET)
+        return true;
+
+    if (requestStarted == false)
+    {
+        if (!startConnection(tx_buf, 3))
+            return true;
+    }
+
+    if (rangeMode == false)
+    {
+        if (pos == position)
+            return false;
+
+        Debug_printf("networkProtocolHTTP::point %u, switching to Range requests\n", pos);
+        client.close();
+        rangeMode = true;
+        streamOpen = false;
+    }
+
+    if (resourceSize >= 0 && pos > resourceSize)
+        return true;
+
+    position = pos;
+    return false;
+}
+
+/*
+ Gets the response stream to offset, asking for len bytes from there.
+ Returns 0 when the next client.read() will return the data at offset,
+ 1 if offset is past the end of the resource, or -1 on error.
+*/
+int networkProtocolHTTP::range_fetch(size_t offset, size_t len)
+{
+    if (rangesUnsupported == false)
+    {
+        char range[32];
+        const char *keys[] = {"Content-Range"};
+
+        client.close();
+        if (client.begin(rangeUrl) == false)
+            return -1;
+        client.collect_headers(keys, 1);
+        snprintf(range, sizeof(range), "bytes=%u-%u", offset, offset + len - 1);
+        client.set_header("Range", range);
+        resultCode = client.GET();
+
+        if (resultCode == 206 || resultCode == 416)
+        {
+            // "bytes first-last/total", or "bytes */total" for a 416
+            string contentRange = client.get_header("Content-Range");
+            size_t slash = contentRange.find('/');
+            if (slash != string::npos && contentRange[slash + 1] != '*')
+                resourceSize = atol(contentRange.c_str() + slash + 1);
+            return resultCode == 206 ? 0 : 1;
+        }
+
+        if (resultCode != 200)
+            return -1;
+
+        Debug_printf("Server ignored our Range request, falling back to reading from the start\n");
+        rangesUnsupported = true;
+        streamOpen = true;
+        streamPosition = 0;
+        if (client.available() > 0)
+            resourceSize = client.available();
+    }
+    else if (streamOpen == false || streamPosition > offset)
+    {
+        client.close();
+        if (client.begin(rangeUrl) == false)
+            return -1;
+        resultCode = client.GET();
+        streamOpen = resultCode == 200;
+        streamPosition = 0;
+        if (streamOpen == false)
+            return -1;
+    }
+
+    // Throw away everything up to where we want to be
+    uint8_t discard[256];
+    while (streamPosition < offset)
+    {
+        size_t n = offset - streamPosition;
+        if (n > sizeof(discard))
+            n = sizeof(discard);
+        int r = client.read(discard, n);
+        if (r <= 0)
+        {
+            streamOpen = false;
+            return 1;
+        }
+        streamPosition += r;
+    }
+    return 0;
+}
+
+/*
+ Returns the cached block with the given number, fetching it if we don't have it.
+ Up to count blocks from there are fetched in the same request if they're missing too.
+ Returns nullptr past the end of the resource or on error.
+*/
+httpRangeBlock *networkProtocolHTTP::range_block(long number, int count)
+{
+    for (int i = 0; i < HTTP_RANGE_CACHE_BLOCKS; i++)
+    {
+        if (rangeBlocks[i].number == number)
+        {
+            rangeBlocks[i].last_used = ++rangeClock;
+            return &rangeBlocks[i];
+        }
+    }
+
+    if (resourceSize >= 0 && (size_t)number * HTTP_RANGE_BLOCK_SIZE >= resourceSize)
+        return nullptr;
+
+    if (rangeCache == nullptr)
+    {
+        rangeCache = (uint8_t *)heap_caps_malloc(HTTP_RANGE_BLOCK_SIZE * HTTP_RANGE_CACHE_BLOCKS, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (rangeCache == nullptr)
+        {
+            Debug_printf("networkProtocolHTTP couldn't allocate range cache\n");
+            return nullptr;
+        }
+        for (int i = 0; i < HTTP_RANGE_CACHE_BLOCKS; i++)
+            rangeBlocks[i].data = rangeCache + i * HTTP_RANGE_BLOCK_SIZE;
+    }
+
+    // Coalesce the run of missing blocks after this one into the same request
+    if (count > HTTP_RANGE_MAX_COALESCE)
+        count = HTTP_RANGE_MAX_COALESCE;
+    for (int n = 1; n < count; n++)
+    {
+        for (int i = 0; i < HTTP_RANGE_CACHE_BLOCKS; i++)
+            if (rangeBlocks[i].number == number + n)
+                count = n;
+    }
+
+    if (range_fetch(number * HTTP_RANGE_BLOCK_SIZE, count * HTTP_RANGE_BLOCK_SIZE) != 0)
+        return nullptr;
+
+    httpRangeBlock *first = nullptr;
+    for (int n = 0; n < count; n++)
+    {
+        // Least recently used block makes way
+        httpRangeBlock *victim = &rangeBlocks[0];
+        for (int i = 1; i < HTTP_RANGE_CACHE_BLOCKS; i++)
+            if (rangeBlocks[i].last_used < victim->last_used)
+                victim = &rangeBlocks[i];
+
+        victim->number = -1;
+        int got = client.read(victim->data, HTTP_RANGE_BLOCK_SIZE);
+        if (got <= 0)
+            break;
+
+        victim->number = number + n;
+        victim->len = got;
+        victim->last_used = ++rangeClock;
+        streamPosition += got;
+        if (first == nullptr)
+            first = victim;
+
+        // A short block is the last one there is
+        if (got < HTTP_RANGE_BLOCK_SIZE)
+        {
+            if (resourceSize < 0)
+                resourceSize = (number + n) * HTTP_RANGE_BLOCK_SIZE + got;
+            break;
+        }
+    }
+
+    return first;
+}
+
+bool networkProtocolHTTP::range_read(uint8_t *rx_buf, unsigned short len)
+{
+    size_t copied = 0;
+
+    while (copied < len)
+    {
+        size_t pos = position + copied;
+        long number = pos / HTTP_RANGE_BLOCK_SIZE;
+        long last = (pos + (len - copied) - 1) / HTTP_RANGE_BLOCK_SIZE;
+        size_t skip = pos - number * HTTP_RANGE_BLOCK_SIZE;
+
+        httpRangeBlock *block = range_block(number, last - number + 1);
+        if (block == nullptr || block->len <= skip)
+            break;
+
+        size_t n = block->len - skip;
+        if (n > len - copied)
+            n = len - copied;
+        memcpy(rx_buf + copied, block->data + skip, n);
+        copied += n;
+    }
+
+    position += copied;
+    return copied != len;
+}
+
+int networkProtocolHTTP::range_available()
+{
+    // Fetching the block we're in tells us how big the resource is if we didn't know
+    httpRangeBlock *block = range_block(position / HTTP_RANGE_BLOCK_SIZE, 1);
+
+    if (resourceSize >= 0)
+        return position < resourceSize ? resourceSize - position : 0;
+
+    size_t skip = position % HTTP_RANGE_BLOCK_SIZE;
+    return (block != nullptr && block->len > skip) ? block->len - skip : 0;
 }
 
 bool networkProtocolHTTP::del(EdUrlParser *urlParser, cmdFrame_t *cmdFrame)
@@ -742,5 +1031,7 @@ bool networkProtocolHTTP::special(uint8_t *sp_buf, unsigned short len, cmdFrame_
 
 int networkProtocolHTTP::available()
 {
+    if (rangeMode)
+        return range_available();
     return client.available();
 }
\ No newline at end of file
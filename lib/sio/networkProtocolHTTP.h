@@ -1,6 +1,8 @@
 #ifndef NETWORKPROTOCOLHTTP
 #define NETWORKPROTOCOLHTTP
 
+#include <expat.h>
+
 #include "networkProtocol.h"
 
 #include "../http/fnHttpClient.h"
@@ -8,13 +10,28 @@
 #include "EdUrlParser.h"
 #include "sio.h"
 
+#define HTTP_RANGE_BLOCK_SIZE 4096 // Bytes fetched and cached at a time once we're seeking around
+#define HTTP_RANGE_CACHE_BLOCKS 8
+#define HTTP_RANGE_MAX_COALESCE 4 // Most missing blocks we'll ask for in one Range request
+#define HTTP_DIR_CHUNK_SIZE 4096 // How much of a PROPFIND response we parse at a time
+
+struct httpRangeBlock
+{
+    long number = -1; // Block index in the resource, or -1 if unused
+    size_t len = 0; // Less than HTTP_RANGE_BLOCK_SIZE for the last block
+    uint32_t last_used = 0;
+    uint8_t *data = nullptr;
+};
+
 class DAVEntry
 {
 public:
     string filename;
-    size_t filesize;
+    size_t filesize = 0;
 };
 
+class DAVHandler;
+
 class networkProtocolHTTP : public networkProtocol
 {
 public:
@@ -37,6 +54,8 @@ public:
     virtual bool rename(EdUrlParser *urlParser, cmdFrame_t *cmdFrame);
     virtual bool mkdir(EdUrlParser *urlParser, cmdFrame_t *cmdFrame);
     virtual bool rmdir(EdUrlParser *urlParser, cmdFrame_t *cmdFrame);
+    virtual bool note(uint8_t *rx_buf);
+    virtual bool point(uint8_t *tx_buf);
     virtual int available();
     
     virtual bool isConnected();
@@ -44,6 +63,14 @@ public:
 private:
     virtual bool startConnection(uint8_t *buf, unsigned short len);
     void parseDir();
+    void dir_start(bool keepEntries);
+    void dir_fill(size_t wanted);
+    void dir_end();
+
+    int range_fetch(size_t offset, size_t len);
+    httpRangeBlock *range_block(long number, int count);
+    bool range_read(uint8_t *rx_buf, unsigned short len);
+    int range_available();
 
     //HTTPClient client;
     fnHttpClient client;
@@ -85,9 +112,29 @@ private:
     size_t comma_pos;
     unsigned char aux1;
     unsigned char aux2;
-    string dirString;
+    string dirString; // Listing parsed so far; read() hands it out from dirOffset
+    size_t dirOffset = 0;
+    XML_Parser dirParser = nullptr;
+    DAVHandler *dirHandler = nullptr;
+    bool dirDone = true;
     vector<DAVEntry> dirEntries;
     string postData;
+
+    /*
+     GETs are read as one stream until the Atari POINTs somewhere else. From
+     then on, reads come from a small block cache filled with Range requests.
+     Servers that ignore Range get re-read from the start and skipped forward.
+    */
+    string rangeUrl; // The URL the GET actually found (after any crunch-resolving)
+    size_t position = 0; // Where the next read comes from
+    long resourceSize = -1; // -1 until we know
+    bool rangeMode = false;
+    bool rangesUnsupported = false;
+    size_t streamPosition = 0; // Where the open response is up to, when ranges are unsupported
+    bool streamOpen = false;
+    uint8_t *rangeCache = nullptr;
+    httpRangeBlock rangeBlocks[HTTP_RANGE_CACHE_BLOCKS];
+    uint32_t rangeClock = 0;
 };
 
 #endif /* NETWORKPROTOCOLHTTP */
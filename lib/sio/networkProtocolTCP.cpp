@@ -1,6 +1,37 @@
 #include <string.h>
+#include <errno.h>
+#include <lwip/sockets.h>
 #include "networkProtocolTCP.h"
 
+// Feeds the prefetch ring straight from the socket
+static int _tcp_prefetch_source(void *arg, uint8_t *buf, size_t len)
+{
+    int fd = (int)(intptr_t)arg;
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = NETWORK_PREFETCH_WAIT_MS * 1000;
+
+    int res = select(fd + 1, &fds, nullptr, nullptr, &tv);
+    if (res < 0)
+        return -1;
+    if (res == 0)
+        return 0;
+
+    res = recv(fd, buf, len, MSG_DONTWAIT);
+    if (res > 0)
+        return res;
+    if (res == 0)
+    {
+        Debug_printf("TCP prefetch: peer closed fd %d\n", fd);
+        return -1;
+    }
+    return (errno == EWOULDBLOCK || errno == EAGAIN) ? 0 : -1;
+}
+
 networkProtocolTCP::networkProtocolTCP()
 {
     Debug_printf("networkProtocolTCP::ctor\n");
@@ -11,11 +42,11 @@ networkProtocolTCP::networkProtocolTCP()
 networkProtocolTCP::~networkProtocolTCP()
 {
     Debug_printf("networkProtocolTCP::dtor\n");
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++)
+        drop_client(i);
+
     if (server != nullptr)
     {
-        if (client.connected())
-            client.stop();
-
         server->stop();
         delete server;
         server = nullptr;
@@ -33,12 +64,14 @@ bool networkProtocolTCP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enab
     Debug_printf("networkProtocolTCP::open %s:%s\n", urlParser->hostName.c_str(), urlParser->port.c_str());
 #endif
 
+    selected = 0;
+
     if (urlParser->hostName == "")
     {
 #ifdef DEBUG
         Debug_printf("Creating server object on port %s\n", urlParser->port.c_str());
 #endif
-        server = new fnTcpServer(atoi(urlParser->port.c_str()));
+        server = new fnTcpServer(atoi(urlParser->port.c_str()), TCP_MAX_CLIENTS);
         server->begin(atoi(urlParser->port.c_str()));
         connectionIsServer = true;
     }
@@ -48,13 +81,18 @@ bool networkProtocolTCP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enab
         Debug_printf("Connecting to host %s port %s\n", urlParser->path.c_str(), urlParser->port.c_str());
 #endif
         connectionIsServer = false;
-        client.connect(urlParser->hostName.c_str(), atoi(urlParser->port.c_str()));
+        clients[0].client.connect(urlParser->hostName.c_str(), atoi(urlParser->port.c_str()));
     }
 
-    if (client.connected() || (server != NULL))
+    if (clients[0].client.connected() || (server != NULL))
     {
         ret = true;
         client_error_code = 0;
+        if (server == NULL)
+        {
+            start_prefetch(0);
+            start_coalescer(0);
+        }
     }
     else
     {
@@ -76,15 +114,15 @@ bool networkProtocolTCP::close(enable_interrupt_t enable_interrupt)
 #ifdef DEBUG
         Debug_printf("closing TCP client\n");
 #endif
-        client.stop();
+        drop_client(0);
     }
     else
     {
 #ifdef DEBUG
         Debug_printf("closing TCP server\n");
 #endif
-        if (client.connected())
-            client.stop();
+        for (int i = 0; i < TCP_MAX_CLIENTS; i++)
+            drop_client(i);
 
         server->stop();
     }
@@ -93,26 +131,40 @@ bool networkProtocolTCP::close(enable_interrupt_t enable_interrupt)
 
 bool networkProtocolTCP::read(uint8_t *rx_buf, unsigned short len)
 {
-    Debug_printf("TCP read %d bytes\n", len);
+    tcpClientSlot &slot = clients[selected];
+
+    Debug_printf("TCP read %d bytes from slot %u\n", len, selected);
 
-    if (!client.connected())
+    if (!client_connected(selected))
     {
         client_error_code = 128;
         return false;
     }
-    return (client.read(rx_buf, len) != len);
+
+    // Whatever we've asked the peer for should go before we wait for its answer
+    if (slot.coalescer != nullptr)
+        slot.coalescer->flush();
+
+    if (slot.prefetch != nullptr)
+        return slot.prefetch->read(rx_buf, len) != len;
+    return (slot.client.read(rx_buf, len) != len);
 }
 
 bool networkProtocolTCP::write(uint8_t *tx_buf, unsigned short len)
 {
-    Debug_printf("TCP write %d bytes\n", len);
+    tcpClientSlot &slot = clients[selected];
+
+    Debug_printf("TCP write %d bytes to slot %u\n", len, selected);
 
-    if (!client.connected())
+    if (!slot.client.connected())
     {
         client_error_code = 128;
         return false;
     }
-    return client.write(tx_buf, len) != len;
+
+    if (slot.coalescer != nullptr)
+        return slot.coalescer->write(tx_buf, len) != len;
+    return slot.client.write(tx_buf, len) != len;
 }
 
 bool networkProtocolTCP::status(uint8_t *status_buf)
@@ -120,35 +172,40 @@ bool networkProtocolTCP::status(uint8_t *status_buf)
     unsigned short available_bytes;
 
     memset(status_buf, 0x00, 4);
-    if (client.connected())
+    if (client_connected(selected))
     {
-        available_bytes = client.available();
+        available_bytes = available();
         status_buf[0] = available_bytes & 0xFF;
         status_buf[1] = available_bytes >> 8;
-        status_buf[2] = (client.connected() == false ? 0 : 1);
-        status_buf[3] = (client.connected() == false ? 136 : 1);
+        status_buf[2] = 1;
+        status_buf[3] = 1;
     }
     else if (server != NULL)
     {
-        if (!client.connected())
-        {
-            status_buf[2] = server->hasClient();
-            status_buf[3] = (_isConnected==true ? 136 : 1);
-        }    
-        else
-        {
-            status_buf[2] = client.connected();
-        }
+        status_buf[2] = server->hasClient();
+        status_buf[3] = (_isConnected==true ? 136 : 1);
     }
     return false;
 }
 
 bool networkProtocolTCP::special_supported_00_command(unsigned char comnd)
 {
-    if (comnd == 'A')
+    switch (comnd)
+    {
+    case 'A': // Accept connection
+    case 'E': // Select connection (aux2)
+    case 'K': // Drop connection (aux2)
+    case 'F': // Flush writes
+    case 'G': // Set write deadline (aux2)
+    case 'N': // Set TCP_NODELAY (aux2)
         return true;
-    else
-        return false;
+    }
+    return false;
+}
+
+bool networkProtocolTCP::special_supported_40_command(unsigned char comnd)
+{
+    return comnd == 'Q'; // Connection table
 }
 
 bool networkProtocolTCP::special(uint8_t *sp_buf, unsigned short len, cmdFrame_t *cmdFrame)
@@ -160,11 +217,62 @@ bool networkProtocolTCP::special(uint8_t *sp_buf, unsigned short len, cmdFrame_t
     case 'A':
         ret = special_accept_connection();
         break;
+    case 'E':
+        ret = special_select_client(cmdFrame->aux2);
+        break;
+    case 'K':
+        ret = special_drop_client(cmdFrame->aux2);
+        break;
+    case 'Q':
+        ret = special_client_table(sp_buf);
+        break;
+    case 'F':
+        ret = special_flush();
+        break;
+    case 'G':
+        ret = special_set_deadline(cmdFrame->aux2);
+        break;
+    case 'N':
+        ret = special_set_nodelay(cmdFrame->aux2 != 0);
+        break;
     }
 
     return ret;
 }
 
+/*
+ Takes the next waiting connection into slot, returning the slot or -1
+*/
+int networkProtocolTCP::accept_into(int slot)
+{
+    if (!server->hasClient())
+        return -1;
+
+    drop_client(slot);
+    clients[slot].client = server->available();
+    if (!clients[slot].client.connected())
+        return -1;
+
+    start_prefetch(slot);
+    start_coalescer(slot);
+    Debug_printf("TCP server accepted connection into slot %d\n", slot);
+    return slot;
+}
+
+/*
+ Moves every waiting connection we have room for into a free slot, so the
+ Atari only has to look at the table to see who's arrived
+*/
+void networkProtocolTCP::accept_pending()
+{
+    if (server == NULL)
+        return;
+
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++)
+        if (!client_connected(i) && accept_into(i) < 0)
+            break;
+}
+
 bool networkProtocolTCP::special_accept_connection()
 {
     if (server == NULL)
@@ -172,28 +280,182 @@ bool networkProtocolTCP::special_accept_connection()
         Debug_printf("accept connection attempted on non-server scoket.");
         return true; // error
     }
-    else
+
+    Debug_printf("accepting connection.");
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++)
     {
-        Debug_printf("accepting connection.");
-        if (server->hasClient())
-        {
-            client = server->available();
-            _isConnected=true;
-        }
-        else
+        if (client_connected(i))
+            continue;
+
+        if (accept_into(i) < 0)
+            return true; // error.
+
+        selected = i;
+        _isConnected = true;
+        return false; // no error.
+    }
+
+    Debug_printf("no free connection slots.\n");
+    return true; // error.
+}
+
+bool networkProtocolTCP::special_select_client(uint8_t slot)
+{
+    if (server == NULL || slot >= TCP_MAX_CLIENTS)
+        return true; // error
+
+    selected = slot;
+    _isConnected = true;
+    return false;
+}
+
+bool networkProtocolTCP::special_drop_client(uint8_t slot)
+{
+    if (server == NULL || slot >= TCP_MAX_CLIENTS)
+        return true; // error
+
+    Debug_printf("TCP server dropping slot %u\n", slot);
+    drop_client(slot);
+    return false;
+}
+
+bool networkProtocolTCP::special_client_table(uint8_t *sp_buf)
+{
+    accept_pending();
+
+    memset(sp_buf, 0, 4);
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++)
+    {
+        if (client_connected(i))
+            sp_buf[0] |= 1 << i;
+        if (client_available(i) > 0)
+            sp_buf[1] |= 1 << i;
+    }
+    sp_buf[2] = (server != NULL && server->hasClient()) ? 1 : 0;
+    sp_buf[3] = selected;
+    return false;
+}
+
+bool networkProtocolTCP::special_flush()
+{
+    networkCoalescer *coalescer = clients[selected].coalescer;
+    if (coalescer == nullptr)
+        return false;
+    return coalescer->flush() == false;
+}
+
+bool networkProtocolTCP::special_set_deadline(uint8_t ms)
+{
+    Debug_printf("TCP write deadline now %ums\n", ms);
+    tx_deadline_ms = ms;
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++)
+        if (clients[i].coalescer != nullptr)
         {
-            return true;    // error.
+            clients[i].coalescer->set_deadline(ms);
+            if (ms == 0)
+                clients[i].coalescer->flush();
         }
-    }
-    return false; // no error.
+    return false;
+}
+
+bool networkProtocolTCP::special_set_nodelay(bool nodelay)
+{
+    Debug_printf("TCP_NODELAY now %s\n", nodelay ? "on" : "off");
+    no_delay = nodelay;
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++)
+        if (clients[i].client.connected())
+            clients[i].client.setNoDelay(nodelay);
+    return false;
+}
+
+void networkProtocolTCP::drop_client(int slot)
+{
+    // Anything still waiting to go out goes now, and prefetch has to stop before the socket's closed
+    stop_coalescer(slot);
+    stop_prefetch(slot);
+    if (clients[slot].client.connected())
+        clients[slot].client.stop();
+    clients[slot].client = fnTcpClient();
 }
 
 bool networkProtocolTCP::isConnected()
 {
-    return client.connected();
+    return client_connected(selected);
 }
 
 int networkProtocolTCP::available()
 {
-    return client.available();
-}
\ No newline at end of file
+    return client_available(selected);
+}
+
+int networkProtocolTCP::client_available(int slot)
+{
+    if (clients[slot].prefetch != nullptr)
+        return clients[slot].prefetch->available();
+    return clients[slot].client.available();
+}
+
+/*
+ Starts pulling data from a client socket in the background. If we can't,
+ reads just go to the socket directly as they always did.
+*/
+void networkProtocolTCP::start_prefetch(int slot)
+{
+    stop_prefetch(slot);
+
+    networkPrefetch *prefetch = new networkPrefetch(_tcp_prefetch_source, (void *)(intptr_t)clients[slot].client.fd());
+    if (prefetch->start() == false)
+    {
+        delete prefetch;
+        prefetch = nullptr;
+    }
+    clients[slot].prefetch = prefetch;
+}
+
+void networkProtocolTCP::stop_prefetch(int slot)
+{
+    if (clients[slot].prefetch == nullptr)
+        return;
+
+    // Must be done before the socket's closed
+    delete clients[slot].prefetch;
+    clients[slot].prefetch = nullptr;
+}
+
+/*
+ Starts gathering writes to a client socket into full segments. If we
+ can't, writes just go to the socket directly as they always did.
+*/
+void networkProtocolTCP::start_coalescer(int slot)
+{
+    stop_coalescer(slot);
+
+    clients[slot].client.setNoDelay(no_delay);
+
+    networkCoalescer *coalescer = new networkCoalescer(&clients[slot].client);
+    coalescer->set_deadline(tx_deadline_ms);
+    if (coalescer->start() == false)
+    {
+        delete coalescer;
+        coalescer = nullptr;
+    }
+    clients[slot].coalescer = coalescer;
+}
+
+void networkProtocolTCP::stop_coalescer(int slot)
+{
+    if (clients[slot].coalescer == nullptr)
+        return;
+
+    // Sends whatever's still waiting
+    delete clients[slot].coalescer;
+    clients[slot].coalescer = nullptr;
+}
+
+// The peer may have gone, but we're still connected until the Atari's read what it sent
+bool networkProtocolTCP::client_connected(int slot)
+{
+    if (clients[slot].client.connected())
+        return true;
+    return clients[slot].prefetch != nullptr && clients[slot].prefetch->available() > 0;
+}
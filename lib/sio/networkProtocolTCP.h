@@ -7,7 +7,33 @@
 #include "sio.h"
 #include "EdUrlParser.h"
 #include "networkProtocol.h"
+#include "networkPrefetch.h"
+#include "networkCoalescer.h"
 
+#define TCP_MAX_CLIENTS 4 // Connections a server can hold at once (also the listen backlog)
+
+struct tcpClientSlot
+{
+    fnTcpClient client;
+    networkPrefetch *prefetch = nullptr;
+    networkCoalescer *coalescer = nullptr;
+};
+
+/*
+ A TCP client, or a server holding up to TCP_MAX_CLIENTS connections.
+ Read, write and status go to the selected connection. The server
+ specials are 'A' to accept, 'E' to select (aux2) and 'K' to drop (aux2)
+ a connection, and 'Q' returns a DVSTAT-sized summary of all of them:
+   [0] bit per slot that's connected
+   [1] bit per slot with data waiting
+   [2] 1 if more connections are waiting than we have slots for
+   [3] the selected slot
+ (O, C, R, W and S are sioNetwork's own commands, so specials can't use them.)
+ Writes are gathered into full segments by a networkCoalescer; 'G' sets
+ how long (aux2, in ms) a write can wait for more before it goes, 'F'
+ sends whatever's waiting now, and 'N' turns TCP_NODELAY on (aux2 1) or
+ off (aux2 0). Those apply to every connection, including later ones.
+*/
 class networkProtocolTCP : public networkProtocol
 {
 public:
@@ -21,16 +47,37 @@ public:
     virtual bool status(uint8_t* status_buf);
     virtual bool special(uint8_t* sp_buf, unsigned short len, cmdFrame_t* cmdFrame);
     virtual bool special_supported_00_command(unsigned char comnd);
+    virtual bool special_supported_40_command(unsigned char comnd);
     virtual bool isConnected();
     virtual int available();
     
 private:
-    fnTcpClient client;
+    tcpClientSlot clients[TCP_MAX_CLIENTS];
+    uint8_t selected = 0; // The one read, write and status work on; always 0 for a client
     fnTcpServer * server;
     uint8_t client_error_code;
+    uint32_t tx_deadline_ms = NETWORK_COALESCE_DEADLINE_MS;
+    bool no_delay = false;
 
     bool _isConnected;
     bool special_accept_connection();
+    bool special_select_client(uint8_t slot);
+    bool special_drop_client(uint8_t slot);
+    bool special_client_table(uint8_t *sp_buf);
+    bool special_flush();
+    bool special_set_deadline(uint8_t ms);
+    bool special_set_nodelay(bool nodelay);
+
+    int accept_into(int slot);
+    void accept_pending();
+    void drop_client(int slot);
+
+    void start_prefetch(int slot);
+    void stop_prefetch(int slot);
+    void start_coalescer(int slot);
+    void stop_coalescer(int slot);
+    bool client_connected(int slot);
+    int client_available(int slot);
 };
 
 #endif // NETWORKPROTOCOLTCP
\ No newline at end of file
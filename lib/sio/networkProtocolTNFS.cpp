@@ -253,54 +253,25 @@ bool networkProtocolTNFS::special_supported_80_command(unsigned char comnd)
 
 bool networkProtocolTNFS::block_read(uint8_t *rx_buf, unsigned short len)
 {
-    unsigned short total_len = len;
-    unsigned short block_len = TNFS_MAX_READWRITE_PAYLOAD;
     uint16_t actual_len;
 
-    while (total_len > 0)
+    // tnfs_read splits larger requests into as many TNFS READs as it needs, keeping several in flight
+    int result = tnfs_read(&mountInfo, fileHandle, rx_buf, len, &actual_len);
+    if (result != 0 && result != TNFS_RESULT_END_OF_FILE)
     {
-        if (total_len > TNFS_MAX_READWRITE_PAYLOAD)
-            block_len = TNFS_MAX_READWRITE_PAYLOAD;
-        else
-            block_len = total_len;
-
-        int result = tnfs_read(&mountInfo, fileHandle, rx_buf, block_len, &actual_len);
-        if (result != 0 && result != TNFS_RESULT_END_OF_FILE)
-        {
-            return true; // error.
-        }
-        else
-        {
-            rx_buf += block_len;
-            total_len -= block_len;
-        }
+        return true; // error.
     }
     return false; // no error
 }
 
 bool networkProtocolTNFS::block_write(uint8_t *tx_buf, unsigned short len)
 {
-    unsigned short total_len = len;
-    unsigned short block_len = TNFS_MAX_READWRITE_PAYLOAD;
     uint16_t actual_len;
 
-    while (total_len > 0)
-    {
-        if (total_len > TNFS_MAX_READWRITE_PAYLOAD)
-            block_len = TNFS_MAX_READWRITE_PAYLOAD;
-        else
-            block_len = total_len;
+    // tnfs_write buffers and splits the data into full-sized requests itself
+    if (tnfs_write(&mountInfo, fileHandle, tx_buf, len, &actual_len) != 0)
+        return true; // error.
 
-        if (tnfs_write(&mountInfo, fileHandle, tx_buf, block_len, &actual_len) != 0)
-        {
-            return true; // error.
-        }
-        else
-        {
-            tx_buf += block_len;
-            total_len -= block_len;
-        }
-    }
     return false; // no error
 }
 
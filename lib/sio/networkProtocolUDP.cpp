@@ -6,7 +6,6 @@ networkProtocolUDP::networkProtocolUDP()
 #ifdef DEBUG
     Debug_printf("networkProtocolUDP::ctor\n");
 #endif
-    saved_rx_buffer_len = 0;
     strcpy(dest, "localhost");
 }
 
@@ -15,7 +14,8 @@ networkProtocolUDP::~networkProtocolUDP()
 #ifdef DEBUG
     Debug_printf("networkProtocolUDP::dtor\n");
 #endif
-    saved_rx_buffer_len = 0;
+    delete queue;
+    queue = nullptr;
 }
 
 bool networkProtocolUDP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enable_interrupt_t enable_interrupt)
@@ -32,11 +32,26 @@ bool networkProtocolUDP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enab
 #endif
     }
 
-    return udp.begin(atoi(urlParser->port.c_str()));
+    if (!udp.begin(atoi(urlParser->port.c_str())))
+        return false;
+
+    delete queue;
+    queue = new networkDatagramQueue(udp.fd());
+    if (queue->start() == false)
+    {
+        delete queue;
+        queue = nullptr;
+        udp.stop();
+        return false;
+    }
+    return true;
 }
 
 bool networkProtocolUDP::close(enable_interrupt_t enable_interrupt)
 {
+    // The queue has to stop before the socket's closed
+    delete queue;
+    queue = nullptr;
     udp.stop();
     return true;
 }
@@ -47,9 +62,26 @@ bool networkProtocolUDP::read(uint8_t *rx_buf, unsigned short len)
     Debug_printf("networkProtocolUDP::read %d bytes\n", len);
 #endif
 
-    memcpy(rx_buf, saved_rx_buffer, len);
-    memset(saved_rx_buffer, 0, len);
-    saved_rx_buffer_len = 0;
+    const networkDatagram *datagram = queue == nullptr ? nullptr : queue->front();
+    if (datagram == nullptr)
+        return false;
+
+    if (with_header)
+    {
+        uint8_t header[UDP_DATAGRAM_HEADER_SIZE];
+        memcpy(header, &datagram->ip, 4);
+        header[4] = datagram->port & 0xFF;
+        header[5] = datagram->port >> 8;
+        header[6] = datagram->len & 0xFF;
+        header[7] = datagram->len >> 8;
+
+        size_t n = len < UDP_DATAGRAM_HEADER_SIZE ? len : UDP_DATAGRAM_HEADER_SIZE;
+        memcpy(rx_buf, header, n);
+        rx_buf += n;
+        len -= n;
+    }
+
+    queue->pop(rx_buf, len);
     return false;
 }
 
@@ -75,28 +107,33 @@ bool networkProtocolUDP::write(uint8_t *tx_buf, unsigned short len)
 
 bool networkProtocolUDP::status(uint8_t *status_buf)
 {
-    unsigned short len = udp.parsePacket();
+    const networkDatagram *datagram = queue == nullptr ? nullptr : queue->front();
 
-    if (len > 0)
+    if (datagram != nullptr)
     {
         // Set destination automatically to remote address.
-        //strcpy(dest, udp.remoteIP().toString().c_str());
-        in_addr_t addr = udp.remoteIP();
+        in_addr_t addr = datagram->ip;
         strcpy(dest, inet_ntoa(addr));
-        //port = udp.remotePort();
-
-        saved_rx_buffer_len = len;
-        udp.read(saved_rx_buffer, len);
+        //port = datagram->port;
     }
 
-    status_buf[0] = saved_rx_buffer_len & 0xFF;
-    status_buf[1] = saved_rx_buffer_len >> 8;
+    unsigned short len = available();
+    status_buf[0] = len & 0xFF;
+    status_buf[1] = len >> 8;
     status_buf[2] = 1;
     status_buf[3] = 0x00;
 
     return false;
 }
 
+bool networkProtocolUDP::special_supported_00_command(unsigned char comnd)
+{
+    if (comnd == 'M') // Set header mode
+        return true;
+    else
+        return false;
+}
+
 bool networkProtocolUDP::special_supported_80_command(unsigned char comnd)
 {
     if (comnd == 'D') // Set DEST address
@@ -143,11 +180,26 @@ bool networkProtocolUDP::special(uint8_t *sp_buf, unsigned short len, cmdFrame_t
     case 'D':
         err = special_set_destination(sp_buf, len);
         break;
+    case 'M':
+        err = special_set_header_mode(cmdFrame->aux2 != 0);
+        break;
     }
     return err;
 }
 
+bool networkProtocolUDP::special_set_header_mode(bool on)
+{
+#ifdef DEBUG
+    Debug_printf("UDP datagram headers %s\n", on ? "on" : "off");
+#endif
+    with_header = on;
+    return false;
+}
+
 int networkProtocolUDP::available()
 {
-    return saved_rx_buffer_len;
+    const networkDatagram *datagram = queue == nullptr ? nullptr : queue->front();
+    if (datagram == nullptr)
+        return 0;
+    return datagram->len + (with_header ? UDP_DATAGRAM_HEADER_SIZE : 0);
 }
\ No newline at end of file
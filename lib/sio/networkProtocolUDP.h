@@ -1,11 +1,23 @@
 #ifndef NETWORKPROTOCOLUDP
 #define NETWORKPROTOCOLUDP
 #include "../tcpip/fnUDP.h"
+#include "networkDatagramQueue.h"
 
 #include "sio.h"
 #include "networkProtocol.h"
 #include "EdUrlParser.h"
 
+#define UDP_DATAGRAM_HEADER_SIZE 8
+
+/*
+ Datagrams are queued as they arrive (see networkDatagramQueue), and each
+ READ takes the next one; STATUS gives its length. After 'M' with aux2 1,
+ each datagram comes with a header in the same READ:
+   [0-3] sender's IP address, first octet first
+   [4-5] sender's port, low byte first
+   [6-7] length of the data that follows, low byte first
+ and the length in STATUS includes it. aux2 0 goes back to just the data.
+*/
 class networkProtocolUDP : public networkProtocol 
 {
 public:
@@ -20,6 +32,7 @@ public:
     virtual bool special(uint8_t* sp_buf, unsigned short len, cmdFrame_t* cmdFrame);
     virtual int available();
 
+    virtual bool special_supported_00_command(unsigned char comnd);
     virtual bool special_supported_80_command(unsigned char comnd);
 
 private:
@@ -27,10 +40,11 @@ private:
     fnUDP udp;
     char dest[64];
     unsigned short port;
-    char saved_rx_buffer[512];
-    unsigned short saved_rx_buffer_len=0;
+    networkDatagramQueue *queue = nullptr;
+    bool with_header = false;
 
     bool special_set_destination(uint8_t* sp_buf, unsigned short len);
+    bool special_set_header_mode(bool on);
 };
 
 #endif // NETWORKPROTOCOLUDP
@@ -331,6 +331,8 @@ void sioBus::service()
     // Neither CMD nor active modem, so throw out any stray input data
     {
         fnUartSIO.flush_input();
+        _fujiDev->sync_disks();
+        _fujiDev->keep_hosts_alive();
     }
 
     // Handle interrupts from network protocols
@@ -51,6 +51,8 @@ public:
 
     in_addr_t remoteIP();
     uint16_t remotePort();
+
+    int fd() const { return udp_server; }
 };
 
 #endif //_FN_UDP_
@@ -0,0 +1,127 @@
+#include <cstring>
+#include <esp_heap_caps.h>
+
+#include "bufferArena.h"
+#include "utils.h"
+#include "../../include/debug.h"
+
+// The one everyone shares
+BufferArena fnBufferArena;
+
+static const size_t _class_sizes[BUFFER_ARENA_CLASSES] = { 256, 1024, 4096, 16384, 65536 };
+// We don't want to sit on too many of the big ones
+static const uint8_t _class_max_free[BUFFER_ARENA_CLASSES] = { 8, 8, 4, 4, 2 };
+
+// Returns the smallest class that holds size bytes, or -1 if none does
+int BufferArena::_class_for(size_t size)
+{
+    for (int i = 0; i < BUFFER_ARENA_CLASSES; i++)
+        if (size <= _class_sizes[i])
+            return i;
+    return -1;
+}
+
+uint8_t *BufferArena::acquire(size_t size, size_t *capacity)
+{
+    int c = _class_for(size);
+    if (c < 0)
+    {
+        Debug_printf("BufferArena::acquire %u bytes is larger than we handle\n", size);
+        portENTER_CRITICAL(&_mux);
+        stats.failures++;
+        portEXIT_CRITICAL(&_mux);
+        return nullptr;
+    }
+
+    uint8_t *buffer = nullptr;
+    portENTER_CRITICAL(&_mux);
+    if (_free_count[c] > 0)
+    {
+        buffer = _free[c][--_free_count[c]];
+        stats.reuses++;
+        stats.bytes_held -= _class_sizes[c];
+    }
+    portEXIT_CRITICAL(&_mux);
+
+    // Nothing to re-use, so it has to come from the heap (which we don't want to do with the lock held)
+    if (buffer == nullptr)
+        buffer = (uint8_t *)heap_caps_malloc(_class_sizes[c], MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+    portENTER_CRITICAL(&_mux);
+    if (buffer == nullptr)
+        stats.failures++;
+    else
+    {
+        stats.acquires++;
+        stats.bytes_in_use += _class_sizes[c];
+        if (stats.bytes_in_use > stats.bytes_in_use_peak)
+            stats.bytes_in_use_peak = stats.bytes_in_use;
+    }
+    portEXIT_CRITICAL(&_mux);
+
+    if (buffer != nullptr)
+        *capacity = _class_sizes[c];
+    return buffer;
+}
+
+void BufferArena::release(uint8_t *buffer, size_t capacity)
+{
+    if (buffer == nullptr)
+        return;
+
+    int c = _class_for(capacity);
+    bool kept = false;
+
+    portENTER_CRITICAL(&_mux);
+    stats.releases++;
+    stats.bytes_in_use -= capacity;
+    if (c >= 0 && _class_sizes[c] == capacity && _free_count[c] < _class_max_free[c])
+    {
+        _free[c][_free_count[c]++] = buffer;
+        stats.bytes_held += capacity;
+        kept = true;
+    }
+    else
+        stats.heap_frees++;
+    portEXIT_CRITICAL(&_mux);
+
+    if (!kept)
+        heap_caps_free(buffer);
+}
+
+uint8_t *BufferArena::grow(uint8_t *buffer, size_t *capacity, size_t needed)
+{
+    if (buffer != nullptr && needed <= *capacity)
+        return buffer;
+
+    size_t new_capacity;
+    uint8_t *new_buffer = acquire(needed, &new_capacity);
+    if (new_buffer == nullptr)
+        return nullptr;
+
+    if (buffer != nullptr)
+    {
+        memcpy(new_buffer, buffer, *capacity);
+        release(buffer, *capacity);
+        portENTER_CRITICAL(&_mux);
+        stats.grows++;
+        portEXIT_CRITICAL(&_mux);
+    }
+
+    *capacity = new_capacity;
+    return new_buffer;
+}
+
+void BufferArena::debug_print_stats()
+{
+    // How badly PSRAM's been chopped up: 0% means all the free space is in one piece
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+    unsigned fragmentation = free_size == 0 ? 0 : (unsigned)(100 - (uint64_t)largest * 100 / free_size);
+    __IGNORE_UNUSED_VAR(fragmentation);
+
+    Debug_printf("BufferArena: acquires=%u (reused %u), grows=%u, releases=%u (to heap %u), failures=%u\n",
+                 stats.acquires, stats.reuses, stats.grows, stats.releases, stats.heap_frees, stats.failures);
+    Debug_printf("BufferArena: in use=%u (peak %u), held=%u; PSRAM free=%u, largest block=%u, fragmentation=%u%%\n",
+                 stats.bytes_in_use, stats.bytes_in_use_peak, stats.bytes_held, free_size, largest, fragmentation);
+}
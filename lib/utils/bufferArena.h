@@ -0,0 +1,58 @@
+#ifndef _BUFFER_ARENA_H
+#define _BUFFER_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+
+#define BUFFER_ARENA_CLASSES 5 // 256, 1K, 4K, 16K and 64K
+#define BUFFER_ARENA_MAX_FREE 8 // Most freed buffers we'll hold on to in any one class
+
+struct bufferArenaStats
+{
+    uint32_t acquires = 0; // Buffers handed out (including the larger ones from grow)
+    uint32_t reuses = 0; // Of those, how many came off a free list instead of the heap
+    uint32_t grows = 0; // Times a buffer was swapped for a larger one
+    uint32_t releases = 0; // Buffers given back to us
+    uint32_t heap_frees = 0; // Of those, how many went back to the heap because their free list was full
+    uint32_t failures = 0; // Requests we couldn't satisfy
+    uint32_t bytes_in_use = 0; // Capacity of all the buffers handed out right now
+    uint32_t bytes_in_use_peak = 0;
+    uint32_t bytes_held = 0; // Capacity of the free buffers we're holding for re-use
+};
+
+/*
+ A pool of PSRAM buffers in a handful of size classes, for things that need a
+ large buffer for a while and then give it back (sioNetwork's receive, transmit
+ and special buffers). Freed buffers are kept on a per-class free list for the
+ next caller, so opening and closing devices over and over doesn't keep carving
+ up PSRAM or waiting on the allocator.
+ Buffers start at the smallest class that fits and can be grown later, so a
+ device that only ever moves a few bytes at a time never takes 64K.
+*/
+class BufferArena
+{
+private:
+    portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+    uint8_t *_free[BUFFER_ARENA_CLASSES][BUFFER_ARENA_MAX_FREE];
+    uint8_t _free_count[BUFFER_ARENA_CLASSES] = { 0 };
+
+    int _class_for(size_t size);
+
+public:
+    bufferArenaStats stats;
+
+    // Returns a buffer of at least size bytes (its actual size is stored in capacity), or nullptr
+    uint8_t *acquire(size_t size, size_t *capacity);
+    // Gives back a buffer from acquire or grow along with the capacity we returned for it
+    void release(uint8_t *buffer, size_t capacity);
+    // Makes sure buffer holds at least needed bytes, moving its contents to a larger one if it has to.
+    // Returns the buffer to use from now on, or nullptr (leaving the original alone) on failure.
+    uint8_t *grow(uint8_t *buffer, size_t *capacity, size_t needed);
+
+    void debug_print_stats();
+};
+
+extern BufferArena fnBufferArena;
+
+#endif // _BUFFER_ARENA_H
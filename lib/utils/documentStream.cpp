@@ -0,0 +1,137 @@
+/**
+ * What the streaming document parsers (JSON, XML) share
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <esp_heap_caps.h>
+
+#include "documentStream.h"
+#include "fnSystem.h"
+#include "../../include/debug.h"
+
+DocumentEvents::~DocumentEvents()
+{
+    free(_events);
+}
+
+void DocumentEvents::clear()
+{
+    free(_events);
+    _events = nullptr;
+    _len = _size = 0;
+}
+
+/**
+ * Make room for len more bytes, doubling the buffer as often as it takes
+ */
+bool DocumentEvents::_reserve(size_t len)
+{
+    size_t needed = _len + len;
+    if (needed <= _size)
+        return true;
+
+    size_t new_size = _size == 0 ? DOCUMENT_EVENTS_INITIAL_SIZE : _size;
+    while (new_size < needed)
+        new_size *= 2;
+
+    uint8_t *p = (uint8_t *)heap_caps_realloc(_events, new_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (p == nullptr)
+    {
+        Debug_printf("DocumentEvents couldn't grow event buffer to %u bytes\n", new_size);
+        return false;
+    }
+    _events = p;
+    _size = new_size;
+    return true;
+}
+
+// The caller has already reserved room for the length (at most 5 bytes) and data
+void DocumentEvents::_append(const char *data, size_t len)
+{
+    size_t l = len;
+    do
+    {
+        uint8_t b = l & 0x7F;
+        l >>= 7;
+        _events[_len++] = b | (l ? 0x80 : 0);
+    } while (l);
+    if (len > 0)
+        memcpy(_events + _len, data, len);
+    _len += len;
+}
+
+bool DocumentEvents::add(uint8_t type)
+{
+    if (!_reserve(1))
+        return false;
+    _events[_len++] = type;
+    return true;
+}
+
+bool DocumentEvents::add(uint8_t type, const char *data, size_t len)
+{
+    if (!_reserve(1 + 5 + len))
+        return false;
+    _events[_len++] = type;
+    _append(data, len);
+    return true;
+}
+
+bool DocumentEvents::add_value(const char *data, size_t len)
+{
+    if (!_reserve(5 + len))
+        return false;
+    _append(data, len);
+    return true;
+}
+
+size_t DocumentEvents::read_len(const uint8_t *events, size_t &pos)
+{
+    size_t len = 0;
+    int shift = 0;
+    uint8_t b;
+    do
+    {
+        b = events[pos++];
+        len |= (size_t)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return len;
+}
+
+bool document_read_protocol(networkProtocol *protocol, size_t chunk_size, unsigned long timeout_ms,
+                            std::function<uint8_t *(size_t len)> buffer, std::function<bool(size_t len)> consume,
+                            std::function<bool()> complete, size_t *total)
+{
+    *total = 0;
+
+    unsigned long last_data = fnSystem.millis();
+    while (true)
+    {
+        int available = protocol->available();
+        if (available <= 0)
+        {
+            // Finished, or the rest of the document isn't coming
+            if (complete() || fnSystem.millis() - last_data > timeout_ms)
+                return true;
+            fnSystem.delay(10);
+            continue;
+        }
+
+        size_t len = (size_t)available > chunk_size ? chunk_size : available;
+        uint8_t *buf = buffer(len);
+        if (buf == nullptr)
+            return false;
+        if (protocol->read(buf, len) == true)
+        {
+            Debug_printf("document_read_protocol - Could not read %u bytes from protocol adapter.\n", len);
+            return false;
+        }
+
+        *total += len;
+        last_data = fnSystem.millis();
+        if (!consume(len))
+            return false;
+    }
+}
@@ -0,0 +1,64 @@
+/**
+ * What the streaming document parsers (JSON, XML) share: the compact list of
+ * events a parsed document is kept as, and reading the document from a
+ * protocol as it arrives.
+ */
+
+#ifndef DOCUMENTSTREAM_H
+#define DOCUMENTSTREAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <networkProtocol.h>
+
+#define DOCUMENT_EVENTS_INITIAL_SIZE 1024
+
+/*
+ A growing buffer of events in PSRAM. Each event is a type byte, and those
+ that carry data are followed by its length (7 bits a byte, low bits first)
+ and that many bytes. The parsers choose the type bytes and which of them
+ carry data.
+*/
+class DocumentEvents
+{
+private:
+    uint8_t *_events = nullptr;
+    size_t _len = 0;
+    size_t _size = 0;
+
+    bool _reserve(size_t len);
+    void _append(const char *data, size_t len);
+
+public:
+    ~DocumentEvents();
+
+    // Throws away every event and the buffer
+    void clear();
+
+    // These return false if the buffer couldn't grow, leaving it as it was
+    bool add(uint8_t type);
+    bool add(uint8_t type, const char *data, size_t len);
+    // Just a length and data, for a value that belongs to the event before it
+    bool add_value(const char *data, size_t len);
+
+    const uint8_t *data() { return _events; }
+    size_t len() { return _len; }
+
+    // Reads the length at pos, leaving pos at the data that follows
+    static size_t read_len(const uint8_t *events, size_t &pos);
+};
+
+/*
+ Reads a document from protocol at most chunk_size bytes at a time as it
+ arrives. buffer(len) says where the next chunk goes (nullptr to give up) and
+ consume(len) hands it to the parser, which returns false to stop. Reading
+ carries on until complete() says the document's all there, or nothing has
+ arrived for timeout_ms. Returns false if a chunk couldn't be read or
+ consumed; total is set to the bytes read either way.
+*/
+bool document_read_protocol(networkProtocol *protocol, size_t chunk_size, unsigned long timeout_ms,
+                            std::function<uint8_t *(size_t len)> buffer, std::function<bool(size_t len)> consume,
+                            std::function<bool()> complete, size_t *total);
+
+#endif /* DOCUMENTSTREAM_H */
@@ -429,6 +429,121 @@ void util_dump_bytes(uint8_t *buff, uint32_t buff_size)
     Debug_println();
 }
 
+// Fills table with the byte-for-byte mapping for EOL translation in one direction
+static void _util_eol_table(uint8_t table[256], bool to_atascii, uint8_t mode, bool tabs)
+{
+    for (int i = 0; i < 256; i++)
+        table[i] = i;
+
+    if (to_atascii)
+    {
+        switch (mode & 3)
+        {
+        case EOL_TRANSLATION_CR:
+            table[0x0D] = 0x9B;
+            break;
+        case EOL_TRANSLATION_LF:
+            table[0x0A] = 0x9B;
+            break;
+        case EOL_TRANSLATION_CRLF:
+            // CR becomes a space so the length doesn't change
+            table[0x0D] = 0x20;
+            table[0x0A] = 0x9B;
+            break;
+        }
+        if (tabs)
+            table[0x09] = 0x7F;
+    }
+    else
+    {
+        // CR/LF expands to two bytes, which util_eol_from_atascii handles itself
+        switch (mode & 3)
+        {
+        case EOL_TRANSLATION_CR:
+            table[0x9B] = 0x0D;
+            break;
+        case EOL_TRANSLATION_LF:
+            table[0x9B] = 0x0A;
+            break;
+        }
+        if (tabs)
+            table[0x7F] = 0x09;
+    }
+}
+
+/**
+ * Translates ASCII line endings (and optionally TABs) to ATASCII in place.
+ * @param buff The data to translate.
+ * @param len Number of bytes in buff.
+ * @param mode One of the EOL_TRANSLATION_* values.
+ * @param tabs true = also translate ASCII TAB to ATASCII TAB.
+ */
+void util_eol_to_atascii(uint8_t *buff, size_t len, uint8_t mode, bool tabs)
+{
+    uint8_t table[256];
+    _util_eol_table(table, true, mode, tabs);
+
+    for (size_t i = 0; i < len; i++)
+        buff[i] = table[buff[i]];
+}
+
+/**
+ * Translates ATASCII EOLs (and optionally TABs) to ASCII in place. In CR/LF mode
+ * each EOL becomes two bytes, so the data grows; anything that won't fit in
+ * capacity once expanded is dropped rather than written past the end of buff.
+ * @param buff The data to translate.
+ * @param len Number of bytes in buff.
+ * @param capacity Most bytes buff can hold.
+ * @param mode One of the EOL_TRANSLATION_* values.
+ * @param tabs true = also translate ATASCII TAB to ASCII TAB.
+ * @return Number of bytes in buff after translation.
+ */
+size_t util_eol_from_atascii(uint8_t *buff, size_t len, size_t capacity, uint8_t mode, bool tabs)
+{
+    uint8_t table[256];
+    _util_eol_table(table, false, mode, tabs);
+
+    if (len > capacity)
+        len = capacity;
+
+    if ((mode & 3) != EOL_TRANSLATION_CRLF)
+    {
+        for (size_t i = 0; i < len; i++)
+            buff[i] = table[buff[i]];
+        return len;
+    }
+
+    // Work out how much of the input fits once it's expanded...
+    size_t in = 0;
+    size_t out = 0;
+    while (in < len)
+    {
+        size_t width = buff[in] == 0x9B ? 2 : 1;
+        if (out + width > capacity)
+            break;
+        out += width;
+        in++;
+    }
+    if (in < len)
+        Debug_printf("util_eol_from_atascii dropping %u bytes that don't fit\n", len - in);
+
+    // ...then expand from the end backwards so nothing's overwritten before it's been read
+    size_t o = out;
+    while (in > 0)
+    {
+        uint8_t c = buff[--in];
+        if (c == 0x9B)
+        {
+            buff[--o] = 0x0A;
+            buff[--o] = 0x0D;
+        }
+        else
+            buff[--o] = table[c];
+    }
+
+    return out;
+}
+
 vector<string> util_tokenize(string s, char c)
 {
     vector<string> tokens;
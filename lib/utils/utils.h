@@ -54,6 +54,15 @@ bool util_concat_paths(char *dest, const char *parent, const char *child, int de
 
 void util_dump_bytes(uint8_t *buff, uint32_t buff_size);
 
+// End-of-line translation modes (the low two bits of aux2 for N: devices)
+#define EOL_TRANSLATION_NONE 0
+#define EOL_TRANSLATION_CR 1
+#define EOL_TRANSLATION_LF 2
+#define EOL_TRANSLATION_CRLF 3
+
+void util_eol_to_atascii(uint8_t *buff, size_t len, uint8_t mode, bool tabs);
+size_t util_eol_from_atascii(uint8_t *buff, size_t len, size_t capacity, uint8_t mode, bool tabs);
+
 std::vector<std::string> util_tokenize(std::string s, char c = ' ');
 
 bool util_string_value_is_true(std::string value);
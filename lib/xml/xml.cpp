@@ -0,0 +1,389 @@
+/**
+ * XML Parser wrapper for #FujiNet
+ */
+
+#include <string.h>
+#include <map>
+
+#include "xml.h"
+#include "../../include/debug.h"
+
+/**
+ * ctor
+ */
+XML::XML()
+{
+    Debug_printf("XML::ctor()\n");
+}
+
+/**
+ * dtor
+ */
+XML::~XML()
+{
+    Debug_printf("XML::dtor()\n");
+    _reset();
+    _protocol = nullptr;
+}
+
+/**
+ * Attach protocol handler
+ */
+void XML::setProtocol(networkProtocol *newProtocol)
+{
+    Debug_printf("XML::setProtocol()\n");
+    _protocol = newProtocol;
+}
+
+/**
+ * Forget the last document
+ */
+void XML::_reset()
+{
+    _events.clear();
+    _failed = false;
+    _depth = 0;
+    _done = false;
+    _text.clear();
+    _value_ready = false;
+}
+
+/**
+ * Set read query string, compiling it into segments
+ */
+void XML::setReadQuery(string queryString)
+{
+    // Drop any EOL or spaces the Atari left on the end
+    while (!queryString.empty() && (queryString.back() == '\x9b' || queryString.back() == '\n' || queryString.back() == '\r' || queryString.back() == ' '))
+        queryString.pop_back();
+
+    _segments.clear();
+    _attribute.clear();
+    _value_ready = false;
+
+    size_t pos = 0;
+    while (pos < queryString.size())
+    {
+        bool descendant = false;
+        if (queryString.compare(pos, 2, "//") == 0)
+        {
+            descendant = true;
+            pos += 2;
+        }
+        else if (queryString[pos] == '/')
+            pos++;
+
+        size_t end = queryString.find('/', pos);
+        if (end == string::npos)
+            end = queryString.size();
+        string name = queryString.substr(pos, end - pos);
+        pos = end;
+
+        if (name.empty() || name == "text()")
+            continue;
+
+        if (name[0] == '@')
+        {
+            // "//@href" means the attribute on any element at all
+            if (descendant)
+            {
+                XMLQuerySegment segment;
+                segment.descendant = true;
+                segment.any = true;
+                _segments.push_back(segment);
+            }
+            _attribute = name.substr(1);
+            break;
+        }
+
+        XMLQuerySegment segment;
+        segment.descendant = descendant;
+        size_t bracket = name.find('[');
+        if (bracket != string::npos)
+        {
+            segment.index = atoi(name.c_str() + bracket + 1);
+            name.erase(bracket);
+        }
+        segment.any = name == "*";
+        segment.name = name;
+        _segments.push_back(segment);
+    }
+
+    Debug_printf("XML::setReadQuery() - %u segments%s%s\n", _segments.size(),
+                 _attribute.empty() ? "" : ", attribute ", _attribute.c_str());
+}
+
+/**
+ * Append an event, with its length and data unless it's an end. A type of
+ * 0 appends just a length and data, for an attribute's value.
+ */
+void XML::_emit(uint8_t type, const char *data, size_t len)
+{
+    bool added;
+    if (type == 0)
+        added = _events.add_value(data, len);
+    else if (type == XML_EV_END)
+        added = _events.add(type);
+    else
+        added = _events.add(type, data, len);
+
+    if (!added)
+        _failed = true;
+}
+
+void XML::_flush_text()
+{
+    if (_text.empty())
+        return;
+    _emit(XML_EV_TEXT, _text.data(), _text.size());
+    _text.clear();
+}
+
+void XML::_start_element(void *userData, const XML_Char *name, const XML_Char **atts)
+{
+    XML *xml = (XML *)userData;
+    if (xml->_failed)
+        return;
+
+    if (++xml->_depth > XML_MAX_DEPTH)
+    {
+        Debug_printf("XML elements nested deeper than %d\n", XML_MAX_DEPTH);
+        xml->_failed = true;
+        return;
+    }
+
+    xml->_flush_text();
+    xml->_emit(XML_EV_ELEMENT, name, strlen(name));
+    for (int i = 0; atts[i] != nullptr; i += 2)
+    {
+        xml->_emit(XML_EV_ATTRIBUTE, atts[i], strlen(atts[i]));
+        xml->_emit(0, atts[i + 1], strlen(atts[i + 1])); // Its value, straight after
+    }
+}
+
+void XML::_end_element(void *userData, const XML_Char *name)
+{
+    XML *xml = (XML *)userData;
+    if (xml->_failed)
+        return;
+
+    xml->_flush_text();
+    xml->_emit(XML_EV_END, nullptr, 0);
+    if (--xml->_depth == 0)
+        xml->_done = true;
+}
+
+void XML::_character_data(void *userData, const XML_Char *s, int len)
+{
+    XML *xml = (XML *)userData;
+    if (xml->_failed || xml->_depth == 0)
+        return;
+    xml->_text.append(s, len);
+}
+
+/**
+ * Parse data from protocol, a chunk at a time as it arrives
+ */
+bool XML::parse()
+{
+    size_t total = 0;
+    bool ok = true;
+
+    if (_protocol == nullptr)
+    {
+        Debug_printf("XML::parse() - NULL protocol.\n");
+        return false;
+    }
+
+    _reset();
+
+    XML_Parser parser = XML_ParserCreate(NULL);
+    if (parser == nullptr)
+    {
+        Debug_printf("XML::parse() - could not create parser\n");
+        return false;
+    }
+    XML_SetUserData(parser, this);
+    XML_SetElementHandler(parser, _start_element, _end_element);
+    XML_SetCharacterDataHandler(parser, _character_data);
+
+    ok = document_read_protocol(
+        _protocol, XML_PARSE_CHUNK_SIZE, XML_PARSE_TIMEOUT_MS,
+        [parser](size_t len) { return (uint8_t *)XML_GetBuffer(parser, len); },
+        [this, parser](size_t len) { return XML_ParseBuffer(parser, len, false) != XML_STATUS_ERROR && _failed == false; },
+        [this]() { return _done; }, &total);
+
+    if (ok && _failed == false && XML_ParseBuffer(parser, 0, true) == XML_STATUS_ERROR)
+        ok = false;
+
+    if (XML_GetErrorCode(parser) != XML_ERROR_NONE)
+        Debug_printf("XML::parse() - %s at line %lu\n", XML_ErrorString(XML_GetErrorCode(parser)),
+                     (unsigned long)XML_GetCurrentLineNumber(parser));
+    XML_ParserFree(parser);
+
+    if (!ok || _failed || !_done)
+    {
+        Debug_printf("XML::parse() - Could not parse XML (%u bytes read)\n", total);
+        return false;
+    }
+
+    Debug_printf("XML::parse() - parsed %u bytes into %u bytes of events\n", total, _events.len());
+    return true;
+}
+
+/*
+ Does the query match the open elements, segment s onwards against level onwards?
+ A "//" segment can skip over any number of levels to find its element.
+*/
+static bool _match_from(const vector<XMLQuerySegment> &segments, size_t s,
+                        const char **names, const size_t *name_lens, const int *indices, size_t level, size_t depth)
+{
+    if (s == segments.size())
+        return level == depth;
+
+    const XMLQuerySegment &segment = segments[s];
+    size_t last = segment.descendant ? depth : level + 1;
+    for (size_t l = level; l < last && l < depth; l++)
+    {
+        bool name_ok = segment.any || (segment.name.size() == name_lens[l] && memcmp(segment.name.data(), names[l], name_lens[l]) == 0);
+        bool index_ok = segment.index == 0 || segment.index == indices[l];
+        if (name_ok && index_ok && _match_from(segments, s + 1, names, name_lens, indices, l + 1, depth))
+            return true;
+    }
+    return false;
+}
+
+bool XML::_path_matches(const char **names, const size_t *name_lens, const int *indices, size_t depth)
+{
+    if (_segments.empty())
+        return depth == 1; // Just the root
+    return _match_from(_segments, 0, names, name_lens, indices, 0, depth);
+}
+
+/**
+ * Work out the value for the current query, if we haven't already
+ */
+void XML::runQuery()
+{
+    if (_value_ready)
+        return;
+
+    _value.clear();
+    _matches = 0;
+    _value_ready = true;
+
+    const uint8_t *events = _events.data();
+    size_t events_len = _events.len();
+    if (events == nullptr)
+        return;
+
+    // The open elements, and how many of each name we've seen under each of them so far
+    const char *names[XML_MAX_DEPTH];
+    size_t name_lens[XML_MAX_DEPTH];
+    int indices[XML_MAX_DEPTH];
+    vector<std::map<string, int>> counts(XML_MAX_DEPTH + 1);
+    size_t depth = 0;
+
+    // Matched elements still open, collecting their text; the results are kept in document order
+    vector<pair<size_t, size_t>> captures; // depth, result
+    vector<string> results;
+
+    size_t pos = 0;
+    while (pos < events_len)
+    {
+        uint8_t type = events[pos++];
+        switch (type)
+        {
+        case XML_EV_ELEMENT:
+        {
+            size_t len = DocumentEvents::read_len(events, pos);
+            const char *name = (const char *)events + pos;
+            pos += len;
+
+            names[depth] = name;
+            name_lens[depth] = len;
+            indices[depth] = ++counts[depth][string(name, len)];
+            counts[depth + 1].clear();
+            depth++;
+
+            if (!_path_matches(names, name_lens, indices, depth))
+                break;
+
+            if (_attribute.empty())
+            {
+                captures.push_back(make_pair(depth, results.size()));
+                results.emplace_back();
+                break;
+            }
+
+            // Look through this element's attributes for the one we want
+            size_t p = pos;
+            while (p < events_len && events[p] == XML_EV_ATTRIBUTE)
+            {
+                p++;
+                size_t attr_len = DocumentEvents::read_len(events, p);
+                const char *attr = (const char *)events + p;
+                p += attr_len;
+                size_t value_len = DocumentEvents::read_len(events, p);
+                if (attr_len == _attribute.size() && memcmp(attr, _attribute.data(), attr_len) == 0)
+                    results.push_back(string((const char *)events + p, value_len));
+                p += value_len;
+            }
+            break;
+        }
+        case XML_EV_ATTRIBUTE:
+            pos += DocumentEvents::read_len(events, pos);
+            pos += DocumentEvents::read_len(events, pos);
+            break;
+        case XML_EV_TEXT:
+        {
+            size_t len = DocumentEvents::read_len(events, pos);
+            for (auto &capture : captures)
+                results[capture.second].append((const char *)events + pos, len);
+            pos += len;
+            break;
+        }
+        case XML_EV_END:
+            if (!captures.empty() && captures.back().first == depth)
+                captures.pop_back();
+            depth--;
+            break;
+        }
+    }
+
+    for (auto &result : results)
+    {
+        size_t start = result.find_first_not_of(" \t\r\n");
+        size_t end = result.find_last_not_of(" \t\r\n");
+        if (start != string::npos)
+            _value.append(result, start, end - start + 1);
+        _value += "\x9b";
+    }
+    _matches = results.size();
+
+    Debug_printf("XML::runQuery() - %d matches, %u bytes\n", _matches, _value.size());
+}
+
+/**
+ * Return requested value
+ */
+bool XML::readValue(uint8_t *rx_buf, unsigned short len)
+{
+    runQuery();
+
+    if (_matches == 0)
+        return true; // error
+
+    memcpy(rx_buf, _value.data(), _value.size() > len ? len : _value.size());
+
+    return false; // no error.
+}
+
+/**
+ * Return requested value length
+ */
+int XML::readValueLen()
+{
+    runQuery();
+    return _value.size();
+}
@@ -0,0 +1,87 @@
+/**
+ * XML Parser wrapper for #FujiNet
+ */
+
+#ifndef XML_H
+#define XML_H
+
+#include <expat.h>
+#include <string>
+#include <vector>
+#include <networkProtocol.h>
+
+#include "../utils/documentStream.h"
+
+#define XML_PARSE_CHUNK_SIZE 1024
+#define XML_PARSE_TIMEOUT_MS 1000 // How long to wait for the rest of a document that's stopped arriving
+#define XML_MAX_DEPTH 64
+
+/*
+ Events recorded while parsing, in a DocumentEvents buffer. Elements,
+ attributes and text carry data. An attribute's name is followed by its
+ value (just a length and data), and an element's attributes come
+ straight after it.
+*/
+#define XML_EV_ELEMENT 'E'
+#define XML_EV_ATTRIBUTE 'A'
+#define XML_EV_TEXT 'T'
+#define XML_EV_END 'X'
+
+struct XMLQuerySegment
+{
+    bool descendant = false; // Came after "//", so it can be any number of levels further down
+    bool any = false; // "*"
+    int index = 0; // From "name[n]", counting from 1 as XPath does; 0 matches every one
+    string name;
+};
+
+/*
+ Parses an XML document (RSS, Atom, OPML and the like) from a protocol
+ with expat, a chunk at a time as it arrives, keeping it as a compact list
+ of events instead of the raw text. Queries are a small subset of XPath:
+ /rss/channel/item[2]/title, //item/link, //enclosure/@url and so on.
+ Element paths return the trimmed text inside each match and a final
+ @name returns that attribute; every match comes back followed by an EOL.
+*/
+class XML
+{
+public:
+    XML();
+    virtual ~XML();
+
+    void setProtocol(networkProtocol *newProtocol);
+    void setReadQuery(string queryString);
+
+    bool parse();
+    int readValueLen();
+    bool readValue(uint8_t *buf, unsigned short len);
+
+private:
+    networkProtocol *_protocol = nullptr;
+
+    DocumentEvents _events;
+    bool _failed = false;
+    int _depth = 0;
+    bool _done = false; // The root element's closed
+    string _text; // Character data comes from expat in pieces; this joins them into one event
+
+    vector<XMLQuerySegment> _segments;
+    string _attribute; // Set when the query ends in @name
+
+    // Result of the current query, worked out the first time it's asked for
+    string _value;
+    int _matches = 0;
+    bool _value_ready = false;
+
+    void _reset();
+    void _emit(uint8_t type, const char *data, size_t len);
+    void _flush_text();
+    bool _path_matches(const char **names, const size_t *name_lens, const int *indices, size_t depth);
+    void runQuery();
+
+    static void _start_element(void *userData, const XML_Char *name, const XML_Char **atts);
+    static void _end_element(void *userData, const XML_Char *name);
+    static void _character_data(void *userData, const XML_Char *s, int len);
+};
+
+#endif /* XML_H */
@@ -0,0 +1,13 @@
+/* Host stand-in for ESP-IDF's driver/gpio.h, for the native unit tests.
+   fnSystem.h only needs the type to compile. */
+#ifndef _TEST_NATIVE_DRIVER_GPIO_H
+#define _TEST_NATIVE_DRIVER_GPIO_H
+
+typedef enum
+{
+    GPIO_MODE_DISABLE = 0,
+    GPIO_MODE_INPUT,
+    GPIO_MODE_OUTPUT
+} gpio_mode_t;
+
+#endif // _TEST_NATIVE_DRIVER_GPIO_H
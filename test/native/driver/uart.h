@@ -0,0 +1,13 @@
+/* Host stand-in for ESP-IDF's driver/uart.h, for the native unit tests.
+   debug.h pulls in fnUART.h, which only needs these types to compile; the
+   tests are built without DEBUG so nothing is ever sent to a UART. */
+#ifndef _TEST_NATIVE_DRIVER_UART_H
+#define _TEST_NATIVE_DRIVER_UART_H
+
+#include <cstddef>
+#include <cstdint>
+
+typedef int uart_port_t;
+typedef void *QueueHandle_t;
+
+#endif // _TEST_NATIVE_DRIVER_UART_H
@@ -0,0 +1,21 @@
+/* Host stand-in for ESP-IDF's esp_heap_caps.h, for the native unit tests.
+   There's no PSRAM on the build machine, so everything comes from the C heap. */
+#ifndef _TEST_NATIVE_ESP_HEAP_CAPS_H
+#define _TEST_NATIVE_ESP_HEAP_CAPS_H
+
+#include <cstddef>
+#include <cstdlib>
+
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_8BIT (1 << 2)
+
+inline void *heap_caps_malloc(size_t size, int caps) { return malloc(size); }
+inline void *heap_caps_calloc(size_t n, size_t size, int caps) { return calloc(n, size); }
+inline void *heap_caps_realloc(void *ptr, size_t size, int caps) { return realloc(ptr, size); }
+inline void heap_caps_free(void *ptr) { free(ptr); }
+
+// No PSRAM to report on
+inline size_t heap_caps_get_free_size(int caps) { return 0; }
+inline size_t heap_caps_get_largest_free_block(int caps) { return 0; }
+
+#endif // _TEST_NATIVE_ESP_HEAP_CAPS_H
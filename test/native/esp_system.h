@@ -0,0 +1,14 @@
+/* Host stand-in for ESP-IDF's esp_system.h, for the native unit tests */
+#ifndef _TEST_NATIVE_ESP_SYSTEM_H
+#define _TEST_NATIVE_ESP_SYSTEM_H
+
+#include <cstdint>
+#include <random>
+
+inline uint32_t esp_random()
+{
+    static std::mt19937 generator(1);
+    return generator();
+}
+
+#endif // _TEST_NATIVE_ESP_SYSTEM_H
@@ -0,0 +1,22 @@
+/* Host stand-in for lib/hardware/fnSystem.h, for the native unit tests.
+   Time only moves when someone calls delay(), so code that waits for data
+   with a timeout runs instantly and the same way every time. */
+#ifndef _TEST_NATIVE_FNSYSTEM_H
+#define _TEST_NATIVE_FNSYSTEM_H
+
+#include <cstdint>
+
+class SystemManager
+{
+private:
+    unsigned long _now_ms = 0;
+
+public:
+    unsigned long millis() { return _now_ms; }
+    void delay(uint32_t ms) { _now_ms += ms; }
+    void yield() {}
+};
+
+inline SystemManager fnSystem;
+
+#endif // _TEST_NATIVE_FNSYSTEM_H
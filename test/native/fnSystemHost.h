@@ -0,0 +1,36 @@
+/* The parts of SystemManager that TNFSlib uses, on the host's own clock, for
+   native tests that build against lib/hardware/fnSystem.h itself rather than
+   the stand-in in test/native/fnSystem.h. Include it in one file per test. */
+#ifndef _TEST_NATIVE_FNSYSTEMHOST_H
+#define _TEST_NATIVE_FNSYSTEMHOST_H
+
+#include <chrono>
+#include <thread>
+
+#include "../../lib/hardware/fnSystem.h"
+
+SystemManager fnSystem;
+
+static const std::chrono::steady_clock::time_point _fnsystem_started = std::chrono::steady_clock::now();
+
+unsigned long SystemManager::millis()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _fnsystem_started).count();
+}
+
+unsigned long SystemManager::micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _fnsystem_started).count();
+}
+
+void SystemManager::delay(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void SystemManager::yield()
+{
+    std::this_thread::yield();
+}
+
+#endif // _TEST_NATIVE_FNSYSTEMHOST_H
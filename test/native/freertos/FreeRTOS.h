@@ -0,0 +1,24 @@
+/* Host stand-in for the parts of FreeRTOS the native unit tests need.
+   Ticks are milliseconds, and portMUX critical sections are plain mutexes. */
+#ifndef _TEST_NATIVE_FREERTOS_H
+#define _TEST_NATIVE_FREERTOS_H
+
+#include <cstdint>
+#include <mutex>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+typedef std::mutex portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {}
+#define portENTER_CRITICAL(mux) (mux)->lock()
+#define portEXIT_CRITICAL(mux) (mux)->unlock()
+
+#endif // _TEST_NATIVE_FREERTOS_H
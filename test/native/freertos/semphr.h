@@ -0,0 +1,36 @@
+/* Host stand-in for FreeRTOS's semphr.h, for the native unit tests.
+   Only mutexes are here; plain ones are recursive too, which no caller can tell. */
+#ifndef _TEST_NATIVE_FREERTOS_SEMPHR_H
+#define _TEST_NATIVE_FREERTOS_SEMPHR_H
+
+#include <chrono>
+#include <mutex>
+#include "FreeRTOS.h"
+#include "task.h"
+
+typedef std::recursive_timed_mutex *SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() { return new std::recursive_timed_mutex; }
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return new std::recursive_timed_mutex; }
+inline void vSemaphoreDelete(SemaphoreHandle_t sem) { delete sem; }
+
+inline BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        sem->lock();
+        return pdTRUE;
+    }
+    return sem->try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+inline BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem)
+{
+    sem->unlock();
+    return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) { return xSemaphoreTakeRecursive(sem, ticks); }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) { return xSemaphoreGiveRecursive(sem); }
+
+#endif // _TEST_NATIVE_FREERTOS_SEMPHR_H
@@ -0,0 +1,96 @@
+/* Host stand-in for FreeRTOS's task.h, for the native unit tests.
+   Tasks are detached threads, each with a notification count of its own. */
+#ifndef _TEST_NATIVE_FREERTOS_TASK_H
+#define _TEST_NATIVE_FREERTOS_TASK_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "FreeRTOS.h"
+
+struct _nativeTask
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint32_t notifications = 0;
+};
+
+typedef _nativeTask *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+// The task the calling thread is running, made up on first use for threads we didn't start
+inline TaskHandle_t _native_current_task()
+{
+    static thread_local _nativeTask task;
+    return &task;
+}
+
+inline BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *param,
+                              int priority, TaskHandle_t *created)
+{
+    std::mutex started;
+    std::condition_variable started_cv;
+    TaskHandle_t task = nullptr;
+    std::thread([&, fn, param]() {
+        {
+            // Notified with the lock held, since xTaskCreate's locals are gone once it has it back
+            std::lock_guard<std::mutex> lock(started);
+            task = _native_current_task();
+            started_cv.notify_one();
+        }
+        fn(param);
+    }).detach();
+
+    std::unique_lock<std::mutex> lock(started);
+    started_cv.wait(lock, [&]() { return task != nullptr; });
+    if (created != nullptr)
+        *created = task;
+    return pdPASS;
+}
+
+inline TickType_t xTaskGetTickCount()
+{
+    static const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+inline void xTaskNotifyGive(TaskHandle_t task)
+{
+    {
+        std::lock_guard<std::mutex> lock(task->mutex);
+        task->notifications++;
+    }
+    task->cv.notify_one();
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    TaskHandle_t task = _native_current_task();
+    std::unique_lock<std::mutex> lock(task->mutex);
+    auto notified = [task]() { return task->notifications > 0; };
+    if (ticks == portMAX_DELAY)
+        task->cv.wait(lock, notified);
+    else
+        task->cv.wait_for(lock, std::chrono::milliseconds(ticks), notified);
+
+    uint32_t count = task->notifications;
+    if (count > 0)
+        task->notifications = clear ? 0 : count - 1;
+    return count;
+}
+
+inline void vTaskDelay(TickType_t ticks)
+{
+    if (ticks == 0)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+inline void taskYIELD()
+{
+    std::this_thread::yield();
+}
+
+#endif // _TEST_NATIVE_FREERTOS_TASK_H
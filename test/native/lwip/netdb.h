@@ -0,0 +1,15 @@
+/* Host stand-in for lwIP's netdb.h, for the native unit tests */
+#ifndef _TEST_NATIVE_LWIP_NETDB_H
+#define _TEST_NATIVE_LWIP_NETDB_H
+
+#include <netdb.h>
+#include "sockets.h"
+
+#ifndef IPADDR_NONE
+#define IPADDR_NONE ((in_addr_t)0xffffffffUL)
+#endif
+#ifndef IPADDR_ANY
+#define IPADDR_ANY ((in_addr_t)0x00000000UL)
+#endif
+
+#endif // _TEST_NATIVE_LWIP_NETDB_H
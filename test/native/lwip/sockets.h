@@ -0,0 +1,19 @@
+/* Host stand-in for lwIP's sockets.h, for the native unit tests.
+   lwIP's socket API is the BSD one, so this is mostly the host's own. */
+#ifndef _TEST_NATIVE_LWIP_SOCKETS_H
+#define _TEST_NATIVE_LWIP_SOCKETS_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Functions, not macros, since fnTcpClient has a connect() of its own
+inline int lwip_ioctl(int s, long cmd, void *argp) { return ::ioctl(s, cmd, argp); }
+inline int lwip_connect(int s, const struct sockaddr *name, socklen_t namelen) { return ::connect(s, name, namelen); }
+
+#endif // _TEST_NATIVE_LWIP_SOCKETS_H
@@ -0,0 +1,43 @@
+/* Included ahead of everything in the native unit tests (see [env:native] in
+   platformio-sample.ini) to fill in what ESP-IDF's C library has and the
+   build machine's may not. */
+#ifndef _TEST_NATIVE_COMPAT_H
+#define _TEST_NATIVE_COMPAT_H
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+// glibc only has strlcpy and strlcat from 2.38
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38))
+inline size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+    if (size > 0)
+    {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+
+inline size_t strlcat(char *dst, const char *src, size_t size)
+{
+    size_t dlen = strnlen(dst, size);
+    if (dlen == size)
+        return size + strlen(src);
+    return dlen + strlcpy(dst + dlen, src, size - dlen);
+}
+#endif
+
+// newlib has itoa; glibc doesn't. Only base 10 is used.
+#if defined(__GLIBC__)
+inline char *itoa(int value, char *str, int base)
+{
+    sprintf(str, "%d", value);
+    return str;
+}
+#endif
+
+#endif // _TEST_NATIVE_COMPAT_H
@@ -0,0 +1,23 @@
+/* Host stand-in for lib/sio/networkProtocol.h, for the native unit tests.
+   The real one brings in the whole SIO layer; parsers only ever ask a
+   protocol what's available and read it, so that's all this has. */
+#ifndef _TEST_NATIVE_NETWORKPROTOCOL_H
+#define _TEST_NATIVE_NETWORKPROTOCOL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class networkProtocol
+{
+public:
+    virtual ~networkProtocol() {}
+
+    // Returns true on error, as the real protocols do
+    virtual bool read(uint8_t *rx_buf, unsigned short len) = 0;
+    virtual int available() = 0;
+};
+
+#endif // _TEST_NATIVE_NETWORKPROTOCOL_H
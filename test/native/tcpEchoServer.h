@@ -0,0 +1,128 @@
+/* A TCP echo server for the native tests, on 127.0.0.1. It sends back
+   everything it reads on each connection, counting the reads and bytes
+   as it goes. */
+#ifndef _TEST_NATIVE_TCPECHOSERVER_H
+#define _TEST_NATIVE_TCPECHOSERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define TCP_ECHO_SERVER_POLL_MS 20 // How often the server looks to see if it's being stopped
+
+class tcpEchoServer
+{
+private:
+    int _fd = -1;
+    uint16_t _port = 0;
+    std::thread _thread;
+    std::atomic<bool> _stopping{false};
+
+    // Returns false once the connection's closed
+    bool _echo(int fd)
+    {
+        uint8_t buf[16384];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return false;
+        reads++;
+        bytes += n;
+
+        for (ssize_t sent = 0; sent < n;)
+        {
+            ssize_t s = send(fd, buf + sent, n - sent, MSG_NOSIGNAL);
+            if (s <= 0)
+                return false;
+            sent += s;
+        }
+        return true;
+    }
+
+    void _run()
+    {
+        std::vector<int> conns;
+        while (!_stopping)
+        {
+            std::vector<pollfd> p;
+            p.push_back({_fd, POLLIN, 0});
+            for (int conn : conns)
+                p.push_back({conn, POLLIN, 0});
+            if (poll(p.data(), p.size(), TCP_ECHO_SERVER_POLL_MS) <= 0)
+                continue;
+
+            if (p[0].revents & POLLIN)
+            {
+                int conn = accept(_fd, nullptr, nullptr);
+                if (conn >= 0)
+                    conns.push_back(conn);
+            }
+            for (size_t i = 1; i < p.size(); i++)
+            {
+                if (p[i].revents == 0 || _echo(p[i].fd))
+                    continue;
+                ::close(p[i].fd);
+                conns.erase(std::find(conns.begin(), conns.end(), p[i].fd));
+            }
+        }
+        for (int conn : conns)
+            ::close(conn);
+    }
+
+public:
+    std::atomic<uint32_t> reads{0}; // recv calls that returned data
+    std::atomic<uint32_t> bytes{0};
+
+    ~tcpEchoServer() { stop(); }
+
+    // Starts listening on a free port on 127.0.0.1; returns false if it couldn't
+    bool start()
+    {
+        _fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (_fd < 0)
+            return false;
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len = sizeof(addr);
+        if (bind(_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(_fd, 16) != 0 ||
+            getsockname(_fd, (sockaddr *)&addr, &addr_len) != 0)
+        {
+            ::close(_fd);
+            _fd = -1;
+            return false;
+        }
+        _port = ntohs(addr.sin_port);
+
+        _stopping = false;
+        _thread = std::thread(&tcpEchoServer::_run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (_thread.joinable())
+        {
+            _stopping = true;
+            _thread.join();
+        }
+        if (_fd >= 0)
+        {
+            ::close(_fd);
+            _fd = -1;
+        }
+    }
+
+    uint16_t port() { return _port; }
+};
+
+#endif // _TEST_NATIVE_TCPECHOSERVER_H
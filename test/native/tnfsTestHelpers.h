@@ -0,0 +1,121 @@
+/* What the TNFS tests and benchmarks share: a stand-in server on a scratch
+   directory, files to put in it, and mounting and moving whole files through
+   the client. Include it in one file per test, ahead of the TNFSlib sources. */
+#ifndef _TEST_NATIVE_TNFSTESTHELPERS_H
+#define _TEST_NATIVE_TNFSTESTHELPERS_H
+
+#include <unity.h>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "tnfsTestServer.h"
+
+static std::string root; // The server's directory on the host
+static tnfsTestServer *server = nullptr;
+
+// Makes a scratch directory from the mkdtemp template and starts a server on it (for setUp)
+static inline void start_server(const char *dir_template)
+{
+    std::string dir = dir_template;
+    TEST_ASSERT_NOT_NULL(mkdtemp(&dir[0]));
+    root = dir;
+    server = new tnfsTestServer(root);
+    TEST_ASSERT_TRUE(server->start());
+}
+
+// Stops the server and throws out its directory (for tearDown)
+static inline void stop_server()
+{
+    delete server;
+    server = nullptr;
+    std::filesystem::remove_all(root);
+}
+
+// The same bytes every time for a given seed
+static inline std::vector<uint8_t> make_data(size_t len, uint32_t seed)
+{
+    std::vector<uint8_t> data(len);
+    for (size_t i = 0; i < len; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+    return data;
+}
+
+static inline void write_host_file(const std::string &name, const std::vector<uint8_t> &data)
+{
+    FILE *f = fopen((root + "/" + name).c_str(), "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    if (!data.empty())
+        fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+}
+
+static inline std::vector<uint8_t> read_host_file(const std::string &name)
+{
+    std::vector<uint8_t> data;
+    FILE *f = fopen((root + "/" + name).c_str(), "rb");
+    if (f == nullptr)
+        return data;
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    return data;
+}
+
+static inline tnfsMountInfo *mount()
+{
+    tnfsMountInfo *m_info = new tnfsMountInfo(htonl(INADDR_LOOPBACK), server->port());
+    m_info->transport = TNFS_TRANSPORT_UDP;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_mount(m_info));
+    return m_info;
+}
+
+static inline void unmount(tnfsMountInfo *m_info)
+{
+    tnfs_umount(m_info);
+    delete m_info;
+}
+
+// Reads the whole of a file through the client, bufflen bytes at a time
+static inline std::vector<uint8_t> read_file(tnfsMountInfo *m_info, const char *path, uint16_t bufflen)
+{
+    std::vector<uint8_t> data;
+    int16_t fh;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, path, TNFS_OPENMODE_READ, 0, &fh));
+    std::vector<uint8_t> buf(bufflen);
+    int result;
+    do
+    {
+        uint16_t got = 0;
+        result = tnfs_read(m_info, fh, buf.data(), bufflen, &got);
+        data.insert(data.end(), buf.begin(), buf.begin() + got);
+    } while (result == TNFS_RESULT_SUCCESS);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_END_OF_FILE, result);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, fh));
+    return data;
+}
+
+// Writes a new file through the client, bufflen bytes at a time
+static inline void write_file(tnfsMountInfo *m_info, const char *path, const std::vector<uint8_t> &data, uint16_t bufflen)
+{
+    int16_t fh;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, path,
+        TNFS_OPENMODE_WRITE | TNFS_OPENMODE_WRITE_CREATE | TNFS_OPENMODE_WRITE_TRUNCATE, 0644, &fh));
+    for (size_t pos = 0; pos < data.size(); pos += bufflen)
+    {
+        uint16_t len = data.size() - pos < bufflen ? data.size() - pos : bufflen;
+        uint16_t put = 0;
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_write(m_info, fh, (uint8_t *)data.data() + pos, len, &put));
+        TEST_ASSERT_EQUAL(len, put);
+    }
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, fh));
+}
+
+#endif // _TEST_NATIVE_TNFSTESTHELPERS_H
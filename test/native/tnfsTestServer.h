@@ -0,0 +1,767 @@
+/* A small TNFS server for the native tests, serving a local directory over UDP
+   on 127.0.0.1. It speaks enough of the protocol for everything tnfslib sends
+   (see lib/TNFSlib/tnfs-protocol.md) and can make the link a poor one: requests
+   and replies can be lost, requests duplicated, and replies delayed or
+   delivered out of order. Like tnfsd, it remembers its recent replies so a
+   duplicated request is answered again instead of being carried out twice. */
+#ifndef _TEST_NATIVE_TNFSTESTSERVER_H
+#define _TEST_NATIVE_TNFSTESTSERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "../../lib/TNFSlib/tnfslib.h"
+
+#define TNFS_TEST_SERVER_VERSION 0x0102
+#define TNFS_TEST_SERVER_HANDLES 16 // Files (and directories) each session can have open
+#define TNFS_TEST_SERVER_REPLY_CACHE 8 // Recent replies kept per session for duplicated requests
+#define TNFS_TEST_SERVER_HOLD_MS 50 // Longest a reply is held back to be sent out of order
+#define TNFS_TEST_SERVER_MAX_DATAGRAM 2048
+
+// How bad to make the link. Percentages apply to each datagram separately.
+struct tnfsTestImpairment
+{
+    uint8_t loss_percent = 0; // Requests and replies dropped
+    uint8_t duplicate_percent = 0; // Requests that arrive twice
+    uint8_t reorder_percent = 0; // Replies held back until after the next one
+    uint16_t delay_ms = 0; // Added to every reply
+    uint16_t jitter_ms = 0; // Random extra delay, up to this much, for every reply
+};
+
+// What the server's seen, for the tests to check on
+struct tnfsTestServerStats
+{
+    uint32_t requests = 0; // Handled, including duplicates
+    uint32_t duplicates = 0; // Answered from the reply cache
+    uint32_t requests_dropped = 0;
+    uint32_t replies_dropped = 0;
+    uint32_t replies_reordered = 0;
+};
+
+class tnfsTestServer
+{
+private:
+    struct directory
+    {
+        struct entry
+        {
+            std::string name;
+            uint8_t flags;
+            uint32_t size;
+            uint32_t m_time;
+            uint32_t c_time;
+        };
+        std::vector<entry> entries;
+        uint32_t position = 0;
+    };
+
+    struct cachedReply
+    {
+        uint8_t sequence_num;
+        uint8_t command;
+        std::vector<uint8_t> data;
+    };
+
+    struct session
+    {
+        std::string root; // The mount path, on the host
+        int files[TNFS_TEST_SERVER_HANDLES];
+        directory *dirs[TNFS_TEST_SERVER_HANDLES];
+        std::deque<cachedReply> replies;
+    };
+
+    struct outgoing
+    {
+        std::chrono::steady_clock::time_point due;
+        sockaddr_in to;
+        std::vector<uint8_t> data;
+    };
+
+    std::string _root;
+    int _fd = -1;
+    uint16_t _port = 0;
+    std::thread _thread;
+    std::atomic<bool> _stopping{false};
+
+    std::mutex _lock; // Everything below, shared with the test
+    tnfsTestImpairment _impairment;
+    tnfsTestServerStats _stats;
+    uint16_t _max_read = TNFS_MAX_READWRITE_PAYLOAD;
+    std::mt19937 _random{1};
+    std::map<uint16_t, session> _sessions;
+    uint16_t _next_session = 0xBEEF;
+    std::vector<outgoing> _outgoing; // Replies waiting for their delay
+    bool _holding = false;
+    outgoing _held; // Reply being held back to go out after the next one
+
+    bool _chance(uint8_t percent) { return percent > 0 && _random() % 100 < percent; }
+
+    static uint16_t _get16(const uint8_t *p) { return p[0] | p[1] << 8; }
+    static uint32_t _get32(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+    static void _put16(std::vector<uint8_t> &v, uint16_t n)
+    {
+        v.push_back(n & 0xFF);
+        v.push_back(n >> 8);
+    }
+    static void _put32(std::vector<uint8_t> &v, uint32_t n)
+    {
+        _put16(v, n & 0xFFFF);
+        _put16(v, n >> 16);
+    }
+
+    static uint8_t _errno_to_tnfs(int err)
+    {
+        switch (err)
+        {
+        case EPERM:
+            return TNFS_RESULT_NOT_PERMITTED;
+        case ENOENT:
+            return TNFS_RESULT_FILE_NOT_FOUND;
+        case EBADF:
+            return TNFS_RESULT_BAD_FILENUM;
+        case EACCES:
+            return TNFS_RESULT_ACCESS_DENIED;
+        case EEXIST:
+            return TNFS_RESULT_FILE_EXISTS;
+        case ENOTDIR:
+            return TNFS_RESULT_NOT_A_DIRECTORY;
+        case EISDIR:
+            return TNFS_RESULT_IS_DIRECTORY;
+        case EINVAL:
+            return TNFS_RESULT_INVALID_ARGUMENT;
+        case EMFILE:
+            return TNFS_RESULT_TOO_MANY_FILES_OPEN;
+        case ENOSPC:
+            return TNFS_RESULT_NO_SPACE_ON_DEVICE;
+        case ENAMETOOLONG:
+            return TNFS_RESULT_NAME_TOO_LONG;
+        case ENOTEMPTY:
+            return TNFS_RESULT_DIRECTORY_NOT_EMPTY;
+        default:
+            return TNFS_RESULT_IO_ERROR;
+        }
+    }
+
+    // Takes the next null-terminated string from the request, or returns false if there isn't one
+    static bool _get_string(const uint8_t *data, size_t len, size_t &pos, std::string &out)
+    {
+        const void *end = pos < len ? memchr(data + pos, '\0', len - pos) : nullptr;
+        if (end == nullptr)
+            return false;
+        out.assign((const char *)data + pos, (const uint8_t *)end - (data + pos));
+        pos += out.size() + 1;
+        return true;
+    }
+
+    // Where a client's path is on the host, refusing anything that climbs out of the mount
+    static bool _host_path(const session &s, const std::string &path, std::string &out)
+    {
+        std::string p = "/" + path + "/";
+        if (p.find("/../") != std::string::npos)
+            return false;
+        out = s.root + "/" + path;
+        return true;
+    }
+
+    static uint8_t _stat_flags(const std::string &name, const struct stat &st)
+    {
+        uint8_t flags = 0;
+        if (S_ISDIR(st.st_mode))
+            flags |= TNFS_READDIRX_DIR;
+        if (name[0] == '.')
+            flags |= TNFS_READDIRX_HIDDEN;
+        if (name == "." || name == "..")
+            flags |= TNFS_READDIRX_SPECIAL;
+        return flags;
+    }
+
+    uint8_t _opendirx(session &s, const uint8_t *data, size_t len, std::vector<uint8_t> &reply)
+    {
+        size_t pos = 4;
+        std::string pattern, path, host;
+        if (len < 4 || !_get_string(data, len, pos, pattern) || !_get_string(data, len, pos, path))
+            return TNFS_RESULT_INVALID_ARGUMENT;
+        if (!_host_path(s, path, host))
+            return TNFS_RESULT_ACCESS_DENIED;
+        uint8_t diropts = data[0];
+        uint8_t sortopts = data[1];
+        uint16_t maxresults = _get16(data + 2);
+
+        int handle = 0;
+        while (handle < TNFS_TEST_SERVER_HANDLES && s.dirs[handle] != nullptr)
+            handle++;
+        if (handle == TNFS_TEST_SERVER_HANDLES)
+            return TNFS_RESULT_TOO_MANY_FILES_OPEN;
+
+        DIR *d = opendir(host.c_str());
+        if (d == nullptr)
+            return _errno_to_tnfs(errno);
+
+        directory *dir = new directory;
+        struct dirent *de;
+        while ((de = readdir(d)) != nullptr)
+        {
+            struct stat st;
+            if (stat((host + "/" + de->d_name).c_str(), &st) != 0)
+                continue;
+            directory::entry e = {de->d_name, _stat_flags(de->d_name, st), (uint32_t)st.st_size, (uint32_t)st.st_mtime, (uint32_t)st.st_ctime};
+            if ((e.flags & TNFS_READDIRX_SPECIAL) && !(diropts & TNFS_DIROPT_NO_SKIPSPECIAL))
+                continue;
+            if ((e.flags & TNFS_READDIRX_HIDDEN) && !(e.flags & TNFS_READDIRX_SPECIAL) && !(diropts & TNFS_DIROPT_NO_SKIPHIDDEN))
+                continue;
+            bool match_dirs = diropts & TNFS_DIROPT_DIR_PATTERN;
+            if (!pattern.empty() && (match_dirs || !(e.flags & TNFS_READDIRX_DIR)) && fnmatch(pattern.c_str(), e.name.c_str(), 0) != 0)
+                continue;
+            dir->entries.push_back(e);
+        }
+        closedir(d);
+
+        if (!(sortopts & TNFS_DIRSORT_NONE))
+            std::sort(dir->entries.begin(), dir->entries.end(), [diropts, sortopts](const directory::entry &a, const directory::entry &b) {
+                bool a_dir = a.flags & TNFS_READDIRX_DIR;
+                bool b_dir = b.flags & TNFS_READDIRX_DIR;
+                if (!(diropts & TNFS_DIROPT_NO_FOLDERSFIRST) && a_dir != b_dir)
+                    return a_dir;
+                long order;
+                if (sortopts & TNFS_DIRSORT_SIZE)
+                    order = (long)a.size - (long)b.size;
+                else if (sortopts & TNFS_DIRSORT_MODIFIED)
+                    order = (long)a.m_time - (long)b.m_time;
+                else if (sortopts & TNFS_DIRSORT_CASE)
+                    order = strcmp(a.name.c_str(), b.name.c_str());
+                else
+                    order = strcasecmp(a.name.c_str(), b.name.c_str());
+                return (sortopts & TNFS_DIRSORT_DESCENDING) ? order > 0 : order < 0;
+            });
+        if (maxresults > 0 && dir->entries.size() > maxresults)
+            dir->entries.resize(maxresults);
+
+        s.dirs[handle] = dir;
+        reply.push_back(handle);
+        _put16(reply, dir->entries.size());
+        return TNFS_RESULT_SUCCESS;
+    }
+
+    uint8_t _readdirx(directory *dir, uint8_t wanted, std::vector<uint8_t> &reply)
+    {
+        if (dir->position >= dir->entries.size())
+            return TNFS_RESULT_END_OF_FILE;
+
+        // Count, status and position go in front of the entries
+        std::vector<uint8_t> entries;
+        uint8_t count = 0;
+        uint32_t first = dir->position;
+        while (dir->position < dir->entries.size() && (wanted == 0 || count < wanted))
+        {
+            const directory::entry &e = dir->entries[dir->position];
+            if (1 + 4 + entries.size() + 13 + e.name.size() + 1 > TNFS_PAYLOAD_SIZE - 1)
+                break;
+            entries.push_back(e.flags);
+            _put32(entries, e.size);
+            _put32(entries, e.m_time);
+            _put32(entries, e.c_time);
+            entries.insert(entries.end(), e.name.begin(), e.name.end());
+            entries.push_back('\0');
+            count++;
+            dir->position++;
+        }
+
+        reply.push_back(count);
+        reply.push_back(dir->position >= dir->entries.size() ? TNFS_READDIRX_STATUS_EOF : 0);
+        _put16(reply, first);
+        reply.insert(reply.end(), entries.begin(), entries.end());
+        return TNFS_RESULT_SUCCESS;
+    }
+
+    uint8_t _open(session &s, const uint8_t *data, size_t len, std::vector<uint8_t> &reply)
+    {
+        size_t pos = 4;
+        std::string path, host;
+        if (len < 4 || !_get_string(data, len, pos, path))
+            return TNFS_RESULT_INVALID_ARGUMENT;
+        if (!_host_path(s, path, host))
+            return TNFS_RESULT_ACCESS_DENIED;
+        uint16_t mode = _get16(data);
+
+        int handle = 0;
+        while (handle < TNFS_TEST_SERVER_HANDLES && s.files[handle] >= 0)
+            handle++;
+        if (handle == TNFS_TEST_SERVER_HANDLES)
+            return TNFS_RESULT_TOO_MANY_FILES_OPEN;
+
+        int flags;
+        switch (mode & TNFS_OPENMODE_READWRITE)
+        {
+        case TNFS_OPENMODE_READ:
+            flags = O_RDONLY;
+            break;
+        case TNFS_OPENMODE_WRITE:
+            flags = O_WRONLY;
+            break;
+        case TNFS_OPENMODE_READWRITE:
+            flags = O_RDWR;
+            break;
+        default:
+            return TNFS_RESULT_INVALID_ARGUMENT;
+        }
+        if (mode & TNFS_OPENMODE_WRITE_APPEND)
+            flags |= O_APPEND;
+        if (mode & TNFS_OPENMODE_WRITE_CREATE)
+            flags |= O_CREAT;
+        if (mode & TNFS_OPENMODE_WRITE_TRUNCATE)
+            flags |= O_TRUNC;
+        if (mode & TNFS_OPENMODE_CREATE_EXCLUSIVE)
+            flags |= O_EXCL;
+
+        int fd = ::open(host.c_str(), flags, _get16(data + 2) & 07777);
+        if (fd < 0)
+            return _errno_to_tnfs(errno);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            ::close(fd);
+            return TNFS_RESULT_IS_DIRECTORY;
+        }
+
+        s.files[handle] = fd;
+        reply.push_back(handle);
+        return TNFS_RESULT_SUCCESS;
+    }
+
+    uint8_t _stat(session &s, const uint8_t *data, size_t len, std::vector<uint8_t> &reply)
+    {
+        size_t pos = 0;
+        std::string path, host;
+        if (!_get_string(data, len, pos, path))
+            return TNFS_RESULT_INVALID_ARGUMENT;
+        if (!_host_path(s, path, host))
+            return TNFS_RESULT_ACCESS_DENIED;
+
+        struct stat st;
+        if (stat(host.c_str(), &st) != 0)
+            return _errno_to_tnfs(errno);
+        _put16(reply, st.st_mode);
+        _put16(reply, st.st_uid);
+        _put16(reply, st.st_gid);
+        _put32(reply, st.st_size);
+        _put32(reply, st.st_atime);
+        _put32(reply, st.st_mtime);
+        _put32(reply, st.st_ctime);
+        reply.push_back('\0'); // No user or group names
+        reply.push_back('\0');
+        return TNFS_RESULT_SUCCESS;
+    }
+
+    // Carries out a request from a session we know, putting any data after the result in reply
+    uint8_t _command(session &s, uint8_t command, const uint8_t *data, size_t len, std::vector<uint8_t> &reply)
+    {
+        int handle = len > 0 && data[0] < TNFS_TEST_SERVER_HANDLES ? data[0] : -1;
+        int fd = handle >= 0 ? s.files[handle] : -1;
+        directory *dir = handle >= 0 ? s.dirs[handle] : nullptr;
+        std::string path, path2, host, host2;
+        size_t pos = 0;
+
+        switch (command)
+        {
+        case TNFS_CMD_OPENDIRX:
+            return _opendirx(s, data, len, reply);
+        case TNFS_CMD_READDIRX:
+            if (dir == nullptr || len < 2)
+                return TNFS_RESULT_BAD_FILENUM;
+            return _readdirx(dir, data[1], reply);
+        case TNFS_CMD_TELLDIR:
+            if (dir == nullptr)
+                return TNFS_RESULT_BAD_FILENUM;
+            _put32(reply, dir->position);
+            return TNFS_RESULT_SUCCESS;
+        case TNFS_CMD_SEEKDIR:
+            if (dir == nullptr || len < 5)
+                return TNFS_RESULT_BAD_FILENUM;
+            dir->position = _get32(data + 1);
+            return TNFS_RESULT_SUCCESS;
+        case TNFS_CMD_CLOSEDIR:
+            if (dir == nullptr)
+                return TNFS_RESULT_BAD_FILENUM;
+            delete dir;
+            s.dirs[handle] = nullptr;
+            return TNFS_RESULT_SUCCESS;
+
+        case TNFS_CMD_OPEN:
+            return _open(s, data, len, reply);
+        case TNFS_CMD_READ:
+        {
+            if (fd < 0 || len < 3)
+                return TNFS_RESULT_BAD_FILENUM;
+            uint16_t wanted = std::min(_get16(data + 1), _max_read);
+            uint8_t buffer[TNFS_TEST_SERVER_MAX_DATAGRAM];
+            ssize_t got = ::read(fd, buffer, wanted);
+            if (got < 0)
+                return _errno_to_tnfs(errno);
+            if (got == 0)
+                return TNFS_RESULT_END_OF_FILE;
+            _put16(reply, got);
+            reply.insert(reply.end(), buffer, buffer + got);
+            return TNFS_RESULT_SUCCESS;
+        }
+        case TNFS_CMD_WRITE:
+        {
+            if (fd < 0 || len < 3)
+                return TNFS_RESULT_BAD_FILENUM;
+            uint16_t count = _get16(data + 1);
+            if (count > len - 3)
+                return TNFS_RESULT_INVALID_ARGUMENT;
+            ssize_t put = ::write(fd, data + 3, count);
+            if (put < 0)
+                return _errno_to_tnfs(errno);
+            _put16(reply, put);
+            return TNFS_RESULT_SUCCESS;
+        }
+        case TNFS_CMD_CLOSE:
+            if (fd < 0)
+                return TNFS_RESULT_BAD_FILENUM;
+            ::close(fd);
+            s.files[handle] = -1;
+            return TNFS_RESULT_SUCCESS;
+        case TNFS_CMD_LSEEK:
+        {
+            if (fd < 0 || len < 6)
+                return TNFS_RESULT_BAD_FILENUM;
+            off_t result = lseek(fd, (int32_t)_get32(data + 2), data[1]);
+            if (result < 0)
+                return _errno_to_tnfs(errno);
+            _put32(reply, result);
+            return TNFS_RESULT_SUCCESS;
+        }
+        case TNFS_CMD_STAT:
+            return _stat(s, data, len, reply);
+
+        case TNFS_CMD_MKDIR:
+        case TNFS_CMD_RMDIR:
+        case TNFS_CMD_UNLINK:
+        {
+            if (!_get_string(data, len, pos, path))
+                return TNFS_RESULT_INVALID_ARGUMENT;
+            if (!_host_path(s, path, host))
+                return TNFS_RESULT_ACCESS_DENIED;
+            int result = command == TNFS_CMD_MKDIR ? mkdir(host.c_str(), 0755) : command == TNFS_CMD_RMDIR ? rmdir(host.c_str()) : unlink(host.c_str());
+            return result == 0 ? TNFS_RESULT_SUCCESS : _errno_to_tnfs(errno);
+        }
+        case TNFS_CMD_RENAME:
+            if (!_get_string(data, len, pos, path) || !_get_string(data, len, pos, path2))
+                return TNFS_RESULT_INVALID_ARGUMENT;
+            if (!_host_path(s, path, host) || !_host_path(s, path2, host2))
+                return TNFS_RESULT_ACCESS_DENIED;
+            return rename(host.c_str(), host2.c_str()) == 0 ? TNFS_RESULT_SUCCESS : _errno_to_tnfs(errno);
+        case TNFS_CMD_CHMOD:
+            pos = 2;
+            if (len < 2 || !_get_string(data, len, pos, path))
+                return TNFS_RESULT_INVALID_ARGUMENT;
+            if (!_host_path(s, path, host))
+                return TNFS_RESULT_ACCESS_DENIED;
+            return chmod(host.c_str(), _get16(data) & 07777) == 0 ? TNFS_RESULT_SUCCESS : _errno_to_tnfs(errno);
+
+        case TNFS_CMD_SIZE:
+        case TNFS_CMD_FREE:
+        {
+            struct statvfs vfs;
+            if (statvfs(s.root.c_str(), &vfs) != 0)
+                return _errno_to_tnfs(errno);
+            uint64_t blocks = command == TNFS_CMD_SIZE ? vfs.f_blocks : vfs.f_bavail;
+            _put32(reply, std::min<uint64_t>(blocks * vfs.f_frsize / 1024, UINT32_MAX));
+            return TNFS_RESULT_SUCCESS;
+        }
+        default:
+            return TNFS_RESULT_FUNCTION_UNIMPLEMENTED;
+        }
+    }
+
+    static void _close_session(session &s)
+    {
+        for (int i = 0; i < TNFS_TEST_SERVER_HANDLES; i++)
+        {
+            if (s.files[i] >= 0)
+                ::close(s.files[i]);
+            delete s.dirs[i];
+        }
+    }
+
+    // Works out the reply to a request, with _lock held
+    std::vector<uint8_t> _handle(const uint8_t *request, size_t len)
+    {
+        uint16_t id = request[0] | request[1] << 8;
+        uint8_t command = request[3];
+        const uint8_t *data = request + TNFS_HEADER_SIZE;
+        len -= TNFS_HEADER_SIZE;
+        _stats.requests++;
+
+        std::vector<uint8_t> reply(request, request + TNFS_HEADER_SIZE);
+
+        if (command == TNFS_CMD_MOUNT)
+        {
+            size_t pos = 2;
+            std::string path;
+            struct stat st;
+            if (len < 2 || !_get_string(data, len, pos, path) || (path + "/").find("/../") != std::string::npos ||
+                stat((_root + "/" + path).c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+            {
+                reply[0] = reply[1] = 0;
+                reply.push_back(TNFS_RESULT_FILE_NOT_FOUND);
+                _put16(reply, TNFS_TEST_SERVER_VERSION);
+                return reply;
+            }
+
+            while (_next_session == TNFS_INVALID_SESSION || _sessions.count(_next_session))
+                _next_session++;
+            id = _next_session++;
+            session &s = _sessions[id];
+            s.root = _root + "/" + path;
+            for (int i = 0; i < TNFS_TEST_SERVER_HANDLES; i++)
+            {
+                s.files[i] = -1;
+                s.dirs[i] = nullptr;
+            }
+
+            reply[0] = id & 0xFF;
+            reply[1] = id >> 8;
+            reply.push_back(TNFS_RESULT_SUCCESS);
+            _put16(reply, TNFS_TEST_SERVER_VERSION);
+            _put16(reply, 0); // Minimum retry time; we're never too busy
+            return reply;
+        }
+
+        auto it = _sessions.find(id);
+        if (it == _sessions.end())
+        {
+            // tnfsd's answer for a session it doesn't know
+            reply.push_back(TNFS_RESULT_INVALID_HANDLE);
+            return reply;
+        }
+        session &s = it->second;
+
+        // A duplicate gets the same answer as the first, without doing it again
+        for (const cachedReply &cached : s.replies)
+            if (cached.sequence_num == request[2] && cached.command == command)
+            {
+                _stats.duplicates++;
+                return cached.data;
+            }
+
+        if (command == TNFS_CMD_UNMOUNT)
+        {
+            _close_session(s);
+            _sessions.erase(it);
+            reply.push_back(TNFS_RESULT_SUCCESS);
+            return reply;
+        }
+
+        std::vector<uint8_t> result;
+        reply.push_back(_command(s, command, data, len, result));
+        reply.insert(reply.end(), result.begin(), result.end());
+
+        s.replies.push_back({request[2], command, reply});
+        if (s.replies.size() > TNFS_TEST_SERVER_REPLY_CACHE)
+            s.replies.pop_front();
+        return reply;
+    }
+
+    // Queues a reply to go out once its delay's up, with _lock held
+    void _queue(const sockaddr_in &to, std::vector<uint8_t> data)
+    {
+        if (_chance(_impairment.loss_percent))
+        {
+            _stats.replies_dropped++;
+            return;
+        }
+        unsigned delay = _impairment.delay_ms + (_impairment.jitter_ms > 0 ? _random() % (_impairment.jitter_ms + 1) : 0);
+        _outgoing.push_back({std::chrono::steady_clock::now() + std::chrono::milliseconds(delay), to, std::move(data)});
+    }
+
+    void _sendto(const outgoing &o)
+    {
+        ::sendto(_fd, o.data.data(), o.data.size(), 0, (const sockaddr *)&o.to, sizeof(o.to));
+    }
+
+    // Sends whatever's due, with _lock held; returns how long until the next one is
+    int _send_due()
+    {
+        auto now = std::chrono::steady_clock::now();
+        int wait_ms = 10;
+        for (size_t i = 0; i < _outgoing.size();)
+        {
+            outgoing &o = _outgoing[i];
+            if (o.due > now)
+            {
+                int ms = std::chrono::duration_cast<std::chrono::milliseconds>(o.due - now).count() + 1;
+                wait_ms = std::min(wait_ms, ms);
+                i++;
+                continue;
+            }
+
+            if (_holding == false && _chance(_impairment.reorder_percent))
+            {
+                _stats.replies_reordered++;
+                _held = std::move(o);
+                _held.due = now + std::chrono::milliseconds(TNFS_TEST_SERVER_HOLD_MS);
+                _holding = true;
+            }
+            else
+            {
+                _sendto(o);
+                if (_holding)
+                {
+                    _sendto(_held);
+                    _holding = false;
+                }
+            }
+            _outgoing.erase(_outgoing.begin() + i);
+        }
+
+        // Nothing came along to overtake it
+        if (_holding && _held.due <= now)
+        {
+            _sendto(_held);
+            _holding = false;
+        }
+        return wait_ms;
+    }
+
+    void _run()
+    {
+        uint8_t request[TNFS_TEST_SERVER_MAX_DATAGRAM];
+        int wait_ms = 10;
+        while (_stopping == false)
+        {
+            struct pollfd pfd = {_fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, wait_ms);
+
+            std::lock_guard<std::mutex> guard(_lock);
+            if (ready > 0)
+            {
+                sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                ssize_t len = recvfrom(_fd, request, sizeof(request), 0, (sockaddr *)&from, &from_len);
+                if (len >= TNFS_HEADER_SIZE)
+                {
+                    if (_chance(_impairment.loss_percent))
+                        _stats.requests_dropped++;
+                    else
+                    {
+                        _queue(from, _handle(request, len));
+                        if (_chance(_impairment.duplicate_percent))
+                            _queue(from, _handle(request, len));
+                    }
+                }
+            }
+            wait_ms = _send_due();
+        }
+    }
+
+public:
+    tnfsTestServer(const std::string &root) : _root(root) {}
+    ~tnfsTestServer() { stop(); }
+
+    // Starts serving on a free port on 127.0.0.1; returns false if it couldn't
+    bool start()
+    {
+        _fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (_fd < 0)
+            return false;
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len = sizeof(addr);
+        if (bind(_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || getsockname(_fd, (sockaddr *)&addr, &addr_len) != 0)
+        {
+            ::close(_fd);
+            _fd = -1;
+            return false;
+        }
+        _port = ntohs(addr.sin_port);
+
+        _stopping = false;
+        _thread = std::thread(&tnfsTestServer::_run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (_thread.joinable())
+        {
+            _stopping = true;
+            _thread.join();
+        }
+        if (_fd >= 0)
+        {
+            ::close(_fd);
+            _fd = -1;
+        }
+        for (auto &it : _sessions)
+            _close_session(it.second);
+        _sessions.clear();
+        _outgoing.clear();
+        _holding = false;
+    }
+
+    uint16_t port() { return _port; }
+
+    void set_impairment(const tnfsTestImpairment &impairment, uint32_t seed = 1)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _impairment = impairment;
+        _random.seed(seed);
+    }
+
+    // Largest READ we'll answer in full; tnfsd's is TNFS_MAX_READWRITE_PAYLOAD
+    void set_max_read(uint16_t max_read)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _max_read = std::min<uint16_t>(max_read, TNFS_TEST_SERVER_MAX_DATAGRAM - TNFS_HEADER_SIZE - 3);
+    }
+
+    // Forgets every session, the way a restarted server would
+    void forget_sessions()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        for (auto &it : _sessions)
+            _close_session(it.second);
+        _sessions.clear();
+    }
+
+    tnfsTestServerStats stats()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _stats;
+    }
+
+    void clear_stats()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stats = tnfsTestServerStats();
+    }
+};
+
+#endif // _TEST_NATIVE_TNFSTESTSERVER_H
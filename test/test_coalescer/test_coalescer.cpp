@@ -0,0 +1,220 @@
+/* Native tests for networkCoalescer against a loopback echo server:
+   pio test -e native -f test_coalescer -v
+   The last one measures sends (roughly packets) per KB and throughput for a
+   program writing a line at a time, with and without a deadline. */
+#include <unity.h>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "tcpEchoServer.h"
+#include "fnSystemHost.h"
+
+// The coalescer is built straight into the test, with test/native standing in for lwIP and FreeRTOS
+#include "../../lib/sio/networkCoalescer.cpp"
+#include "../../lib/utils/bufferArena.cpp"
+#include "../../lib/tcpip/fnTcpClient.cpp"
+#include "../../lib/tcpip/fnDNS.cpp"
+#include "../../lib/utils/cbuf.cpp"
+
+#define COALESCER_LINE 40 // Bytes in each write, about a line of text
+#define COALESCER_BENCHMARK_BYTES (64 * 1024)
+#define COALESCER_ECHO_TIMEOUT_MS 5000
+
+static tcpEchoServer *server = nullptr;
+
+static std::vector<uint8_t> make_data(size_t len, uint32_t seed)
+{
+    std::vector<uint8_t> data(len);
+    for (size_t i = 0; i < len; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+    return data;
+}
+
+static void connect(fnTcpClient &client)
+{
+    TEST_ASSERT_EQUAL(1, client.connect(htonl(INADDR_LOOPBACK), server->port()));
+    client.setNoDelay(true);
+}
+
+// Reads len bytes of echo, giving up after COALESCER_ECHO_TIMEOUT_MS
+static std::vector<uint8_t> read_echo(fnTcpClient &client, size_t len)
+{
+    std::vector<uint8_t> got;
+    auto started = std::chrono::steady_clock::now();
+    uint8_t buf[4096];
+    while (got.size() < len && std::chrono::steady_clock::now() - started < std::chrono::milliseconds(COALESCER_ECHO_TIMEOUT_MS))
+    {
+        int n = client.available() > 0 ? client.read(buf, sizeof(buf)) : 0;
+        if (n > 0)
+            got.insert(got.end(), buf, buf + n);
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    return got;
+}
+
+void setUp()
+{
+    server = new tcpEchoServer();
+    TEST_ASSERT_TRUE(server->start());
+}
+
+void tearDown()
+{
+    delete server;
+    server = nullptr;
+}
+
+/*
+ A failed assertion longjmps out of the test without running destructors, which
+ would leave a coalescer on the service task's list. So each test stops its
+ coalescers before checking anything that happened while they were running.
+*/
+
+// Small writes are gathered into segments and the deadline sends the rest, all in order
+void test_deadline_gathers_writes()
+{
+    fnTcpClient client;
+    connect(client);
+    networkCoalescer coalescer(&client);
+    coalescer.set_deadline(200);
+    TEST_ASSERT_TRUE(coalescer.start());
+
+    std::vector<uint8_t> data = make_data(5000, 1);
+    size_t accepted = 0;
+    for (size_t pos = 0; pos < data.size(); pos += 10)
+        accepted += coalescer.write(data.data() + pos, 10);
+    std::vector<uint8_t> echo = read_echo(client, data.size());
+    coalescer.stop();
+
+    TEST_ASSERT_EQUAL(data.size(), accepted);
+    TEST_ASSERT_TRUE(echo == data);
+    // Three full segments, then the deadline sends what's left
+    TEST_ASSERT_EQUAL(4, coalescer.sends());
+    TEST_ASSERT_EQUAL(data.size(), coalescer.bytes_sent());
+}
+
+// Once the connection's gone, write says so instead of claiming it sent everything
+void test_write_failure()
+{
+    fnTcpClient client;
+    connect(client);
+    networkCoalescer coalescer(&client);
+    TEST_ASSERT_TRUE(coalescer.start());
+
+    std::vector<uint8_t> data = make_data(3000, 2);
+    size_t before = coalescer.write(data.data(), 100);
+    client.stop();
+
+    // Sent straight away, so it fails straight away
+    size_t immediate = coalescer.write(data.data(), 100);
+
+    // With a deadline, the first full segment fails
+    coalescer.set_deadline(1000);
+    size_t segment = coalescer.write(data.data(), data.size());
+
+    // What's only been buffered is accepted, and the flush reports it couldn't be sent
+    size_t buffered = coalescer.write(data.data(), 100);
+    bool flushed = coalescer.flush();
+    coalescer.stop();
+
+    TEST_ASSERT_EQUAL(100, before);
+    TEST_ASSERT_EQUAL(0, immediate);
+    TEST_ASSERT_EQUAL(0, segment);
+    TEST_ASSERT_EQUAL(100, buffered);
+    TEST_ASSERT_FALSE(flushed);
+}
+
+// Coalescers stopping while the service task has their deadlines due
+void test_stop_while_due()
+{
+    const int count = 8;
+    fnTcpClient clients[count];
+    for (int i = 0; i < count; i++)
+        connect(clients[i]);
+
+    uint8_t line[COALESCER_LINE] = {0};
+    for (int round = 0; round < 100; round++)
+    {
+        networkCoalescer *coalescers[count];
+        bool started = true;
+        size_t accepted = 0;
+        for (int i = 0; i < count; i++)
+        {
+            coalescers[i] = new networkCoalescer(&clients[i]);
+            coalescers[i]->set_deadline(1);
+            started = coalescers[i]->start() && started;
+            accepted += coalescers[i]->write(line, sizeof(line));
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(round * 20));
+        uint32_t bytes = 0;
+        for (int i = 0; i < count; i++)
+        {
+            coalescers[i]->stop();
+            bytes += coalescers[i]->bytes_sent();
+            delete coalescers[i];
+        }
+        TEST_ASSERT_TRUE(started);
+        TEST_ASSERT_EQUAL(count * sizeof(line), accepted);
+        // Every byte goes out once, by the deadline or by stop
+        TEST_ASSERT_EQUAL(count * sizeof(line), bytes);
+    }
+}
+
+// A program writing a line at a time, sent as it's written and then gathered with a deadline
+void test_packets_and_throughput()
+{
+    std::vector<uint8_t> data = make_data(COALESCER_BENCHMARK_BYTES, 3);
+    const uint32_t deadlines[] = {0, 1, 5};
+    double sends_per_kb[3];
+
+    for (int d = 0; d < 3; d++)
+    {
+        fnTcpClient client;
+        connect(client);
+        networkCoalescer coalescer(&client);
+        coalescer.set_deadline(deadlines[d]);
+        TEST_ASSERT_TRUE(coalescer.start());
+        uint32_t reads_before = server->reads;
+
+        auto started = std::chrono::steady_clock::now();
+        size_t accepted = 0;
+        for (size_t pos = 0; pos < data.size(); pos += COALESCER_LINE)
+        {
+            size_t n = data.size() - pos < COALESCER_LINE ? data.size() - pos : COALESCER_LINE;
+            accepted += coalescer.write(data.data() + pos, n);
+        }
+        std::vector<uint8_t> echo = read_echo(client, data.size());
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        coalescer.stop();
+        TEST_ASSERT_EQUAL(data.size(), accepted);
+        TEST_ASSERT_TRUE(echo == data);
+
+        sends_per_kb[d] = coalescer.sends() * 1024.0 / coalescer.bytes_sent();
+        char message[160];
+        snprintf(message, sizeof(message), "deadline %ums: %u KB in %u sends, %.2f sends/KB, %u server reads, %.2f MB/s",
+                 deadlines[d], (unsigned)(data.size() / 1024), coalescer.sends(), sends_per_kb[d],
+                 (unsigned)(server->reads - reads_before), data.size() / 1048576.0 / (ms / 1000));
+        TEST_MESSAGE(message);
+    }
+
+    // Sending every line on its own is one send per line; a deadline fills segments
+    TEST_ASSERT_TRUE(sends_per_kb[0] > 1024.0 / COALESCER_LINE - 1);
+    TEST_ASSERT_TRUE(sends_per_kb[1] < sends_per_kb[0] / 4);
+    TEST_ASSERT_TRUE(sends_per_kb[2] < sends_per_kb[0] / 4);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_deadline_gathers_writes);
+    RUN_TEST(test_write_failure);
+    RUN_TEST(test_stop_while_due);
+    RUN_TEST(test_packets_and_throughput);
+    return UNITY_END();
+}
@@ -0,0 +1,333 @@
+/* Native tests for util_eol_to_atascii and util_eol_from_atascii: pio test -e native -f test_eol -v
+   Besides the fixed cases, both are checked against a byte-at-a-time reference
+   on random data, and the last test times CR/LF expansion against the old
+   memmove loop it replaced. */
+#include <unity.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "utils.h"
+
+// utils.cpp is built straight into the test, since the rest of lib/utils needs the ESP32
+#include "../../lib/utils/utils.cpp"
+
+// util_sam_say's speech synthesizer isn't part of this test
+int sam(int argc, char **argv) { return 0; }
+
+#define EOL_RANDOM_SEED 40
+#define EOL_RANDOM_ROUNDS 20000
+#define EOL_BENCHMARK_LINE 40 // Bytes in each line, EOL included
+#define EOL_BENCHMARK_BYTES (4 * 1024 * 1024) // Translated at each write size
+
+void setUp() {}
+void tearDown() {}
+
+static uint32_t random_seed = EOL_RANDOM_SEED;
+
+static uint32_t next_random()
+{
+    random_seed = random_seed * 1103515245 + 12345;
+    return random_seed >> 8;
+}
+
+// Mostly the bytes the translation cares about, so every case turns up often
+static std::vector<uint8_t> random_text(size_t len)
+{
+    static const uint8_t interesting[] = { 0x0D, 0x0A, 0x9B, 0x09, 0x7F, 0x20 };
+    std::vector<uint8_t> text(len);
+    for (size_t i = 0; i < len; i++)
+    {
+        uint32_t r = next_random();
+        text[i] = r % 2 ? interesting[(r >> 1) % sizeof(interesting)] : (r >> 4) & 0xFF;
+    }
+    return text;
+}
+
+// The translation to ATASCII done the plain way, one byte at a time
+static std::vector<uint8_t> reference_to_atascii(const std::vector<uint8_t> &in, uint8_t mode, bool tabs)
+{
+    std::vector<uint8_t> out;
+    for (uint8_t c : in)
+    {
+        if (c == 0x0D && mode == EOL_TRANSLATION_CR)
+            c = 0x9B;
+        else if (c == 0x0D && mode == EOL_TRANSLATION_CRLF)
+            c = 0x20;
+        else if (c == 0x0A && (mode == EOL_TRANSLATION_LF || mode == EOL_TRANSLATION_CRLF))
+            c = 0x9B;
+        else if (c == 0x09 && tabs)
+            c = 0x7F;
+        out.push_back(c);
+    }
+    return out;
+}
+
+// The translation from ATASCII into a fresh buffer, stopping at the first byte that won't fit
+static std::vector<uint8_t> reference_from_atascii(const std::vector<uint8_t> &in, size_t capacity, uint8_t mode, bool tabs)
+{
+    std::vector<uint8_t> out;
+    for (size_t i = 0; i < in.size() && i < capacity; i++)
+    {
+        uint8_t c = in[i];
+        std::vector<uint8_t> translated(1, c);
+        if (c == 0x9B && mode == EOL_TRANSLATION_CR)
+            translated = { 0x0D };
+        else if (c == 0x9B && mode == EOL_TRANSLATION_LF)
+            translated = { 0x0A };
+        else if (c == 0x9B && mode == EOL_TRANSLATION_CRLF)
+            translated = { 0x0D, 0x0A };
+        else if (c == 0x7F && tabs)
+            translated = { 0x09 };
+
+        if (out.size() + translated.size() > capacity)
+            break;
+        out.insert(out.end(), translated.begin(), translated.end());
+    }
+    return out;
+}
+
+// How sioNetwork::sio_write used to expand EOLs to CR/LF, moving the rest of the buffer up for each one
+static size_t old_from_atascii_crlf(uint8_t *tx_buf, size_t tx_buf_len)
+{
+    for (size_t i = 0; i < tx_buf_len; i++)
+    {
+        if (tx_buf[i] == 0x9B)
+        {
+            memmove(&tx_buf[i + 1], &tx_buf[i], tx_buf_len);
+            tx_buf[i] = 0x0D;
+            tx_buf[i + 1] = 0x0A;
+            tx_buf_len++;
+        }
+        if (tx_buf[i] == 0x7F)
+            tx_buf[i] = 0x09;
+    }
+    return tx_buf_len;
+}
+
+static const uint8_t ASCII_TEXT[] = "A\tB\rC\nD\r\nE";
+static const size_t ASCII_TEXT_LEN = sizeof(ASCII_TEXT) - 1;
+
+static const uint8_t ATASCII_TEXT[] = "A\x7f" "B\x9b" "C\x9b";
+static const size_t ATASCII_TEXT_LEN = sizeof(ATASCII_TEXT) - 1;
+
+static void check_to_atascii(uint8_t mode, bool tabs, const char *expected)
+{
+    uint8_t buf[sizeof(ASCII_TEXT)];
+    memcpy(buf, ASCII_TEXT, ASCII_TEXT_LEN);
+    util_eol_to_atascii(buf, ASCII_TEXT_LEN, mode, tabs);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY((const uint8_t *)expected, buf, ASCII_TEXT_LEN);
+}
+
+static void check_from_atascii(uint8_t mode, bool tabs, const char *expected, size_t expected_len)
+{
+    uint8_t buf[32];
+    memcpy(buf, ATASCII_TEXT, ATASCII_TEXT_LEN);
+    size_t len = util_eol_from_atascii(buf, ATASCII_TEXT_LEN, sizeof(buf), mode, tabs);
+    TEST_ASSERT_EQUAL_size_t(expected_len, len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY((const uint8_t *)expected, buf, expected_len);
+}
+
+void test_to_atascii_none()
+{
+    check_to_atascii(EOL_TRANSLATION_NONE, false, "A\tB\rC\nD\r\nE");
+}
+
+void test_to_atascii_cr()
+{
+    check_to_atascii(EOL_TRANSLATION_CR, false, "A\tB\x9b" "C\nD\x9b\nE");
+}
+
+void test_to_atascii_lf()
+{
+    check_to_atascii(EOL_TRANSLATION_LF, false, "A\tB\rC\x9b" "D\r\x9b" "E");
+}
+
+void test_to_atascii_crlf()
+{
+    // The CR of a pair becomes a space so the length doesn't change
+    check_to_atascii(EOL_TRANSLATION_CRLF, false, "A\tB C\x9b" "D \x9b" "E");
+}
+
+void test_to_atascii_tabs()
+{
+    check_to_atascii(EOL_TRANSLATION_NONE, true, "A\x7f" "B\rC\nD\r\nE");
+    check_to_atascii(EOL_TRANSLATION_LF, true, "A\x7f" "B\rC\x9b" "D\r\x9b" "E");
+}
+
+void test_to_atascii_crlf_split_across_buffers()
+{
+    // A CR at the end of one read and its LF at the start of the next come out the same as in one piece
+    uint8_t whole[] = "AB\r\nCD";
+    uint8_t first[] = "AB\r";
+    uint8_t second[] = "\nCD";
+
+    util_eol_to_atascii(whole, 6, EOL_TRANSLATION_CRLF, false);
+    util_eol_to_atascii(first, 3, EOL_TRANSLATION_CRLF, false);
+    util_eol_to_atascii(second, 3, EOL_TRANSLATION_CRLF, false);
+
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(whole, first, 3);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(whole + 3, second, 3);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY((const uint8_t *)"AB \x9b" "CD", whole, 6);
+}
+
+void test_from_atascii_none()
+{
+    check_from_atascii(EOL_TRANSLATION_NONE, false, "A\x7f" "B\x9b" "C\x9b", ATASCII_TEXT_LEN);
+}
+
+void test_from_atascii_cr()
+{
+    check_from_atascii(EOL_TRANSLATION_CR, false, "A\x7f" "B\rC\r", ATASCII_TEXT_LEN);
+}
+
+void test_from_atascii_lf()
+{
+    check_from_atascii(EOL_TRANSLATION_LF, false, "A\x7f" "B\nC\n", ATASCII_TEXT_LEN);
+}
+
+void test_from_atascii_crlf()
+{
+    check_from_atascii(EOL_TRANSLATION_CRLF, false, "A\x7f" "B\r\nC\r\n", ATASCII_TEXT_LEN + 2);
+}
+
+void test_from_atascii_tabs()
+{
+    check_from_atascii(EOL_TRANSLATION_LF, true, "A\tB\nC\n", ATASCII_TEXT_LEN);
+    check_from_atascii(EOL_TRANSLATION_CRLF, true, "A\tB\r\nC\r\n", ATASCII_TEXT_LEN + 2);
+}
+
+void test_from_atascii_crlf_exactly_at_capacity()
+{
+    // Two EOLs grow four bytes to six, which is exactly what there's room for
+    uint8_t buf[6] = { 'A', 0x9B, 'B', 0x9B, 0xEE, 0xEE };
+    size_t len = util_eol_from_atascii(buf, 4, sizeof(buf), EOL_TRANSLATION_CRLF, false);
+    TEST_ASSERT_EQUAL_size_t(6, len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY((const uint8_t *)"A\r\nB\r\n", buf, 6);
+}
+
+void test_from_atascii_crlf_overflow_drops_what_doesnt_fit()
+{
+    // Expanded this would be ten bytes; only what fits in seven is kept, and nothing past them is touched
+    uint8_t buf[8] = { 'A', 0x9B, 'B', 'C', 0x9B, 'D', 0x9B, 0xEE };
+    size_t len = util_eol_from_atascii(buf, 7, 7, EOL_TRANSLATION_CRLF, false);
+    TEST_ASSERT_EQUAL_size_t(7, len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY((const uint8_t *)"A\r\nBC\r\n", buf, 7);
+    TEST_ASSERT_EQUAL_UINT8(0xEE, buf[7]);
+}
+
+void test_from_atascii_crlf_eol_split_at_end_of_buffer()
+{
+    // The last EOL would need two bytes with only one left, so it's dropped whole rather than leaving a lone CR
+    uint8_t buf[5] = { 'A', 'B', 'C', 0x9B, 0xEE };
+    size_t len = util_eol_from_atascii(buf, 4, 4, EOL_TRANSLATION_CRLF, false);
+    TEST_ASSERT_EQUAL_size_t(3, len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY((const uint8_t *)"ABC", buf, 3);
+    TEST_ASSERT_EQUAL_UINT8(0xEE, buf[4]);
+}
+
+void test_from_atascii_len_beyond_capacity()
+{
+    // Only capacity bytes are ever looked at, whatever the mode
+    uint8_t buf[6] = { 'A', 0x9B, 'B', 0x9B, 'C', 0xEE };
+    size_t len = util_eol_from_atascii(buf, 5, 4, EOL_TRANSLATION_LF, false);
+    TEST_ASSERT_EQUAL_size_t(4, len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY((const uint8_t *)"A\nB\n", buf, 4);
+    TEST_ASSERT_EQUAL_UINT8('C', buf[4]);
+}
+
+// Random data in every mode matches the reference, and nothing past capacity is touched
+void test_random_against_reference()
+{
+    random_seed = EOL_RANDOM_SEED;
+    for (int round = 0; round < EOL_RANDOM_ROUNDS; round++)
+    {
+        uint8_t mode = next_random() & 3;
+        bool tabs = next_random() & 1;
+        std::vector<uint8_t> text = random_text(next_random() % 64);
+
+        std::vector<uint8_t> to = text;
+        if (!to.empty())
+            util_eol_to_atascii(to.data(), to.size(), mode, tabs);
+        TEST_ASSERT_TRUE(to == reference_to_atascii(text, mode, tabs));
+
+        size_t capacity = next_random() % (text.size() * 2 + 2);
+        std::vector<uint8_t> buf(capacity + 1, 0xEE);
+        std::copy(text.begin(), text.begin() + std::min(text.size(), buf.size()), buf.begin());
+        std::vector<uint8_t> expected = reference_from_atascii(text, capacity, mode, tabs);
+        size_t len = util_eol_from_atascii(buf.data(), text.size(), capacity, mode, tabs);
+        TEST_ASSERT_EQUAL_size_t(expected.size(), len);
+        TEST_ASSERT_TRUE(std::vector<uint8_t>(buf.begin(), buf.begin() + len) == expected);
+        if (text.size() <= capacity)
+            TEST_ASSERT_EQUAL_UINT8(0xEE, buf[capacity]);
+    }
+}
+
+// CR/LF expansion of writes full of short lines, the old way and the new
+void test_crlf_benchmark()
+{
+    const size_t sizes[] = { 1024, 16384 };
+    for (size_t size : sizes)
+    {
+        random_seed = EOL_RANDOM_SEED;
+        std::vector<uint8_t> text = random_text(size);
+        for (size_t i = 0; i < text.size(); i++)
+            text[i] = i % EOL_BENCHMARK_LINE == EOL_BENCHMARK_LINE - 1 ? 0x9B : (text[i] == 0x9B ? 'x' : text[i]);
+        int rounds = EOL_BENCHMARK_BYTES / size;
+
+        // The old loop moves the whole length each time, so its buffer needs room for that
+        std::vector<uint8_t> old_buf(size * 4);
+        std::vector<uint8_t> new_buf(size * 2);
+        size_t old_len = 0, new_len = 0;
+
+        auto started = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; i++)
+        {
+            std::copy(text.begin(), text.end(), old_buf.begin());
+            old_len = old_from_atascii_crlf(old_buf.data(), text.size());
+        }
+        double old_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count();
+
+        started = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; i++)
+        {
+            std::copy(text.begin(), text.end(), new_buf.begin());
+            new_len = util_eol_from_atascii(new_buf.data(), text.size(), new_buf.size(), EOL_TRANSLATION_CRLF, true);
+        }
+        double new_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count();
+
+        // Given the room, the old way gets the same answer; it's only the time that differs
+        TEST_ASSERT_EQUAL_size_t(old_len, new_len);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(old_buf.data(), new_buf.data(), new_len);
+
+        char message[128];
+        snprintf(message, sizeof(message), "CR/LF of %u bytes: old %.2f us, new %.2f us",
+                 (unsigned)size, old_us / rounds, new_us / rounds);
+        TEST_MESSAGE(message);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_to_atascii_none);
+    RUN_TEST(test_to_atascii_cr);
+    RUN_TEST(test_to_atascii_lf);
+    RUN_TEST(test_to_atascii_crlf);
+    RUN_TEST(test_to_atascii_tabs);
+    RUN_TEST(test_to_atascii_crlf_split_across_buffers);
+    RUN_TEST(test_from_atascii_none);
+    RUN_TEST(test_from_atascii_cr);
+    RUN_TEST(test_from_atascii_lf);
+    RUN_TEST(test_from_atascii_crlf);
+    RUN_TEST(test_from_atascii_tabs);
+    RUN_TEST(test_from_atascii_crlf_exactly_at_capacity);
+    RUN_TEST(test_from_atascii_crlf_overflow_drops_what_doesnt_fit);
+    RUN_TEST(test_from_atascii_crlf_eol_split_at_end_of_buffer);
+    RUN_TEST(test_from_atascii_len_beyond_capacity);
+    RUN_TEST(test_random_against_reference);
+    RUN_TEST(test_crlf_benchmark);
+    return UNITY_END();
+}
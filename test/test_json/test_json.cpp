@@ -0,0 +1,313 @@
+/* Native tests for the streaming JSON tokenizer and its path queries: pio test -e native -f test_json */
+#include <unity.h>
+#include <cstring>
+#include <string>
+
+#include "jsonStream.h"
+
+// jsonStream.cpp is built straight into the test, since json.cpp needs a protocol to read from
+#include "../../lib/json/jsonStream.cpp"
+#include "../../lib/utils/documentStream.cpp"
+
+void setUp() {}
+void tearDown() {}
+
+static const char *DOC =
+    "{\"name\":\"FujiNet\",\"version\":1.5,\"ok\":true,\"gone\":null,\"none\":false,"
+    "\"results\":[{\"id\":1,\"title\":\"Star Raiders\",\"tags\":[\"space\",\"action\"]},"
+    "{\"id\":-3e2,\"title\":\"M.U.L.E.\",\"tags\":[]},"
+    "{\"id\":42,\"title\":\"caf\\u00e9 \\\"quoted\\\"\\n\",\"meta\":{\"year\":1983}}],"
+    "\"empty\":{}}";
+
+static void parse_whole(JSONStreamParser &parser, const char *doc)
+{
+    parser.reset();
+    parser.push(doc, strlen(doc));
+}
+
+// Runs query against the parsed document, with the Atari's EOLs shown as '|'
+static std::string query(JSONStreamParser &parser, const char *q, int *matches = nullptr)
+{
+    JSONQuery query;
+    query.compile(q);
+    std::string out;
+    int n = query.run(parser.events(), parser.events_len(), out);
+    if (matches != nullptr)
+        *matches = n;
+    for (auto &c : out)
+        if ((uint8_t)c == 0x9B)
+            c = '|';
+    return out;
+}
+
+void test_whole_document()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, DOC);
+    TEST_ASSERT_TRUE(parser.finish());
+    TEST_ASSERT_TRUE(parser.complete());
+    TEST_ASSERT_FALSE(parser.failed());
+}
+
+void test_split_at_every_position()
+{
+    // However the data arrives, a token split between pushes gives the same events as the whole thing
+    JSONStreamParser whole;
+    parse_whole(whole, DOC);
+    TEST_ASSERT_TRUE(whole.finish());
+    std::string expected((const char *)whole.events(), whole.events_len());
+
+    size_t len = strlen(DOC);
+    for (size_t split = 1; split < len; split++)
+    {
+        JSONStreamParser parser;
+        parser.reset();
+        parser.push(DOC, split);
+        parser.push(DOC + split, len - split);
+        TEST_ASSERT_TRUE(parser.finish());
+        TEST_ASSERT_EQUAL_size_t(expected.size(), parser.events_len());
+        TEST_ASSERT_EQUAL_MEMORY(expected.data(), parser.events(), expected.size());
+    }
+}
+
+void test_one_byte_at_a_time()
+{
+    JSONStreamParser parser;
+    parser.reset();
+    for (const char *p = DOC; *p; p++)
+        parser.push(p, 1);
+    TEST_ASSERT_TRUE(parser.finish());
+    TEST_ASSERT_EQUAL_STRING("Star Raiders|", query(parser, "/results/0/title").c_str());
+}
+
+void test_unicode_escapes()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, "[\"\\u00e9\",\"\\u20ac\",\"\\ud83d\\ude00\",\"a\\u0041\"]");
+    TEST_ASSERT_TRUE(parser.finish());
+    TEST_ASSERT_EQUAL_STRING("\xC3\xA9|", query(parser, "/0").c_str());
+    TEST_ASSERT_EQUAL_STRING("\xE2\x82\xAC|", query(parser, "/1").c_str());
+    // A surrogate pair is one character, four bytes of UTF-8
+    TEST_ASSERT_EQUAL_STRING("\xF0\x9F\x98\x80|", query(parser, "/2").c_str());
+    TEST_ASSERT_EQUAL_STRING("aA|", query(parser, "/3").c_str());
+}
+
+void test_surrogate_pair_split_across_pushes()
+{
+    const char *doc = "[\"\\ud83d\\ude00\"]";
+    size_t len = strlen(doc);
+    for (size_t split = 1; split < len; split++)
+    {
+        JSONStreamParser parser;
+        parser.reset();
+        parser.push(doc, split);
+        parser.push(doc + split, len - split);
+        TEST_ASSERT_TRUE(parser.finish());
+        TEST_ASSERT_EQUAL_STRING("\xF0\x9F\x98\x80|", query(parser, "/0").c_str());
+    }
+}
+
+void test_string_escapes()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, DOC);
+    TEST_ASSERT_TRUE(parser.finish());
+    TEST_ASSERT_EQUAL_STRING("caf\xC3\xA9 \"quoted\"\n|", query(parser, "/results/2/title").c_str());
+}
+
+void test_scalar_queries()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, DOC);
+    TEST_ASSERT_TRUE(parser.finish());
+    TEST_ASSERT_EQUAL_STRING("FujiNet|", query(parser, "/name").c_str());
+    TEST_ASSERT_EQUAL_STRING("1.5|", query(parser, "/version").c_str());
+    TEST_ASSERT_EQUAL_STRING("TRUE|", query(parser, "/ok").c_str());
+    TEST_ASSERT_EQUAL_STRING("FALSE|", query(parser, "/none").c_str());
+    TEST_ASSERT_EQUAL_STRING("NULL|", query(parser, "/gone").c_str());
+    // The leading slash is optional, and an EOL left on the end by the Atari is ignored
+    TEST_ASSERT_EQUAL_STRING("FujiNet|", query(parser, "name").c_str());
+    TEST_ASSERT_EQUAL_STRING("FujiNet|", query(parser, "/name\x9b").c_str());
+}
+
+void test_nested_and_index_queries()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, DOC);
+    TEST_ASSERT_TRUE(parser.finish());
+    TEST_ASSERT_EQUAL_STRING("1|", query(parser, "/results/0/id").c_str());
+    TEST_ASSERT_EQUAL_STRING("-300|", query(parser, "/results/1/id").c_str());
+    TEST_ASSERT_EQUAL_STRING("action|", query(parser, "/results/0/tags/1").c_str());
+    TEST_ASSERT_EQUAL_STRING("1983|", query(parser, "/results/2/meta/year").c_str());
+    // A matched container comes back as everything inside it, in order
+    TEST_ASSERT_EQUAL_STRING("space|action|", query(parser, "/results/0/tags").c_str());
+    TEST_ASSERT_EQUAL_STRING("year|1983|", query(parser, "/results/2/meta").c_str());
+}
+
+void test_wildcard_queries()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, DOC);
+    TEST_ASSERT_TRUE(parser.finish());
+
+    int matches;
+    TEST_ASSERT_EQUAL_STRING("Star Raiders|M.U.L.E.|caf\xC3\xA9 \"quoted\"\n|", query(parser, "/results/*/title", &matches).c_str());
+    TEST_ASSERT_EQUAL_INT(3, matches);
+    TEST_ASSERT_EQUAL_STRING("space|action|", query(parser, "/results/*/tags/*", &matches).c_str());
+    TEST_ASSERT_EQUAL_INT(2, matches);
+    // Only the results that have one
+    TEST_ASSERT_EQUAL_STRING("year|1983|", query(parser, "/results/*/meta", &matches).c_str());
+    TEST_ASSERT_EQUAL_INT(1, matches);
+}
+
+void test_queries_that_match_nothing()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, DOC);
+    TEST_ASSERT_TRUE(parser.finish());
+
+    int matches;
+    TEST_ASSERT_EQUAL_STRING("", query(parser, "/missing", &matches).c_str());
+    TEST_ASSERT_EQUAL_INT(0, matches);
+    TEST_ASSERT_EQUAL_STRING("", query(parser, "/results/9", &matches).c_str());
+    TEST_ASSERT_EQUAL_INT(0, matches);
+    TEST_ASSERT_EQUAL_STRING("", query(parser, "/name/0", &matches).c_str());
+    TEST_ASSERT_EQUAL_INT(0, matches);
+    // Empty containers match, with nothing in them
+    TEST_ASSERT_EQUAL_STRING("", query(parser, "/empty", &matches).c_str());
+    TEST_ASSERT_EQUAL_INT(1, matches);
+}
+
+// Runs query with JSON_OUTPUT_BINARY
+static std::string query_binary(JSONStreamParser &parser, const char *q, int *matches = nullptr)
+{
+    JSONQuery query;
+    query.compile(q);
+    std::string out;
+    int n = query.run(parser.events(), parser.events_len(), out, JSON_OUTPUT_BINARY);
+    if (matches != nullptr)
+        *matches = n;
+    return out;
+}
+
+static void check_binary(const std::string &expected, const std::string &actual)
+{
+    TEST_ASSERT_EQUAL_size_t(expected.size(), actual.size());
+    TEST_ASSERT_EQUAL_MEMORY(expected.data(), actual.data(), expected.size());
+}
+
+void test_binary_scalars()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, DOC);
+    TEST_ASSERT_TRUE(parser.finish());
+
+    check_binary(std::string("S\x07\x00" "FujiNet", 10), query_binary(parser, "/name"));
+    check_binary(std::string("I\x01\x00\x00\x00", 5), query_binary(parser, "/results/0/id"));
+    check_binary(std::string("I\xBF\x07\x00\x00", 5), query_binary(parser, "/results/2/meta/year"));
+    check_binary("T", query_binary(parser, "/ok"));
+    check_binary("F", query_binary(parser, "/none"));
+    check_binary("Z", query_binary(parser, "/gone"));
+    // Numbers that aren't integers come as the text they arrived as
+    check_binary(std::string("S\x03\x00" "1.5", 6), query_binary(parser, "/version"));
+    check_binary(std::string("S\x04\x00" "-3e2", 7), query_binary(parser, "/results/1/id"));
+}
+
+void test_binary_integer_range()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, "[-1,2147483647,-2147483648,2147483648]");
+    TEST_ASSERT_TRUE(parser.finish());
+
+    check_binary(std::string("I\xFF\xFF\xFF\xFF", 5), query_binary(parser, "/0"));
+    check_binary(std::string("I\xFF\xFF\xFF\x7F", 5), query_binary(parser, "/1"));
+    check_binary(std::string("I\x00\x00\x00\x80", 5), query_binary(parser, "/2"));
+    // Too big for four bytes, so it's sent as text
+    check_binary(std::string("S\x0A\x00" "2147483648", 13), query_binary(parser, "/3"));
+}
+
+void test_binary_containers()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, DOC);
+    TEST_ASSERT_TRUE(parser.finish());
+
+    check_binary(std::string("L\x02\x00" "S\x05\x00" "space" "S\x06\x00" "action", 3 + 8 + 9),
+                 query_binary(parser, "/results/0/tags"));
+    check_binary(std::string("L\x02\x00" "K\x04\x00" "year" "I\xBF\x07\x00\x00", 3 + 7 + 5),
+                 query_binary(parser, "/results/2/meta"));
+    check_binary(std::string("L\x00\x00", 3), query_binary(parser, "/empty"));
+
+    // Anything nested inside is flattened into the one list, with the count covering all of it
+    std::string result = query_binary(parser, "/results/0");
+    TEST_ASSERT_EQUAL_UINT8('L', result[0]);
+    TEST_ASSERT_EQUAL_UINT16(7, (uint8_t)result[1] | (uint8_t)result[2] << 8);
+    check_binary(std::string("L\x07\x00"
+                             "K\x02\x00" "id" "I\x01\x00\x00\x00"
+                             "K\x05\x00" "title" "S\x0C\x00" "Star Raiders"
+                             "K\x04\x00" "tags" "S\x05\x00" "space" "S\x06\x00" "action",
+                             3 + 5 + 5 + 8 + 15 + 7 + 8 + 9),
+                 result);
+}
+
+void test_binary_wildcard()
+{
+    JSONStreamParser parser;
+    parse_whole(parser, DOC);
+    TEST_ASSERT_TRUE(parser.finish());
+
+    int matches;
+    check_binary(std::string("I\x01\x00\x00\x00" "S\x04\x00" "-3e2" "I\x2A\x00\x00\x00", 5 + 7 + 5),
+                 query_binary(parser, "/results/*/id", &matches));
+    TEST_ASSERT_EQUAL_INT(3, matches);
+}
+
+void test_incomplete_and_invalid_documents()
+{
+    JSONStreamParser parser;
+
+    parse_whole(parser, "{\"a\":[1,2");
+    TEST_ASSERT_FALSE(parser.finish());
+
+    parse_whole(parser, "{\"a\" 1}");
+    TEST_ASSERT_FALSE(parser.finish());
+    TEST_ASSERT_TRUE(parser.failed());
+
+    parse_whole(parser, "[1,2}");
+    TEST_ASSERT_FALSE(parser.finish());
+
+    parse_whole(parser, "[\"bad \\q escape\"]");
+    TEST_ASSERT_FALSE(parser.finish());
+
+    // Nested deeper than we keep track of
+    std::string deep(JSON_MAX_DEPTH + 1, '[');
+    deep += std::string(JSON_MAX_DEPTH + 1, ']');
+    parse_whole(parser, deep.c_str());
+    TEST_ASSERT_FALSE(parser.finish());
+
+    // reset() makes the parser good for another document
+    parse_whole(parser, "[true]");
+    TEST_ASSERT_TRUE(parser.finish());
+    TEST_ASSERT_EQUAL_STRING("TRUE|", query(parser, "/0").c_str());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_whole_document);
+    RUN_TEST(test_split_at_every_position);
+    RUN_TEST(test_one_byte_at_a_time);
+    RUN_TEST(test_unicode_escapes);
+    RUN_TEST(test_surrogate_pair_split_across_pushes);
+    RUN_TEST(test_string_escapes);
+    RUN_TEST(test_scalar_queries);
+    RUN_TEST(test_nested_and_index_queries);
+    RUN_TEST(test_wildcard_queries);
+    RUN_TEST(test_queries_that_match_nothing);
+    RUN_TEST(test_binary_scalars);
+    RUN_TEST(test_binary_integer_range);
+    RUN_TEST(test_binary_containers);
+    RUN_TEST(test_binary_wildcard);
+    RUN_TEST(test_incomplete_and_invalid_documents);
+    return UNITY_END();
+}
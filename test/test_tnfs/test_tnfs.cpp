@@ -0,0 +1,484 @@
+/* Native tests for the TNFS client against the stand-in server, over a clean
+   link and a poor one: pio test -e native -f test_tnfs */
+#include <unity.h>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tnfsTestHelpers.h"
+#include "fnSystemHost.h"
+
+// The client is built straight into the test, with test/native standing in for lwIP and FreeRTOS
+#include "../../lib/TNFSlib/tnfslib.cpp"
+#include "../../lib/TNFSlib/tnfslibMountInfo.cpp"
+#include "../../lib/TNFSlib/tnfslibBlockCache.cpp"
+#include "../../lib/TNFSlib/tnfslibMetaCache.cpp"
+#include "../../lib/tcpip/fnUDP.cpp"
+#include "../../lib/tcpip/fnTcpClient.cpp"
+#include "../../lib/tcpip/fnDNS.cpp"
+#include "../../lib/utils/cbuf.cpp"
+
+void setUp()
+{
+    start_server("/tmp/tnfs_testXXXXXX");
+}
+
+void tearDown()
+{
+    stop_server();
+}
+
+void test_mount_and_stat()
+{
+    write_host_file("disk.atr", make_data(92176, 1));
+    tnfsMountInfo *m_info = mount();
+    TEST_ASSERT_EQUAL_HEX16(TNFS_TEST_SERVER_VERSION, m_info->server_version);
+
+    tnfsStat st;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_stat(m_info, &st, "/disk.atr"));
+    TEST_ASSERT_FALSE(st.isDir);
+    TEST_ASSERT_EQUAL_UINT32(92176, st.filesize);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_stat(m_info, &st, "/"));
+    TEST_ASSERT_TRUE(st.isDir);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_FILE_NOT_FOUND, tnfs_stat(m_info, &st, "/nothing.atr"));
+
+    uint32_t size = 0, free = 0;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_size(m_info, &size));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_free(m_info, &free));
+    TEST_ASSERT_TRUE(size > 0 && free <= size);
+
+    unmount(m_info);
+
+    // Somewhere that isn't there
+    m_info = new tnfsMountInfo(htonl(INADDR_LOOPBACK), server->port());
+    m_info->transport = TNFS_TRANSPORT_UDP;
+    strlcpy(m_info->mountpath, "/missing", sizeof(m_info->mountpath));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_FILE_NOT_FOUND, tnfs_mount(m_info));
+    delete m_info;
+}
+
+void test_sequential_read()
+{
+    std::vector<uint8_t> data = make_data(100000, 2);
+    write_host_file("big.bin", data);
+    tnfsMountInfo *m_info = mount();
+
+    // Sector-sized reads, and larger ones that span many READs
+    TEST_ASSERT_TRUE(read_file(m_info, "/big.bin", 128) == data);
+    TEST_ASSERT_TRUE(read_file(m_info, "/big.bin", 4000) == data);
+    TEST_ASSERT_TRUE(m_info->protocol_stats.bytes_read > 0);
+
+    unmount(m_info);
+}
+
+void test_jumbo_reads()
+{
+    std::vector<uint8_t> data = make_data(50000, 3);
+    write_host_file("big.bin", data);
+
+    // A server that sends as much as we ask for
+    server->set_max_read(TNFS_JUMBO_READ_PAYLOAD);
+    tnfsMountInfo *m_info = mount();
+    TEST_ASSERT_TRUE(read_file(m_info, "/big.bin", 8192) == data);
+    TEST_ASSERT_TRUE(m_info->read_payload_learned);
+    TEST_ASSERT_EQUAL(TNFS_JUMBO_READ_PAYLOAD, m_info->read_payload);
+    unmount(m_info);
+
+    // And one that sends less
+    server->set_max_read(1024);
+    m_info = mount();
+    TEST_ASSERT_TRUE(read_file(m_info, "/big.bin", 8192) == data);
+    TEST_ASSERT_EQUAL(1024, m_info->read_payload);
+    unmount(m_info);
+}
+
+void test_random_read()
+{
+    std::vector<uint8_t> data = make_data(65536, 4);
+    write_host_file("random.bin", data);
+    tnfsMountInfo *m_info = mount();
+
+    int16_t fh;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, "/random.bin", TNFS_OPENMODE_READ, 0, &fh));
+    uint32_t seed = 5;
+    for (int i = 0; i < 200; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t pos = (seed >> 8) % data.size();
+        uint8_t buf[256];
+        uint16_t got = 0;
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_lseek(m_info, fh, pos, SEEK_SET));
+        int result = tnfs_read(m_info, fh, buf, sizeof(buf), &got);
+        uint16_t expected = data.size() - pos < sizeof(buf) ? data.size() - pos : sizeof(buf);
+        TEST_ASSERT_EQUAL(expected < sizeof(buf) ? TNFS_RESULT_END_OF_FILE : TNFS_RESULT_SUCCESS, result);
+        TEST_ASSERT_EQUAL(expected, got);
+        TEST_ASSERT_EQUAL_MEMORY(data.data() + pos, buf, got);
+    }
+
+    // Seeking from the end
+    uint8_t buf[16];
+    uint16_t got = 0;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_lseek(m_info, fh, -16, SEEK_END));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_read(m_info, fh, buf, sizeof(buf), &got));
+    TEST_ASSERT_EQUAL_MEMORY(data.data() + data.size() - 16, buf, 16);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, fh));
+
+    unmount(m_info);
+}
+
+void test_write()
+{
+    std::vector<uint8_t> data = make_data(40000, 6);
+    tnfsMountInfo *m_info = mount();
+
+    // Sector writes, gathered into full WRITEs
+    write_file(m_info, "/out.bin", data, 128);
+    TEST_ASSERT_TRUE(read_host_file("out.bin") == data);
+    TEST_ASSERT_TRUE(read_file(m_info, "/out.bin", 512) == data);
+
+    // Overwriting part of it in place
+    int16_t fh;
+    std::vector<uint8_t> patch = make_data(3000, 7);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, "/out.bin", TNFS_OPENMODE_READWRITE, 0, &fh));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_lseek(m_info, fh, 10000, SEEK_SET));
+    uint16_t put = 0;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_write(m_info, fh, patch.data(), patch.size(), &put));
+    // Reading back what's still in the write buffer sends it first
+    uint8_t buf[100];
+    uint16_t got = 0;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_lseek(m_info, fh, 12950, SEEK_SET));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_read(m_info, fh, buf, sizeof(buf), &got));
+    TEST_ASSERT_EQUAL_MEMORY(patch.data() + 2950, buf, 50);
+    TEST_ASSERT_EQUAL_MEMORY(data.data() + 13000, buf + 50, 50);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, fh));
+
+    std::copy(patch.begin(), patch.end(), data.begin() + 10000);
+    TEST_ASSERT_TRUE(read_host_file("out.bin") == data);
+
+    // Opening exclusively fails now it's there
+    TEST_ASSERT_EQUAL(TNFS_RESULT_FILE_EXISTS, tnfs_open(m_info, "/out.bin",
+        TNFS_OPENMODE_WRITE | TNFS_OPENMODE_WRITE_CREATE | TNFS_OPENMODE_CREATE_EXCLUSIVE, 0644, &fh));
+
+    unmount(m_info);
+}
+
+void test_readdir()
+{
+    std::filesystem::create_directory(root + "/games");
+    std::filesystem::create_directory(root + "/Demos");
+    write_host_file("b.atr", make_data(10, 1));
+    write_host_file("A.ATR", make_data(20, 1));
+    write_host_file("c.xex", make_data(30, 1));
+    write_host_file(".hidden", make_data(40, 1));
+    tnfsMountInfo *m_info = mount();
+
+    // Folders first, then files, ignoring case and hidden files
+    const char *expected[] = {"Demos", "games", "A.ATR", "b.atr", "c.xex"};
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_opendirx(m_info, "/"));
+    TEST_ASSERT_EQUAL(5, m_info->dir_entries);
+    for (const char *name : expected)
+    {
+        tnfsStat st;
+        char entry[TNFS_MAX_FILELEN];
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_readdirx(m_info, &st, entry, sizeof(entry)));
+        TEST_ASSERT_EQUAL_STRING(name, entry);
+        TEST_ASSERT_EQUAL(name[0] == 'D' || name[0] == 'g', st.isDir);
+        if (strcmp(name, "c.xex") == 0)
+            TEST_ASSERT_EQUAL_UINT32(30, st.filesize);
+    }
+    tnfsStat st;
+    char entry[TNFS_MAX_FILELEN];
+    TEST_ASSERT_EQUAL(TNFS_RESULT_END_OF_FILE, tnfs_readdirx(m_info, &st, entry, sizeof(entry)));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_closedir(m_info));
+
+    // The pattern leaves the folders alone
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_opendirx(m_info, "/", 0, 0, "*.atr"));
+    TEST_ASSERT_EQUAL(3, m_info->dir_entries);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_closedir(m_info));
+
+    // Plenty of entries, more than fit in one READDIRX
+    std::filesystem::create_directory(root + "/many");
+    for (int i = 0; i < 300; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "many/file_with_a_long_name_%03d.atr", i);
+        write_host_file(name, make_data(i, 1));
+    }
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_opendirx(m_info, "/many"));
+    TEST_ASSERT_EQUAL(300, m_info->dir_entries);
+    for (int i = 0; i < 300; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "file_with_a_long_name_%03d.atr", i);
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_readdirx(m_info, &st, entry, sizeof(entry)));
+        TEST_ASSERT_EQUAL_STRING(name, entry);
+        TEST_ASSERT_EQUAL_UINT32(i, st.filesize);
+    }
+    TEST_ASSERT_EQUAL(TNFS_RESULT_END_OF_FILE, tnfs_readdirx(m_info, &st, entry, sizeof(entry)));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_closedir(m_info));
+
+    unmount(m_info);
+}
+
+// Directory streams have their own server handles, so they don't get in the way of tnfs_opendirx or each other
+void test_dir_streams()
+{
+    std::filesystem::create_directory(root + "/many");
+    for (int i = 0; i < 300; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "many/file_with_a_long_name_%03d.atr", i);
+        write_host_file(name, make_data(i, 1));
+    }
+    write_host_file("one.atr", make_data(10, 1));
+    tnfsMountInfo *m_info = mount();
+
+    tnfsStat st;
+    char entry[TNFS_MAX_FILELEN];
+    char name[64];
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_opendirx(m_info, "/many"));
+    for (int i = 0; i < 10; i++)
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_readdirx(m_info, &st, entry, sizeof(entry)));
+
+    tnfsDirStream many, top;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_dirstream_open(m_info, &many, "/many"));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_dirstream_open(m_info, &top, "/"));
+    TEST_ASSERT_NOT_EQUAL(many.handle, top.handle);
+    TEST_ASSERT_NOT_EQUAL(m_info->dir_handle, many.handle);
+
+    // Every entry, crossing several READDIRX replies, while the others are read too
+    for (int i = 0; i < 300; i++)
+    {
+        snprintf(name, sizeof(name), "file_with_a_long_name_%03d.atr", i);
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_dirstream_read(m_info, &many, &st, entry, sizeof(entry)));
+        TEST_ASSERT_EQUAL_STRING(name, entry);
+        TEST_ASSERT_EQUAL_UINT32(i, st.filesize);
+        if (i == 100)
+        {
+            TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_dirstream_read(m_info, &top, &st, entry, sizeof(entry)));
+            TEST_ASSERT_EQUAL_STRING("many", entry);
+            TEST_ASSERT_TRUE(st.isDir);
+        }
+        if (i == 200)
+            TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_readdirx(m_info, &st, entry, sizeof(entry)));
+    }
+    TEST_ASSERT_EQUAL(TNFS_RESULT_END_OF_FILE, tnfs_dirstream_read(m_info, &many, &st, entry, sizeof(entry)));
+    TEST_ASSERT_EQUAL(300, many.position);
+
+    // Going back for an entry
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_dirstream_seek(m_info, &many, 250));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_dirstream_read(m_info, &many, &st, entry, sizeof(entry)));
+    TEST_ASSERT_EQUAL_STRING("file_with_a_long_name_250.atr", entry);
+    TEST_ASSERT_EQUAL(251, many.position);
+
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_dirstream_read(m_info, &top, &st, entry, sizeof(entry)));
+    TEST_ASSERT_EQUAL_STRING("one.atr", entry);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_END_OF_FILE, tnfs_dirstream_read(m_info, &top, &st, entry, sizeof(entry)));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_dirstream_close(m_info, &many));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_dirstream_close(m_info, &top));
+
+    // The mount's own directory carried on from where it was
+    for (int i = 11; i < 300; i++)
+    {
+        snprintf(name, sizeof(name), "file_with_a_long_name_%03d.atr", i);
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_readdirx(m_info, &st, entry, sizeof(entry)));
+        TEST_ASSERT_EQUAL_STRING(name, entry);
+    }
+    TEST_ASSERT_EQUAL(TNFS_RESULT_END_OF_FILE, tnfs_readdirx(m_info, &st, entry, sizeof(entry)));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_closedir(m_info));
+
+    unmount(m_info);
+}
+
+// An open file's size counts writes that haven't been sent yet, without sending them
+void test_fstat_pending_writes()
+{
+    tnfsMountInfo *m_info = mount();
+    int16_t fh;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, "/out.bin",
+        TNFS_OPENMODE_WRITE | TNFS_OPENMODE_WRITE_CREATE | TNFS_OPENMODE_WRITE_TRUNCATE, 0644, &fh));
+    std::vector<uint8_t> data = make_data(300, 5);
+    uint16_t len = 0;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_write(m_info, fh, data.data(), data.size(), &len));
+
+    tnfsStat st;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_fstat(m_info, fh, &st));
+    TEST_ASSERT_EQUAL_UINT32(300, st.filesize);
+    TEST_ASSERT_EQUAL_UINT32(0, m_info->protocol_stats.bytes_written);
+
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, fh));
+    TEST_ASSERT_TRUE(read_host_file("out.bin") == data);
+    unmount(m_info);
+}
+
+void test_directory_changes()
+{
+    tnfsMountInfo *m_info = mount();
+
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_mkdir(m_info, "/new"));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_FILE_EXISTS, tnfs_mkdir(m_info, "/new"));
+    write_file(m_info, "/new/one.bin", make_data(1000, 8), 256);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_DIRECTORY_NOT_EMPTY, tnfs_rmdir(m_info, "/new"));
+
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_rename(m_info, "/new/one.bin", "/new/two.bin"));
+    tnfsStat st;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_FILE_NOT_FOUND, tnfs_stat(m_info, &st, "/new/one.bin"));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_stat(m_info, &st, "/new/two.bin"));
+    TEST_ASSERT_EQUAL_UINT32(1000, st.filesize);
+
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_unlink(m_info, "/new/two.bin"));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_FILE_NOT_FOUND, tnfs_unlink(m_info, "/new/two.bin"));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_rmdir(m_info, "/new"));
+    TEST_ASSERT_FALSE(std::filesystem::exists(root + "/new"));
+
+    // Nothing outside the mount
+    TEST_ASSERT_EQUAL(TNFS_RESULT_ACCESS_DENIED, tnfs_stat(m_info, &st, "/../etc/passwd"));
+
+    unmount(m_info);
+}
+
+void test_server_restart()
+{
+    std::vector<uint8_t> data = make_data(30000, 9);
+    write_host_file("restart.bin", data);
+    tnfsMountInfo *m_info = mount();
+
+    int16_t fh;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, "/restart.bin", TNFS_OPENMODE_READ, 0, &fh));
+    std::vector<uint8_t> got_data(data.size());
+    uint16_t got = 0;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_read(m_info, fh, got_data.data(), 10000, &got));
+
+    // The open file carries on from where it was on a new session
+    server->forget_sessions();
+    uint16_t more = 0;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_END_OF_FILE, tnfs_read(m_info, fh, got_data.data() + got, 30000, &more));
+    TEST_ASSERT_EQUAL(data.size(), got + more);
+    TEST_ASSERT_TRUE(got_data == data);
+    TEST_ASSERT_EQUAL_UINT32(1, m_info->protocol_stats.reconnects);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, fh));
+
+    unmount(m_info);
+}
+
+void test_impaired_link()
+{
+    std::vector<uint8_t> data = make_data(60000, 10);
+    write_host_file("in.bin", data);
+
+    tnfsTestImpairment impairment;
+    impairment.loss_percent = 5;
+    impairment.duplicate_percent = 10;
+    impairment.reorder_percent = 10;
+    impairment.delay_ms = 1;
+    impairment.jitter_ms = 4;
+    server->set_impairment(impairment);
+
+    tnfsMountInfo *m_info = mount();
+    TEST_ASSERT_TRUE(read_file(m_info, "/in.bin", 1024) == data);
+    write_file(m_info, "/out.bin", data, 128);
+    TEST_ASSERT_TRUE(read_host_file("out.bin") == data);
+
+    tnfsStat st;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_opendirx(m_info, "/"));
+    char entry[TNFS_MAX_FILELEN];
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_readdirx(m_info, &st, entry, sizeof(entry)));
+    TEST_ASSERT_EQUAL_STRING("in.bin", entry);
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_closedir(m_info));
+
+    // Make sure the link really was a poor one
+    tnfsTestServerStats stats = server->stats();
+    TEST_ASSERT_TRUE(stats.requests_dropped + stats.replies_dropped > 0);
+    TEST_ASSERT_TRUE(stats.duplicates > 0);
+    TEST_ASSERT_TRUE(stats.replies_reordered > 0);
+    TEST_ASSERT_TRUE(m_info->protocol_stats.retransmits > 0);
+
+    unmount(m_info);
+}
+
+// A background task reading a large file while another reads and writes sectors on the same mount
+void test_shared_mount()
+{
+    std::vector<uint8_t> big = make_data(300000, 11);
+    std::vector<uint8_t> disk = make_data(92160, 12);
+    std::vector<uint8_t> out = make_data(128 * 200, 13);
+    write_host_file("big.bin", big);
+    write_host_file("disk.atr", disk);
+    // Slow enough that the background reads are always part-way through something
+    tnfsTestImpairment impairment;
+    impairment.delay_ms = 1;
+    server->set_impairment(impairment);
+    tnfsMountInfo *m_info = mount();
+
+    // Unity can't assert from another thread, so the background task just keeps score
+    std::atomic<bool> done(false);
+    int passes = 0, bad_passes = 0;
+    std::thread background([&]() {
+        std::vector<uint8_t> got(big.size());
+        while (done == false || passes == 0)
+        {
+            int16_t fh;
+            uint16_t len = 0;
+            size_t pos = 0;
+            if (tnfs_open(m_info, "/big.bin", TNFS_OPENMODE_READ, 0, &fh) == TNFS_RESULT_SUCCESS)
+            {
+                while (pos < got.size() && tnfs_read(m_info, fh, got.data() + pos, 8192, &len) != -1 && len > 0)
+                    pos += len;
+                tnfs_close(m_info, fh);
+            }
+            passes++;
+            if (pos != big.size() || got != big)
+                bad_passes++;
+        }
+    });
+
+    int16_t disk_fh, out_fh;
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, "/disk.atr", TNFS_OPENMODE_READ, 0, &disk_fh));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, "/out.bin",
+        TNFS_OPENMODE_WRITE | TNFS_OPENMODE_WRITE_CREATE | TNFS_OPENMODE_WRITE_TRUNCATE, 0644, &out_fh));
+    uint32_t seed = 14;
+    for (size_t i = 0; i < out.size() / 128; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t pos = (seed >> 8) % (disk.size() / 128) * 128;
+        uint8_t sector[128];
+        uint16_t len = 0;
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_lseek(m_info, disk_fh, pos, SEEK_SET));
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_read(m_info, disk_fh, sector, sizeof(sector), &len));
+        TEST_ASSERT_EQUAL_MEMORY(disk.data() + pos, sector, sizeof(sector));
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_write(m_info, out_fh, out.data() + i * 128, 128, &len));
+    }
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, out_fh));
+    TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, disk_fh));
+
+    done = true;
+    background.join();
+    TEST_ASSERT_EQUAL(0, bad_passes);
+    TEST_ASSERT_TRUE(read_host_file("out.bin") == out);
+    // The background reads let us in part-way through rather than making us wait for them
+    TEST_ASSERT_TRUE(m_info->protocol_stats.handovers > 0);
+
+    unmount(m_info);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_mount_and_stat);
+    RUN_TEST(test_sequential_read);
+    RUN_TEST(test_jumbo_reads);
+    RUN_TEST(test_random_read);
+    RUN_TEST(test_write);
+    RUN_TEST(test_readdir);
+    RUN_TEST(test_dir_streams);
+    RUN_TEST(test_fstat_pending_writes);
+    RUN_TEST(test_directory_changes);
+    RUN_TEST(test_server_restart);
+    RUN_TEST(test_impaired_link);
+    RUN_TEST(test_shared_mount);
+    return UNITY_END();
+}
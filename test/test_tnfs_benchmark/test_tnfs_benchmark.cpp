@@ -0,0 +1,233 @@
+/* Benchmarks for the TNFS client against the stand-in server, over a clean link
+   and a poor one: pio test -e native -f test_tnfs_benchmark -v
+   Each one reports its throughput or time per operation along with the
+   client's protocol counters, and checks the data it moved was right. */
+#include <unity.h>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "tnfsTestHelpers.h"
+#include "fnSystemHost.h"
+
+// The client is built straight into the test, with test/native standing in for lwIP and FreeRTOS
+#include "../../lib/TNFSlib/tnfslib.cpp"
+#include "../../lib/TNFSlib/tnfslibMountInfo.cpp"
+#include "../../lib/TNFSlib/tnfslibBlockCache.cpp"
+#include "../../lib/TNFSlib/tnfslibMetaCache.cpp"
+#include "../../lib/tcpip/fnUDP.cpp"
+#include "../../lib/tcpip/fnTcpClient.cpp"
+#include "../../lib/tcpip/fnDNS.cpp"
+#include "../../lib/utils/cbuf.cpp"
+
+#define BENCHMARK_FILE_SIZE (1024 * 1024)
+#define BENCHMARK_OPEN_FILES 50
+#define BENCHMARK_RANDOM_READS 500
+#define BENCHMARK_DIR_ENTRIES 500
+#define BENCHMARK_DIR_LISTINGS 16
+
+// A link to run every benchmark over. The poor one does less of everything, since each loss costs a timeout.
+struct benchmarkLink
+{
+    const char *name;
+    tnfsTestImpairment impairment;
+    int divisor;
+};
+
+static benchmarkLink links[] = {
+    {"clean", {}, 1},
+    {"poor", {1, 2, 5, 2, 3}, 8}, // 1% loss, 2% duplicated, 5% reordered, 2-5ms late
+};
+
+static std::chrono::steady_clock::time_point started;
+
+static tnfsMountInfo *mount(const benchmarkLink &link)
+{
+    server->set_impairment(link.impairment);
+    tnfsMountInfo *m_info = mount();
+    // Only count what the benchmark itself does
+    m_info->protocol_stats = tnfsProtocolStats();
+    started = std::chrono::steady_clock::now();
+    return m_info;
+}
+
+static double elapsed_ms()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+}
+
+static void report(tnfsMountInfo *m_info, const benchmarkLink &link, const char *what, const char *result)
+{
+    const tnfsProtocolStats &ps = m_info->protocol_stats;
+    char message[256];
+    snprintf(message, sizeof(message), "%-6s %-32s %-16s requests=%u retransmits=%u failures=%u",
+             link.name, what, result, ps.requests, ps.retransmits, ps.failures);
+    TEST_MESSAGE(message);
+    unmount(m_info);
+}
+
+static void report_throughput(tnfsMountInfo *m_info, const benchmarkLink &link, const char *what, size_t bytes)
+{
+    char what_size[64], result[32];
+    snprintf(what_size, sizeof(what_size), "%s %u KB", what, (unsigned)(bytes / 1024));
+    snprintf(result, sizeof(result), "%.2f MB/s", bytes / 1048576.0 / (elapsed_ms() / 1000));
+    report(m_info, link, what_size, result);
+}
+
+static void report_per_operation(tnfsMountInfo *m_info, const benchmarkLink &link, const char *what, int count)
+{
+    char what_count[64], result[32];
+    snprintf(what_count, sizeof(what_count), "%s x%d", what, count);
+    snprintf(result, sizeof(result), "%.3f ms each", elapsed_ms() / count);
+    report(m_info, link, what_count, result);
+}
+
+void setUp()
+{
+    start_server("/tmp/tnfs_benchXXXXXX");
+}
+
+void tearDown()
+{
+    stop_server();
+}
+
+// Opening and closing small files, the way a program loader might
+void test_open()
+{
+    for (int i = 0; i < BENCHMARK_OPEN_FILES; i++)
+        write_host_file("file" + std::to_string(i) + ".xex", make_data(100, i));
+
+    for (const benchmarkLink &link : links)
+    {
+        int opens = BENCHMARK_OPEN_FILES / link.divisor;
+        tnfsMountInfo *m_info = mount(link);
+        for (int i = 0; i < opens; i++)
+        {
+            int16_t fh;
+            std::string path = "/file" + std::to_string(i) + ".xex";
+            TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, path.c_str(), TNFS_OPENMODE_READ, 0, &fh));
+            TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, fh));
+        }
+        report_per_operation(m_info, link, "open and close", opens);
+    }
+}
+
+// Reading a whole file in large pieces
+void test_sequential_read()
+{
+    std::vector<uint8_t> data = make_data(BENCHMARK_FILE_SIZE, 1);
+    write_host_file("big.bin", data);
+
+    for (const benchmarkLink &link : links)
+    {
+        size_t size = data.size() / link.divisor;
+        std::vector<uint8_t> got(size);
+        tnfsMountInfo *m_info = mount(link);
+        int16_t fh;
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, "/big.bin", TNFS_OPENMODE_READ, 0, &fh));
+        for (size_t pos = 0; pos < size; pos += 4096)
+        {
+            uint16_t len = 0;
+            TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_read(m_info, fh, got.data() + pos, 4096, &len));
+            TEST_ASSERT_EQUAL(4096, len);
+        }
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, fh));
+        TEST_ASSERT_EQUAL_MEMORY(data.data(), got.data(), size);
+        report_throughput(m_info, link, "sequential read", size);
+    }
+}
+
+// Sector reads from all over a disk image
+void test_random_read()
+{
+    std::vector<uint8_t> data = make_data(BENCHMARK_FILE_SIZE, 2);
+    write_host_file("disk.atr", data);
+
+    for (const benchmarkLink &link : links)
+    {
+        int reads = BENCHMARK_RANDOM_READS / link.divisor;
+        tnfsMountInfo *m_info = mount(link);
+        int16_t fh;
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, "/disk.atr", TNFS_OPENMODE_READ, 0, &fh));
+        uint32_t seed = 3;
+        for (int i = 0; i < reads; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            uint32_t pos = (seed >> 8) % (data.size() / 256) * 256;
+            uint8_t sector[256];
+            uint16_t len = 0;
+            TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_lseek(m_info, fh, pos, SEEK_SET));
+            TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_read(m_info, fh, sector, sizeof(sector), &len));
+            TEST_ASSERT_EQUAL_MEMORY(data.data() + pos, sector, sizeof(sector));
+        }
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, fh));
+        report_per_operation(m_info, link, "random 256 byte read", reads);
+    }
+}
+
+// Listing a full directory, as the disk browser does
+void test_readdir()
+{
+    std::filesystem::create_directory(root + "/games");
+    for (int i = 0; i < BENCHMARK_DIR_ENTRIES; i++)
+        write_host_file("games/game number " + std::to_string(i) + ".atr", make_data(10, i));
+
+    for (const benchmarkLink &link : links)
+    {
+        int listings = BENCHMARK_DIR_LISTINGS / link.divisor;
+        tnfsMountInfo *m_info = mount(link);
+        for (int i = 0; i < listings; i++)
+        {
+            // Every listing comes from the server, not the one we cached last time
+            m_info->meta_cache.clear();
+            TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_opendirx(m_info, "/games"));
+            int entries = 0;
+            tnfsStat st;
+            char entry[TNFS_MAX_FILELEN];
+            while (tnfs_readdirx(m_info, &st, entry, sizeof(entry)) == TNFS_RESULT_SUCCESS)
+                entries++;
+            TEST_ASSERT_EQUAL(BENCHMARK_DIR_ENTRIES, entries);
+            TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_closedir(m_info));
+        }
+        char what[64];
+        snprintf(what, sizeof(what), "readdir of %d entries", BENCHMARK_DIR_ENTRIES);
+        report_per_operation(m_info, link, what, listings);
+    }
+}
+
+// Writing a file a sector at a time
+void test_write()
+{
+    std::vector<uint8_t> data = make_data(BENCHMARK_FILE_SIZE, 4);
+
+    for (const benchmarkLink &link : links)
+    {
+        size_t size = data.size() / link.divisor;
+        tnfsMountInfo *m_info = mount(link);
+        int16_t fh;
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_open(m_info, "/out.bin",
+            TNFS_OPENMODE_WRITE | TNFS_OPENMODE_WRITE_CREATE | TNFS_OPENMODE_WRITE_TRUNCATE, 0644, &fh));
+        for (size_t pos = 0; pos < size; pos += 128)
+        {
+            uint16_t len = 0;
+            TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_write(m_info, fh, data.data() + pos, 128, &len));
+        }
+        TEST_ASSERT_EQUAL(TNFS_RESULT_SUCCESS, tnfs_close(m_info, fh));
+        report_throughput(m_info, link, "sector write", size);
+        TEST_ASSERT_TRUE(read_host_file("out.bin") == std::vector<uint8_t>(data.begin(), data.begin() + size));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_open);
+    RUN_TEST(test_sequential_read);
+    RUN_TEST(test_random_read);
+    RUN_TEST(test_readdir);
+    RUN_TEST(test_write);
+    return UNITY_END();
+}
@@ -0,0 +1,216 @@
+/* Native tests for the XML parser and its XPath-like queries: pio test -e native -f test_xml */
+#include <unity.h>
+#include <cstring>
+#include <string>
+
+#include "xml.h"
+
+// xml.cpp is built straight into the test, with test/native standing in for the protocol and system
+#include "../../lib/xml/xml.cpp"
+#include "../../lib/utils/documentStream.cpp"
+
+/*
+ Hands a document to the parser a few bytes at a time, the way it would
+ arrive over the network, going quiet now and then between pieces
+*/
+class memoryProtocol : public networkProtocol
+{
+private:
+    string _data;
+    size_t _pos = 0;
+    size_t _piece;
+    int _quiet_every;
+    int _calls = 0;
+
+public:
+    memoryProtocol(const string &data, size_t piece = 7, int quiet_every = 3)
+        : _data(data), _piece(piece), _quiet_every(quiet_every) {}
+
+    int available() override
+    {
+        if (_quiet_every > 0 && ++_calls % _quiet_every == 0)
+            return 0;
+        size_t left = _data.size() - _pos;
+        return left < _piece ? left : _piece;
+    }
+
+    bool read(uint8_t *rx_buf, unsigned short len) override
+    {
+        if (len > _data.size() - _pos)
+            return true;
+        memcpy(rx_buf, _data.data() + _pos, len);
+        _pos += len;
+        return false;
+    }
+};
+
+static const char *FEED =
+    "<?xml version=\"1.0\"?>\n"
+    "<rss version=\"2.0\">\n"
+    "  <channel>\n"
+    "    <title>Fuji &amp; Friends</title>\n"
+    "    <link href=\"http://fujinet.online/\">home</link>\n"
+    "    <item>\n"
+    "      <title>  First post  </title>\n"
+    "      <link>http://example.com/1</link>\n"
+    "      <enclosure url=\"http://example.com/1.atr\" type=\"application/octet-stream\"/>\n"
+    "    </item>\n"
+    "    <item>\n"
+    "      <title><![CDATA[Second <post>]]></title>\n"
+    "      <link>http://example.com/2</link>\n"
+    "      <enclosure url=\"http://example.com/2.xex\"/>\n"
+    "    </item>\n"
+    "    <item>\n"
+    "      <title>Third</title>\n"
+    "      <category><name>games</name></category>\n"
+    "    </item>\n"
+    "  </channel>\n"
+    "</rss>\n";
+
+static XML xml;
+static memoryProtocol *protocol = nullptr;
+
+void setUp() {}
+
+void tearDown()
+{
+    delete protocol;
+    protocol = nullptr;
+}
+
+static bool parse(const char *doc, size_t piece = 7, int quiet_every = 3)
+{
+    delete protocol;
+    protocol = new memoryProtocol(doc, piece, quiet_every);
+    xml.setProtocol(protocol);
+    return xml.parse();
+}
+
+// Runs query, with the Atari's EOLs shown as '|'
+static string query(const char *q)
+{
+    xml.setReadQuery(q);
+    int len = xml.readValueLen();
+    string value(len, '\0');
+    if (len > 0)
+        TEST_ASSERT_FALSE(xml.readValue((uint8_t *)&value[0], len));
+    for (auto &c : value)
+        if ((uint8_t)c == 0x9B)
+            c = '|';
+    return value;
+}
+
+void test_parse_in_pieces()
+{
+    TEST_ASSERT_TRUE(parse(FEED, 1, 2));
+    TEST_ASSERT_EQUAL_STRING("Fuji & Friends|", query("/rss/channel/title").c_str());
+    TEST_ASSERT_TRUE(parse(FEED, 4096, 0));
+    TEST_ASSERT_EQUAL_STRING("Fuji & Friends|", query("/rss/channel/title").c_str());
+}
+
+void test_absolute_paths()
+{
+    TEST_ASSERT_TRUE(parse(FEED));
+    // Text is trimmed, and every match ends with an EOL
+    TEST_ASSERT_EQUAL_STRING("First post|Second <post>|Third|", query("/rss/channel/item/title").c_str());
+    TEST_ASSERT_EQUAL_STRING("http://example.com/1|http://example.com/2|", query("/rss/channel/item/link").c_str());
+    TEST_ASSERT_EQUAL_STRING("games|", query("/rss/channel/item/category/name").c_str());
+    // A trailing text() is the same as leaving it off, and the Atari's EOL is ignored
+    TEST_ASSERT_EQUAL_STRING("Third|", query("/rss/channel/item[3]/title/text()\x9b").c_str());
+}
+
+void test_index()
+{
+    TEST_ASSERT_TRUE(parse(FEED));
+    // Counting from 1, among elements of the same name under the same parent
+    TEST_ASSERT_EQUAL_STRING("First post|", query("/rss/channel/item[1]/title").c_str());
+    TEST_ASSERT_EQUAL_STRING("Second <post>|", query("/rss/channel/item[2]/title").c_str());
+    TEST_ASSERT_EQUAL_STRING("http://example.com/2|", query("/rss/channel/item[2]/link[1]").c_str());
+    TEST_ASSERT_EQUAL_STRING("", query("/rss/channel/item[4]/title").c_str());
+}
+
+void test_descendant()
+{
+    TEST_ASSERT_TRUE(parse(FEED));
+    TEST_ASSERT_EQUAL_STRING("Fuji & Friends|First post|Second <post>|Third|", query("//title").c_str());
+    TEST_ASSERT_EQUAL_STRING("http://example.com/1|http://example.com/2|", query("//item/link").c_str());
+    TEST_ASSERT_EQUAL_STRING("Second <post>|", query("//item[2]/title").c_str());
+    TEST_ASSERT_EQUAL_STRING("games|", query("/rss//name").c_str());
+    TEST_ASSERT_EQUAL_STRING("games|", query("//category//name").c_str());
+}
+
+void test_wildcard()
+{
+    TEST_ASSERT_TRUE(parse(FEED));
+    TEST_ASSERT_EQUAL_STRING("Third|games|", query("/rss/channel/item[3]/*").c_str());
+    TEST_ASSERT_EQUAL_STRING("http://example.com/1|http://example.com/2|", query("/*/*/item/link").c_str());
+}
+
+void test_attributes()
+{
+    TEST_ASSERT_TRUE(parse(FEED));
+    TEST_ASSERT_EQUAL_STRING("2.0|", query("/rss/@version").c_str());
+    TEST_ASSERT_EQUAL_STRING("http://example.com/1.atr|http://example.com/2.xex|", query("//enclosure/@url").c_str());
+    TEST_ASSERT_EQUAL_STRING("http://example.com/2.xex|", query("/rss/channel/item[2]/enclosure/@url").c_str());
+    // Elements without the attribute are skipped
+    TEST_ASSERT_EQUAL_STRING("application/octet-stream|", query("//enclosure/@type").c_str());
+    // On any element at all
+    TEST_ASSERT_EQUAL_STRING("http://fujinet.online/|", query("//@href").c_str());
+}
+
+void test_no_match()
+{
+    TEST_ASSERT_TRUE(parse(FEED));
+    xml.setReadQuery("//nothing");
+    TEST_ASSERT_EQUAL_INT(0, xml.readValueLen());
+    uint8_t buf[4];
+    TEST_ASSERT_TRUE(xml.readValue(buf, sizeof(buf)));
+
+    TEST_ASSERT_EQUAL_STRING("", query("/channel/title").c_str());
+    TEST_ASSERT_EQUAL_STRING("", query("//item/@missing").c_str());
+}
+
+void test_value_longer_than_buffer()
+{
+    TEST_ASSERT_TRUE(parse(FEED));
+    xml.setReadQuery("//item/link");
+    uint8_t buf[8];
+    memset(buf, 0, sizeof(buf));
+    TEST_ASSERT_FALSE(xml.readValue(buf, 4));
+    TEST_ASSERT_EQUAL_MEMORY("http", buf, 4);
+    TEST_ASSERT_EQUAL_UINT8(0, buf[4]);
+}
+
+void test_invalid_documents()
+{
+    // Mismatched tags
+    TEST_ASSERT_FALSE(parse("<a><b></a></b>"));
+    // The root never closes; we give up once nothing more arrives
+    TEST_ASSERT_FALSE(parse("<rss><channel>"));
+    // Nested deeper than we keep track of
+    string deep;
+    for (int i = 0; i <= XML_MAX_DEPTH; i++)
+        deep += "<a>";
+    for (int i = 0; i <= XML_MAX_DEPTH; i++)
+        deep += "</a>";
+    TEST_ASSERT_FALSE(parse(deep.c_str()));
+
+    // And a good one afterwards is fine
+    TEST_ASSERT_TRUE(parse("<a><b>ok</b></a>"));
+    TEST_ASSERT_EQUAL_STRING("ok|", query("/a/b").c_str());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_parse_in_pieces);
+    RUN_TEST(test_absolute_paths);
+    RUN_TEST(test_index);
+    RUN_TEST(test_descendant);
+    RUN_TEST(test_wildcard);
+    RUN_TEST(test_attributes);
+    RUN_TEST(test_no_match);
+    RUN_TEST(test_value_longer_than_buffer);
+    RUN_TEST(test_invalid_documents);
+    return UNITY_END();
+}